@@ -20,16 +20,22 @@
 #include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
-#include <logwrap/logwrap.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-#include <fstream>
 #include <regex>
 
 namespace android {
 namespace apex {
 
+using ::android::base::ErrnoError;
 using ::android::base::Error;
 using ::android::base::StringPrintf;
+using ::android::base::unique_fd;
 
 android::base::Result<ClassPath> ClassPath::DeriveClassPath(
     const std::vector<std::string>& temp_mounted_apex_paths,
@@ -55,45 +61,67 @@ android::base::Result<ClassPath> ClassPath::DeriveClassPath(
       StringPrintf("--scan-dirs=%s",
                    android::base::Join(temp_mounted_apex_paths, ",").c_str());
 
-  // Create a temp file to write output
-  auto temp_output_path = "/apex/derive_classpath_temp";
-  auto cleanup = [temp_output_path]() {
-    android::base::RemoveFileIfExists(temp_output_path);
-  };
-  auto scope_guard = android::base::make_scope_guard(cleanup);
-  // Cleanup to ensure we are creating an empty file
-  cleanup();
-  // Create the empty file where derive_classpath will write into
-  std::ofstream _(temp_output_path);
+  // derive_classpath writes its output to the file given on the command line,
+  // which it reopens without following symlinks. Give every call a file of
+  // its own, so that concurrent calls don't overwrite each other's output.
+  // apexd creates the file: derive_classpath is only allowed to write to it.
+  std::string output_path = "/apex/derive_classpath_temp_XXXXXX";
+  unique_fd output_fd(mkostemp(output_path.data(), O_CLOEXEC));
+  if (output_fd.get() == -1) {
+    return ErrnoError() << "Failed to create " << output_path;
+  }
+  auto remove_output = android::base::make_scope_guard(
+      [&]() { android::base::RemoveFileIfExists(output_path); });
 
   const char* const argv[] = {binary_path.c_str(), scan_dirs_flag.c_str(),
-                              temp_output_path};
-  auto rc = logwrap_fork_execvp(arraysize(argv), argv, nullptr, false, LOG_ALOG,
-                                false, nullptr);
-  if (rc != 0) {
+                              output_path.c_str(), nullptr};
+  pid_t pid;
+  int spawn_error = posix_spawn(&pid, binary_path.c_str(), nullptr, nullptr,
+                                const_cast<char* const*>(argv), environ);
+  int status = 0;
+  if (spawn_error == 0 &&
+      TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid) {
+    spawn_error = errno;
+  }
+  if (spawn_error != 0) {
+    return Error(spawn_error)
+           << "Running derive_classpath failed; binary path: " << binary_path;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
     return Error() << "Running derive_classpath failed; binary path: " +
                           binary_path;
   }
 
-  return ClassPath::ParseFromFile(temp_output_path);
+  // The file is truncated and rewritten in place, so |output_fd| sees the
+  // output.
+  std::string output;
+  if (!android::base::ReadFdToString(output_fd.get(), &output)) {
+    return ErrnoError() << "Failed to read classpath info from "
+                        << output_path;
+  }
+  return ClassPath::ParseFromString(output);
 }
 
-// Parse the string output into structured information
-// The raw output from derive_classpath has the following format:
-// ```
-// export BOOTCLASSPATH path/to/jar1:/path/to/jar2
-// export DEX2OATBOOTCLASSPATH
-// export SYSTEMSERVERCLASSPATH path/to/some/jar
 android::base::Result<ClassPath> ClassPath::ParseFromFile(
     const std::string& file_path) {
-  ClassPath result;
-
   std::string contents;
   auto read_status = android::base::ReadFileToString(file_path, &contents,
                                                      /*follow_symlinks=*/false);
   if (!read_status) {
     return Error() << "Failed to read classpath info from file";
   }
+  return ParseFromString(contents);
+}
+
+// Parse the string output into structured information
+// The raw output from derive_classpath has the following format:
+// ```
+// export BOOTCLASSPATH path/to/jar1:/path/to/jar2
+// export DEX2OATBOOTCLASSPATH
+// export SYSTEMSERVERCLASSPATH path/to/some/jar
+android::base::Result<ClassPath> ClassPath::ParseFromString(
+    const std::string& contents) {
+  ClassPath result;
 
   // Jars in apex have the following format: /apex/<package-name>/*
   const std::regex capture_apex_package_name("^/apex/([^/]+)/");
@@ -46,6 +46,8 @@ class ClassPath {
   // Exposed for testing only
   static android::base::Result<ClassPath> ParseFromFile(
       const std::string& file_path);
+  static android::base::Result<ClassPath> ParseFromString(
+      const std::string& contents);
 
  private:
   void AddPackageWithClasspathJars(const std::string& package);
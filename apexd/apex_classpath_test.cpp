@@ -20,7 +20,9 @@
 #include <android-base/result-gmock.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
+#include <filesystem>
 #include <fstream>
 #include <string>
 
@@ -92,6 +94,17 @@ TEST(ApexClassPathUnitTest, ParseFromFileEmptyJars) {
   ASSERT_THAT(result, Ok());
 }
 
+TEST(ApexClassPathUnitTest, ParseFromString) {
+  auto result = ClassPath::ParseFromString(
+      "export BOOTCLASSPATH /apex/a/jar1\n"
+      "export SYSTEMSERVERCLASSPATH /apex/b/jar2");
+  ASSERT_THAT(result, Ok());
+
+  ASSERT_THAT(result->HasClassPathJars("a"), true);
+  ASSERT_THAT(result->HasClassPathJars("b"), true);
+  ASSERT_THAT(result->HasClassPathJars("c"), false);
+}
+
 TEST(ApexClassPathUnitTest, DeriveClassPathNoStagedApex) {
   auto result = ClassPath::DeriveClassPath({});
   ASSERT_THAT(
@@ -114,5 +127,27 @@ TEST(ApexClassPathUnitTest, DeriveClassPathPreferBinaryInStagedApex) {
                   "binary path: /apex/temp@123/bin/derive_classpath"))));
 }
 
+TEST(ApexClassPathUnitTest, DeriveClassPathRunsRealBinary) {
+  const std::string binary_path =
+      "/apex/com.android.sdkext/bin/derive_classpath";
+  if (access(binary_path.c_str(), X_OK) != 0) {
+    GTEST_SKIP() << binary_path << " is not available";
+  }
+
+  auto result = ClassPath::DeriveClassPath({"/apex/com.android.art"});
+  ASSERT_THAT(result, Ok());
+  // ART contributes the core libraries to BOOTCLASSPATH. Only the scanned
+  // APEXes are reported.
+  ASSERT_TRUE(result->HasClassPathJars("com.android.art"));
+  ASSERT_FALSE(result->HasClassPathJars("com.android.sdkext"));
+
+  // The output file doesn't outlive the call.
+  for (const auto& entry : std::filesystem::directory_iterator("/apex")) {
+    ASSERT_FALSE(
+        entry.path().filename().string().starts_with("derive_classpath"))
+        << entry.path();
+  }
+}
+
 }  // namespace apex
 }  // namespace android
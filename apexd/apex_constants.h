@@ -29,6 +29,7 @@ static constexpr const char* kApexBackupDir = "/data/apex/backup";
 static constexpr const char* kApexHashTreeDir = "/data/apex/hashtree";
 static constexpr const char* kApexDecompressedDir = "/data/apex/decompressed";
 static constexpr const char* kOtaReservedDir = "/data/apex/ota_reserved";
+static constexpr const char* kActivationPlanFile = "/data/apex/activation_plan";
 static constexpr const char* kApexPackageSystemDir = "/system/apex";
 static constexpr const char* kApexPackageSystemExtDir = "/system_ext/apex";
 static constexpr const char* kApexPackageVendorDir = "/vendor/apex";
@@ -39,6 +40,7 @@ static const std::vector<std::string> kApexPackageBuiltinDirs = {
     kApexPackageVendorDir,
 };
 static constexpr const char* kApexRoot = "/apex";
+static constexpr const char* kMountedApexDatabaseFile = "/apex/.apexd-db";
 static constexpr const char* kStagedSessionsDir = "/data/app-staging";
 
 static constexpr const char* kApexDataSubDir = "apexdata";
@@ -60,6 +62,7 @@ static constexpr const char* kManifestFilenameJson = "apex_manifest.json";
 static constexpr const char* kManifestFilenamePb = "apex_manifest.pb";
 
 static constexpr const char* kApexInfoList = "apex-info-list.xml";
+static constexpr const char* kApexInfoIndex = "apex-info-list.bin";
 
 // These should be in-sync with system/sepolicy/private/property_contexts
 static constexpr const char* kApexStatusSysprop = "apexd.status";
@@ -18,6 +18,7 @@
 #include "apex_constants.h"
 #include "apex_file.h"
 #include "apexd_utils.h"
+#include "mounted_apex_database.pb.h"
 #include "string_log.h"
 
 #include <android-base/file.h>
@@ -26,11 +27,17 @@
 #include <android-base/result.h>
 #include <android-base/strings.h>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 using android::base::ConsumeSuffix;
 using android::base::EndsWith;
@@ -38,10 +45,12 @@ using android::base::ErrnoError;
 using android::base::Error;
 using android::base::ParseInt;
 using android::base::ReadFileToString;
+using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::Split;
 using android::base::StartsWith;
 using android::base::Trim;
+using android::base::WriteStringToFile;
 
 namespace fs = std::filesystem;
 
@@ -51,6 +60,8 @@ namespace apex {
 namespace {
 
 using MountedApexData = MountedApexDatabase::MountedApexData;
+using MountedApexDataPtr = MountedApexDatabase::MountedApexDataPtr;
+using IndexEntry = MountedApexDatabase::IndexEntry;
 
 enum BlockDeviceType {
   UnknownDevice,
@@ -239,8 +250,333 @@ Result<MountedApexData> ResolveMountInfo(
   }
 }
 
+const MountedApexDataPtr& DataOf(const IndexEntry& entry) {
+  return entry.data;
+}
+
+const MountedApexDataPtr& DataOf(const MountedApexDataPtr& data) {
+  return data;
+}
+
+// Fills in metadata of the APEX file backing |apex_data|.
+void LoadMetadata(MountedApexData* apex_data) {
+  if (apex_data->deleted) {
+    return;
+  }
+  auto apex_file = ApexFile::Open(apex_data->full_path);
+  if (!apex_file.ok()) {
+    LOG(WARNING) << "Can't open " << apex_data->full_path << " : "
+                 << apex_file.error();
+    return;
+  }
+  apex_data->metadata = ApexMetadata::FromApexFile(*apex_file);
+}
+
+// Checks that the data loop device of |apex_data| is still backed by its
+// full_path, and refreshes whether that file has been deleted.
+Result<void> RevalidateBackingFile(const std::string& sys_block_dir,
+                                   MountedApexData* apex_data) {
+  const std::string backing_file_path =
+      sys_block_dir + "/" + fs::path(apex_data->loop_name).filename().string() +
+      "/loop/backing_file";
+  std::string backing_file;
+  if (!ReadFileToString(backing_file_path, &backing_file)) {
+    return ErrnoError() << "Failed to read " << backing_file_path;
+  }
+  MountedApexData current;
+  current.full_path = Trim(backing_file);
+  NormalizeIfDeleted(&current);
+  if (current.full_path != apex_data->full_path) {
+    return Error() << apex_data->loop_name << " is backed by "
+                   << current.full_path << " instead of "
+                   << apex_data->full_path;
+  }
+  apex_data->deleted = current.deleted;
+  if (!apex_data->deleted) {
+    struct stat st;
+    if (stat(apex_data->full_path.c_str(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << apex_data->full_path;
+    }
+  }
+  return {};
+}
+
+// An APEX mount as listed in /proc/self/mountinfo.
+struct MountInfoEntry {
+  int mount_id = 0;
+  std::string device_number;  // major:minor
+  std::string source;         // block device
+};
+
+// Returns mount point -> mount for the APEX mounts in |mountinfo_path|
+// (format of /proc/self/mountinfo).
+Result<std::map<std::string, MountInfoEntry>> ReadApexMountsFromMountInfo(
+    const std::string& mountinfo_path) {
+  std::string content;
+  if (!ReadFileToString(mountinfo_path, &content)) {
+    return ErrnoError() << "Failed to read " << mountinfo_path;
+  }
+  std::map<std::string, MountInfoEntry> mounts;
+  for (const auto& line : Split(content, "\n")) {
+    // mount_id parent_id major:minor root mount_point options [optional
+    // fields...] - fs_type source super_options
+    const auto& tokens = Split(line, " ");
+    if (tokens.size() < 5) {
+      continue;
+    }
+    const std::string& mount_point = tokens[4];
+    if (fs::path(mount_point).parent_path() != kApexRoot ||
+        IsActiveMountPoint(mount_point)) {
+      continue;
+    }
+    auto separator = std::find(tokens.begin() + 5, tokens.end(), "-");
+    MountInfoEntry entry;
+    if (std::distance(separator, tokens.end()) < 3 ||
+        !ParseInt(tokens[0], &entry.mount_id)) {
+      return Error() << "Malformed line in " << mountinfo_path << " : "
+                     << line;
+    }
+    entry.device_number = tokens[2];
+    entry.source = *(separator + 2);
+    mounts.emplace(mount_point, std::move(entry));
+  }
+  return mounts;
+}
+
+// Returns whether |mount| was persisted from the very mount |entry|, backed by
+// the same file as now.
+bool IsSameMount(const ::apex::proto::MountedApexDatabase::Mount& mount,
+                 const MountInfoEntry& entry) {
+  if (mount.mount_id() == 0 || mount.mount_id() != entry.mount_id ||
+      mount.device_number() != entry.device_number ||
+      mount.backing_file_ino() == 0) {
+    return false;
+  }
+  struct stat st;
+  return stat(mount.full_path().c_str(), &st) == 0 &&
+         st.st_dev == mount.backing_file_dev() &&
+         st.st_ino == mount.backing_file_ino();
+}
+
+// Removes |key| -> |mount| entry from one of the secondary indexes.
+template <typename Index>
+void EraseFromIndex(Index* index, const std::string& key,
+                    const MountedApexDataPtr& mount) {
+  auto [begin, end] = index->equal_range(key);
+  for (auto it = begin; it != end; ++it) {
+    if (DataOf(it->second) == mount) {
+      index->erase(it);
+      return;
+    }
+  }
+}
+
 }  // namespace
 
+void MountedApexDatabase::AddMountedApexTo(State* state,
+                                           const std::string& package,
+                                           MountedApexData data) {
+  auto mount = std::make_shared<const MountedApexData>(std::move(data));
+  auto check_it = state->mounted_apexes[package].emplace(mount);
+  CHECK(check_it.second);
+
+  IndexEntry entry{package, mount};
+  for (const std::string* loop_name :
+       {&mount->loop_name, &mount->hashtree_loop_name}) {
+    if (*loop_name != "") {
+      CHECK(state->by_loop_name.emplace(*loop_name, entry).second)
+          << "Duplicate loop device: " << *loop_name;
+    }
+  }
+  if (mount->device_name != "") {
+    CHECK(state->by_device_name.emplace(mount->device_name, entry).second)
+        << "Duplicate dm device: " << mount->device_name;
+  }
+  state->by_full_path.emplace(mount->full_path, entry);
+  state->by_mount_point.emplace(mount->mount_point, entry);
+  if (mount->is_temp_mount) {
+    state->temp_mounts.emplace(package, mount);
+  }
+}
+
+void MountedApexDatabase::RemoveMountedApexFrom(State* state,
+                                                const std::string& package,
+                                                const std::string& full_path,
+                                                bool match_temp_mounts) {
+  // If there are several matching mounts, remove the first one in the order
+  // of MountedApexData.
+  auto [begin, end] = state->by_full_path.equal_range(full_path);
+  auto found = end;
+  for (auto it = begin; it != end; ++it) {
+    const auto& entry = it->second;
+    if (entry.package != package ||
+        entry.data->is_temp_mount != match_temp_mounts) {
+      continue;
+    }
+    if (found == end || *entry.data < *found->second.data) {
+      found = it;
+    }
+  }
+  if (found == end) {
+    return;
+  }
+
+  MountedApexDataPtr mount = found->second.data;
+  state->by_full_path.erase(found);
+  EraseFromIndex(&state->by_mount_point, mount->mount_point, mount);
+  EraseFromIndex(&state->by_loop_name, mount->loop_name, mount);
+  EraseFromIndex(&state->by_loop_name, mount->hashtree_loop_name, mount);
+  EraseFromIndex(&state->by_device_name, mount->device_name, mount);
+  if (mount->is_temp_mount) {
+    EraseFromIndex(&state->temp_mounts, package, mount);
+  }
+  state->mounted_apexes[package].erase(mount);
+}
+
+void MountedApexDatabase::SetPersistentPath(const std::string& path,
+                                            const std::string& mountinfo_path)
+    REQUIRES(!mounted_apexes_mutex_) {
+  std::lock_guard lock(mounted_apexes_mutex_);
+  persistent_path_ = path;
+  mountinfo_path_ = mountinfo_path;
+}
+
+void MountedApexDatabase::Persist()
+    REQUIRES(!persist_mutex_, !mounted_apexes_mutex_) {
+  std::lock_guard persist_lock(persist_mutex_);
+  std::shared_ptr<const State> snapshot;
+  std::string path;
+  std::string mountinfo_path;
+  {
+    std::lock_guard lock(mounted_apexes_mutex_);
+    if (persistent_path_.empty() || !dirty_) {
+      return;
+    }
+    snapshot = GetSnapshot();
+    path = persistent_path_;
+    mountinfo_path = mountinfo_path_;
+    dirty_ = false;
+  }
+  // Without the mount IDs, RestoreFromFile falls back to sysfs.
+  auto apex_mounts = ReadApexMountsFromMountInfo(mountinfo_path);
+  if (!apex_mounts.ok()) {
+    LOG(WARNING) << apex_mounts.error();
+  }
+  ::apex::proto::MountedApexDatabase db;
+  for (const auto& [package, mounts] : snapshot->mounted_apexes) {
+    for (const auto& data : mounts) {
+      auto* mount = db.add_mounts();
+      mount->set_package(package);
+      mount->set_version(data->version);
+      mount->set_loop_name(data->loop_name);
+      mount->set_full_path(data->full_path);
+      mount->set_mount_point(data->mount_point);
+      mount->set_device_name(data->device_name);
+      mount->set_hashtree_loop_name(data->hashtree_loop_name);
+      mount->set_deleted(data->deleted);
+      mount->set_is_temp_mount(data->is_temp_mount);
+      mount->set_block_device(data->block_device);
+      if (data->metadata != nullptr) {
+        auto* metadata = mount->mutable_metadata();
+        metadata->set_name(data->metadata->name);
+        metadata->set_version(data->metadata->version);
+        metadata->set_version_name(data->metadata->version_name);
+        metadata->set_provide_shared_apex_libs(
+            data->metadata->provide_shared_apex_libs);
+        metadata->set_public_key(data->metadata->public_key);
+      }
+      if (apex_mounts.ok()) {
+        auto it = apex_mounts->find(data->mount_point);
+        if (it != apex_mounts->end()) {
+          mount->set_mount_id(it->second.mount_id);
+          mount->set_device_number(it->second.device_number);
+        }
+      }
+      struct stat st;
+      if (!data->deleted && stat(data->full_path.c_str(), &st) == 0) {
+        mount->set_backing_file_dev(st.st_dev);
+        mount->set_backing_file_ino(st.st_ino);
+      }
+    }
+  }
+  std::string content;
+  const std::string tmp_path = path + ".tmp";
+  if (db.SerializeToString(&content) &&
+      WriteStringToFile(content, tmp_path, 0600, getuid(), getgid()) &&
+      rename(tmp_path.c_str(), path.c_str()) == 0) {
+    return;
+  }
+  // Never leave a stale database behind: restarted apexd would trust it.
+  PLOG(ERROR) << "Failed to persist APEX database to " << path;
+  RemoveFileIfExists(tmp_path);
+  RemoveFileIfExists(path);
+}
+
+Result<void> MountedApexDatabase::RestoreFromFile(
+    const std::string& path, const std::string& mountinfo_path,
+    const std::string& sys_block_dir) REQUIRES(!mounted_apexes_mutex_) {
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  ::apex::proto::MountedApexDatabase db;
+  if (!db.ParseFromString(content)) {
+    return Error() << "Failed to parse " << path;
+  }
+
+  auto apex_mounts = OR_RETURN(ReadApexMountsFromMountInfo(mountinfo_path));
+  if (static_cast<size_t>(db.mounts_size()) != apex_mounts.size()) {
+    return Error() << path << " has " << db.mounts_size()
+                   << " mounts, but there are " << apex_mounts.size();
+  }
+  for (const auto& mount : db.mounts()) {
+    auto it = apex_mounts.find(mount.mount_point());
+    if (it == apex_mounts.end() || it->second.source != mount.block_device()) {
+      return Error() << mount.mount_point() << " backed by "
+                     << mount.block_device() << " is not mounted";
+    }
+  }
+
+  std::vector<std::pair<std::string, MountedApexData>> found;
+  size_t revalidated = 0;
+  for (const auto& mount : db.mounts()) {
+    MountedApexData data(mount.version(), mount.loop_name(),
+                         mount.full_path(), mount.mount_point(),
+                         mount.device_name(), mount.hashtree_loop_name(),
+                         mount.is_temp_mount());
+    data.block_device = mount.block_device();
+    // The backing file might have been deleted or replaced since the database
+    // was persisted. Unless the mount and its file are provably the same,
+    // trust the kernel rather than the file.
+    if (!IsSameMount(mount, apex_mounts.at(mount.mount_point()))) {
+      OR_RETURN(RevalidateBackingFile(sys_block_dir, &data));
+      revalidated++;
+    }
+    // Like PopulateFromMounts, don't report metadata of a deleted file.
+    if (mount.has_metadata() && !data.deleted) {
+      auto metadata = std::make_shared<ApexMetadata>();
+      metadata->path = data.full_path;
+      metadata->name = mount.metadata().name();
+      metadata->version = mount.metadata().version();
+      metadata->version_name = mount.metadata().version_name();
+      metadata->provide_shared_apex_libs =
+          mount.metadata().provide_shared_apex_libs();
+      metadata->public_key = mount.metadata().public_key();
+      data.metadata = std::move(metadata);
+    }
+    found.emplace_back(mount.package(), std::move(data));
+  }
+  Update([&](State* state) {
+    *state = State();
+    for (auto& [package, data] : found) {
+      AddMountedApexTo(state, package, std::move(data));
+    }
+  });
+  LOG(INFO) << "Restored " << found.size() << " APEX mounts from " << path
+            << " (" << revalidated << " revalidated through sysfs)";
+  return {};
+}
+
 // On startup, APEX database is populated from /proc/mounts.
 
 // /apex/<package-id> can be mounted from
@@ -262,12 +598,14 @@ Result<MountedApexData> ResolveMountInfo(
 // at any time (It's a lazy service).
 void MountedApexDatabase::PopulateFromMounts(
     const std::string& active_apex_dir, const std::string& decompression_dir,
-    const std::string& apex_hash_tree_dir) REQUIRES(!mounted_apexes_mutex_) {
+    const std::string& apex_hash_tree_dir)
+    REQUIRES(!mounted_apexes_mutex_) {
   LOG(INFO) << "Populating APEX database from mounts...";
 
+  // Resolve everything first, and then publish all the mounts in one update.
+  std::vector<std::pair<std::string, MountedApexData>> found;
   std::ifstream mounts("/proc/mounts");
   std::string line;
-  std::lock_guard lock(mounted_apexes_mutex_);
   while (std::getline(mounts, line)) {
     auto [block, mount_point] = ParseMountInfo(line);
     // TODO(b/158469914): distinguish between temp and non-temp mounts
@@ -288,14 +626,24 @@ void MountedApexDatabase::PopulateFromMounts(
 
     auto [package, version] = ParseMountPoint(mount_point);
     mount_data->version = version;
-    AddMountedApexLocked(package, *mount_data);
+    mount_data->block_device = block;
+    LoadMetadata(&*mount_data);
 
     LOG(INFO) << "Found " << mount_point << " backed by"
               << (mount_data->deleted ? " deleted " : " ") << "file "
               << mount_data->full_path;
+    found.emplace_back(package, std::move(*mount_data));
   }
 
-  LOG(INFO) << mounted_apexes_.size() << " packages restored.";
+  size_t package_count = 0;
+  Update([&](State* state) {
+    for (auto& [package, data] : found) {
+      AddMountedApexTo(state, package, std::move(data));
+    }
+    package_count = state->mounted_apexes.size();
+  });
+
+  LOG(INFO) << package_count << " packages restored.";
 }
 
 }  // namespace apex
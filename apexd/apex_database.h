@@ -21,20 +21,27 @@
 #include <android-base/result.h>
 #include <android-base/thread_annotations.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <set>
 #include <string>
-#include <unordered_set>
+#include <unordered_map>
+
+#include "apex_file.h"
 
 namespace android {
 namespace apex {
 
 class MountedApexDatabase {
  public:
-  // Stores associated low-level data for a mounted APEX. To conserve memory,
-  // the APEX file isn't stored, but must be opened to retrieve specific data.
+  // Stores associated low-level data for a mounted APEX, together with the
+  // metadata of the APEX file it was mounted from, which saves reopening the
+  // file on every query.
   struct MountedApexData {
     int version = 0;        // APEX version for this mount
     std::string loop_name;  // Loop device used (fs path).
@@ -44,10 +51,18 @@ class MountedApexDatabase {
     // Name of the loop device backing up hashtree or empty string in case
     // hashtree is embedded inside an APEX.
     std::string hashtree_loop_name;
+    // Block device mounted on mount_point (either a loop or a dm device).
+    // Not part of the ordering.
+    std::string block_device;
     // Whenever apex file specified in full_path was deleted.
     bool deleted;
     // Whether the mount is a temp mount or not.
     bool is_temp_mount;
+    // Metadata of the mounted APEX file. Immutable and shared between all
+    // copies of this record. Not part of the ordering. Might be null if the
+    // record was restored from /proc/mounts and the backing file couldn't be
+    // opened (e.g. it was deleted).
+    std::shared_ptr<const ApexMetadata> metadata;
 
     MountedApexData() : deleted(false), is_temp_mount(false) {}
     MountedApexData(int version, const std::string& loop_name,
@@ -97,163 +112,304 @@ class MountedApexDatabase {
     }
   };
 
-  template <typename... Args>
-  inline void AddMountedApexLocked(const std::string& package, Args&&... args)
-      REQUIRES(mounted_apexes_mutex_) {
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
-      auto insert_it =
-          mounted_apexes_.emplace(package, std::set<MountedApexData>());
-      CHECK(insert_it.second);
-      it = insert_it.first;
+  using MountedApexDataPtr = std::shared_ptr<const MountedApexData>;
+
+  struct MountedApexDataPtrLess {
+    bool operator()(const MountedApexDataPtr& lhs,
+                    const MountedApexDataPtr& rhs) const {
+      return *lhs < *rhs;
     }
+  };
+
+  using MountedApexSet = std::set<MountedApexDataPtr, MountedApexDataPtrLess>;
+
+  // Entry of a secondary index: the mount together with its package name.
+  struct IndexEntry {
+    std::string package;
+    MountedApexDataPtr data;
+  };
 
-    auto check_it =
-        it->second.emplace(MountedApexData(std::forward<Args>(args)...));
-    CHECK(check_it.second);
+  // Content of the database. Mounts are shared between the primary map and
+  // the secondary indexes (and between snapshots), so copying a state doesn't
+  // copy MountedApexData.
+  struct State {
+    // A map from package name to mounted apexes.
+    // Note: using std::maps to
+    //         a) so we do not have to worry about iterator invalidation.
+    //         b) do not have to const_cast (over std::set)
+    std::map<std::string, MountedApexSet> mounted_apexes;
+    // Secondary indexes, maintained incrementally on every insert/remove.
+    // Loop devices (both data and hashtree ones) and dm devices are unique
+    // across all mounts.
+    std::unordered_map<std::string, IndexEntry> by_loop_name;
+    std::unordered_map<std::string, IndexEntry> by_device_name;
+    // The same file can be mounted more than once (e.g. as a temp mount).
+    std::unordered_multimap<std::string, IndexEntry> by_full_path;
+    std::unordered_multimap<std::string, IndexEntry> by_mount_point;
+    // A map from package name to its temp mounts.
+    std::unordered_multimap<std::string, MountedApexDataPtr> temp_mounts;
+  };
+
+  // Returns an immutable view of the database. The view stays consistent (and
+  // alive) for as long as the caller holds on to it, regardless of concurrent
+  // updates. It is the state published by the last update, shared by all
+  // callers until the next one. Never takes a lock.
+  inline std::shared_ptr<const State> GetSnapshot() const {
+    return std::atomic_load(&state_);
+  }
 
-    CheckUniqueLoopDm();
+  // Applies |fn| to a copy of the current state, and then publishes the copy.
+  // Writers are serialized with each other; readers never wait for them and
+  // see either the old or the new state as a whole. Copying a state doesn't
+  // copy MountedApexData, but it is still linear in the number of mounts, so
+  // batch several changes into one update. |fn| must only modify the state
+  // through AddMountedApexTo/RemoveMountedApexFrom to keep the indexes in
+  // sync.
+  template <typename Fn>
+  inline void Update(const Fn& fn) REQUIRES(!mounted_apexes_mutex_) {
+    std::lock_guard lock(mounted_apexes_mutex_);
+    auto state = std::make_shared<State>(*std::atomic_load(&state_));
+    fn(state.get());
+    std::atomic_store(&state_, std::shared_ptr<const State>(std::move(state)));
+    dirty_ = true;
   }
 
+  static void AddMountedApexTo(State* state, const std::string& package,
+                               MountedApexData data);
+  static void RemoveMountedApexFrom(State* state, const std::string& package,
+                                    const std::string& full_path,
+                                    bool match_temp_mounts);
+
   template <typename... Args>
   inline void AddMountedApex(const std::string& package, Args&&... args)
       REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    AddMountedApexLocked(package, args...);
+    MountedApexData data(std::forward<Args>(args)...);
+    Update([&](State* state) {
+      AddMountedApexTo(state, package, std::move(data));
+    });
   }
 
   inline void RemoveMountedApex(const std::string& package,
                                 const std::string& full_path,
                                 bool match_temp_mounts = false)
       REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
-      return;
-    }
-
-    auto& pkg_set = it->second;
+    Update([&](State* state) {
+      RemoveMountedApexFrom(state, package, full_path, match_temp_mounts);
+    });
+  }
 
-    for (auto pkg_it = pkg_set.begin(); pkg_it != pkg_set.end(); ++pkg_it) {
-      if (pkg_it->full_path == full_path &&
-          pkg_it->is_temp_mount == match_temp_mounts) {
-        pkg_set.erase(pkg_it);
-        return;
-      }
-    }
+  // Returns whether the passed package is the latest mounted version.
+  inline bool IsLatest(const std::string& package,
+                       const std::string& full_path) const {
+    return IsLatestIn(*GetSnapshot(), package, full_path);
   }
 
-  // Invoke handler if the passed package is the latest
+  // Runs |handler| if |full_path| is the latest mounted version of |package|.
+  // Writers are locked out while |handler| runs, so no other version can be
+  // mounted in between. |handler| must not update the database.
   inline base::Result<void> DoIfLatest(
       const std::string& package, const std::string& full_path,
       const std::function<base::Result<void>()>& handler)
       REQUIRES(!mounted_apexes_mutex_) {
     std::lock_guard lock(mounted_apexes_mutex_);
-    auto it = mounted_apexes_.find(package);
-    CHECK(it != mounted_apexes_.end());
-    CHECK(!it->second.empty());
-
-    auto latest = it->second.rbegin();
-    if (latest->full_path == full_path) {
+    if (IsLatestIn(*GetSnapshot(), package, full_path)) {
       return handler();
     }
     return {};
   }
 
+  // Returns whether |full_path| is mounted (not as a temp mount).
+  inline bool IsMounted(const std::string& full_path) const {
+    auto snapshot = GetSnapshot();
+    auto [begin, end] = snapshot->by_full_path.equal_range(full_path);
+    return std::any_of(begin, end, [](const auto& entry) {
+      return !entry.second.data->is_temp_mount;
+    });
+  }
+
+  inline std::optional<MountedApexData> GetMountedApex(
+      const std::string& package, const std::string& full_path,
+      bool match_temp_mounts = false) const {
+    auto data = FindMountedApexIn(*GetSnapshot(), package, full_path,
+                                  match_temp_mounts);
+    if (data == nullptr) {
+      return std::nullopt;
+    }
+    return *data;
+  }
+
+  // Same as GetMountedApex, but also sets |latest| to whether the returned
+  // mount is the latest mounted version of |package|. Both answers come from
+  // the same state of the database.
+  inline std::optional<MountedApexData> GetMountedApexAndIsLatest(
+      const std::string& package, const std::string& full_path,
+      bool* latest) const {
+    auto snapshot = GetSnapshot();
+    auto data = FindMountedApexIn(*snapshot, package, full_path,
+                                  /*match_temp_mounts=*/false);
+    if (data == nullptr) {
+      return std::nullopt;
+    }
+    *latest = IsLatestIn(*snapshot, package, full_path);
+    return *data;
+  }
+
+  inline std::optional<MountedApexData> GetMountedApexByMountPoint(
+      const std::string& mount_point) const {
+    auto snapshot = GetSnapshot();
+    auto it = snapshot->by_mount_point.find(mount_point);
+    if (it == snapshot->by_mount_point.end()) {
+      return std::nullopt;
+    }
+    return *it->second.data;
+  }
+
+  // Returns the highest temp mounted version of |package|, if any.
+  inline std::optional<MountedApexData> GetTempMountedApex(
+      const std::string& package) const {
+    auto snapshot = GetSnapshot();
+    auto [begin, end] = snapshot->temp_mounts.equal_range(package);
+    if (begin == end) {
+      return std::nullopt;
+    }
+    auto it = std::max_element(begin, end, [](const auto& a, const auto& b) {
+      return *a.second < *b.second;
+    });
+    return *it->second;
+  }
+
+  // Handlers run on a snapshot of the database, without holding any lock, so
+  // they are free to block or to modify the database.
   template <typename T>
   inline void ForallMountedApexes(const std::string& package, const T& handler,
-                                  bool match_temp_mounts = false) const
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    auto outer_it = mounted_apexes_.find(package);
-    if (outer_it == mounted_apexes_.end()) {
+                                  bool match_temp_mounts = false) const {
+    auto snapshot = GetSnapshot();
+    auto outer_it = snapshot->mounted_apexes.find(package);
+    if (outer_it == snapshot->mounted_apexes.end()) {
       return;
     }
     for (auto it = outer_it->second.rbegin(), end = outer_it->second.rend();
          it != end; it++) {
-      if (it->is_temp_mount == match_temp_mounts) {
+      if ((*it)->is_temp_mount == match_temp_mounts) {
         bool latest = (it == outer_it->second.rbegin());
-        handler(*it, latest);
+        handler(**it, latest);
       }
     }
   }
 
   template <typename T>
   inline void ForallMountedApexes(const T& handler,
-                                  bool match_temp_mounts = false) const
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    for (const auto& pkg : mounted_apexes_) {
+                                  bool match_temp_mounts = false) const {
+    auto snapshot = GetSnapshot();
+    for (const auto& pkg : snapshot->mounted_apexes) {
       for (auto it = pkg.second.rbegin(), end = pkg.second.rend(); it != end;
            it++) {
-        if (it->is_temp_mount == match_temp_mounts) {
+        if ((*it)->is_temp_mount == match_temp_mounts) {
           bool latest = (it == pkg.second.rbegin());
-          handler(pkg.first, *it, latest);
+          handler(pkg.first, **it, latest);
         }
       }
     }
   }
 
   inline std::optional<MountedApexData> GetLatestMountedApex(
-      const std::string& package) REQUIRES(!mounted_apexes_mutex_) {
-    std::optional<MountedApexData> ret;
-    ForallMountedApexes(package,
-                        [&ret](const MountedApexData& data, bool latest) {
-                          if (latest) {
-                            ret.emplace(data);
-                          }
-                        });
-    return ret;
+      const std::string& package) const {
+    auto snapshot = GetSnapshot();
+    auto it = snapshot->mounted_apexes.find(package);
+    if (it == snapshot->mounted_apexes.end() || it->second.empty()) {
+      return std::nullopt;
+    }
+    const auto& latest = *it->second.rbegin();
+    if (latest->is_temp_mount) {
+      return std::nullopt;
+    }
+    return *latest;
   }
 
   void PopulateFromMounts(const std::string& active_apex_dir,
                           const std::string& decompression_dir,
                           const std::string& apex_hash_tree_dir);
 
+  // Once set, Persist() writes the database to |path|, so that a restarted
+  // apexd can pick it up with RestoreFromFile. |path| is expected to be on
+  // tmpfs: the content is meaningless after a reboot. Mounts are identified
+  // by their entries in |mountinfo_path|.
+  void SetPersistentPath(
+      const std::string& path,
+      const std::string& mountinfo_path = "/proc/self/mountinfo")
+      REQUIRES(!mounted_apexes_mutex_);
+
+  // Writes the current state to the persistent path, if one is set and the
+  // database changed since the last call. Meant to be called once a batch of
+  // mounts (e.g. boot activation, an install) is done rather than on every
+  // update. RestoreFromFile rejects a file that has gone stale since.
+  void Persist() REQUIRES(!persist_mutex_, !mounted_apexes_mutex_);
+
+  // Replaces content of the database with the one persisted at |path|. The
+  // persisted state is only accepted if it describes exactly the APEX mounts
+  // currently listed in |mountinfo_path|. A mount whose mount ID, device and
+  // backing file are the ones recorded by Persist() is taken as is. For any
+  // other, its loop device in |sys_block_dir| must still be backed by the
+  // recorded file. Otherwise an error is returned and the database is left
+  // untouched.
+  base::Result<void> RestoreFromFile(
+      const std::string& path,
+      const std::string& mountinfo_path = "/proc/self/mountinfo",
+      const std::string& sys_block_dir = "/sys/block")
+      REQUIRES(!mounted_apexes_mutex_);
+
   // Resets state of the database. Should only be used in testing.
   inline void Reset() REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    mounted_apexes_.clear();
+    Update([](State* state) { *state = State(); });
   }
 
  private:
-  // A map from package name to mounted apexes.
-  // Note: using std::maps to
-  //         a) so we do not have to worry about iterator invalidation.
-  //         b) do not have to const_cast (over std::set)
-  // TODO(b/158467745): This structure (and functions) need to be guarded by
-  //   locks.
-  std::map<std::string, std::set<MountedApexData>> mounted_apexes_
-      GUARDED_BY(mounted_apexes_mutex_);
-
   // To fix thread safety negative capability warning
   class Mutex : public std::mutex {
    public:
     // for negative capabilities
     const Mutex& operator!() const { return *this; }
   };
+  // Serializes writers of the state, and protects the persistent path.
   mutable Mutex mounted_apexes_mutex_;
-
-  inline void CheckUniqueLoopDm() REQUIRES(mounted_apexes_mutex_) {
-    std::unordered_set<std::string> loop_devices;
-    std::unordered_set<std::string> dm_devices;
-    for (const auto& apex_set : mounted_apexes_) {
-      for (const auto& mount : apex_set.second) {
-        if (mount.loop_name != "") {
-          CHECK(loop_devices.insert(mount.loop_name).second)
-              << "Duplicate loop device: " << mount.loop_name;
-        }
-        if (mount.device_name != "") {
-          CHECK(dm_devices.insert(mount.device_name).second)
-              << "Duplicate dm device: " << mount.device_name;
-        }
-        if (mount.hashtree_loop_name != "") {
-          CHECK(loop_devices.insert(mount.hashtree_loop_name).second)
-              << "Duplicate loop device: " << mount.hashtree_loop_name;
-        }
+  // Where Persist() writes the database. Empty if disabled.
+  std::string persistent_path_ GUARDED_BY(mounted_apexes_mutex_);
+  // Where Persist() looks up the mount IDs.
+  std::string mountinfo_path_ GUARDED_BY(mounted_apexes_mutex_);
+  // Whether the state changed since it was last persisted.
+  bool dirty_ GUARDED_BY(mounted_apexes_mutex_) = false;
+  // Serializes writers of the persistent file. Taken before
+  // |mounted_apexes_mutex_|, and held while writing, so that an older state
+  // never overwrites a newer one.
+  Mutex persist_mutex_;
+  // Returns the first mount of |full_path| by |package| in |state|, in the
+  // order of MountedApexData, the same one RemoveMountedApexFrom would remove.
+  static inline MountedApexDataPtr FindMountedApexIn(
+      const State& state, const std::string& package,
+      const std::string& full_path, bool match_temp_mounts) {
+    MountedApexDataPtr found;
+    auto [begin, end] = state.by_full_path.equal_range(full_path);
+    for (auto it = begin; it != end; ++it) {
+      const auto& entry = it->second;
+      if (entry.package == package &&
+          entry.data->is_temp_mount == match_temp_mounts &&
+          (found == nullptr || *entry.data < *found)) {
+        found = entry.data;
       }
     }
+    return found;
+  }
+  static inline bool IsLatestIn(const State& state, const std::string& package,
+                                const std::string& full_path) {
+    auto it = state.mounted_apexes.find(package);
+    CHECK(it != state.mounted_apexes.end());
+    CHECK(!it->second.empty());
+    return (*it->second.rbegin())->full_path == full_path;
   }
+  // Published content of the database. Never modified once published:
+  // Update() replaces it as a whole. Always accessed through
+  // std::atomic_load/std::atomic_store, so readers don't need the mutex.
+  std::shared_ptr<const State> state_ = std::make_shared<const State>();
 };
 
 }  // namespace apex
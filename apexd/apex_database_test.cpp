@@ -16,19 +16,28 @@
 
 #include "apex_database.h"
 
+#include <android-base/file.h>
 #include <android-base/macros.h>
 #include <android-base/result-gmock.h>
+#include <android-base/strings.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
+#include <filesystem>
 #include <string>
 #include <tuple>
+#include <vector>
 
 using android::base::Error;
+using android::base::Join;
 using android::base::Result;
+using android::base::WriteStringToFile;
 using android::base::testing::HasError;
 using android::base::testing::Ok;
 using android::base::testing::WithMessage;
+using ::testing::HasSubstr;
+using ::testing::Not;
 
 namespace android {
 namespace apex {
@@ -209,23 +218,99 @@ TEST(ApexDatabaseTest, MountMultiple) {
                               kDeviceName[3], kHashtreeLoopName[3]));
 }
 
-TEST(ApexDatabaseTest, DoIfLatest) {
-  // Check by passing error-returning handler
-  // When handler is triggered, DoIfLatest() returns the expected error.
-  auto returnError = []() -> Result<void> { return Error() << "expected"; };
-
+TEST(ApexDatabaseTest, IsLatest) {
   MountedApexDatabase db;
 
   // With apex: [{version=0,path=path}]
   db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
-  ASSERT_THAT(db.DoIfLatest("package", "path", returnError),
-              HasError(WithMessage("expected")));
+  ASSERT_TRUE(db.IsLatest("package", "path"));
 
   // With apexes: [{version=0,path=path}, {version=5,path=path5}]
   db.AddMountedApex("package", 5, "loop5", "path5", "mount5", "dev5", "hash5");
-  ASSERT_THAT(db.DoIfLatest("package", "path", returnError), Ok());
-  ASSERT_THAT(db.DoIfLatest("package", "path5", returnError),
-              HasError(WithMessage("expected")));
+  ASSERT_FALSE(db.IsLatest("package", "path"));
+  ASSERT_TRUE(db.IsLatest("package", "path5"));
+}
+
+TEST(ApexDatabaseTest, DoIfLatest) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+  db.AddMountedApex("package", 5, "loop5", "path5", "mount5", "dev5", "hash5");
+
+  size_t calls = 0;
+  auto handler = [&]() -> Result<void> {
+    calls++;
+    return {};
+  };
+  ASSERT_THAT(db.DoIfLatest("package", "path", handler), Ok());
+  ASSERT_EQ(calls, 0u);
+  ASSERT_THAT(db.DoIfLatest("package", "path5", handler), Ok());
+  ASSERT_EQ(calls, 1u);
+
+  auto failing = []() -> Result<void> { return Error() << "failed"; };
+  ASSERT_THAT(db.DoIfLatest("package", "path5", failing),
+              HasError(WithMessage("failed")));
+}
+
+TEST(ApexDatabaseTest, SnapshotIsSharedUntilUpdate) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+
+  auto snapshot = db.GetSnapshot();
+  ASSERT_EQ(db.GetSnapshot(), snapshot);
+  db.AddMountedApex("package2", 0, "loop2", "path2", "mount2", "dev2", "hash2");
+  ASSERT_NE(db.GetSnapshot(), snapshot);
+  ASSERT_EQ(db.GetSnapshot()->mounted_apexes.size(), 2u);
+}
+
+TEST(ApexDatabaseTest, SnapshotIsNotAffectedByUpdates) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+
+  auto snapshot = db.GetSnapshot();
+  db.AddMountedApex("package2", 0, "loop2", "path2", "mount2", "dev2", "hash2");
+  db.RemoveMountedApex("package", "path");
+
+  ASSERT_EQ(snapshot->mounted_apexes.size(), 1u);
+  ASSERT_EQ(snapshot->mounted_apexes.at("package").size(), 1u);
+  ASSERT_EQ((*snapshot->mounted_apexes.at("package").begin())->full_path,
+            "path");
+  ASSERT_FALSE(ContainsPackage(db, "package", "loop", "path", "dev", "hash"));
+  ASSERT_TRUE(
+      ContainsPackage(db, "package2", "loop2", "path2", "dev2", "hash2"));
+}
+
+TEST(ApexDatabaseTest, LookupsDontWaitForWriters) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+
+  // DoIfLatest locks writers out while its handler runs. Lookups read the
+  // published state without taking that lock.
+  auto handler = [&]() -> Result<void> {
+    if (!db.IsLatest("package", "path") || !db.IsMounted("path") ||
+        !db.GetLatestMountedApex("package").has_value() ||
+        !db.GetMountedApexByMountPoint("mount").has_value()) {
+      return Error() << "lookup failed";
+    }
+    return {};
+  };
+  ASSERT_THAT(db.DoIfLatest("package", "path", handler), Ok());
+}
+
+TEST(ApexDatabaseTest, HandlerCanModifyDatabase) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+  db.AddMountedApex("package2", 0, "loop2", "path2", "mount2", "dev2", "hash2");
+
+  // Handlers run without holding the lock, so they can remove what they see.
+  size_t visited = 0;
+  db.ForallMountedApexes([&](const std::string& package,
+                             const MountedApexData& data,
+                             bool b ATTRIBUTE_UNUSED) {
+    visited++;
+    db.RemoveMountedApex(package, data.full_path);
+  });
+  ASSERT_EQ(visited, 2u);
+  ASSERT_EQ(CountPackages(db), 0u);
 }
 
 TEST(ApexDatabaseTest, GetLatestMountedApex) {
@@ -259,6 +344,301 @@ TEST(ApexDatabaseTest, GetLatestMountedApexReturnsNullopt) {
   ASSERT_FALSE(ret.has_value());
 }
 
+TEST(ApexDatabaseTest, IndexLookups) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+  db.AddMountedApex("package", 1, "loop1", "path1", "mount1.tmp", "dev1",
+                    "hash1", /* is_temp_mount= */ true);
+
+  ASSERT_TRUE(db.IsMounted("path"));
+  // Temp mounts don't count.
+  ASSERT_FALSE(db.IsMounted("path1"));
+  ASSERT_FALSE(db.IsMounted("no-such-path"));
+
+  auto data = db.GetMountedApex("package", "path");
+  ASSERT_TRUE(data.has_value());
+  ASSERT_EQ(data->loop_name, "loop");
+  ASSERT_FALSE(db.GetMountedApex("package2", "path").has_value());
+  ASSERT_FALSE(db.GetMountedApex("package", "path1").has_value());
+
+  auto by_mount_point = db.GetMountedApexByMountPoint("mount");
+  ASSERT_TRUE(by_mount_point.has_value());
+  ASSERT_EQ(by_mount_point->full_path, "path");
+
+  auto temp = db.GetTempMountedApex("package");
+  ASSERT_TRUE(temp.has_value());
+  ASSERT_EQ(temp->full_path, "path1");
+
+  db.RemoveMountedApex("package", "path1", /* match_temp_mounts= */ true);
+  ASSERT_FALSE(db.GetTempMountedApex("package").has_value());
+  db.RemoveMountedApex("package", "path");
+  ASSERT_FALSE(db.IsMounted("path"));
+  ASSERT_FALSE(db.GetMountedApexByMountPoint("mount").has_value());
+
+  // Devices of removed mounts can be reused.
+  db.AddMountedApex("package", 2, "loop", "path2", "mount2", "dev", "hash1");
+  ASSERT_TRUE(db.IsMounted("path2"));
+}
+
+TEST(ApexDatabaseTest, GetMountedApexAndIsLatest) {
+  MountedApexDatabase db;
+  bool latest = false;
+  ASSERT_FALSE(
+      db.GetMountedApexAndIsLatest("package", "path", &latest).has_value());
+
+  db.AddMountedApex("package", 0, "loop", "path", "mount", "dev", "hash");
+  auto data = db.GetMountedApexAndIsLatest("package", "path", &latest);
+  ASSERT_TRUE(data.has_value());
+  ASSERT_EQ(data->loop_name, "loop");
+  ASSERT_TRUE(latest);
+
+  db.AddMountedApex("package", 5, "loop5", "path5", "mount5", "dev5", "hash5");
+  data = db.GetMountedApexAndIsLatest("package", "path", &latest);
+  ASSERT_TRUE(data.has_value());
+  ASSERT_FALSE(latest);
+}
+
+TEST(ApexDatabaseTest, GetTempMountedApexReturnsHighestVersion) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", 3, "loop3", "path3", "mount3.tmp", "dev3",
+                    "hash3", /* is_temp_mount= */ true);
+  db.AddMountedApex("package", 7, "loop7", "path7", "mount7.tmp", "dev7",
+                    "hash7", /* is_temp_mount= */ true);
+  db.AddMountedApex("package", 5, "loop5", "path5", "mount5.tmp", "dev5",
+                    "hash5", /* is_temp_mount= */ true);
+
+  auto temp = db.GetTempMountedApex("package");
+  ASSERT_TRUE(temp.has_value());
+  ASSERT_EQ(temp->version, 7);
+  ASSERT_EQ(temp->full_path, "path7");
+}
+
+void WriteMountInfo(const std::string& path,
+                    const std::vector<std::string>& lines) {
+  ASSERT_TRUE(WriteStringToFile(Join(lines, "\n") + "\n", path));
+}
+
+// Makes |loop_name| look backed by |backing_file| in a fake /sys/block.
+void WriteBackingFile(const std::string& sys_block_dir,
+                      const std::string& loop_name,
+                      const std::string& backing_file) {
+  const std::string dir = sys_block_dir + "/" +
+                          std::filesystem::path(loop_name).filename().string() +
+                          "/loop";
+  std::filesystem::create_directories(dir);
+  ASSERT_TRUE(WriteStringToFile(backing_file + "\n", dir + "/backing_file"));
+}
+
+TEST(ApexDatabaseTest, RestoreFromFile) {
+  TemporaryDir td;
+  const std::string db_path = std::string(td.path) + "/apexd-db";
+  const std::string mountinfo_path = std::string(td.path) + "/mountinfo";
+  const std::string sys_block_dir = std::string(td.path) + "/sys";
+  const std::string foo_path = std::string(td.path) + "/foo.apex";
+  const std::string bar_path = std::string(td.path) + "/bar.apex";
+  ASSERT_TRUE(WriteStringToFile("", foo_path));
+  ASSERT_TRUE(WriteStringToFile("", bar_path));
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path);
+  WriteBackingFile(sys_block_dir, "/dev/block/loop3", bar_path);
+
+  MountedApexDatabase db;
+  db.SetPersistentPath(db_path);
+  MountedApexData data(1, "/dev/block/loop1", foo_path, "/apex/foo@1", "foo@1",
+                       "/dev/block/loop2");
+  data.block_device = "/dev/block/dm-1";
+  db.AddMountedApex("foo", data);
+  MountedApexData bar(2, "/dev/block/loop3", bar_path, "/apex/bar@2", "", "");
+  bar.block_device = "/dev/block/loop3";
+  db.AddMountedApex("bar", bar);
+
+  // Nothing is written until the database is persisted explicitly.
+  ASSERT_FALSE(std::filesystem::exists(db_path));
+  db.Persist();
+
+  WriteMountInfo(
+      mountinfo_path,
+      {"20 1 0:18 / /apex rw,nosuid,nodev - tmpfs tmpfs rw,seclabel",
+       "30 20 253:1 / /apex/foo@1 ro,nodev,noatime - ext4 /dev/block/dm-1 ro",
+       "31 20 253:1 / /apex/foo ro,nodev,noatime - ext4 /dev/block/dm-1 ro",
+       "32 20 7:3 / /apex/bar@2 ro,nodev,noatime shared:5 - erofs "
+       "/dev/block/loop3 ro"});
+
+  MountedApexDatabase restored;
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+  ASSERT_EQ(CountPackages(restored), 2u);
+  ASSERT_TRUE(Contains(restored, "foo", "/dev/block/loop1", foo_path,
+                       "/apex/foo@1", "foo@1", "/dev/block/loop2"));
+  ASSERT_TRUE(Contains(restored, "bar", "/dev/block/loop3", bar_path,
+                       "/apex/bar@2", "", ""));
+
+  // Removing a mount is persisted as well.
+  db.RemoveMountedApex("bar", bar_path);
+  db.Persist();
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir),
+              HasError(WithMessage(HasSubstr("has 1 mounts"))));
+}
+
+TEST(ApexDatabaseTest, RestoreFromFileKeepsMetadata) {
+  TemporaryDir td;
+  const std::string db_path = std::string(td.path) + "/apexd-db";
+  const std::string mountinfo_path = std::string(td.path) + "/mountinfo";
+  const std::string sys_block_dir = std::string(td.path) + "/sys";
+  // Not a valid APEX: the metadata can't come from opening the file.
+  const std::string foo_path = std::string(td.path) + "/foo.apex";
+  ASSERT_TRUE(WriteStringToFile("", foo_path));
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path);
+
+  MountedApexDatabase db;
+  db.SetPersistentPath(db_path);
+  MountedApexData data(3, "/dev/block/loop1", foo_path, "/apex/foo@3", "", "");
+  data.block_device = "/dev/block/loop1";
+  auto metadata = std::make_shared<ApexMetadata>();
+  metadata->path = foo_path;
+  metadata->name = "foo";
+  metadata->version = 3;
+  metadata->version_name = "3.0";
+  metadata->provide_shared_apex_libs = true;
+  metadata->public_key = std::string("key\0bytes", 9);
+  data.metadata = metadata;
+  db.AddMountedApex("foo", data);
+  db.Persist();
+  WriteMountInfo(mountinfo_path,
+                 {"30 20 7:1 / /apex/foo@3 ro - ext4 /dev/block/loop1 ro"});
+
+  MountedApexDatabase restored;
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+  auto restored_data = restored.GetLatestMountedApex("foo");
+  ASSERT_TRUE(restored_data.has_value());
+  ASSERT_NE(restored_data->metadata, nullptr);
+  ASSERT_EQ(restored_data->metadata->path, foo_path);
+  ASSERT_EQ(restored_data->metadata->name, "foo");
+  ASSERT_EQ(restored_data->metadata->version, 3);
+  ASSERT_EQ(restored_data->metadata->version_name, "3.0");
+  ASSERT_TRUE(restored_data->metadata->provide_shared_apex_libs);
+  ASSERT_EQ(restored_data->metadata->public_key, metadata->public_key);
+}
+
+TEST(ApexDatabaseTest, RestoreFromFileSkipsSysfsForSameMounts) {
+  TemporaryDir td;
+  const std::string db_path = std::string(td.path) + "/apexd-db";
+  const std::string mountinfo_path = std::string(td.path) + "/mountinfo";
+  const std::string sys_block_dir = std::string(td.path) + "/sys";
+  const std::string foo_path = std::string(td.path) + "/foo.apex";
+  ASSERT_TRUE(WriteStringToFile("", foo_path));
+  WriteMountInfo(mountinfo_path,
+                 {"30 20 7:1 / /apex/foo@1 ro - ext4 /dev/block/loop1 ro"});
+
+  MountedApexDatabase db;
+  db.SetPersistentPath(db_path, mountinfo_path);
+  MountedApexData data(1, "/dev/block/loop1", foo_path, "/apex/foo@1", "", "");
+  data.block_device = "/dev/block/loop1";
+  db.AddMountedApex("foo", data);
+  db.Persist();
+
+  // Same mount, same file: there's no sysfs to read, and none is needed.
+  MountedApexDatabase restored;
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+  auto restored_data = restored.GetMountedApex("foo", foo_path);
+  ASSERT_TRUE(restored_data.has_value());
+  ASSERT_FALSE(restored_data->deleted);
+
+  // The mount was replaced by another one of the same device.
+  WriteMountInfo(mountinfo_path,
+                 {"31 20 7:1 / /apex/foo@1 ro - ext4 /dev/block/loop1 ro"});
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir),
+              HasError(WithMessage(HasSubstr("Failed to read"))));
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path);
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+
+  // The file was replaced, while the mount still holds on to the old one.
+  WriteMountInfo(mountinfo_path,
+                 {"30 20 7:1 / /apex/foo@1 ro - ext4 /dev/block/loop1 ro"});
+  const std::string new_foo_path = foo_path + ".new";
+  ASSERT_TRUE(WriteStringToFile("", new_foo_path));
+  ASSERT_EQ(rename(new_foo_path.c_str(), foo_path.c_str()), 0);
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path + " (deleted)");
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+  restored_data = restored.GetMountedApex("foo", foo_path);
+  ASSERT_TRUE(restored_data.has_value());
+  ASSERT_TRUE(restored_data->deleted);
+}
+
+TEST(ApexDatabaseTest, RestoreFromFileRevalidatesBackingFiles) {
+  TemporaryDir td;
+  const std::string db_path = std::string(td.path) + "/apexd-db";
+  const std::string mountinfo_path = std::string(td.path) + "/mountinfo";
+  const std::string sys_block_dir = std::string(td.path) + "/sys";
+  const std::string foo_path = std::string(td.path) + "/foo.apex";
+  ASSERT_TRUE(WriteStringToFile("", foo_path));
+
+  MountedApexDatabase db;
+  db.SetPersistentPath(db_path);
+  MountedApexData data(1, "/dev/block/loop1", foo_path, "/apex/foo@1", "", "");
+  data.block_device = "/dev/block/loop1";
+  db.AddMountedApex("foo", data);
+  db.Persist();
+  WriteMountInfo(mountinfo_path,
+                 {"30 20 7:1 / /apex/foo@1 ro - ext4 /dev/block/loop1 ro"});
+
+  // Loop device is backed by another file.
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path + ".other");
+  MountedApexDatabase restored;
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir),
+              HasError(WithMessage(HasSubstr("instead of"))));
+
+  // Backing file is gone, but the kernel doesn't know about it.
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path);
+  ASSERT_EQ(unlink(foo_path.c_str()), 0);
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir),
+              HasError(WithMessage(HasSubstr("Failed to stat"))));
+  ASSERT_EQ(CountPackages(restored), 0u);
+
+  // Backing file was deleted after the database had been persisted.
+  WriteBackingFile(sys_block_dir, "/dev/block/loop1", foo_path + " (deleted)");
+  ASSERT_THAT(
+      restored.RestoreFromFile(db_path, mountinfo_path, sys_block_dir), Ok());
+  auto restored_data = restored.GetMountedApex("foo", foo_path);
+  ASSERT_TRUE(restored_data.has_value());
+  ASSERT_TRUE(restored_data->deleted);
+}
+
+TEST(ApexDatabaseTest, RestoreFromFileRejectsMismatchingMounts) {
+  TemporaryDir td;
+  const std::string db_path = std::string(td.path) + "/apexd-db";
+  const std::string mountinfo_path = std::string(td.path) + "/mountinfo";
+
+  MountedApexDatabase db;
+  db.SetPersistentPath(db_path);
+  MountedApexData data(1, "/dev/block/loop1", "/data/apex/active/foo.apex",
+                       "/apex/foo@1", "foo@1", "");
+  data.block_device = "/dev/block/dm-1";
+  db.AddMountedApex("foo", data);
+  db.Persist();
+
+  MountedApexDatabase restored;
+  restored.AddMountedApex("baz", 1, "/dev/block/loop7", "/system/apex/baz.apex",
+                          "/apex/baz@1", "", "");
+
+  // Same mount point, but a different block device.
+  WriteMountInfo(mountinfo_path,
+                 {"30 20 253:2 / /apex/foo@1 ro - ext4 /dev/block/dm-2 ro"});
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path),
+              HasError(WithMessage(HasSubstr("is not mounted"))));
+
+  // Nothing is mounted anymore (e.g. after apexd --unmount-all).
+  WriteMountInfo(mountinfo_path, {});
+  ASSERT_THAT(restored.RestoreFromFile(db_path, mountinfo_path), Not(Ok()));
+
+  // Database is left untouched.
+  ASSERT_EQ(CountPackages(restored), 1u);
+  ASSERT_TRUE(restored.IsMounted("/system/apex/baz.apex"));
+}
+
 #pragma clang diagnostic push
 // error: 'ReturnSentinel' was marked unused but was used
 // [-Werror,-Wused-but-marked-unused]
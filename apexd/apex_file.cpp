@@ -19,6 +19,7 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <fcntl.h>
@@ -28,9 +29,12 @@
 #include <unistd.h>
 #include <ziparchive/zip_archive.h>
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <span>
+#include <thread>
 
 #include "apex_constants.h"
 #include "apexd_utils.h"
@@ -42,7 +46,9 @@ using android::base::Error;
 using android::base::ReadFullyAtOffset;
 using android::base::RemoveFileIfExists;
 using android::base::Result;
+using android::base::StringPrintf;
 using android::base::unique_fd;
+using android::base::WriteFullyAtOffset;
 using ::apex::proto::ApexManifest;
 
 namespace android {
@@ -52,6 +58,11 @@ namespace {
 constexpr const char* kImageFilename = "apex_payload.img";
 constexpr const char* kCompressedApexFilename = "original_apex";
 constexpr const char* kBundledPublicKeyFilename = "apex_pubkey";
+// A chunked CAPEX stores original_apex as entries named
+// original_apex_chunk_0000, original_apex_chunk_0001, ... Each one is
+// compressed on its own, so they can be inflated in parallel.
+constexpr const char* kCompressedApexChunkPrefix = "original_apex_chunk_";
+constexpr size_t kMaxCompressedApexChunks = 10000;
 
 struct FsMagic {
   const char* type;
@@ -76,6 +87,98 @@ Result<std::string> RetrieveFsType(borrowed_fd fd, uint32_t image_offset) {
   return Error() << "Couldn't find filesystem magic";
 }
 
+std::string GetCompressedApexChunkName(size_t index) {
+  return StringPrintf("%s%04zu", kCompressedApexChunkPrefix, index);
+}
+
+struct CompressedApexChunk {
+  std::string name;
+  // Offset of the chunk within the decompressed APEX
+  off64_t offset;
+};
+
+// Returns chunks of a chunked CAPEX in the order they appear in the original
+// APEX, or an empty list if |handle| doesn't contain any. The zip central
+// directory serves as the chunk index.
+std::vector<CompressedApexChunk> FindCompressedApexChunks(
+    ZipArchiveHandle handle, off64_t* total_size) {
+  std::vector<CompressedApexChunk> chunks;
+  *total_size = 0;
+  ZipEntry entry;
+  for (size_t i = 0; i < kMaxCompressedApexChunks; i++) {
+    auto name = GetCompressedApexChunkName(i);
+    if (FindEntry(handle, name, &entry) < 0) {
+      break;
+    }
+    chunks.push_back({std::move(name), *total_size});
+    *total_size += entry.uncompressed_length;
+  }
+  return chunks;
+}
+
+struct ChunkWriter {
+  int fd;
+  off64_t offset;
+};
+
+bool WriteChunk(const uint8_t* buf, size_t buf_size, void* cookie) {
+  auto* writer = static_cast<ChunkWriter*>(cookie);
+  if (!WriteFullyAtOffset(writer->fd, buf, buf_size, writer->offset)) {
+    return false;
+  }
+  writer->offset += buf_size;
+  return true;
+}
+
+// Inflates |chunks| of the CAPEX at |src_path| into |dest_fd|. Chunks are
+// spread over worker threads, each writing straight to the chunk's offset.
+Result<void> DecompressChunks(const std::string& src_path,
+                              const std::vector<CompressedApexChunk>& chunks,
+                              int dest_fd) {
+  std::atomic<size_t> next_chunk = 0;
+  auto worker = [&]() -> Result<void> {
+    // ZipArchiveHandle can't be shared between threads, so each worker opens
+    // the CAPEX on its own.
+    unique_fd fd(open(src_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1) {
+      next_chunk = chunks.size();
+      return ErrnoError() << "Failed to open compressed APEX " << src_path;
+    }
+    ZipArchiveHandle handle;
+    int ret = OpenArchiveFd(fd.get(), src_path.c_str(), &handle, false);
+    auto handle_guard =
+        android::base::make_scope_guard([&handle] { CloseArchive(handle); });
+    if (ret < 0) {
+      next_chunk = chunks.size();
+      return Error() << "Failed to open package " << src_path << ": "
+                     << ErrorCodeString(ret);
+    }
+    for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+      const auto& chunk = chunks[i];
+      ZipEntry entry;
+      ret = FindEntry(handle, chunk.name, &entry);
+      if (ret >= 0) {
+        ChunkWriter writer = {dest_fd, chunk.offset};
+        ret = ProcessZipEntryContents(handle, &entry, WriteChunk, &writer);
+      }
+      if (ret < 0) {
+        // Make the other workers bail out early
+        next_chunk = chunks.size();
+        return Error() << "Could not decompress \"" << chunk.name << "\" of "
+                       << src_path << ": " << ErrorCodeString(ret);
+      }
+    }
+    return {};
+  };
+
+  // Chunks are handed out by the workers themselves, so that each of them
+  // opens the CAPEX only once.
+  size_t num_workers = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u), chunks.size());
+  return RunInParallel(num_workers, num_workers,
+                       [&](size_t) { return worker(); });
+}
+
 }  // namespace
 
 Result<ApexFile> ApexFile::Open(const std::string& path) {
@@ -103,9 +206,17 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
   }
 
   bool is_compressed = true;
+  std::optional<size_t> decompressed_size;
   ret = FindEntry(handle, kCompressedApexFilename, &entry);
-  if (ret < 0) {
-    is_compressed = false;
+  if (ret >= 0) {
+    decompressed_size = entry.uncompressed_length;
+  } else {
+    off64_t chunked_size = 0;
+    if (FindCompressedApexChunks(handle, &chunked_size).empty()) {
+      is_compressed = false;
+    } else {
+      decompressed_size = chunked_size;
+    }
   }
 
   if (!is_compressed) {
@@ -174,7 +285,7 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
   }
 
   return ApexFile(realpath, image_offset, image_size, std::move(*manifest),
-                  pubkey, fs_type, is_compressed);
+                  pubkey, fs_type, is_compressed, decompressed_size);
 }
 
 // AVB-related code.
@@ -419,10 +530,16 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   auto handle_guard =
       android::base::make_scope_guard([&handle] { CloseArchive(handle); });
 
-  // Find the original apex file inside the zip and extract to dest
+  // Find the original apex file inside the zip and extract to dest. If it's
+  // missing, the CAPEX may store it in chunks instead.
   ZipEntry entry;
   ret = FindEntry(handle, kCompressedApexFilename, &entry);
+  off64_t chunked_size = 0;
+  std::vector<CompressedApexChunk> chunks;
   if (ret < 0) {
+    chunks = FindCompressedApexChunks(handle, &chunked_size);
+  }
+  if (ret < 0 && chunks.empty()) {
     return Error() << "Could not find entry \"" << kCompressedApexFilename
                    << "\" in package " << src_path << ": "
                    << ErrorCodeString(ret);
@@ -440,11 +557,24 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   auto decompressed_guard = android::base::make_scope_guard(
       [&dest_path] { RemoveFileIfExists(dest_path); });
 
-  // Extract the original_apex to dest_path
-  ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
-  if (ret < 0) {
-    return Error() << "Could not decompress to file " << dest_path << " "
-                   << ErrorCodeString(ret);
+  if (chunks.empty()) {
+    // Extract the original_apex to dest_path
+    ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
+    if (ret < 0) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << ErrorCodeString(ret);
+    }
+  } else {
+    // Allocate the whole file upfront, chunks may complete in any order.
+    // Fall back to a sparse file if the filesystem can't preallocate.
+    if (fallocate(dest_fd.get(), 0, 0, chunked_size) != 0 &&
+        ftruncate(dest_fd.get(), chunked_size) != 0) {
+      return ErrnoError() << "Failed to allocate " << dest_path;
+    }
+    if (auto st = DecompressChunks(src_path, chunks, dest_fd.get()); !st.ok()) {
+      return Error() << "Could not decompress to file " << dest_path << ": "
+                     << st.error();
+    }
   }
 
   // Verification complete. Accept the decompressed file
@@ -454,5 +584,18 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   return {};
 }
 
+std::shared_ptr<const ApexMetadata> ApexMetadata::FromApexFile(
+    const ApexFile& apex) {
+  const ApexManifest& manifest = apex.GetManifest();
+  auto metadata = std::make_shared<ApexMetadata>();
+  metadata->path = apex.GetPath();
+  metadata->name = manifest.name();
+  metadata->version = manifest.version();
+  metadata->version_name = manifest.versionname();
+  metadata->provide_shared_apex_libs = manifest.providesharedapexlibs();
+  metadata->public_key = apex.GetBundledPublicKey();
+  return metadata;
+}
+
 }  // namespace apex
 }  // namespace android
@@ -44,6 +44,8 @@ class ApexFile {
   static android::base::Result<ApexFile> Open(const std::string& path);
 
   ApexFile() = delete;
+  ApexFile(const ApexFile&) = default;
+  ApexFile& operator=(const ApexFile&) = default;
   ApexFile(ApexFile&&) = default;
   ApexFile& operator=(ApexFile&&) = default;
 
@@ -58,6 +60,10 @@ class ApexFile {
   android::base::Result<ApexVerityData> VerifyApexVerity(
       const std::string& public_key) const;
   bool IsCompressed() const { return is_compressed_; }
+  // Size of the original APEX stored inside a compressed APEX.
+  const std::optional<size_t>& GetDecompressedSize() const {
+    return decompressed_size_;
+  }
   android::base::Result<void> Decompress(const std::string& output_path) const;
 
  private:
@@ -65,14 +71,16 @@ class ApexFile {
            const std::optional<uint32_t>& image_offset,
            const std::optional<size_t>& image_size,
            ::apex::proto::ApexManifest manifest, const std::string& apex_pubkey,
-           const std::optional<std::string>& fs_type, bool is_compressed)
+           const std::optional<std::string>& fs_type, bool is_compressed,
+           const std::optional<size_t>& decompressed_size)
       : apex_path_(apex_path),
         image_offset_(image_offset),
         image_size_(image_size),
         manifest_(std::move(manifest)),
         apex_pubkey_(apex_pubkey),
         fs_type_(fs_type),
-        is_compressed_(is_compressed) {}
+        is_compressed_(is_compressed),
+        decompressed_size_(decompressed_size) {}
 
   std::string apex_path_;
   std::optional<uint32_t> image_offset_;
@@ -81,6 +89,22 @@ class ApexFile {
   std::string apex_pubkey_;
   std::optional<std::string> fs_type_;
   bool is_compressed_;
+  std::optional<size_t> decompressed_size_;
+};
+
+// Metadata of an APEX file that queries about active APEXes need: a few
+// manifest fields, the public key and the path. Unlike ApexFile, it's cheap
+// to keep one per mounted APEX, and it can be rebuilt from a persisted record
+// without opening the file. Shared as an immutable object.
+struct ApexMetadata {
+  std::string path;
+  std::string name;
+  int64_t version = 0;
+  std::string version_name;
+  bool provide_shared_apex_libs = false;
+  std::string public_key;
+
+  static std::shared_ptr<const ApexMetadata> FromApexFile(const ApexFile& apex);
 };
 
 }  // namespace apex
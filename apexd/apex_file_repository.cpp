@@ -456,6 +456,10 @@ bool ApexFileRepository::IsDecompressedApex(const ApexFile& apex) const {
   return apex.GetPath().starts_with(decompression_dir_);
 }
 
+bool ApexFileRepository::IsDecompressedApex(const ApexMetadata& apex) const {
+  return apex.path.starts_with(decompression_dir_);
+}
+
 bool ApexFileRepository::IsPreInstalledApex(const ApexFile& apex) const {
   auto it = pre_installed_store_.find(apex.GetManifest().name());
   if (it == pre_installed_store_.end()) {
@@ -464,6 +468,14 @@ bool ApexFileRepository::IsPreInstalledApex(const ApexFile& apex) const {
   return it->second.GetPath() == apex.GetPath() || IsDecompressedApex(apex);
 }
 
+bool ApexFileRepository::IsPreInstalledApex(const ApexMetadata& apex) const {
+  auto it = pre_installed_store_.find(apex.name);
+  if (it == pre_installed_store_.end()) {
+    return false;
+  }
+  return it->second.GetPath() == apex.path || IsDecompressedApex(apex);
+}
+
 bool ApexFileRepository::IsBlockApex(const ApexFile& apex) const {
   return block_disk_path_.has_value() &&
          apex.GetPath().starts_with(*block_disk_path_);
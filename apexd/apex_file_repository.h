@@ -126,9 +126,11 @@ class ApexFileRepository final {
 
   // Checks if given |apex| is pre-installed.
   bool IsPreInstalledApex(const ApexFile& apex) const;
+  bool IsPreInstalledApex(const ApexMetadata& apex) const;
 
   // Checks if given |apex| is decompressed from a pre-installed APEX
   bool IsDecompressedApex(const ApexFile& apex) const;
+  bool IsDecompressedApex(const ApexMetadata& apex) const;
 
   // Checks if given |apex| is loaded from block device.
   bool IsBlockApex(const ApexFile& apex) const;
@@ -276,6 +276,38 @@ TEST(ApexFileTest, DecompressCompressedApex) {
   ASSERT_RESULT_OK(verity_status);
 }
 
+TEST(ApexFileTest, DecompressChunkedCompressedApex) {
+  Result<ApexFile> apex_file = ApexFile::Open(
+      kTestDataDir + "com.android.apex.compressed.v1.capex");
+  ASSERT_RESULT_OK(apex_file);
+  Result<ApexFile> chunked_apex_file = ApexFile::Open(
+      kTestDataDir + "com.android.apex.compressed.v1_chunked.capex");
+  ASSERT_RESULT_OK(chunked_apex_file);
+  ASSERT_TRUE(chunked_apex_file->IsCompressed());
+
+  TemporaryDir tmp_dir;
+  const std::string decompressed_path =
+      std::string(tmp_dir.path) + "/decompressed.apex";
+  const std::string chunked_decompressed_path =
+      std::string(tmp_dir.path) + "/chunked_decompressed.apex";
+  ASSERT_RESULT_OK(apex_file->Decompress(decompressed_path));
+  ASSERT_RESULT_OK(chunked_apex_file->Decompress(chunked_decompressed_path));
+
+  // Both flavours of CAPEX must decompress to the very same APEX
+  std::string decompressed;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(decompressed_path, &decompressed));
+  std::string chunked_decompressed;
+  ASSERT_TRUE(android::base::ReadFileToString(chunked_decompressed_path,
+                                              &chunked_decompressed));
+  ASSERT_EQ(decompressed, chunked_decompressed);
+
+  auto decompressed_apex_file = ApexFile::Open(chunked_decompressed_path);
+  ASSERT_RESULT_OK(decompressed_apex_file);
+  ASSERT_RESULT_OK(decompressed_apex_file->VerifyApexVerity(
+      decompressed_apex_file->GetBundledPublicKey()));
+}
+
 TEST(ApexFileTest, DecompressFailForNormalApex) {
   const std::string file_path =
       kTestDataDir + "com.android.apex.compressed.v1_original.apex";
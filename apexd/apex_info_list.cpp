@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_info_list.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/scopeguard.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <utility>
+
+#include "com_android_apex.h"
+
+using android::base::ErrnoError;
+using android::base::RemoveFileIfExists;
+using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteStringToFd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Number of removed paths remembered for GetChangesSince(). Callers holding
+// an older generation than that of the oldest remembered one get the full
+// list instead.
+constexpr size_t kMaxRemovedPaths = 64;
+
+// Writes |path| + ".tmp" with |write|, syncs it and renames it to |path|.
+template <typename WriteFn>
+Result<void> ReplaceFile(const std::string& path, WriteFn write) {
+  std::ostringstream content;
+  write(content);
+
+  const std::string tmp_path = path + ".tmp";
+  auto tmp_guard = android::base::make_scope_guard(
+      [&tmp_path]() { RemoveFileIfExists(tmp_path); });
+  unique_fd fd(TEMP_FAILURE_RETRY(open(
+      tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Can't open " << tmp_path;
+  }
+  if (!WriteStringToFd(content.str(), fd)) {
+    return ErrnoError() << "Can't write to " << tmp_path;
+  }
+  if (fchmod(fd.get(), 0644) != 0) {
+    return ErrnoError() << "Failed to chmod " << tmp_path;
+  }
+  if (fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << tmp_path;
+  }
+  fd.reset();
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  tmp_guard.Disable();
+  return {};
+}
+
+}  // namespace
+
+ApexInfoListModel::Entry ApexInfoListModel::CreateEntry(
+    const ApexMetadata& apex, const ApexFileRepository& instance) {
+  Entry entry;
+  entry.name = apex.name;
+  auto preinstalled_path = instance.GetPreinstalledPath(apex.name);
+  if (preinstalled_path.ok()) {
+    entry.preinstalled_path = *preinstalled_path;
+  }
+  entry.version = apex.version;
+  entry.version_name = apex.version_name;
+  entry.is_factory = instance.IsPreInstalledApex(apex);
+  entry.mtime = instance.GetBlockApexLastUpdateSeconds(apex.path);
+  if (!entry.mtime.has_value()) {
+    struct stat stat_buf;
+    if (stat(apex.path.c_str(), &stat_buf) == 0) {
+      entry.mtime.emplace(stat_buf.st_mtime);
+    } else {
+      PLOG(WARNING) << "Failed to stat " << apex.path;
+    }
+  }
+  entry.provide_shared_apex_libs = apex.provide_shared_apex_libs;
+  return entry;
+}
+
+void ApexInfoListModel::Update(
+    const std::vector<std::shared_ptr<const ApexMetadata>>& active,
+    const std::vector<std::shared_ptr<const ApexMetadata>>& factory,
+    const ApexFileRepository& instance,
+    const std::set<std::string>& changed_active_apexes) {
+  const uint64_t next_generation = generation_ + 1;
+  bool changed = false;
+  std::map<std::string, Entry> entries;
+  auto add = [&](const ApexMetadata& apex, bool is_active) {
+    auto [it, inserted] = entries.try_emplace(apex.path);
+    if (!inserted) {
+      return;
+    }
+    const bool active_apex_changed =
+        changed_active_apexes.count(apex.name) > 0;
+    auto cached = entries_.find(apex.path);
+    if (cached == entries_.end()) {
+      it->second = CreateEntry(apex, instance);
+      it->second.generation = next_generation;
+      removed_.erase(apex.path);
+      changed = true;
+    } else if (active_apex_changed) {
+      // The file may have been rewritten at the same path, e.g. decompressed
+      // again after an OTA, so the cached entry can't be trusted.
+      Entry entry = CreateEntry(apex, instance);
+      entry.is_active = cached->second.is_active;
+      entry.active_apex_changed = cached->second.active_apex_changed;
+      entry.generation = cached->second.generation;
+      if (!(entry == cached->second)) {
+        entry.generation = next_generation;
+        changed = true;
+      }
+      it->second = std::move(entry);
+    } else {
+      it->second = std::move(cached->second);
+    }
+    if (it->second.is_active != is_active) {
+      it->second.is_active = is_active;
+      it->second.generation = next_generation;
+      changed = true;
+    }
+    if (it->second.active_apex_changed != active_apex_changed) {
+      it->second.active_apex_changed = active_apex_changed;
+      it->second.generation = next_generation;
+      changed = true;
+    }
+  };
+  for (const auto& apex : active) {
+    add(*apex, /* is_active= */ true);
+  }
+  for (const auto& apex : factory) {
+    add(*apex, /* is_active= */ false);
+  }
+  for (const auto& [path, entry] : entries_) {
+    if (entries.find(path) == entries.end()) {
+      removed_[path] = next_generation;
+      changed = true;
+    }
+  }
+  entries_ = std::move(entries);
+  if (changed) {
+    generation_ = next_generation;
+  }
+  // Forget the oldest removals, a whole generation at a time, so that a
+  // generation is either served completely or not at all.
+  while (removed_.size() > kMaxRemovedPaths) {
+    auto oldest = std::min_element(
+        removed_.begin(), removed_.end(),
+        [](const auto& a, const auto& b) { return a.second < b.second; });
+    const uint64_t oldest_generation = oldest->second;
+    std::erase_if(removed_, [oldest_generation](const auto& removed) {
+      return removed.second <= oldest_generation;
+    });
+    oldest_generation_ = oldest_generation;
+  }
+}
+
+void ApexInfoListModel::Write(std::ostream& os) const {
+  std::vector<com::android::apex::ApexInfo> apex_infos;
+  apex_infos.reserve(entries_.size());
+  for (const auto& [path, entry] : entries_) {
+    apex_infos.emplace_back(entry.name, path, entry.preinstalled_path,
+                            entry.version, entry.version_name,
+                            entry.is_factory, entry.is_active, entry.mtime,
+                            entry.provide_shared_apex_libs);
+  }
+  com::android::apex::ApexInfoList apex_info_list(apex_infos);
+  com::android::apex::write(os, apex_info_list);
+}
+
+Result<void> ApexInfoListModel::WriteToFile(const std::string& path) const {
+  return ReplaceFile(path, [this](std::ostream& out) { Write(out); });
+}
+
+ApexInfoEntry ApexInfoListModel::ToIndexEntry(const std::string& path,
+                                              const Entry& entry) {
+  ApexInfoEntry index_entry;
+  index_entry.module_name = entry.name;
+  index_entry.module_path = path;
+  index_entry.preinstalled_module_path = entry.preinstalled_path;
+  index_entry.version_code = entry.version;
+  index_entry.version_name = entry.version_name;
+  index_entry.is_factory = entry.is_factory;
+  index_entry.is_active = entry.is_active;
+  index_entry.last_update_millis = entry.mtime;
+  index_entry.provide_shared_apex_libs = entry.provide_shared_apex_libs;
+  return index_entry;
+}
+
+ApexInfoListModel::Package ApexInfoListModel::ToPackage(
+    const std::string& path, const Entry& entry) {
+  Package package;
+  package.entry = ToIndexEntry(path, entry);
+  package.active_apex_changed = entry.active_apex_changed;
+  return package;
+}
+
+std::vector<ApexInfoEntry> ApexInfoListModel::ToIndexEntries() const {
+  std::vector<ApexInfoEntry> entries;
+  entries.reserve(entries_.size());
+  for (const auto& [path, entry] : entries_) {
+    entries.push_back(ToIndexEntry(path, entry));
+  }
+  return entries;
+}
+
+Result<void> ApexInfoListModel::WriteIndexToFile(
+    const std::string& path) const {
+  const std::string content =
+      SerializeApexInfoIndex(ToIndexEntries(), generation_);
+  return ReplaceFile(path, [&content](std::ostream& out) {
+    out.write(content.data(), content.size());
+  });
+}
+
+ApexInfoListModel::Changes ApexInfoListModel::GetChangesSince(
+    uint64_t generation) const {
+  Changes changes;
+  changes.generation = generation_;
+  changes.is_full_list =
+      generation < oldest_generation_ || generation > generation_;
+  for (const auto& [path, entry] : entries_) {
+    if (changes.is_full_list || entry.generation > generation) {
+      changes.changed.push_back(ToPackage(path, entry));
+    }
+  }
+  if (!changes.is_full_list) {
+    for (const auto& [path, removed_generation] : removed_) {
+      if (removed_generation > generation) {
+        changes.removed_paths.push_back(path);
+      }
+    }
+  }
+  return changes;
+}
+
+std::vector<ApexInfoListModel::Package> ApexInfoListModel::GetPackagesByName(
+    const std::vector<std::string>& names) const {
+  std::vector<Package> packages;
+  for (const auto& [path, entry] : entries_) {
+    if (std::find(names.begin(), names.end(), entry.name) != names.end()) {
+      packages.push_back(ToPackage(path, entry));
+    }
+  }
+  return packages;
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEX_INFO_LIST_H_
+#define ANDROID_APEXD_APEX_INFO_LIST_H_
+
+#include <android-base/result.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "apex_file.h"
+#include "apex_file_repository.h"
+#include "apexinfo_index.h"
+
+namespace android {
+namespace apex {
+
+// In-memory model of apex-info-list.xml.
+//
+// Information about an APEX (pre-installed path, mtime, ...) is computed when
+// it enters the list and is reused by subsequent updates for as long as it
+// stays in the list, so that updating the list doesn't stat() every APEX.
+// APEXes whose active version changed during this boot are the exception:
+// their files may have been rewritten in place, so their information is
+// computed again on every update.
+class ApexInfoListModel {
+ public:
+  // An entry of the list, with what apexd reports about the APEX beyond
+  // apex-info-list.xml.
+  struct Package {
+    ApexInfoEntry entry;
+    // Set if the active version of the APEX changed during this boot.
+    bool active_apex_changed = false;
+  };
+
+  // Changes of the list between two generations of the model.
+  struct Changes {
+    // Generation of the model these changes bring the caller to.
+    uint64_t generation = 0;
+    // Set if the requested generation isn't one of this model, e.g. it is 0
+    // or comes from a previous apexd instance, or is too old for the removed
+    // paths to still be known. |changed| then lists every entry.
+    bool is_full_list = false;
+    // Entries added or modified since the requested generation.
+    std::vector<Package> changed;
+    // Paths of the entries removed since the requested generation.
+    std::vector<std::string> removed_paths;
+  };
+
+  // Generations of this model start after |first_generation|, which should
+  // differ between instances so that callers can't mix them up.
+  explicit ApexInfoListModel(uint64_t first_generation = 0)
+      : oldest_generation_(first_generation + 1),
+        generation_(first_generation) {}
+
+  // Brings the model in sync with the given |active| and |factory| APEXes.
+  // Factory APEXes which are also active are only listed once, as active.
+  // |changed_active_apexes| names the APEXes whose active version changed
+  // during this boot.
+  void Update(const std::vector<std::shared_ptr<const ApexMetadata>>& active,
+              const std::vector<std::shared_ptr<const ApexMetadata>>& factory,
+              const ApexFileRepository& instance,
+              const std::set<std::string>& changed_active_apexes = {});
+
+  // Writes the list in the apex-info-list.xml format.
+  void Write(std::ostream& os) const;
+
+  // Atomically replaces |path| with the current content of the list, so that
+  // readers never observe a partially written file.
+  android::base::Result<void> WriteToFile(const std::string& path) const;
+
+  // Returns the list as entries of the binary index (see apexinfo_index.h).
+  std::vector<ApexInfoEntry> ToIndexEntries() const;
+
+  // Atomically replaces |path| with the binary index of the list. The index
+  // carries the generation of the model, so rewriting an unchanged list
+  // doesn't invalidate what clients cached from it.
+  android::base::Result<void> WriteIndexToFile(const std::string& path) const;
+
+  // Returns the current generation. Every Update() that changes the list
+  // bumps it.
+  uint64_t GetGeneration() const { return generation_; }
+
+  // Returns what changed in the list since |generation|.
+  Changes GetChangesSince(uint64_t generation) const;
+
+  // Returns the entries, active or not, of the APEXes named |names|.
+  std::vector<Package> GetPackagesByName(
+      const std::vector<std::string>& names) const;
+
+ private:
+  struct Entry {
+    std::string name;
+    std::optional<std::string> preinstalled_path;
+    int64_t version = 0;
+    std::string version_name;
+    bool is_factory = false;
+    bool is_active = false;
+    std::optional<int64_t> mtime;
+    bool provide_shared_apex_libs = false;
+    bool active_apex_changed = false;
+    // Generation of the model in which the entry was last added or changed.
+    uint64_t generation = 0;
+
+    bool operator==(const Entry&) const = default;
+  };
+
+  static Entry CreateEntry(const ApexMetadata& apex,
+                           const ApexFileRepository& instance);
+
+  static ApexInfoEntry ToIndexEntry(const std::string& path,
+                                    const Entry& entry);
+
+  static Package ToPackage(const std::string& path, const Entry& entry);
+
+  // A map from APEX path to its entry.
+  std::map<std::string, Entry> entries_;
+  // A map from path of a removed APEX to the generation it was removed in.
+  // Only the most recent ones are kept, see oldest_generation_.
+  std::map<std::string, uint64_t> removed_;
+  // Oldest generation GetChangesSince() can tell the changes since. Older
+  // ones get the full list.
+  uint64_t oldest_generation_;
+  uint64_t generation_;
+};
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEX_INFO_LIST_H_
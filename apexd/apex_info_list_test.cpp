@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_info_list.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <android-base/stringprintf.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "apex_file.h"
+#include "apex_file_repository.h"
+#include "apexd_test_utils.h"
+#include "apexinfo_index.h"
+#include "com_android_apex.h"
+
+namespace android {
+namespace apex {
+namespace {
+
+namespace fs = std::filesystem;
+
+using android::base::GetExecutableDirectory;
+using android::base::StringPrintf;
+using android::base::testing::Ok;
+using com::android::apex::testing::ApexInfoXmlEq;
+using ::testing::UnorderedElementsAre;
+
+std::string GetTestFile(const std::string& name) {
+  return GetExecutableDirectory() + "/" + name;
+}
+
+int64_t GetMTime(const std::string& path) {
+  struct stat st_buf;
+  if (stat(path.c_str(), &st_buf) != 0) {
+    return 0;
+  }
+  return st_buf.st_mtime;
+}
+
+class ApexInfoListModelTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fs::copy(GetTestFile("apex.apexd_test.apex"), built_in_dir_.path);
+    fs::copy(GetTestFile("apex.apexd_test_different_app.apex"),
+             built_in_dir_.path);
+    fs::copy(GetTestFile("apex.apexd_test_v2.apex"), data_dir_.path);
+    ASSERT_THAT(instance_.AddPreInstalledApex({built_in_dir_.path}), Ok());
+  }
+
+  std::string BuiltInPath(const std::string& name) {
+    return StringPrintf("%s/%s", built_in_dir_.path, name.c_str());
+  }
+
+  std::string DataPath(const std::string& name) {
+    return StringPrintf("%s/%s", data_dir_.path, name.c_str());
+  }
+
+  std::shared_ptr<const ApexMetadata> Open(const std::string& path) {
+    auto apex = ApexFile::Open(path);
+    CHECK(apex.ok()) << apex.error();
+    return ApexMetadata::FromApexFile(*apex);
+  }
+
+  std::vector<com::android::apex::ApexInfo> Read(
+      const ApexInfoListModel& model) {
+    TemporaryDir td;
+    auto path = StringPrintf("%s/apex-info-list.xml", td.path);
+    CHECK(model.WriteToFile(path).ok());
+    auto info_list = com::android::apex::readApexInfoList(path.c_str());
+    CHECK(info_list.has_value());
+    return info_list->getApexInfo();
+  }
+
+  TemporaryDir built_in_dir_;
+  TemporaryDir data_dir_;
+  ApexFileRepository instance_;
+};
+
+TEST_F(ApexInfoListModelTest, ActiveFactoryApexIsListedOnce) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+
+  ApexInfoListModel model;
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+
+  auto info_1 = com::android::apex::ApexInfo(
+      /* moduleName= */ "com.android.apex.test_package",
+      /* modulePath= */ apex_1, /* preinstalledModulePath= */ apex_1,
+      /* versionCode= */ 1, /* versionName= */ "1", /* isFactory= */ true,
+      /* isActive= */ true, GetMTime(apex_1),
+      /* provideSharedApexLibs= */ false);
+  auto info_2 = com::android::apex::ApexInfo(
+      /* moduleName= */ "com.android.apex.test_package_2",
+      /* modulePath= */ apex_2, /* preinstalledModulePath= */ apex_2,
+      /* versionCode= */ 1, /* versionName= */ "1", /* isFactory= */ true,
+      /* isActive= */ false, GetMTime(apex_2),
+      /* provideSharedApexLibs= */ false);
+  ASSERT_THAT(Read(model), UnorderedElementsAre(ApexInfoXmlEq(info_1),
+                                                ApexInfoXmlEq(info_2)));
+}
+
+TEST_F(ApexInfoListModelTest, UpdateMovesApexBetweenActiveAndInactive) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = DataPath("apex.apexd_test_v2.apex");
+
+  ApexInfoListModel model;
+  model.Update({Open(apex_1)}, {Open(apex_1)}, instance_);
+  model.Update({Open(apex_2)}, {Open(apex_1)}, instance_);
+
+  auto info_1 = com::android::apex::ApexInfo(
+      /* moduleName= */ "com.android.apex.test_package",
+      /* modulePath= */ apex_1, /* preinstalledModulePath= */ apex_1,
+      /* versionCode= */ 1, /* versionName= */ "1", /* isFactory= */ true,
+      /* isActive= */ false, GetMTime(apex_1),
+      /* provideSharedApexLibs= */ false);
+  auto info_2 = com::android::apex::ApexInfo(
+      /* moduleName= */ "com.android.apex.test_package",
+      /* modulePath= */ apex_2, /* preinstalledModulePath= */ apex_1,
+      /* versionCode= */ 2, /* versionName= */ "2", /* isFactory= */ false,
+      /* isActive= */ true, GetMTime(apex_2),
+      /* provideSharedApexLibs= */ false);
+  ASSERT_THAT(Read(model), UnorderedElementsAre(ApexInfoXmlEq(info_1),
+                                                ApexInfoXmlEq(info_2)));
+}
+
+TEST_F(ApexInfoListModelTest, EntriesAreReusedWhileApexStaysInList) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = DataPath("apex.apexd_test_v2.apex");
+  const int64_t mtime = GetMTime(apex_2);
+
+  ApexInfoListModel model;
+  auto active = Open(apex_2);
+  model.Update({active}, {Open(apex_1)}, instance_);
+
+  // APEX that stays in the list is not stat()-ed again.
+  fs::remove(apex_2);
+  model.Update({active}, {Open(apex_1)}, instance_);
+
+  auto info_list = Read(model);
+  auto it = std::find_if(
+      info_list.begin(), info_list.end(),
+      [&](const auto& info) { return info.getModulePath() == apex_2; });
+  ASSERT_NE(it, info_list.end());
+  ASSERT_TRUE(it->hasLastUpdateMillis());
+  ASSERT_EQ(it->getLastUpdateMillis(), mtime);
+}
+
+TEST_F(ApexInfoListModelTest, WriteToFileReplacesFile) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex-info-list.xml", td.path);
+  ASSERT_TRUE(android::base::WriteStringToFile("garbage", path));
+
+  ApexInfoListModel model;
+  model.Update({Open(apex_1)}, {}, instance_);
+  ASSERT_THAT(model.WriteToFile(path), Ok());
+
+  std::stringstream expected;
+  model.Write(expected);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &content));
+  ASSERT_EQ(content, expected.str());
+  ASSERT_FALSE(fs::exists(path + ".tmp"));
+}
+
+TEST_F(ApexInfoListModelTest, IndexAgreesWithXml) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+  const std::string apex_3 = DataPath("apex.apexd_test_v2.apex");
+
+  ApexInfoListModel model;
+  model.Update({Open(apex_3), Open(apex_2)}, {Open(apex_1), Open(apex_2)},
+               instance_);
+
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex-info-list.bin", td.path);
+  ASSERT_THAT(model.WriteIndexToFile(path), Ok());
+  auto index = ApexInfoIndex::Open(path);
+  ASSERT_THAT(index, Ok());
+
+  auto info_list = Read(model);
+  ASSERT_EQ(index->Size(), info_list.size());
+  for (const auto& info : info_list) {
+    auto entries = index->Find(info.getModuleName());
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const auto& e) {
+      return e.module_path == info.getModulePath();
+    });
+    ASSERT_NE(it, entries.end()) << info.getModulePath();
+    if (info.hasPreinstalledModulePath()) {
+      ASSERT_EQ(it->preinstalled_module_path, info.getPreinstalledModulePath());
+    } else {
+      ASSERT_EQ(it->preinstalled_module_path, std::nullopt);
+    }
+    ASSERT_EQ(it->version_code, info.getVersionCode());
+    ASSERT_EQ(it->version_name, info.getVersionName());
+    ASSERT_EQ(it->is_factory, info.getIsFactory());
+    ASSERT_EQ(it->is_active, info.getIsActive());
+    if (info.hasLastUpdateMillis()) {
+      ASSERT_EQ(it->last_update_millis, info.getLastUpdateMillis());
+    } else {
+      ASSERT_EQ(it->last_update_millis, std::nullopt);
+    }
+    ASSERT_EQ(it->provide_shared_apex_libs, info.getProvideSharedApexLibs());
+  }
+
+  auto active = index->FindActive("com.android.apex.test_package");
+  ASSERT_TRUE(active.has_value());
+  ASSERT_EQ(active->module_path, apex_3);
+}
+
+TEST_F(ApexInfoListModelTest, WriteIndexToFileKeepsGenerationOfModel) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex-info-list.bin", td.path);
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({Open(apex_1)}, {}, instance_);
+  ASSERT_THAT(model.WriteIndexToFile(path), Ok());
+  ASSERT_EQ(ReadApexInfoIndexGeneration(path).value_or(0), 101u);
+
+  // Rewriting an unchanged list keeps the generation.
+  model.Update({Open(apex_1)}, {}, instance_);
+  ASSERT_THAT(model.WriteIndexToFile(path), Ok());
+  ASSERT_EQ(ReadApexInfoIndexGeneration(path).value_or(0), 101u);
+
+  model.Update({Open(apex_1)}, {Open(apex_2)}, instance_);
+  ASSERT_THAT(model.WriteIndexToFile(path), Ok());
+  ASSERT_EQ(ReadApexInfoIndexGeneration(path).value_or(0), 102u);
+  ASSERT_FALSE(fs::exists(path + ".tmp"));
+}
+
+std::vector<std::string> Paths(
+    const std::vector<ApexInfoListModel::Package>& packages) {
+  std::vector<std::string> paths;
+  for (const auto& package : packages) {
+    paths.push_back(package.entry.module_path);
+  }
+  return paths;
+}
+
+TEST_F(ApexInfoListModelTest, EntriesOfChangedActiveApexesAreRebuilt) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = DataPath("apex.apexd_test_v2.apex");
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({Open(apex_2)}, {Open(apex_1)}, instance_);
+  ASSERT_EQ(model.GetGeneration(), 101u);
+
+  // The active APEX is rewritten in place with different contents.
+  fs::copy(GetTestFile("apex.apexd_test.apex"), apex_2,
+           fs::copy_options::overwrite_existing);
+  model.Update({Open(apex_2)}, {Open(apex_1)}, instance_,
+               {"com.android.apex.test_package"});
+  auto changes = model.GetChangesSince(101);
+  ASSERT_EQ(changes.generation, 102u);
+  ASSERT_THAT(Paths(changes.changed), UnorderedElementsAre(apex_1, apex_2));
+  for (const auto& package : changes.changed) {
+    ASSERT_EQ(package.entry.version_code, 1) << package.entry.module_path;
+  }
+
+  // Rebuilding an entry that didn't change keeps the generation.
+  model.Update({Open(apex_2)}, {Open(apex_1)}, instance_,
+               {"com.android.apex.test_package"});
+  ASSERT_EQ(model.GetGeneration(), 102u);
+}
+
+TEST_F(ApexInfoListModelTest, GetChangesSinceReturnsOnlyChanges) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+  const std::string apex_3 = DataPath("apex.apexd_test_v2.apex");
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+  const uint64_t generation = model.GetGeneration();
+  ASSERT_EQ(generation, 101u);
+
+  // Same list doesn't bump the generation.
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+  ASSERT_EQ(model.GetGeneration(), generation);
+  auto changes = model.GetChangesSince(generation);
+  ASSERT_FALSE(changes.is_full_list);
+  ASSERT_EQ(changes.generation, generation);
+  ASSERT_TRUE(changes.changed.empty());
+  ASSERT_TRUE(changes.removed_paths.empty());
+
+  // apex_3 becomes active, apex_1 becomes inactive.
+  model.Update({Open(apex_3)}, {Open(apex_1), Open(apex_2)}, instance_);
+  changes = model.GetChangesSince(generation);
+  ASSERT_FALSE(changes.is_full_list);
+  ASSERT_EQ(changes.generation, generation + 1);
+  ASSERT_THAT(Paths(changes.changed), UnorderedElementsAre(apex_1, apex_3));
+  ASSERT_TRUE(changes.removed_paths.empty());
+
+  // apex_3 goes away.
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+  changes = model.GetChangesSince(generation + 1);
+  ASSERT_EQ(changes.generation, generation + 2);
+  ASSERT_THAT(Paths(changes.changed), UnorderedElementsAre(apex_1));
+  ASSERT_THAT(changes.removed_paths, UnorderedElementsAre(apex_3));
+}
+
+TEST_F(ApexInfoListModelTest, GetChangesSinceUnknownGenerationReturnsAll) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+
+  for (uint64_t generation : {0u, 50u, 100u, 102u}) {
+    auto changes = model.GetChangesSince(generation);
+    ASSERT_TRUE(changes.is_full_list) << generation;
+    ASSERT_EQ(changes.generation, 101u);
+    ASSERT_THAT(Paths(changes.changed), UnorderedElementsAre(apex_1, apex_2));
+    ASSERT_TRUE(changes.removed_paths.empty());
+  }
+}
+
+TEST_F(ApexInfoListModelTest, GetChangesSinceAfterActiveApexChanged) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_);
+  ASSERT_EQ(model.GetGeneration(), 101u);
+
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_,
+               {"com.android.apex.test_package"});
+  auto changes = model.GetChangesSince(101);
+  ASSERT_FALSE(changes.is_full_list);
+  ASSERT_EQ(changes.generation, 102u);
+  ASSERT_THAT(Paths(changes.changed), UnorderedElementsAre(apex_1));
+  ASSERT_TRUE(changes.changed[0].active_apex_changed);
+
+  // Same set of changed APEXes doesn't bump the generation.
+  model.Update({Open(apex_1)}, {Open(apex_1), Open(apex_2)}, instance_,
+               {"com.android.apex.test_package"});
+  ASSERT_EQ(model.GetGeneration(), 102u);
+}
+
+TEST_F(ApexInfoListModelTest, GetChangesSinceForgetsOldRemovals) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  std::vector<std::shared_ptr<const ApexMetadata>> copies;
+  for (int i = 0; i < 64; i++) {
+    auto path = DataPath(StringPrintf("copy_%d.apex", i));
+    fs::copy(apex_1, path);
+    copies.push_back(Open(path));
+  }
+
+  ApexInfoListModel model(/* first_generation= */ 100);
+  model.Update({}, copies, instance_);
+  // 64 removed paths are still remembered.
+  model.Update({}, {}, instance_);
+  auto changes = model.GetChangesSince(101);
+  ASSERT_FALSE(changes.is_full_list);
+  ASSERT_EQ(changes.removed_paths.size(), 64u);
+
+  // One more pushes out all the paths removed in generation 102.
+  model.Update({}, {Open(apex_1)}, instance_);
+  model.Update({}, {}, instance_);
+  ASSERT_EQ(model.GetGeneration(), 104u);
+  changes = model.GetChangesSince(101);
+  ASSERT_TRUE(changes.is_full_list);
+  ASSERT_TRUE(changes.changed.empty());
+  ASSERT_TRUE(changes.removed_paths.empty());
+  changes = model.GetChangesSince(102);
+  ASSERT_FALSE(changes.is_full_list);
+  ASSERT_THAT(changes.removed_paths, UnorderedElementsAre(apex_1));
+}
+
+TEST_F(ApexInfoListModelTest, GetPackagesByName) {
+  const std::string apex_1 = BuiltInPath("apex.apexd_test.apex");
+  const std::string apex_2 = BuiltInPath("apex.apexd_test_different_app.apex");
+  const std::string apex_3 = DataPath("apex.apexd_test_v2.apex");
+
+  ApexInfoListModel model;
+  model.Update({Open(apex_3), Open(apex_2)}, {Open(apex_1), Open(apex_2)},
+               instance_);
+
+  ASSERT_THAT(
+      Paths(model.GetPackagesByName({"com.android.apex.test_package"})),
+      UnorderedElementsAre(apex_1, apex_3));
+  ASSERT_THAT(
+      Paths(model.GetPackagesByName({"com.android.apex.test_package_2",
+                                     "com.android.apex.not_there"})),
+      UnorderedElementsAre(apex_2));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
@@ -20,19 +20,27 @@
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
 #include <openssl/sha.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <filesystem>
-#include <fstream>
-#include <sstream>
+#include <mutex>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "apex_constants.h"
 #include "apex_file.h"
+#include "apexd_verity.h"
 #include "string_log.h"
 
 using android::base::ErrnoError;
 using android::base::Error;
 using android::base::Result;
+using android::base::unique_fd;
 using ::apex::proto::ApexManifest;
 
 namespace android {
@@ -45,7 +53,9 @@ namespace {
 
 static constexpr const char* kApexCtsShimPackage = "com.android.apex.cts.shim";
 static constexpr const char* kHashFilePath = "etc/hash.txt";
-static constexpr const int kBufSize = 1024;
+// Reading in large chunks keeps the number of syscalls low. The file isn't
+// mmapped since a concurrent truncation would crash apexd with SIGBUS.
+static constexpr const size_t kBufSize = 256 * 1024;
 static constexpr const fs::perms kForbiddenFilePermissions =
     fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec;
 static constexpr const char* kExpectedCtsShimFiles[] = {
@@ -78,31 +88,34 @@ static constexpr const char* kExpectedCtsShimFiles[] = {
     "priv-app/CtsShimPriv@MASTER/CtsShimPriv.apk",
 };
 
-Result<std::string> CalculateSha512(const std::string& path) {
+Result<std::string> CalculateSha512(int fd, const std::string& path) {
   LOG(DEBUG) << "Calculating SHA512 of " << path;
+  // Only a hint, hashing works the same if the kernel ignores it.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
   SHA512_CTX ctx;
   SHA512_Init(&ctx);
-  std::ifstream apex(path, std::ios::binary);
-  if (apex.bad()) {
-    return Error() << "Failed to open " << path;
-  }
-  char buf[kBufSize];
-  while (!apex.eof()) {
-    apex.read(buf, kBufSize);
-    if (apex.bad()) {
-      return Error() << "Failed to read " << path;
+  std::vector<uint8_t> buf(kBufSize);
+  while (true) {
+    ssize_t bytes_read = TEMP_FAILURE_RETRY(read(fd, buf.data(), buf.size()));
+    if (bytes_read < 0) {
+      return ErrnoError() << "Failed to read " << path;
+    }
+    if (bytes_read == 0) {
+      break;
     }
-    int bytes_read = apex.gcount();
-    SHA512_Update(&ctx, buf, bytes_read);
+    SHA512_Update(&ctx, buf.data(), bytes_read);
   }
   uint8_t hash[SHA512_DIGEST_LENGTH];
   SHA512_Final(hash, &ctx);
-  std::stringstream ss;
-  ss << std::hex;
-  for (int i = 0; i < SHA512_DIGEST_LENGTH; i++) {
-    ss << std::setw(2) << std::setfill('0') << static_cast<int>(hash[i]);
+  return BytesToHex(hash, SHA512_DIGEST_LENGTH);
+}
+
+Result<unique_fd> OpenForHashing(const std::string& path) {
+  unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
   }
-  return ss.str();
+  return fd;
 }
 
 Result<std::vector<std::string>> GetAllowedHashes(const std::string& path) {
@@ -116,7 +129,7 @@ Result<std::vector<std::string>> GetAllowedHashes(const std::string& path) {
     return ErrnoError() << "Failed to read " << file_path;
   }
   std::vector<std::string> allowed_hashes = android::base::Split(hash, "\n");
-  auto system_shim_hash = CalculateSha512(
+  auto system_shim_hash = CalculateSha512Cached(
       StringPrintf("%s/%s", kApexPackageSystemDir, shim::kSystemShimApexName));
   if (!system_shim_hash.ok()) {
     return system_shim_hash.error();
@@ -126,6 +139,47 @@ Result<std::vector<std::string>> GetAllowedHashes(const std::string& path) {
 }
 }  // namespace
 
+Result<std::string> CalculateSha512(const std::string& path) {
+  unique_fd fd = OR_RETURN(OpenForHashing(path));
+  return CalculateSha512(fd.get(), path);
+}
+
+Result<std::string> CalculateSha512Cached(const std::string& path) {
+  struct CacheEntry {
+    struct stat st;
+    std::string hash;
+  };
+  static std::mutex mutex;
+  static auto* cache = new std::unordered_map<std::string, CacheEntry>();
+
+  // The identity is taken from the same fd that is hashed, so a cached hash
+  // always belongs to the file contents it was computed from.
+  unique_fd fd = OR_RETURN(OpenForHashing(path));
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+  auto same_file = [&st](const struct stat& other) {
+    return st.st_dev == other.st_dev && st.st_ino == other.st_ino &&
+           st.st_size == other.st_size &&
+           st.st_mtim.tv_sec == other.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == other.st_mtim.tv_nsec &&
+           st.st_ctim.tv_sec == other.st_ctim.tv_sec &&
+           st.st_ctim.tv_nsec == other.st_ctim.tv_nsec;
+  };
+  {
+    std::lock_guard lock(mutex);
+    auto it = cache->find(path);
+    if (it != cache->end() && same_file(it->second.st)) {
+      return it->second.hash;
+    }
+  }
+  std::string hash = OR_RETURN(CalculateSha512(fd.get(), path));
+  std::lock_guard lock(mutex);
+  (*cache)[path] = CacheEntry{st, hash};
+  return hash;
+}
+
 bool IsShimApex(const ApexFile& apex_file) {
   return apex_file.GetManifest().name() == kApexCtsShimPackage;
 }
@@ -29,6 +29,14 @@ bool IsShimApex(const ApexFile& apex_file);
 android::base::Result<void> ValidateShimApex(const std::string& mount_point,
                                              const ApexFile& apex_file);
 
+// Returns the hex-encoded SHA-512 of the file at |path|.
+android::base::Result<std::string> CalculateSha512(const std::string& path);
+
+// Same as CalculateSha512, but remembers the result for as long as the file
+// isn't changed. Meant for files on read-only partitions, e.g. the system shim.
+android::base::Result<std::string> CalculateSha512Cached(
+    const std::string& path);
+
 android::base::Result<void> ValidateUpdate(const std::string& system_apex_path,
                                            const std::string& new_apex_path);
 
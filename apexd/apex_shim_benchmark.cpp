@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <benchmark/benchmark.h>
+#include <openssl/sha.h>
+
+#include <fstream>
+#include <string>
+
+#include "apex_shim.h"
+#include "apexd_verity.h"
+
+namespace android {
+namespace apex {
+namespace shim {
+namespace {
+
+// How CalculateSha512 used to read the file, kept as the baseline.
+std::string IfstreamSha512(const std::string& path) {
+  constexpr int kBufSize = 1024;
+  SHA512_CTX ctx;
+  SHA512_Init(&ctx);
+  std::ifstream apex(path, std::ios::binary);
+  char buf[kBufSize];
+  while (!apex.eof()) {
+    apex.read(buf, kBufSize);
+    SHA512_Update(&ctx, buf, apex.gcount());
+  }
+  uint8_t hash[SHA512_DIGEST_LENGTH];
+  SHA512_Final(hash, &ctx);
+  return BytesToHex(hash, SHA512_DIGEST_LENGTH);
+}
+
+// Creates a file of |size| bytes, roughly the size of a shim APEX.
+void WriteTestFile(const std::string& path, size_t size) {
+  std::string content(size, '\0');
+  for (size_t i = 0; i < size; i++) {
+    content[i] = static_cast<char>(i * 31 + (i >> 12));
+  }
+  if (!android::base::WriteStringToFile(content, path)) {
+    abort();
+  }
+}
+
+void BM_IfstreamSha512(benchmark::State& state) {
+  TemporaryFile file;
+  WriteTestFile(file.path, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(IfstreamSha512(file.path));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IfstreamSha512)->Arg(1 << 20)->Arg(16 << 20);
+
+void BM_CalculateSha512(benchmark::State& state) {
+  TemporaryFile file;
+  WriteTestFile(file.path, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(CalculateSha512(file.path));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CalculateSha512)->Arg(1 << 20)->Arg(16 << 20);
+
+void BM_CalculateSha512Cached(benchmark::State& state) {
+  TemporaryFile file;
+  WriteTestFile(file.path, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(CalculateSha512Cached(file.path));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CalculateSha512Cached)->Arg(1 << 20)->Arg(16 << 20);
+
+}  // namespace
+}  // namespace shim
+}  // namespace apex
+}  // namespace android
+
+BENCHMARK_MAIN();
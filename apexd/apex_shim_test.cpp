@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_shim.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace android {
+namespace apex {
+namespace shim {
+
+using android::base::WriteStringToFile;
+using android::base::testing::HasError;
+using android::base::testing::HasValue;
+
+// SHA-512 of "abc", from FIPS 180-2.
+static constexpr const char* kAbcSha512 =
+    "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f";
+
+TEST(ApexShimTest, CalculateSha512) {
+  TemporaryFile file;
+  ASSERT_TRUE(WriteStringToFile("abc", file.path));
+
+  ASSERT_THAT(CalculateSha512(file.path), HasValue(std::string(kAbcSha512)));
+}
+
+TEST(ApexShimTest, CalculateSha512LargerThanReadBuffer) {
+  TemporaryFile file;
+  std::string content(1024 * 1024 + 7, 'x');
+  ASSERT_TRUE(WriteStringToFile(content, file.path));
+
+  auto hash = CalculateSha512(file.path);
+  ASSERT_THAT(hash, HasValue(testing::SizeIs(128)));
+  ASSERT_THAT(CalculateSha512Cached(file.path), HasValue(*hash));
+}
+
+TEST(ApexShimTest, CalculateSha512CachedNoticesChanges) {
+  TemporaryFile file;
+  ASSERT_TRUE(WriteStringToFile("ab", file.path));
+  ASSERT_THAT(CalculateSha512Cached(file.path),
+              HasValue(testing::Ne(kAbcSha512)));
+
+  ASSERT_TRUE(WriteStringToFile("abc", file.path));
+  ASSERT_THAT(CalculateSha512Cached(file.path),
+              HasValue(std::string(kAbcSha512)));
+}
+
+TEST(ApexShimTest, CalculateSha512MissingFile) {
+  ASSERT_THAT(CalculateSha512("/does/not/exist"), HasError(testing::_));
+}
+
+}  // namespace shim
+}  // namespace apex
+}  // namespace android
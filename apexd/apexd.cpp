@@ -37,8 +37,10 @@
 #include <libdm/dm_table.h>
 #include <libdm/dm_target.h>
 #include <linux/f2fs.h>
+#include <linux/fs.h>
 #include <linux/loop.h>
 #include <selinux/android.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
@@ -52,6 +54,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
 #include <filesystem>
@@ -59,32 +62,41 @@
 #include <future>
 #include <iomanip>
 #include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "VerityUtils.h"
+#include "activation_plan.pb.h"
 #include "apex_constants.h"
 #include "apex_database.h"
 #include "apex_file.h"
 #include "apex_file_repository.h"
+#include "apex_info_list.h"
 #include "apex_manifest.h"
 #include "apex_shim.h"
+#include "apexd_activation_plan.h"
+#include "apexd_async_operations.h"
 #include "apexd_checkpoint.h"
 #include "apexd_lifecycle.h"
 #include "apexd_loop.h"
 #include "apexd_private.h"
-#include "apexd_rollback_utils.h"
 #include "apexd_session.h"
+#include "apexd_snapshot_store.h"
 #include "apexd_utils.h"
 #include "apexd_vendor_apex.h"
+#include "apexd_verified_apex.h"
 #include "apexd_verity.h"
 #include "com_android_apex.h"
 
@@ -95,16 +107,19 @@ using android::base::Error;
 using android::base::GetProperty;
 using android::base::Join;
 using android::base::ParseUint;
+using android::base::ReadFileToString;
 using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::SetProperty;
 using android::base::StartsWith;
 using android::base::StringPrintf;
 using android::base::unique_fd;
+using android::base::WriteStringToFile;
 using android::dm::DeviceMapper;
 using android::dm::DmDeviceState;
 using android::dm::DmTable;
 using android::dm::DmTargetVerity;
+using ::apex::proto::ActivationPlan;
 using ::apex::proto::ApexManifest;
 using apex::proto::SessionState;
 using google::protobuf::util::MessageDifferencer;
@@ -143,6 +158,15 @@ bool gInFsCheckpointMode = false;
 //  pre-installed APEX.
 std::set<std::string> gChangedActiveApexes;
 
+// APEXes activated during this boot. Persisted once boot is completed, so that
+// the next boot can skip selecting APEXes if nothing has changed.
+std::optional<ActivationPlan> gActivationPlan;
+
+// APEXes of the staged sessions being activated during this boot, by name, as
+// verified when their sessions were submitted. Only populated until they are
+// activated.
+std::unordered_map<std::string, VerifiedApex> gVerifiedApexes;
+
 static constexpr size_t kLoopDeviceSetupAttempts = 3u;
 
 // Please DO NOT add new modules to this list without contacting mainline-modularization@ first.
@@ -199,6 +223,20 @@ void ReleaseF2fsCompressedBlocks(const std::string& file_path) {
             << file_path;
 }
 
+// f2fs refuses to fallocate() files that have compression enabled, which new
+// files inherit from their directory. Turns it off for the empty file |fd|.
+void DisableF2fsCompression(int fd, const std::string& file_path) {
+  unsigned int flags;
+  if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == -1 ||
+      (flags & FS_COMPR_FL) == 0) {
+    return;
+  }
+  flags &= ~FS_COMPR_FL;
+  if (ioctl(fd, FS_IOC_SETFLAGS, &flags) == -1) {
+    PLOG(WARNING) << "Failed to disable f2fs-compression on " << file_path;
+  }
+}
+
 std::unique_ptr<DmTable> CreateVerityTable(const ApexVerityData& verity_data,
                                            const std::string& block_device,
                                            const std::string& hash_device,
@@ -348,6 +386,35 @@ Result<DmVerityDevice> CreateVerityDevice(const std::string& name,
   }
 }
 
+/**
+ * Returns the package names of the apex files currently present in
+ * kActiveApexPackagesDataDir, keyed by path. The directory is scanned once.
+ * apexd names the files it creates `<name>@<version>[_<minor>].apex`, so the
+ * package name is taken from the file name; only files named differently are
+ * opened to read their manifest.
+ */
+Result<std::unordered_map<std::string, std::string>> ScanActiveApexFiles() {
+  auto all_active_apex_files =
+      FindFilesBySuffix(gConfig->active_apex_data_dir, {kApexPackageSuffix});
+  if (!all_active_apex_files.ok()) {
+    return all_active_apex_files.error();
+  }
+
+  std::unordered_map<std::string, std::string> active_files;
+  for (const std::string& path : *all_active_apex_files) {
+    if (auto parsed = ParseActiveApexFileName(path); parsed.has_value()) {
+      active_files.emplace(path, std::move(parsed->first));
+      continue;
+    }
+    Result<ApexFile> apex_file = ApexFile::Open(path);
+    if (!apex_file.ok()) {
+      return apex_file.error();
+    }
+    active_files.emplace(path, apex_file->GetManifest().name());
+  }
+  return active_files;
+}
+
 /**
  * When we create hardlink for a new apex package in kActiveApexPackagesDataDir,
  * there might be an older version of the same package already present in there.
@@ -355,42 +422,32 @@ Result<DmVerityDevice> CreateVerityDevice(const std::string& name,
  * old one needs to deleted so that we don't end up activating same package
  * twice.
  *
+ * @param active_files apex files that were present in
+ * kActiveApexPackagesDataDir before staging, as returned by ScanActiveApexFiles
  * @param affected_packages package names of the news apex that are being
  * installed in this boot
  * @param files_to_keep path to the new apex packages in
  * kActiveApexPackagesDataDir
  */
 Result<void> RemovePreviouslyActiveApexFiles(
+    const std::unordered_map<std::string, std::string>& active_files,
     const std::unordered_set<std::string>& affected_packages,
     const std::unordered_set<std::string>& files_to_keep) {
-  auto all_active_apex_files =
-      FindFilesBySuffix(gConfig->active_apex_data_dir, {kApexPackageSuffix});
-
-  if (!all_active_apex_files.ok()) {
-    return all_active_apex_files.error();
-  }
-
-  for (const std::string& path : *all_active_apex_files) {
-    Result<ApexFile> apex_file = ApexFile::Open(path);
-    if (!apex_file.ok()) {
-      return apex_file.error();
-    }
-
-    const std::string& package_name = apex_file->GetManifest().name();
+  for (const auto& [path, package_name] : active_files) {
     if (affected_packages.find(package_name) == affected_packages.end()) {
       // This apex belongs to a package that wasn't part of this stage sessions,
       // hence it should be kept.
       continue;
     }
 
-    if (files_to_keep.find(apex_file->GetPath()) != files_to_keep.end()) {
+    if (files_to_keep.find(path) != files_to_keep.end()) {
       // This is a path that was staged and should be kept.
       continue;
     }
 
-    LOG(DEBUG) << "Deleting previously active apex " << apex_file->GetPath();
-    if (unlink(apex_file->GetPath().c_str()) != 0) {
-      return ErrnoError() << "Failed to unlink " << apex_file->GetPath();
+    LOG(DEBUG) << "Deleting previously active apex " << path;
+    if (unlink(path.c_str()) != 0) {
+      return ErrnoError() << "Failed to unlink " << path;
     }
   }
 
@@ -441,6 +498,34 @@ Result<void> VerifyMountedImage(const ApexFile& apex,
   return {};
 }
 
+// Returns the record of |apex| if it is a staged APEX being activated, and it
+// was verified with |public_key| when its session was submitted.
+const VerifiedApex* FindVerifiedApex(const ApexFile& apex,
+                                     const std::string& public_key) {
+  auto it = gVerifiedApexes.find(apex.GetManifest().name());
+  if (it == gVerifiedApexes.end()) {
+    return nullptr;
+  }
+  if (auto st = CheckVerifiedApex(it->second, apex, public_key); !st.ok()) {
+    LOG(WARNING) << "Verifying " << apex.GetPath() << " again : "
+                 << st.error();
+    return nullptr;
+  }
+  return &it->second;
+}
+
+// Verifies the AVB signature of |apex|, unless it was verified already when
+// its session was submitted.
+Result<ApexVerityData> VerifyApexVerity(const ApexFile& apex,
+                                        const std::string& public_key) {
+  if (const auto* verified = FindVerifiedApex(apex, public_key);
+      verified != nullptr) {
+    LOG(DEBUG) << "Reusing verification of " << apex.GetPath();
+    return GetVerifiedVerityData(*verified);
+  }
+  return apex.VerifyApexVerity(public_key);
+}
+
 Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                                          const std::string& mount_point,
                                          const std::string& device_name,
@@ -510,7 +595,10 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     return public_key.error();
   }
 
-  auto verity_data = apex.VerifyApexVerity(*public_key);
+  const VerifiedApex* verified_apex = FindVerifiedApex(apex, *public_key);
+  auto verity_data = verified_apex != nullptr
+                         ? GetVerifiedVerityData(*verified_apex)
+                         : apex.VerifyApexVerity(*public_key);
   if (!verity_data.ok()) {
     return Error() << "Failed to verify Apex Verity data for " << full_path
                    << ": " << verity_data.error();
@@ -532,6 +620,7 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                             /* device_name = */ "",
                             /* hashtree_loop_name = */ "",
                             /* is_temp_mount */ temp_mount);
+  apex_data.metadata = ApexMetadata::FromApexFile(apex);
 
   // for APEXes in immutable partitions, we don't need to mount them on
   // dm-verity because they are already in the dm-verity protected partition;
@@ -548,9 +637,14 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (mount_on_verity) {
     std::string hash_device = loopback_device.name;
     if (verity_data->desc->tree_size == 0) {
-      if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
-          !st.ok()) {
-        return st.error();
+      // A hashtree generated when the session was submitted is known to be
+      // good: no need to read it all again.
+      if (verified_apex == nullptr ||
+          !CheckVerifiedHashtree(*verified_apex, hashtree_file).ok()) {
+        if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
+            !st.ok()) {
+          return st.error();
+        }
       }
       auto create_loop_status =
           loop::CreateAndConfigureLoopDevice(hashtree_file,
@@ -599,6 +693,7 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (!apex.GetFsType()) {
     return Error() << "Cannot mount package without FsType";
   }
+  apex_data.block_device = block_device;
   if (mount(block_device.c_str(), mount_point.c_str(),
             apex.GetFsType().value().c_str(), mount_flags, nullptr) == 0) {
     auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -661,6 +756,26 @@ Result<MountedApexData> VerifyAndTempMountPackage(
 
 }  // namespace
 
+std::optional<std::pair<std::string, uint64_t>> ParseActiveApexFileName(
+    const std::string& path) {
+  std::string package_id = std::filesystem::path(path).stem();
+  size_t at = package_id.find('@');
+  if (at == std::string::npos || at == 0) {
+    return std::nullopt;
+  }
+  size_t underscore = package_id.find('_', at);
+  uint64_t version;
+  if (!ParseUint(package_id.substr(at + 1, underscore - at - 1), &version)) {
+    return std::nullopt;
+  }
+  uint64_t minor;
+  if (underscore != std::string::npos &&
+      !ParseUint(package_id.substr(underscore + 1), &minor)) {
+    return std::nullopt;
+  }
+  return std::make_pair(package_id.substr(0, at), version);
+}
+
 Result<void> Unmount(const MountedApexData& data, bool deferred) {
   LOG(DEBUG) << "Unmounting " << data.full_path << " from mount point "
              << data.mount_point << " deferred = " << deferred;
@@ -821,7 +936,7 @@ Result<void> VerifyPackageBoot(const ApexFile& apex_file) {
   if (!public_key.ok()) {
     return public_key.error();
   }
-  Result<ApexVerityData> verity_or = apex_file.VerifyApexVerity(*public_key);
+  Result<ApexVerityData> verity_or = VerifyApexVerity(apex_file, *public_key);
   if (!verity_or.ok()) {
     return verity_or.error();
   }
@@ -944,38 +1059,54 @@ Result<void> BackupActivePackages() {
     return Error() << "Backup failed : " << active_packages.error();
   }
 
-  auto cleanup_status = DeleteBackup();
-  if (!cleanup_status.ok()) {
-    return Error() << "Backup failed : " << cleanup_status.error();
+  // The backup is assembled in a fresh directory which then atomically
+  // replaces kApexBackupDir, so an interrupted backup never leaves a partial
+  // set of packages behind.
+  const std::string new_backup_dir = std::string(kApexBackupDir) + ".new";
+  if (auto result = DeleteDir(new_backup_dir); !result.ok()) {
+    return Error() << "Backup failed : " << result.error();
+  }
+  if (auto result = CreateDirIfNeeded(new_backup_dir, 0700); !result.ok()) {
+    return Error() << "Backup failed : " << result.error();
   }
 
-  auto backup_path_fn = [](const ApexFile& apex_file) {
-    return StringPrintf("%s/%s%s", kApexBackupDir,
-                        GetPackageId(apex_file.GetManifest()).c_str(),
-                        kApexPackageSuffix);
-  };
-
-  auto deleter = []() {
-    auto result = DeleteDirContent(std::string(kApexBackupDir));
+  auto deleter = [&new_backup_dir]() {
+    auto result = DeleteDir(new_backup_dir);
     if (!result.ok()) {
-      LOG(ERROR) << "Failed to cleanup " << kApexBackupDir << " : "
+      LOG(ERROR) << "Failed to cleanup " << new_backup_dir << " : "
                  << result.error();
     }
   };
   auto scope_guard = android::base::make_scope_guard(deleter);
 
   for (const std::string& path : *active_packages) {
-    Result<ApexFile> apex_file = ApexFile::Open(path);
-    if (!apex_file.ok()) {
-      return Error() << "Backup failed : " << apex_file.error();
+    // Backups are named after the package id. Files apexd created already
+    // carry it in their name; only differently named files need to be opened.
+    std::string package_id;
+    if (auto parsed = ParseActiveApexFileName(path); parsed.has_value()) {
+      package_id = parsed->first + "@" + std::to_string(parsed->second);
+    } else {
+      Result<ApexFile> apex_file = ApexFile::Open(path);
+      if (!apex_file.ok()) {
+        return Error() << "Backup failed : " << apex_file.error();
+      }
+      package_id = GetPackageId(apex_file->GetManifest());
     }
-    const auto& dest_path = backup_path_fn(*apex_file);
-    if (link(apex_file->GetPath().c_str(), dest_path.c_str()) != 0) {
-      return ErrnoError() << "Failed to backup " << apex_file->GetPath();
+    std::string dest_path =
+        StringPrintf("%s/%s%s", new_backup_dir.c_str(), package_id.c_str(),
+                     kApexPackageSuffix);
+    if (link(path.c_str(), dest_path.c_str()) != 0) {
+      return ErrnoError() << "Failed to backup " << path;
     }
   }
 
-  scope_guard.Disable();  // Accept the backup.
+  if (renameat2(AT_FDCWD, new_backup_dir.c_str(), AT_FDCWD, kApexBackupDir,
+                RENAME_EXCHANGE) != 0) {
+    return ErrnoError() << "Failed to move " << new_backup_dir << " to "
+                        << kApexBackupDir;
+  }
+  // new_backup_dir now holds the previous backup, which the scope guard
+  // deletes.
   return {};
 }
 
@@ -995,21 +1126,21 @@ Result<void> RestoreActivePackages() {
     return ErrnoError() << "Failed to access " << gConfig->active_apex_data_dir;
   }
 
-  LOG(DEBUG) << "Deleting existing packages in "
-             << gConfig->active_apex_data_dir;
-  auto delete_status =
-      DeleteDirContent(std::string(gConfig->active_apex_data_dir));
-  if (!delete_status.ok()) {
-    return delete_status;
-  }
-
-  LOG(DEBUG) << "Renaming " << kApexBackupDir << " to "
+  // Swap the directories rather than emptying the active one first, so that
+  // kActiveApexPackagesDataDir always holds a complete set of packages.
+  LOG(DEBUG) << "Exchanging " << kApexBackupDir << " and "
              << gConfig->active_apex_data_dir;
-  if (rename(kApexBackupDir, gConfig->active_apex_data_dir) != 0) {
+  if (renameat2(AT_FDCWD, kApexBackupDir, AT_FDCWD,
+                gConfig->active_apex_data_dir, RENAME_EXCHANGE) != 0) {
     return ErrnoError() << "Failed to rename " << kApexBackupDir << " to "
                         << gConfig->active_apex_data_dir;
   }
 
+  LOG(DEBUG) << "Deleting previously active packages in " << kApexBackupDir;
+  if (auto result = DeleteDir(kApexBackupDir); !result.ok()) {
+    LOG(ERROR) << result.error();
+  }
+
   LOG(DEBUG) << "Restoring original permissions for "
              << gConfig->active_apex_data_dir;
   if (chmod(gConfig->active_apex_data_dir, stat_data.st_mode & ALLPERMS) != 0) {
@@ -1028,17 +1159,10 @@ Result<void> UnmountPackage(const ApexFile& apex, bool allow_latest,
 
   const ApexManifest& manifest = apex.GetManifest();
 
-  std::optional<MountedApexData> data;
   bool latest = false;
-
-  auto fn = [&](const MountedApexData& d, bool l) {
-    if (d.full_path == apex.GetPath()) {
-      data.emplace(d);
-      latest = l;
-    }
-  };
-  gMountedApexes.ForallMountedApexes(manifest.name(), fn);
-
+  std::optional<MountedApexData> data =
+      gMountedApexes.GetMountedApexAndIsLatest(manifest.name(), apex.GetPath(),
+                                               &latest);
   if (!data) {
     return Error() << "Did not find " << apex.GetPath();
   }
@@ -1112,33 +1236,15 @@ Result<void> UnmountTempMount(const ApexFile& apex) {
 }
 
 Result<MountedApexData> GetTempMountedApexData(const std::string& package) {
-  bool found = false;
-  Result<MountedApexData> mount_data;
-  gMountedApexes.ForallMountedApexes(
-      package,
-      [&](const MountedApexData& data, [[maybe_unused]] bool latest) {
-        if (!found) {
-          mount_data = data;
-          found = true;
-        }
-      },
-      true);
-  if (found) {
-    return mount_data;
+  auto mount_data = gMountedApexes.GetTempMountedApex(package);
+  if (mount_data.has_value()) {
+    return *mount_data;
   }
   return Error() << "No temp mount data found for " << package;
 }
 
 bool IsMounted(const std::string& full_path) {
-  bool found_mounted = false;
-  gMountedApexes.ForallMountedApexes([&](const std::string&,
-                                         const MountedApexData& data,
-                                         [[maybe_unused]] bool latest) {
-    if (full_path == data.full_path) {
-      found_mounted = true;
-    }
-  });
-  return found_mounted;
+  return gMountedApexes.IsMounted(full_path);
 }
 
 std::string GetPackageMountPoint(const ApexManifest& manifest) {
@@ -1316,12 +1422,10 @@ Result<void> ActivatePackageImpl(const ApexFile& apex_file,
     bool version_found_active = false;
     gMountedApexes.ForallMountedApexes(
         manifest.name(), [&](const MountedApexData& data, bool latest) {
-          Result<ApexFile> other_apex = ApexFile::Open(data.full_path);
-          if (!other_apex.ok()) {
+          if (data.metadata == nullptr) {
             return;
           }
-          if (static_cast<uint64_t>(other_apex->GetManifest().version()) ==
-              new_version) {
+          if (static_cast<uint64_t>(data.metadata->version) == new_version) {
             version_found_mounted = true;
             version_found_active = latest;
           }
@@ -1435,8 +1539,75 @@ Result<std::vector<ApexFile>> GetStagedApexFiles(
   return OpenApexFiles(apex_file_paths);
 }
 
+namespace {
+
+// Identifies a set of APEXes by the name and file identity (device, inode,
+// size, mtime and ctime) of each of them. Any write to a file changes its
+// ctime, which, unlike the mtime, can't be set back, so a file that kept its
+// identity kept the content it was verified and mounted with.
+using ClassPathCacheKey = std::set<
+    std::tuple<std::string, uint64_t, uint64_t, int64_t, int64_t, int64_t>>;
+
+// Deriving a classpath costs temp mounts and a fork/exec, and PackageManager
+// asks for the same staged set several times per install. derive_classpath
+// also looks at the active APEXes, so a rebootless install drops the cached
+// results. Once full, the least recently used result makes room.
+constexpr size_t kMaxCachedClassPaths = 8;
+struct CachedClassPath {
+  ClassPath class_path;
+  uint64_t last_used;
+};
+std::mutex gClassPathCacheMutex;
+std::map<ClassPathCacheKey, CachedClassPath> gClassPathCache;
+uint64_t gClassPathCacheUses = 0;
+// Bumped whenever the active APEXes change, so that a classpath derived
+// meanwhile isn't cached.
+uint64_t gClassPathCacheGeneration = 0;
+
+void InvalidateClassPathCache() {
+  std::lock_guard lock(gClassPathCacheMutex);
+  gClassPathCache.clear();
+  gClassPathCacheGeneration++;
+}
+
+int64_t ToNs(const struct timespec& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Costs a stat() per APEX, so that looking up the cache is cheap compared to
+// deriving the classpath. Returns nullopt if an APEX can't be identified.
+std::optional<ClassPathCacheKey> GetClassPathCacheKey(
+    const std::vector<ApexFile>& apex_files) {
+  ClassPathCacheKey key;
+  for (const auto& apex : apex_files) {
+    struct stat st;
+    if (stat(apex.GetPath().c_str(), &st) != 0) {
+      return std::nullopt;
+    }
+    key.emplace(apex.GetManifest().name(), st.st_dev, st.st_ino, st.st_size,
+                ToNs(st.st_mtim), ToNs(st.st_ctim));
+  }
+  return key;
+}
+
+}  // namespace
+
 Result<ClassPath> MountAndDeriveClassPath(
     const std::vector<ApexFile>& apex_files) {
+  auto cache_key = GetClassPathCacheKey(apex_files);
+  uint64_t generation;
+  {
+    std::lock_guard lock(gClassPathCacheMutex);
+    generation = gClassPathCacheGeneration;
+    if (cache_key.has_value()) {
+      auto it = gClassPathCache.find(*cache_key);
+      if (it != gClassPathCache.end()) {
+        it->second.last_used = ++gClassPathCacheUses;
+        return it->second.class_path;
+      }
+    }
+  }
+
   auto guard = android::base::make_scope_guard([&]() {
     for (const auto& apex : apex_files) {
       apexd_private::UnmountTempMount(apex);
@@ -1460,76 +1631,82 @@ Result<ClassPath> MountAndDeriveClassPath(
   }
 
   // Calculate classpaths of temp mounted staged apexs
-  return ClassPath::DeriveClassPath(temp_mounted_apex_paths);
+  auto class_path = ClassPath::DeriveClassPath(temp_mounted_apex_paths);
+  if (class_path.ok() && cache_key.has_value()) {
+    std::lock_guard lock(gClassPathCacheMutex);
+    if (generation == gClassPathCacheGeneration) {
+      if (gClassPathCache.size() >= kMaxCachedClassPaths) {
+        gClassPathCache.erase(std::min_element(
+            gClassPathCache.begin(), gClassPathCache.end(),
+            [](const auto& a, const auto& b) {
+              return a.second.last_used < b.second.last_used;
+            }));
+      }
+      gClassPathCache.insert_or_assign(
+          std::move(*cache_key),
+          CachedClassPath{*class_path, ++gClassPathCacheUses});
+    }
+  }
+  return class_path;
 }
 
-std::vector<ApexFile> GetActivePackages() {
-  std::vector<ApexFile> ret;
+std::vector<std::shared_ptr<const ApexMetadata>> GetActivePackages() {
+  std::vector<std::shared_ptr<const ApexMetadata>> ret;
   gMountedApexes.ForallMountedApexes(
       [&](const std::string&, const MountedApexData& data, bool latest) {
-        if (!latest) {
-          return;
-        }
-
-        Result<ApexFile> apex_file = ApexFile::Open(data.full_path);
-        if (!apex_file.ok()) {
+        if (!latest || data.metadata == nullptr) {
           return;
         }
-        ret.emplace_back(std::move(*apex_file));
+        ret.push_back(data.metadata);
       });
 
   return ret;
 }
 
-std::vector<ApexFile> CalculateInactivePackages(
-    const std::vector<ApexFile>& active) {
-  std::vector<ApexFile> inactive = GetFactoryPackages();
-  auto new_end = std::remove_if(
-      inactive.begin(), inactive.end(), [&active](const ApexFile& apex) {
-        return std::any_of(active.begin(), active.end(),
-                           [&apex](const ApexFile& active_apex) {
-                             return apex.GetPath() == active_apex.GetPath();
-                           });
-      });
-  inactive.erase(new_end, inactive.end());
-  return std::move(inactive);
-}
-
-Result<void> EmitApexInfoList(bool is_bootstrap) {
-  // Apexd runs both in "bootstrap" and "default" mount namespace.
-  // To expose /apex/apex-info-list.xml separately in each mount namespaces,
-  // we write /apex/.<namespace>-apex-info-list .xml file first and then
-  // bind mount it to the canonical file (/apex/apex-info-list.xml).
-  const std::string file_name =
-      fmt::format("{}/.{}-{}", kApexRoot,
-                  is_bootstrap ? "bootstrap" : "default", kApexInfoList);
-
-  unique_fd fd(TEMP_FAILURE_RETRY(
-      open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
-  if (fd.get() == -1) {
-    return ErrnoErrorf("Can't open {}", file_name);
-  }
-
-  const std::vector<ApexFile> active(GetActivePackages());
-
-  std::vector<ApexFile> inactive;
-  // we skip for non-activated built-in apexes in bootstrap mode
-  // in order to avoid boottime increase
-  if (!is_bootstrap) {
-    inactive = CalculateInactivePackages(active);
-  }
+namespace {
 
-  std::stringstream xml;
-  CollectApexInfoList(xml, active, inactive);
+// Generations of the in-memory apex-info-list start at a random point, so
+// that a generation handed out by a previous apexd instance isn't mistaken
+// for one of this instance. Stays below 2^56, i.e. a valid Java long.
+uint64_t GetFirstApexInfoListGeneration() {
+  std::random_device random;
+  return static_cast<uint64_t>(random()) << 24;
+}
 
-  if (!android::base::WriteStringToFd(xml.str(), fd)) {
-    return ErrnoErrorf("Can't write to {}", file_name);
-  }
+// In-memory apex-info-list, kept between updates of the file. Guarded by
+// gApexInfoListMutex.
+std::mutex gApexInfoListMutex;
+ApexInfoListModel gApexInfoList(GetFirstApexInfoListGeneration());
+
+// Brings gApexInfoList in sync with currently active APEXes (and inactive
+// factory ones, if |include_inactive| is set) and writes it to |xml_path|, and
+// its binary index to |index_path|.
+Result<void> WriteApexInfoList(const std::string& xml_path,
+                               const std::string& index_path,
+                               bool include_inactive) {
+  const auto active = GetActivePackages();
+  std::vector<std::shared_ptr<const ApexMetadata>> factory;
+  if (include_inactive) {
+    factory = GetFactoryPackages();
+  }
+  std::lock_guard lock(gApexInfoListMutex);
+  gApexInfoList.Update(active, factory, ApexFileRepository::GetInstance(),
+                       gChangedActiveApexes);
+  OR_RETURN(gApexInfoList.WriteToFile(xml_path));
+  return gApexInfoList.WriteIndexToFile(index_path);
+}
 
-  fd.reset();
+// Returns the per-namespace file (/apex/.<namespace>-<name>) which is bind
+// mounted to /apex/<name>.
+std::string GetNamespacedApexInfoFile(bool is_bootstrap,
+                                      const std::string& name) {
+  return fmt::format("{}/.{}-{}", kApexRoot,
+                     is_bootstrap ? "bootstrap" : "default", name);
+}
 
-  const std::string mount_point =
-      fmt::format("{}/{}", kApexRoot, kApexInfoList);
+Result<void> PublishApexInfoFile(const std::string& file_name,
+                                 const std::string& name) {
+  const std::string mount_point = fmt::format("{}/{}", kApexRoot, name);
   if (access(mount_point.c_str(), F_OK) != 0) {
     close(open(mount_point.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
                0644));
@@ -1541,58 +1718,90 @@ Result<void> EmitApexInfoList(bool is_bootstrap) {
   return RestoreconPath(file_name);
 }
 
+}  // namespace
+
+Result<void> EmitApexInfoList(bool is_bootstrap) {
+  // Apexd runs both in "bootstrap" and "default" mount namespace.
+  // To expose /apex/apex-info-list.xml separately in each mount namespaces,
+  // we write /apex/.<namespace>-apex-info-list .xml file first and then
+  // bind mount it to the canonical file (/apex/apex-info-list.xml). Same for
+  // its binary index (/apex/apex-info-list.bin).
+  const std::string file_name =
+      GetNamespacedApexInfoFile(is_bootstrap, kApexInfoList);
+  const std::string index_file_name =
+      GetNamespacedApexInfoFile(is_bootstrap, kApexInfoIndex);
+
+  // we skip for non-activated built-in apexes in bootstrap mode
+  // in order to avoid boottime increase
+  if (auto st = WriteApexInfoList(file_name, index_file_name,
+                                  /* include_inactive= */ !is_bootstrap);
+      !st.ok()) {
+    return st.error();
+  }
+
+  OR_RETURN(PublishApexInfoFile(file_name, kApexInfoList));
+  return PublishApexInfoFile(index_file_name, kApexInfoIndex);
+}
+
 namespace {
 std::unordered_map<std::string, uint64_t> GetActivePackagesMap() {
-  std::vector<ApexFile> active_packages = GetActivePackages();
   std::unordered_map<std::string, uint64_t> ret;
-  for (const auto& package : active_packages) {
-    const ApexManifest& manifest = package.GetManifest();
-    ret.insert({manifest.name(), manifest.version()});
-  }
+  gMountedApexes.ForallMountedApexes(
+      [&](const std::string&, const MountedApexData& data, bool latest) {
+        if (!latest || data.metadata == nullptr) {
+          return;
+        }
+        ret.insert({data.metadata->name, data.metadata->version});
+      });
   return ret;
 }
 
 }  // namespace
 
-std::vector<ApexFile> GetFactoryPackages() {
-  std::vector<ApexFile> ret;
+std::vector<std::shared_ptr<const ApexMetadata>> GetFactoryPackages() {
+  std::vector<std::shared_ptr<const ApexMetadata>> ret;
 
   // Decompressed APEX is considered factory package
   std::vector<std::string> decompressed_pkg_names;
-  auto active_pkgs = GetActivePackages();
-  for (ApexFile& apex : active_pkgs) {
-    if (ApexFileRepository::GetInstance().IsDecompressedApex(apex)) {
-      decompressed_pkg_names.push_back(apex.GetManifest().name());
-      ret.emplace_back(std::move(apex));
+  for (auto& apex : GetActivePackages()) {
+    if (ApexFileRepository::GetInstance().IsDecompressedApex(*apex)) {
+      decompressed_pkg_names.push_back(apex->name);
+      ret.push_back(std::move(apex));
     }
   }
 
   const auto& file_repository = ApexFileRepository::GetInstance();
   for (const auto& ref : file_repository.GetPreInstalledApexFiles()) {
-    Result<ApexFile> apex_file = ApexFile::Open(ref.get().GetPath());
-    if (!apex_file.ok()) {
-      LOG(ERROR) << apex_file.error();
-      continue;
-    }
+    const ApexFile& apex_file = ref.get();
     // Ignore compressed APEX if it has been decompressed already
-    if (apex_file->IsCompressed() &&
+    if (apex_file.IsCompressed() &&
         std::find(decompressed_pkg_names.begin(), decompressed_pkg_names.end(),
-                  apex_file->GetManifest().name()) !=
+                  apex_file.GetManifest().name()) !=
             decompressed_pkg_names.end()) {
       continue;
     }
 
-    ret.emplace_back(std::move(*apex_file));
+    ret.push_back(ApexMetadata::FromApexFile(apex_file));
   }
   return ret;
 }
 
-Result<ApexFile> GetActivePackage(const std::string& packageName) {
-  std::vector<ApexFile> packages = GetActivePackages();
-  for (ApexFile& apex : packages) {
-    if (apex.GetManifest().name() == packageName) {
-      return std::move(apex);
-    }
+std::vector<ApexInfoListModel::Package> GetPackagesByName(
+    const std::vector<std::string>& package_names) {
+  std::lock_guard lock(gApexInfoListMutex);
+  return gApexInfoList.GetPackagesByName(package_names);
+}
+
+ApexInfoListModel::Changes GetPackageChangesSince(uint64_t generation) {
+  std::lock_guard lock(gApexInfoListMutex);
+  return gApexInfoList.GetChangesSince(generation);
+}
+
+Result<std::shared_ptr<const ApexMetadata>> GetActivePackage(
+    const std::string& packageName) {
+  auto data = gMountedApexes.GetLatestMountedApex(packageName);
+  if (data.has_value() && data->metadata != nullptr) {
+    return data->metadata;
   }
 
   return ErrnoError() << "Cannot find matching package for: " << packageName;
@@ -1821,6 +2030,19 @@ Result<void> ActivateMissingApexes(const std::vector<ApexFileRef>& apexes,
 
 }  // namespace
 
+/**
+ * Deletes the objects of the snapshot store in base_dir that are no longer
+ * used by any snapshot.
+ */
+void CollectSnapshotGarbage(const std::string& base_dir) {
+  SnapshotStore store(
+      StringPrintf("%s/%s", base_dir.c_str(), kApexSnapshotSubDir));
+  if (auto result = store.CollectGarbage(); !result.ok()) {
+    LOG(ERROR) << "Failed to collect snapshot garbage in " << base_dir << " : "
+               << result.error();
+  }
+}
+
 /**
  * Snapshots data from base_dir/apexdata/<apex name> to
  * base_dir/apexrollback/<rollback id>/<apex name>.
@@ -1842,7 +2064,9 @@ Result<void> SnapshotDataDirectory(const std::string& base_dir,
   auto to_path =
       StringPrintf("%s/%s", rollback_path.c_str(), apex_name.c_str());
 
-  return ReplaceFiles(from_path, to_path);
+  SnapshotStore store(
+      StringPrintf("%s/%s", base_dir.c_str(), kApexSnapshotSubDir));
+  return store.Snapshot(from_path, to_path);
 }
 
 /**
@@ -1859,19 +2083,13 @@ Result<void> RestoreDataDirectory(const std::string& base_dir,
       pre_restore ? kPreRestoreSuffix : "", apex_name.c_str());
   auto to_path = StringPrintf("%s/%s/%s", base_dir.c_str(), kApexDataSubDir,
                               apex_name.c_str());
-  Result<void> result = ReplaceFiles(from_path, to_path);
+  SnapshotStore store(
+      StringPrintf("%s/%s", base_dir.c_str(), kApexSnapshotSubDir));
+  Result<void> result = store.Restore(from_path, to_path);
   if (!result.ok()) {
     return result;
   }
-  result = RestoreconPath(to_path);
-  if (!result.ok()) {
-    return result;
-  }
-  result = DeleteDir(from_path);
-  if (!result.ok()) {
-    LOG(ERROR) << "Failed to delete the snapshot: " << result.error();
-  }
-  return {};
+  return RestoreconPath(to_path);
 }
 
 void SnapshotOrRestoreDeIfNeeded(const std::string& base_dir,
@@ -1899,7 +2117,11 @@ void SnapshotOrRestoreDeIfNeeded(const std::string& base_dir,
                    << result.error();
       }
     }
+  } else {
+    return;
   }
+  // Once for all APEXes of the session, rather than after each of them.
+  CollectSnapshotGarbage(base_dir);
 }
 
 void SnapshotOrRestoreDeSysData() {
@@ -1935,6 +2157,8 @@ Result<void> SnapshotCeData(const int user_id, const int rollback_id,
   return SnapshotDataDirectory(base_dir, rollback_id, apex_name);
 }
 
+// Objects the restored snapshot leaves behind are deleted together with the
+// other CE snapshots of the user, see DestroyCeSnapshots.
 Result<void> RestoreCeData(const int user_id, const int rollback_id,
                            const std::string& apex_name) {
   auto base_dir = StringPrintf("%s/%d", kCeDataDir, user_id);
@@ -1945,7 +2169,9 @@ Result<void> DestroySnapshots(const std::string& base_dir,
                               const int rollback_id) {
   auto path = StringPrintf("%s/%s/%d", base_dir.c_str(), kApexSnapshotSubDir,
                            rollback_id);
-  return DeleteDir(path);
+  OR_RETURN(DeleteDir(path));
+  CollectSnapshotGarbage(base_dir);
+  return {};
 }
 
 Result<void> DestroyDeSnapshots(const int rollback_id) {
@@ -1964,9 +2190,8 @@ Result<void> DestroyDeSnapshots(const int rollback_id) {
 }
 
 Result<void> DestroyCeSnapshots(const int user_id, const int rollback_id) {
-  auto path = StringPrintf("%s/%d/%s/%d", kCeDataDir, user_id,
-                           kApexSnapshotSubDir, rollback_id);
-  return DeleteDir(path);
+  auto base_dir = StringPrintf("%s/%d", kCeDataDir, user_id);
+  return DestroySnapshots(base_dir, rollback_id);
 }
 
 /**
@@ -1996,6 +2221,7 @@ Result<void> DestroyCeSnapshotsNotSpecified(
       }
     }
   }
+  CollectSnapshotGarbage(StringPrintf("%s/%d", kCeDataDir, user_id));
   return {};
 }
 
@@ -2013,6 +2239,7 @@ void RestorePreRestoreSnapshotsIfPresent(const std::string& base_dir,
                    << ": " << result.error();
       }
     }
+    CollectSnapshotGarbage(base_dir);
   }
 }
 
@@ -2039,6 +2266,7 @@ void DeleteDePreRestoreSnapshots(const std::string& base_dir,
   if (!result.ok()) {
     LOG(ERROR) << "Deletion of pre-restore snapshot failed: " << result.error();
   }
+  CollectSnapshotGarbage(base_dir);
 }
 
 void DeleteDePreRestoreSnapshots(const ApexSession& session) {
@@ -2078,6 +2306,16 @@ void ScanStagedSessionsDirAndStage() {
                                 activated_sessions.end());
   }
 
+  // Staged APEXes were verified when their sessions were submitted, no need to
+  // do all of it again.
+  for (const auto& session : sessions_to_activate) {
+    for (const auto& verified_apex : session.GetVerifiedApexes()) {
+      gVerifiedApexes.insert_or_assign(verified_apex.name(), verified_apex);
+    }
+  }
+
+  // The new state of each session is persisted as soon as it is known, before
+  // moving on to the next one: its packages are already in place by then.
   for (auto& session : sessions_to_activate) {
     auto session_id = session.GetId();
 
@@ -2203,6 +2441,21 @@ std::string StageDestPath(const ApexFile& apex_file) {
                       kApexPackageSuffix);
 }
 
+// Verifies |apex_files| for staging. Packages are independent of each other,
+// so they are verified concurrently; the first failure in input order is
+// returned.
+Result<void> VerifyPackagesBoot(const std::vector<ApexFile>& apex_files) {
+  return RunInParallel(
+      apex_files.size(), std::thread::hardware_concurrency(),
+      [&](size_t i) -> Result<void> {
+        if (shim::IsShimApex(apex_files[i])) {
+          // Shim apex will be validated on every boot. No need to do it here.
+          return {};
+        }
+        return VerifyPackageBoot(apex_files[i]);
+      });
+}
+
 }  // namespace
 
 Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
@@ -2219,15 +2472,8 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
   if (!apex_files.ok()) {
     return apex_files.error();
   }
-  for (const ApexFile& apex_file : *apex_files) {
-    if (shim::IsShimApex(apex_file)) {
-      // Shim apex will be validated on every boot. No need to do it here.
-      continue;
-    }
-    Result<void> result = VerifyPackageBoot(apex_file);
-    if (!result.ok()) {
-      return result.error();
-    }
+  if (auto result = VerifyPackagesBoot(*apex_files); !result.ok()) {
+    return result.error();
   }
 
   // Make sure that kActiveApexPackagesDataDir exists.
@@ -2236,6 +2482,10 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
   if (!create_dir_status.ok()) {
     return create_dir_status.error();
   }
+  auto active_files = ScanActiveApexFiles();
+  if (!active_files.ok()) {
+    return active_files.error();
+  }
 
   // 2) Now stage all of them.
 
@@ -2274,7 +2524,7 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
     }
     // And only then move apex to /data/apex/active.
     std::string dest_path = StageDestPath(apex_file);
-    if (access(dest_path.c_str(), F_OK) == 0) {
+    if (active_files->count(dest_path) != 0) {
       LOG(DEBUG) << dest_path << " already exists. Deleting";
       if (TEMP_FAILURE_RETRY(unlink(dest_path.c_str())) != 0) {
         return ErrnoError() << "Failed to unlink " << dest_path;
@@ -2294,7 +2544,8 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
 
   scope_guard.Disable();  // Accept the state.
 
-  return RemovePreviouslyActiveApexFiles(staged_packages, staged_files);
+  return RemovePreviouslyActiveApexFiles(*active_files, staged_packages,
+                                         staged_files);
 }
 
 Result<void> UnstagePackages(const std::vector<std::string>& paths) {
@@ -2348,24 +2599,34 @@ Result<void> RevertActiveSessions(const std::string& crashing_native_process,
     return Error() << "Revert requested, when there are no active sessions.";
   }
 
-  for (auto& session : active_sessions) {
-    if (!crashing_native_process.empty()) {
-      session.SetCrashingNativeProcess(crashing_native_process);
-    }
-    if (!error_message.empty()) {
-      session.SetErrorMessage(error_message);
+  {
+    auto commit_batch = gSessionManager->BatchCommits();
+    for (auto& session : active_sessions) {
+      if (!crashing_native_process.empty()) {
+        session.SetCrashingNativeProcess(crashing_native_process);
+      }
+      if (!error_message.empty()) {
+        session.SetErrorMessage(error_message);
+      }
+      auto status =
+          session.UpdateStateAndCommit(SessionState::REVERT_IN_PROGRESS);
+      if (!status.ok()) {
+        return Error() << "Revert of session " << session
+                       << " failed : " << status.error();
+      }
     }
-    auto status =
-        session.UpdateStateAndCommit(SessionState::REVERT_IN_PROGRESS);
-    if (!status.ok()) {
-      return Error() << "Revert of session " << session
-                     << " failed : " << status.error();
+    // The revert must be on disk before packages are touched, so that it is
+    // resumed if we crash half-way.
+    if (auto status = commit_batch.Flush(); !status.ok()) {
+      return Error() << "Failed to persist revert of sessions : "
+                     << status.error();
     }
   }
 
   if (!gSupportsFsCheckpoints) {
     auto restore_status = RestoreActivePackages();
     if (!restore_status.ok()) {
+      auto commit_batch = gSessionManager->BatchCommits();
       for (auto& session : active_sessions) {
         auto st = session.UpdateStateAndCommit(SessionState::REVERT_FAILED);
         LOG(DEBUG) << "Marking " << session << " as failed to revert";
@@ -2380,6 +2641,7 @@ Result<void> RevertActiveSessions(const std::string& crashing_native_process,
     LOG(INFO) << "Not restoring active packages in checkpoint mode.";
   }
 
+  auto commit_batch = gSessionManager->BatchCommits();
   for (auto& session : active_sessions) {
     if (!gSupportsFsCheckpoints && session.IsRollback()) {
       // If snapshots have already been restored, undo that by restoring the
@@ -2569,6 +2831,14 @@ void InitializeSessionManager(ApexSessionManager* session_manager) {
   gSessionManager = session_manager;
 }
 
+std::vector<ApexSession> GetSessions() {
+  return gSessionManager->GetSessions();
+}
+
+Result<ApexSession> GetSession(int session_id) {
+  return gSessionManager->GetSession(session_id);
+}
+
 void Initialize(CheckpointInterface* checkpoint_service) {
   InitializeVold(checkpoint_service);
   ApexFileRepository& instance = ApexFileRepository::GetInstance();
@@ -2585,9 +2855,22 @@ void Initialize(CheckpointInterface* checkpoint_service) {
     return;
   }
 
+  if (gConfig->mounted_apex_database_path != nullptr) {
+    // apexd is a lazy service. If it's just being restarted, the database
+    // persisted by its previous instance is much cheaper to load than
+    // reconstructing it from mounts.
+    auto restored =
+        gMountedApexes.RestoreFromFile(gConfig->mounted_apex_database_path);
+    gMountedApexes.SetPersistentPath(gConfig->mounted_apex_database_path);
+    if (restored.ok()) {
+      return;
+    }
+    LOG(INFO) << "Can't reuse persisted APEX database: " << restored.error();
+  }
   gMountedApexes.PopulateFromMounts(gConfig->active_apex_data_dir,
                                     gConfig->decompression_dir,
                                     gConfig->apex_hash_tree_dir);
+  gMountedApexes.Persist();
 }
 
 // Note: Pre-installed apex are initialized in Initialize(CheckpointInterface*)
@@ -2710,16 +2993,103 @@ std::vector<ApexFileRef> SelectApexForActivation(
 
 namespace {
 
+// Suffix of the file next to a decompressed APEX that records the root digest
+// the APEX was verified against, together with the identity of the APEX at that
+// time. The record lives in apexd's own directory, so unlike an xattr of the
+// APEX it can't be written by anyone else. It includes the ctime of the APEX,
+// which, unlike the mtime, can't be set back, so any later change to the APEX,
+// rename included, makes the record stale.
+constexpr const char* kVerifiedDigestSuffix = ".verified";
+
+std::optional<std::string> GetVerifiedDigestRecord(const std::string& path,
+                                                   const std::string& digest) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+  return digest + " ino=" + std::to_string(static_cast<uint64_t>(st.st_ino)) +
+         " size=" + std::to_string(static_cast<int64_t>(st.st_size)) +
+         " mtime=" + std::to_string(ToNs(st.st_mtim)) +
+         " ctime=" + std::to_string(ToNs(st.st_ctim));
+}
+
+// Remembers that |path| has been verified to have root |digest|.
+void RecordVerifiedDigest(const std::string& path, const std::string& digest) {
+  auto record = GetVerifiedDigestRecord(path, digest);
+  if (!record.has_value() ||
+      !WriteStringToFile(*record, path + kVerifiedDigestSuffix, 0600, getuid(),
+                         getgid())) {
+    PLOG(WARNING) << "Failed to record verified digest of " << path;
+  }
+}
+
+bool HasVerifiedDigest(const std::string& path, const std::string& digest) {
+  std::string record;
+  if (!ReadFileToString(path + kVerifiedDigestSuffix, &record)) {
+    return false;
+  }
+  auto expected = GetVerifiedDigestRecord(path, digest);
+  return expected.has_value() && record == *expected;
+}
+
+// Removes the decompressed APEX at |path| along with its verified digest
+// record.
+void RemoveDecompressedApex(const std::string& path) {
+  RemoveFileIfExists(path);
+  RemoveFileIfExists(path + kVerifiedDigestSuffix);
+}
+
+Result<void> ValidateDecompressedApexImpl(const ApexFile& capex,
+                                          const ApexFile& apex,
+                                          bool verify_digest) {
+  // Decompressed APEX must have same public key as CAPEX
+  if (capex.GetBundledPublicKey() != apex.GetBundledPublicKey()) {
+    return Error()
+           << "Public key of compressed APEX is different than original "
+           << "APEX for " << apex.GetPath();
+  }
+  // Decompressed APEX must have same version as CAPEX
+  if (capex.GetManifest().version() != apex.GetManifest().version()) {
+    return Error()
+           << "Compressed APEX has different version than decompressed APEX "
+           << apex.GetPath();
+  }
+  if (!verify_digest) {
+    return {};
+  }
+  // Decompressed APEX must have same root digest as what is stored in CAPEX
+  auto apex_verity = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+  if (!apex_verity.ok() ||
+      capex.GetManifest().capexmetadata().originalapexdigest() !=
+          apex_verity->root_digest) {
+    return Error() << "Root digest of " << apex.GetPath()
+                   << " does not match with"
+                   << " expected root digest in " << capex.GetPath();
+  }
+  return {};
+}
+
+// |digest_verified| tells that the root digest of |apex_path| has just been
+// checked against |capex| by VerifyDecompressedImage.
 Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
-                                                 const std::string& apex_path) {
+                                                 const std::string& apex_path,
+                                                 bool digest_verified = false) {
   auto apex = ApexFile::Open(apex_path);
   if (!apex.ok()) {
     return Error() << "Failed to open decompressed APEX: " << apex.error();
   }
-  auto result = ValidateDecompressedApex(capex, *apex);
+  // AVB verification can be skipped if this very file was already verified
+  // against the digest in |capex|, e.g. before reboot in OTA chroot.
+  const auto& digest = capex.GetManifest().capexmetadata().originalapexdigest();
+  bool recorded = HasVerifiedDigest(apex_path, digest);
+  auto result = ValidateDecompressedApexImpl(capex, *apex,
+                                             !digest_verified && !recorded);
   if (!result.ok()) {
     return result.error();
   }
+  if (!recorded) {
+    RecordVerifiedDigest(apex_path, digest);
+  }
   auto ctx = GetfileconPath(apex_path);
   if (!ctx.ok()) {
     return ctx.error();
@@ -2730,10 +3100,134 @@ Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
   return std::move(*apex);
 }
 
+// Shrinks the space reserved by ReserveSpaceForCompressedApex by |size| bytes,
+// so that decompression can take over the released blocks.
+void ConsumeReservedSpace(size_t size) {
+  auto file_path = StringPrintf("%s/full.tmp", gConfig->ota_reserved_dir);
+  unique_fd fd(open(file_path.c_str(), O_WRONLY | O_CLOEXEC));
+  if (fd.get() == -1) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "Failed to open " << file_path;
+    }
+    return;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << file_path;
+    return;
+  }
+  if (static_cast<size_t>(st.st_size) <= size) {
+    RemoveFileIfExists(file_path);
+    return;
+  }
+  if (ftruncate(fd.get(), st.st_size - size) != 0) {
+    PLOG(ERROR) << "Failed to shrink " << file_path;
+    RemoveFileIfExists(file_path);
+  }
+}
+
+// Checks a freshly decompressed APEX at |apex_path| against the root digest
+// recorded in |capex| before it is published under its final name. This runs
+// right after decompression, while the image is still in the page cache. For
+// APEXes without an embedded hashtree, the image is hashed block by block and
+// the resulting tree is stored where activation expects it, so the image
+// doesn't have to be read again at mount time.
+Result<void> VerifyDecompressedImage(const ApexFile& capex,
+                                     const std::string& apex_path,
+                                     bool is_ota_chroot) {
+  auto apex = ApexFile::Open(apex_path);
+  if (!apex.ok()) {
+    return Error() << "Failed to open decompressed APEX: " << apex.error();
+  }
+  auto verity_data = apex->VerifyApexVerity(capex.GetBundledPublicKey());
+  if (!verity_data.ok()) {
+    return Error() << "Failed to verify decompressed APEX " << apex_path
+                   << ": " << verity_data.error();
+  }
+  if (verity_data->root_digest !=
+      capex.GetManifest().capexmetadata().originalapexdigest()) {
+    return Error() << "Root digest of " << apex_path << " does not match with"
+                   << " expected root digest in " << capex.GetPath();
+  }
+  // APEXes with an embedded hashtree are checked by dm-verity as they are
+  // read. In OTA chroot the hashtree dir belongs to the running system, so
+  // leave it alone.
+  if (verity_data->desc->tree_size != 0 || is_ota_chroot) {
+    return {};
+  }
+  auto hashtree_file = GetHashTreeFileName(*apex, /* is_new= */ false);
+  if (auto st = PrepareHashTree(*apex, *verity_data, hashtree_file); !st.ok()) {
+    return st.error();
+  }
+  return {};
+}
+
+// Moves a validated OTA APEX to |dest_path| in the cheapest way the filesystem
+// allows: rename, then reflink, then an in-kernel copy. A verified-digest
+// record of |ota_apex_path| is carried over to |dest_path|.
+Result<void> PromoteOtaApex(const ApexFile& capex,
+                            const std::string& ota_apex_path,
+                            const std::string& dest_path) {
+  const auto& digest = capex.GetManifest().capexmetadata().originalapexdigest();
+  bool verified = HasVerifiedDigest(ota_apex_path, digest);
+  if (rename(ota_apex_path.c_str(), dest_path.c_str()) == 0) {
+    LOG(INFO) << "Renamed " << ota_apex_path << " to " << dest_path;
+    RemoveFileIfExists(ota_apex_path + kVerifiedDigestSuffix);
+    if (verified) {
+      RecordVerifiedDigest(dest_path, digest);
+    }
+    return {};
+  }
+  PLOG(WARNING) << "Failed to rename " << ota_apex_path << ", copying it";
+
+  unique_fd src_fd(open(ota_apex_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (src_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << ota_apex_path;
+  }
+  struct stat st;
+  if (fstat(src_fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << ota_apex_path;
+  }
+  unique_fd dest_fd(
+      open(dest_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644));
+  if (dest_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << dest_path;
+  }
+  auto dest_guard = android::base::make_scope_guard(
+      [&dest_path]() { RemoveFileIfExists(dest_path); });
+
+  if (ioctl(dest_fd.get(), FICLONE, src_fd.get()) == 0) {
+    LOG(INFO) << "Cloned " << ota_apex_path << " to " << dest_path;
+  } else {
+    for (off64_t remaining = st.st_size; remaining > 0;) {
+      ssize_t copied = copy_file_range(src_fd.get(), nullptr, dest_fd.get(),
+                                       nullptr, remaining, 0);
+      if (copied <= 0) {
+        return ErrnoError() << "Failed to copy " << ota_apex_path << " to "
+                            << dest_path;
+      }
+      remaining -= copied;
+    }
+    LOG(INFO) << "Copied " << ota_apex_path << " to " << dest_path;
+  }
+  dest_fd.reset();
+
+  if (auto restore = RestoreconPath(dest_path); !restore.ok()) {
+    return restore.error();
+  }
+  if (verified) {
+    RecordVerifiedDigest(dest_path, digest);
+  }
+  dest_guard.Disable();
+  RemoveDecompressedApex(ota_apex_path);
+  return {};
+}
+
 // Process a single compressed APEX. Returns the decompressed APEX if
 // successful.
 Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
-                                       bool is_ota_chroot) {
+                                       bool is_ota_chroot,
+                                       bool* consumed_reserved_space) {
   LOG(INFO) << "Processing compressed APEX " << capex.GetPath();
   const auto decompressed_apex_path =
       StringPrintf("%s/%s%s", gConfig->decompression_dir,
@@ -2754,7 +3248,7 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
       // Existing decompressed APEX is not valid. We will have to redecompress
       LOG(WARNING) << "Existing decompressed APEX is invalid: "
                    << result.error();
-      RemoveFileIfExists(decompressed_apex_path);
+      RemoveDecompressedApex(decompressed_apex_path);
     }
   }
 
@@ -2774,9 +3268,9 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
       // Existing ota_apex is not valid. We will have to decompress
       LOG(WARNING) << "Existing decompressed OTA APEX is invalid: "
                    << result.error();
-      RemoveFileIfExists(ota_apex_path);
+      RemoveDecompressedApex(ota_apex_path);
     } else {
-      // During boot, we can avoid decompression by renaming OTA apex
+      // During boot, we can avoid decompression by promoting OTA apex
       // to expected decompressed_apex path
 
       // Check if ota_apex APEX is valid
@@ -2784,24 +3278,24 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
       if (result.ok()) {
         // ota_apex matches with capex. Slot has been switched.
 
-        // Rename ota_apex to expected decompressed_apex path
-        if (rename(ota_apex_path.c_str(), decompressed_apex_path.c_str()) ==
-            0) {
-          // Check if renamed decompressed APEX is valid
+        // Move ota_apex to expected decompressed_apex path
+        auto promoted =
+            PromoteOtaApex(capex, ota_apex_path, decompressed_apex_path);
+        if (promoted.ok()) {
+          // Check if promoted decompressed APEX is valid
           result =
               OpenAndValidateDecompressedApex(capex, decompressed_apex_path);
           if (result.ok()) {
-            LOG(INFO) << "Renamed " << ota_apex_path << " to "
-                      << decompressed_apex_path;
             return result;
           }
-          // Renamed ota_apex is not valid. We will have to decompress
-          LOG(WARNING) << "Renamed decompressed APEX from " << ota_apex_path
+          // Promoted ota_apex is not valid. We will have to decompress
+          LOG(WARNING) << "Promoted decompressed APEX from " << ota_apex_path
                        << " to " << decompressed_apex_path
                        << " is invalid: " << result.error();
-          RemoveFileIfExists(decompressed_apex_path);
+          RemoveDecompressedApex(decompressed_apex_path);
         } else {
-          PLOG(ERROR) << "Failed to rename file " << ota_apex_path;
+          LOG(ERROR) << "Failed to promote " << ota_apex_path << ": "
+                     << promoted.error();
         }
       }
     }
@@ -2809,38 +3303,61 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
 
   // There was no way to avoid decompression
 
-  // Clean up reserved space before decompressing capex
-  if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
+  // Hand over as much reserved space as the decompressed APEX needs. The rest
+  // stays reserved for the other compressed APEXes.
+  *consumed_reserved_space = true;
+  if (capex.GetDecompressedSize().has_value()) {
+    ConsumeReservedSpace(*capex.GetDecompressedSize());
+  } else if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir);
+             !ret.ok()) {
     LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
   }
 
   auto decompression_dest =
       is_ota_chroot ? ota_apex_path : decompressed_apex_path;
-  auto scope_guard = android::base::make_scope_guard(
-      [&]() { RemoveFileIfExists(decompression_dest); });
+  // Decompress into a temporary file, so that an APEX whose content doesn't
+  // match the CAPEX never shows up under its final name.
+  auto decompression_tmp = decompression_dest + ".tmp";
+  RemoveFileIfExists(decompression_tmp);
+  auto scope_guard = android::base::make_scope_guard([&]() {
+    RemoveFileIfExists(decompression_tmp);
+    RemoveDecompressedApex(decompression_dest);
+  });
 
-  auto decompression_result = capex.Decompress(decompression_dest);
+  auto decompression_result = capex.Decompress(decompression_tmp);
   if (!decompression_result.ok()) {
     return Error() << "Failed to decompress : " << capex.GetPath().c_str()
                    << " " << decompression_result.error();
   }
 
   // Fix label of decompressed file
-  auto restore = RestoreconPath(decompression_dest);
+  auto restore = RestoreconPath(decompression_tmp);
   if (!restore.ok()) {
     return restore.error();
   }
 
-  // Validate the newly decompressed APEX
-  auto return_apex = OpenAndValidateDecompressedApex(capex, decompression_dest);
+  auto verify = VerifyDecompressedImage(capex, decompression_tmp, is_ota_chroot);
+  if (!verify.ok()) {
+    return Error() << "Failed to decompress CAPEX: " << verify.error();
+  }
+  if (rename(decompression_tmp.c_str(), decompression_dest.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << decompression_tmp << " to "
+                        << decompression_dest;
+  }
+  /// Release compressed blocks in case decompression_dest is on f2fs-compressed
+  // filesystem.
+  ReleaseF2fsCompressedBlocks(decompression_dest);
+
+  // Validate the newly decompressed APEX. Its root digest was checked above,
+  // don't read the image once more. Both rename and releasing blocks change
+  // the ctime, so the verified digest is only recorded now.
+  auto return_apex = OpenAndValidateDecompressedApex(
+      capex, decompression_dest, /* digest_verified= */ true);
   if (!return_apex.ok()) {
     return Error() << "Failed to decompress CAPEX: " << return_apex.error();
   }
 
   gChangedActiveApexes.insert(return_apex->GetManifest().name());
-  /// Release compressed blocks in case decompression_dest is on f2fs-compressed
-  // filesystem.
-  ReleaseF2fsCompressedBlocks(decompression_dest);
 
   scope_guard.Disable();
   return return_apex;
@@ -2858,12 +3375,14 @@ std::vector<ApexFile> ProcessCompressedApex(
   LOG(INFO) << "Processing compressed APEX";
 
   std::vector<ApexFile> decompressed_apex_list;
+  bool consumed_reserved_space = false;
   for (const ApexFile& capex : compressed_apex) {
     if (!capex.IsCompressed()) {
       continue;
     }
 
-    auto decompressed_apex = ProcessCompressedApex(capex, is_ota_chroot);
+    auto decompressed_apex = ProcessCompressedApex(capex, is_ota_chroot,
+                                                   &consumed_reserved_space);
     if (decompressed_apex.ok()) {
       decompressed_apex_list.emplace_back(std::move(*decompressed_apex));
       continue;
@@ -2871,35 +3390,133 @@ std::vector<ApexFile> ProcessCompressedApex(
     LOG(ERROR) << "Failed to process compressed APEX: "
                << decompressed_apex.error();
   }
+  // The reservation was made for this round of decompression, don't keep
+  // what's left of it around.
+  if (consumed_reserved_space) {
+    if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
+      LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
+    }
+  }
   return std::move(decompressed_apex_list);
 }
 
 Result<void> ValidateDecompressedApex(const ApexFile& capex,
                                       const ApexFile& apex) {
-  // Decompressed APEX must have same public key as CAPEX
-  if (capex.GetBundledPublicKey() != apex.GetBundledPublicKey()) {
-    return Error()
-           << "Public key of compressed APEX is different than original "
-           << "APEX for " << apex.GetPath();
+  return ValidateDecompressedApexImpl(capex, apex, /* verify_digest= */ true);
+}
+
+namespace {
+
+std::vector<std::string> GetActivationPlanSourceDirs() {
+  std::vector<std::string> dirs = gConfig->apex_built_in_dirs;
+  dirs.emplace_back(gConfig->active_apex_data_dir);
+  dirs.emplace_back(gConfig->decompression_dir);
+  return dirs;
+}
+
+Result<ActivationPlan> CreateActivationPlan(
+    const std::vector<ApexFileRef>& activation_list) {
+  const auto& instance = ApexFileRepository::GetInstance();
+  ActivationPlan plan;
+  for (const ApexFile& apex : activation_list) {
+    auto source = ActivationPlanEntry::DATA;
+    if (instance.IsDecompressedApex(apex)) {
+      source = ActivationPlanEntry::DECOMPRESSED;
+    } else if (instance.IsPreInstalledApex(apex)) {
+      source = ActivationPlanEntry::PRE_INSTALLED;
+    }
+    *plan.add_entries() = OR_RETURN(CreateActivationPlanEntry(apex, source));
   }
-  // Decompressed APEX must have same version as CAPEX
-  if (capex.GetManifest().version() != apex.GetManifest().version()) {
-    return Error()
-           << "Compressed APEX has different version than decompressed APEX "
-           << apex.GetPath();
+  return plan;
+}
+
+// Maps entries of |plan| back to APEXes collected by ApexFileRepository.
+// Decompressed APEXes are not part of it, they are opened into
+// |decompressed_apex| instead.
+Result<std::vector<ApexFileRef>> ResolveActivationPlan(
+    const ActivationPlan& plan, std::vector<ApexFile>* decompressed_apex) {
+  const auto& instance = ApexFileRepository::GetInstance();
+  std::vector<ApexFileRef> activation_list;
+  for (const auto& entry : plan.entries()) {
+    OR_RETURN(VerifyActivationPlanEntry(entry));
+    if (entry.source() == ActivationPlanEntry::DECOMPRESSED) {
+      auto apex = OR_RETURN(ApexFile::Open(entry.path()));
+      if (apex.GetManifest().version() != entry.version()) {
+        return Error() << entry.path() << " has unexpected version";
+      }
+      decompressed_apex->emplace_back(std::move(apex));
+      continue;
+    }
+    bool pre_installed = entry.source() == ActivationPlanEntry::PRE_INSTALLED;
+    if (pre_installed ? !instance.HasPreInstalledVersion(entry.name())
+                      : !instance.HasDataVersion(entry.name())) {
+      return Error() << entry.path() << " is no longer available";
+    }
+    auto apex = pre_installed ? instance.GetPreInstalledApex(entry.name())
+                              : instance.GetDataApex(entry.name());
+    if (apex.get().GetPath() != entry.path() ||
+        apex.get().GetManifest().version() != entry.version()) {
+      return Error() << entry.path() << " is no longer selected";
+    }
+    activation_list.emplace_back(apex);
   }
-  // Decompressed APEX must have same root digest as what is stored in CAPEX
-  auto apex_verity = apex.VerifyApexVerity(apex.GetBundledPublicKey());
-  if (!apex_verity.ok() ||
-      capex.GetManifest().capexmetadata().originalapexdigest() !=
-          apex_verity->root_digest) {
-    return Error() << "Root digest of " << apex.GetPath()
-                   << " does not match with"
-                   << " expected root digest in " << capex.GetPath();
+  for (const ApexFile& apex_file : *decompressed_apex) {
+    activation_list.emplace_back(std::cref(apex_file));
   }
-  return {};
+  return activation_list;
+}
+
+// Reuses the activation plan of the previous boot if none of the APEX
+// directories changed since.
+std::optional<std::vector<ApexFileRef>> GetCachedActivationList(
+    std::vector<ApexFile>* decompressed_apex) {
+  if (gConfig->activation_plan_path == nullptr) {
+    return std::nullopt;
+  }
+  auto plan = ReadActivationPlan(gConfig->activation_plan_path);
+  if (!plan.ok()) {
+    LOG(INFO) << "No activation plan to reuse: " << plan.error();
+    return std::nullopt;
+  }
+  auto fingerprint =
+      ComputeActivationPlanFingerprint(GetActivationPlanSourceDirs());
+  if (!fingerprint.ok() || *fingerprint != plan->fingerprint()) {
+    LOG(INFO) << "APEXes have changed since last boot, not reusing "
+              << "activation plan";
+    return std::nullopt;
+  }
+  auto activation_list = ResolveActivationPlan(*plan, decompressed_apex);
+  if (!activation_list.ok()) {
+    LOG(WARNING) << "Failed to reuse activation plan: "
+                 << activation_list.error();
+    decompressed_apex->clear();
+    return std::nullopt;
+  }
+  return std::move(*activation_list);
+}
+
+void WriteActivationPlanIfNeeded() {
+  if (gConfig->activation_plan_path == nullptr || !gActivationPlan) {
+    return;
+  }
+  auto fingerprint =
+      ComputeActivationPlanFingerprint(GetActivationPlanSourceDirs());
+  if (!fingerprint.ok()) {
+    LOG(ERROR) << "Failed to compute activation plan fingerprint: "
+               << fingerprint.error();
+    return;
+  }
+  gActivationPlan->set_fingerprint(*fingerprint);
+  if (auto st = WriteActivationPlan(*gActivationPlan,
+                                    gConfig->activation_plan_path);
+      !st.ok()) {
+    LOG(ERROR) << "Failed to write activation plan: " << st.error();
+  }
+  gActivationPlan.reset();
 }
 
+}  // namespace
+
 void OnStart() {
   ATRACE_NAME("OnStart");
   LOG(INFO) << "Marking APEXd as starting";
@@ -2945,29 +3562,35 @@ void OnStart() {
     LOG(ERROR) << "Failed to resume revert : " << status.error();
   }
 
-  // Group every ApexFile on device by name
-  const auto& instance = ApexFileRepository::GetInstance();
-  const auto& all_apex = instance.AllApexFilesByName();
-  // There can be multiple APEX packages with package name X. Determine which
-  // one to activate.
-  auto activation_list = SelectApexForActivation(all_apex, instance);
-
-  // Process compressed APEX, if any
-  std::vector<ApexFileRef> compressed_apex;
-  for (auto it = activation_list.begin(); it != activation_list.end();) {
-    if (it->get().IsCompressed()) {
-      compressed_apex.emplace_back(*it);
-      it = activation_list.erase(it);
-    } else {
-      it++;
-    }
-  }
   std::vector<ApexFile> decompressed_apex;
-  if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
-    for (const ApexFile& apex_file : decompressed_apex) {
-      activation_list.emplace_back(std::cref(apex_file));
+  std::vector<ApexFileRef> activation_list;
+  if (auto cached = GetCachedActivationList(&decompressed_apex); cached) {
+    LOG(INFO) << "Reusing activation plan of previous boot";
+    activation_list = std::move(*cached);
+  } else {
+    // Group every ApexFile on device by name
+    const auto& instance = ApexFileRepository::GetInstance();
+    const auto& all_apex = instance.AllApexFilesByName();
+    // There can be multiple APEX packages with package name X. Determine which
+    // one to activate.
+    activation_list = SelectApexForActivation(all_apex, instance);
+
+    // Process compressed APEX, if any
+    std::vector<ApexFileRef> compressed_apex;
+    for (auto it = activation_list.begin(); it != activation_list.end();) {
+      if (it->get().IsCompressed()) {
+        compressed_apex.emplace_back(*it);
+        it = activation_list.erase(it);
+      } else {
+        it++;
+      }
+    }
+    if (!compressed_apex.empty()) {
+      decompressed_apex =
+          ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
+      for (const ApexFile& apex_file : decompressed_apex) {
+        activation_list.emplace_back(std::cref(apex_file));
+      }
     }
   }
 
@@ -2989,8 +3612,19 @@ void OnStart() {
     if (!retry_status.ok()) {
       LOG(ERROR) << retry_status.error();
     }
+  } else if (gConfig->activation_plan_path != nullptr) {
+    auto plan = CreateActivationPlan(activation_list);
+    if (plan.ok()) {
+      gActivationPlan = std::move(*plan);
+    } else {
+      LOG(ERROR) << "Failed to create activation plan: " << plan.error();
+    }
   }
 
+  // Staged APEXes are either active or failed to activate by now.
+  gVerifiedApexes.clear();
+  gMountedApexes.Persist();
+
   // Now that APEXes are mounted, snapshot or restore DE_sys data.
   SnapshotOrRestoreDeSysData();
 
@@ -3042,6 +3676,23 @@ void OnAllPackagesReady() {
   }
 }
 
+namespace {
+
+// Records the verification of |apex|, which was just temp mounted, so that it
+// isn't verified again when it's activated.
+Result<VerifiedApex> CreateVerifiedApexRecord(const ApexFile& apex) {
+  const auto& instance = ApexFileRepository::GetInstance();
+  auto public_key =
+      OR_RETURN(instance.GetPublicKey(apex.GetManifest().name()));
+  auto verity_data = OR_RETURN(apex.VerifyApexVerity(public_key));
+  // The hashtree generated by the temp mount, if any, becomes the one used
+  // for activation.
+  return CreateVerifiedApex(apex, public_key, verity_data,
+                            GetHashTreeFileName(apex, /* is_new= */ true));
+}
+
+}  // namespace
+
 Result<std::vector<ApexFile>> SubmitStagedSession(
     const int session_id, const std::vector<int>& child_session_ids,
     const bool has_rollback_enabled, const bool is_rollback,
@@ -3097,6 +3748,13 @@ Result<std::vector<ApexFile>> SubmitStagedSession(
   session->SetRollbackId(rollback_id);
   for (const auto& apex_file : ret) {
     session->AddApexName(apex_file.GetManifest().name());
+    auto verified_apex = CreateVerifiedApexRecord(apex_file);
+    if (!verified_apex.ok()) {
+      // Will be verified again during activation.
+      LOG(WARNING) << verified_apex.error();
+      continue;
+    }
+    session->AddVerifiedApex(*verified_apex);
   }
   Result<void> commit_status =
       (*session).UpdateStateAndCommit(SessionState::VERIFIED);
@@ -3193,6 +3851,7 @@ void RemoveInactiveDataApex() {
       if (unlink(path.c_str()) != 0) {
         PLOG(ERROR) << "Failed to unlink inactive data APEX " << path;
       }
+      RemoveFileIfExists(path + kVerifiedDigestSuffix);
     }
   }
 }
@@ -3229,6 +3888,9 @@ void DeleteUnusedVerityDevices() {
 
 void BootCompletedCleanup() {
   RemoveInactiveDataApex();
+  // Only now, after cleaning up, APEX directories are in the state the next
+  // boot will see.
+  WriteActivationPlanIfNeeded();
 
   auto sessions = gSessionManager->GetSessions();
   for (const ApexSession& session : sessions) {
@@ -3254,14 +3916,12 @@ int UnmountAll() {
                                          bool latest) {
     LOG(INFO) << "Unmounting " << data.full_path << " mounted on "
               << data.mount_point;
-    auto apex = ApexFile::Open(data.full_path);
-    if (!apex.ok()) {
-      LOG(ERROR) << "Failed to open " << data.full_path << " : "
-                 << apex.error();
+    if (data.metadata == nullptr) {
+      LOG(ERROR) << "Failed to open " << data.full_path;
       ret = 1;
       return;
     }
-    if (latest && !apex->GetManifest().providesharedapexlibs()) {
+    if (latest && !data.metadata->provide_shared_apex_libs) {
       auto pos = data.mount_point.find('@');
       CHECK(pos != std::string::npos);
       std::string bind_mount = data.mount_point.substr(0, pos);
@@ -3298,6 +3958,8 @@ Result<void> RemountPackages() {
       failed.emplace_back(apex);
     }
   }
+  // Remounted APEXes may carry different classpath jars.
+  InvalidateClassPathCache();
   static constexpr const char* kErrorMessage =
       "Failed to remount following APEX packages, hence previous versions of "
       "them are still active. If APEX you are developing is in this list, it "
@@ -3373,44 +4035,18 @@ int64_t CalculateSizeForCompressedApex(
 void CollectApexInfoList(std::ostream& os,
                          const std::vector<ApexFile>& active_apexs,
                          const std::vector<ApexFile>& inactive_apexs) {
-  std::vector<com::android::apex::ApexInfo> apex_infos;
-
-  auto convert_to_autogen = [&apex_infos](const ApexFile& apex,
-                                          bool is_active) {
-    auto& instance = ApexFileRepository::GetInstance();
-
-    auto preinstalled_path =
-        instance.GetPreinstalledPath(apex.GetManifest().name());
-    std::optional<std::string> preinstalled_module_path;
-    if (preinstalled_path.ok()) {
-      preinstalled_module_path = *preinstalled_path;
+  auto to_metadata = [](const std::vector<ApexFile>& apexs) {
+    std::vector<std::shared_ptr<const ApexMetadata>> ret;
+    ret.reserve(apexs.size());
+    for (const auto& apex : apexs) {
+      ret.push_back(ApexMetadata::FromApexFile(apex));
     }
-
-    std::optional<int64_t> mtime =
-        instance.GetBlockApexLastUpdateSeconds(apex.GetPath());
-    if (!mtime.has_value()) {
-      struct stat stat_buf;
-      if (stat(apex.GetPath().c_str(), &stat_buf) == 0) {
-        mtime.emplace(stat_buf.st_mtime);
-      } else {
-        PLOG(WARNING) << "Failed to stat " << apex.GetPath();
-      }
-    }
-    com::android::apex::ApexInfo apex_info(
-        apex.GetManifest().name(), apex.GetPath(), preinstalled_module_path,
-        apex.GetManifest().version(), apex.GetManifest().versionname(),
-        instance.IsPreInstalledApex(apex), is_active, mtime,
-        apex.GetManifest().providesharedapexlibs());
-    apex_infos.emplace_back(std::move(apex_info));
+    return ret;
   };
-  for (const auto& apex : active_apexs) {
-    convert_to_autogen(apex, /* is_active= */ true);
-  }
-  for (const auto& apex : inactive_apexs) {
-    convert_to_autogen(apex, /* is_active= */ false);
-  }
-  com::android::apex::ApexInfoList apex_info_list(apex_infos);
-  com::android::apex::write(os, apex_info_list);
+  ApexInfoListModel model;
+  model.Update(to_metadata(active_apexs), to_metadata(inactive_apexs),
+               ApexFileRepository::GetInstance());
+  model.Write(os);
 }
 
 // Reserve |size| bytes in |dest_dir| by creating a zero-filled file.
@@ -3430,7 +4066,7 @@ Result<void> ReserveSpaceForCompressedApex(int64_t size,
     return Error() << "Failed to clean up ota_apex: " << ota_apex_files.error();
   }
   for (const std::string& ota_apex : *ota_apex_files) {
-    RemoveFileIfExists(ota_apex);
+    RemoveDecompressedApex(ota_apex);
   }
 
   auto file_path = StringPrintf("%s/full.tmp", dest_dir.c_str());
@@ -3449,13 +4085,29 @@ Result<void> ReserveSpaceForCompressedApex(int64_t size,
                         << file_path.c_str();
   }
 
-  // Resize to required size
-  std::error_code ec;
-  std::filesystem::resize_file(file_path, size, ec);
-  if (ec) {
+  struct stat st;
+  if (fstat(dest_fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << file_path;
+  }
+  if (st.st_size == 0) {
+    DisableF2fsCompression(dest_fd.get(), file_path);
+  }
+
+  // Resize to required size. Shrinking gives the blocks back right away.
+  if (ftruncate(dest_fd.get(), size) != 0) {
     RemoveFileIfExists(file_path);
-    return ErrnoError() << "Failed to resize file " << file_path.c_str()
-                        << " : " << ec.message();
+    return ErrnoError() << "Failed to resize file " << file_path.c_str();
+  }
+  // A resized file is sparse, actually allocate its blocks so that they are
+  // there for decompression after reboot.
+  if (fallocate(dest_fd.get(), 0, 0, size) != 0) {
+    if (errno != EOPNOTSUPP) {
+      RemoveFileIfExists(file_path);
+      return ErrnoError() << "Failed to allocate " << size << " bytes for "
+                          << file_path;
+    }
+    PLOG(WARNING) << "Can't allocate blocks for " << file_path
+                  << ", reserved space is sparse";
   }
 
   return {};
@@ -3593,41 +4245,22 @@ int OnOtaChrootBootstrap() {
     }
   }
 
-  // There are a bunch of places that are producing apex-info.xml file.
-  // We should consolidate the logic in one function and make all other places
-  // use it.
-  auto active_apexes = GetActivePackages();
-  std::vector<ApexFile> inactive_apexes = GetFactoryPackages();
-  auto new_end = std::remove_if(
-      inactive_apexes.begin(), inactive_apexes.end(),
-      [&active_apexes](const ApexFile& apex) {
-        return std::any_of(active_apexes.begin(), active_apexes.end(),
-                           [&apex](const ApexFile& active_apex) {
-                             return apex.GetPath() == active_apex.GetPath();
-                           });
-      });
-  inactive_apexes.erase(new_end, inactive_apexes.end());
-  std::stringstream xml;
-  CollectApexInfoList(xml, active_apexes, inactive_apexes);
   std::string file_name = StringPrintf("%s/%s", kApexRoot, kApexInfoList);
-  unique_fd fd(TEMP_FAILURE_RETRY(
-      open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
-  if (fd.get() == -1) {
-    PLOG(ERROR) << "Can't open " << file_name;
+  std::string index_file_name =
+      StringPrintf("%s/%s", kApexRoot, kApexInfoIndex);
+  if (auto st = WriteApexInfoList(file_name, index_file_name,
+                                  /* include_inactive= */ true);
+      !st.ok()) {
+    LOG(ERROR) << st.error();
     return 1;
   }
 
-  if (!android::base::WriteStringToFd(xml.str(), fd)) {
-    PLOG(ERROR) << "Can't write to " << file_name;
-    return 1;
-  }
-
-  fd.reset();
-
-  if (auto status = RestoreconPath(file_name); !status.ok()) {
-    LOG(ERROR) << "Failed to restorecon " << file_name << " : "
-               << status.error();
-    return 1;
+  for (const auto& path : {file_name, index_file_name}) {
+    if (auto status = RestoreconPath(path); !status.ok()) {
+      LOG(ERROR) << "Failed to restorecon " << path << " : "
+                 << status.error();
+      return 1;
+    }
   }
 
   return 0;
@@ -3772,22 +4405,27 @@ Result<size_t> ComputePackageIdMinor(const ApexFile& apex) {
 }
 
 Result<void> UpdateApexInfoList() {
-  std::vector<ApexFile> active(GetActivePackages());
-  std::vector<ApexFile> inactive = CalculateInactivePackages(active);
-
-  std::stringstream xml;
-  CollectApexInfoList(xml, active, inactive);
-
   std::string name = StringPrintf("%s/.default-%s", kApexRoot, kApexInfoList);
-  unique_fd fd(TEMP_FAILURE_RETRY(
-      open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
-  if (fd.get() == -1) {
-    return ErrnoError() << "Can't open " << name;
-  }
-  if (!WriteStringToFd(xml.str(), fd)) {
-    return ErrnoError() << "Failed to write to " << name;
+  std::string index_name =
+      StringPrintf("%s/.default-%s", kApexRoot, kApexInfoIndex);
+  OR_RETURN(WriteApexInfoList(name, index_name, /* include_inactive= */ true));
+
+  // |name| was atomically replaced with a new file, but
+  // /apex/apex-info-list.xml is still a bind mount of the old one. Replace
+  // that bind mount with one of the new file rather than stacking another one
+  // on top of it, or every install would leave a mount behind. Same for the
+  // binary index.
+  for (const auto& [file, canonical] :
+       {std::pair{name, kApexInfoList},
+        std::pair{index_name, kApexInfoIndex}}) {
+    OR_RETURN(RestoreconPath(file));
+    std::string mount_point = StringPrintf("%s/%s", kApexRoot, canonical);
+    if (access(mount_point.c_str(), F_OK) != 0) {
+      // Not published yet.
+      continue;
+    }
+    OR_RETURN(apexd_private::SwapBindMount(mount_point, file));
   }
-
   return {};
 }
 
@@ -3815,8 +4453,77 @@ Result<void> LoadApexFromInit(const std::string& apex_name) {
   return {};
 }
 
+namespace {
+
+// Frees the devices backing |data|, whose mount was already detached.
+Result<void> TearDownDevices(const MountedApexData& data) {
+  if (!data.device_name.empty()) {
+    if (auto st = DeleteVerityDevice(data.device_name, /* deferred= */ false);
+        !st.ok()) {
+      LOG(DEBUG) << st.error() << ", deferring it";
+      // Loop devices are freed together with the dm device.
+      return DeleteVerityDevice(data.device_name, /* deferred= */ true);
+    }
+  }
+  auto log_fn = [](const std::string& path, const std::string& /*id*/) {
+    LOG(VERBOSE) << "Freeing loop device " << path << " for unmount.";
+  };
+  if (!data.loop_name.empty()) {
+    loop::DestroyLoopDevice(data.loop_name, log_fn);
+  }
+  if (!data.hashtree_loop_name.empty()) {
+    loop::DestroyLoopDevice(data.hashtree_loop_name, log_fn);
+  }
+  return {};
+}
+
+// Devices of retired APEXes are freed on a single worker, one APEX at a time,
+// so that installs don't wait for it.
+AsyncOperationRunner& GetDeviceTeardownRunner() {
+  static auto* runner = new AsyncOperationRunner(/* num_workers= */ 1);
+  return *runner;
+}
+
+// Queues freeing the devices backing |data| on the teardown worker. Devices
+// still in use (e.g. by processes holding files of the APEX open) are freed
+// once they aren't anymore.
+void TearDownDevicesInBackground(MountedApexData data) {
+  GetDeviceTeardownRunner().Submit(
+      /* key= */ 0,
+      {[data = std::move(data)]() { return TearDownDevices(data); }},
+      /* on_progress= */ nullptr,
+      [](int64_t /*token*/, const Result<void>& result) {
+        if (!result.ok()) {
+          LOG(ERROR) << result.error();
+        }
+      });
+}
+
+// Makes the APEX mounted on |from| available on |to| instead.
+Result<void> MoveToMountPoint(const std::string& from, const std::string& to) {
+  // MS_MOVE doesn't work under a shared mount like /apex, so bind-mount and
+  // detach instead.
+  if (mkdir(to.c_str(), kMkdirMode) != 0 && errno != EEXIST) {
+    return ErrnoError() << "Could not create mount point " << to;
+  }
+  if (mount(from.c_str(), to.c_str(), nullptr, MS_BIND, nullptr) != 0) {
+    return ErrnoError() << "Could not bind-mount " << from << " to " << to;
+  }
+  if (umount2(from.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0) {
+    PLOG(ERROR) << "Failed to unmount " << from;
+  } else if (rmdir(from.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to rmdir " << from;
+  }
+  return {};
+}
+
+}  // namespace
+
 Result<ApexFile> InstallPackage(const std::string& package_path, bool force) {
   LOG(INFO) << "Installing " << package_path;
+  // Set of active APEXes is about to change, don't let the next boot reuse
+  // the activation plan of this one.
+  gActivationPlan.reset();
   auto temp_apex = ApexFile::Open(package_path);
   if (!temp_apex.ok()) {
     return temp_apex.error();
@@ -3829,10 +4536,10 @@ Result<ApexFile> InstallPackage(const std::string& package_path, bool force) {
     return Error() << "No active version found for package " << module_name;
   }
 
-  auto cur_apex = ApexFile::Open(cur_mounted_data->full_path);
-  if (!cur_apex.ok()) {
-    return cur_apex.error();
+  if (cur_mounted_data->metadata == nullptr) {
+    return Error() << "Failed to open " << cur_mounted_data->full_path;
   }
+  const ApexMetadata* cur_apex = cur_mounted_data->metadata.get();
 
   // Do a quick check if this APEX can be installed without a reboot.
   // Note that passing this check doesn't guarantee that APEX will be
@@ -3857,45 +4564,14 @@ Result<ApexFile> InstallPackage(const std::string& package_path, bool force) {
   std::string new_id = GetPackageId(temp_apex->GetManifest()) + "_" +
                        std::to_string(*new_id_minor);
 
-  // Before unmounting the current apex, unload it from the init process:
-  // terminates services started from the apex and init scripts read from the
-  // apex.
-  OR_RETURN(UnloadApexFromInit(module_name));
-
-  // And then reload it from the init process whether it succeeds or not.
-  auto reload_apex = android::base::make_scope_guard([&]() {
-    if (auto status = LoadApexFromInit(module_name); !status.ok()) {
-      LOG(ERROR) << "Failed to load apex " << module_name
-                  << " : " << status.error().message();
-    }
-  });
-
-  // 2. Unmount currently active APEX.
-  if (auto res =
-          UnmountPackage(*cur_apex, /* allow_latest= */ true,
-                         /* deferred= */ true, /* detach_mount_point= */ force);
-      !res.ok()) {
-    return res.error();
-  }
-
   // 3. Hard link to final destination.
   std::string target_file =
       StringPrintf("%s/%s.apex", gConfig->active_apex_data_dir, new_id.c_str());
 
-  auto guard = android::base::make_scope_guard([&]() {
+  auto unlink_target = android::base::make_scope_guard([&]() {
     if (unlink(target_file.c_str()) != 0 && errno != ENOENT) {
       PLOG(ERROR) << "Failed to unlink " << target_file;
     }
-    // We can't really rely on the fact that dm-verity device backing up
-    // previously active APEX is still around. We need to create a new one.
-    std::string old_new_id = GetPackageId(temp_apex->GetManifest()) + "_" +
-                             std::to_string(*new_id_minor + 1);
-    auto res = ActivatePackageImpl(*cur_apex, old_new_id,
-                                   /* reuse_device= */ false);
-    if (!res.ok()) {
-      // At this point not much we can do... :(
-      LOG(ERROR) << res.error();
-    }
   });
 
   // At this point it should be safe to hard link |temp_apex| to
@@ -3911,17 +4587,84 @@ Result<ApexFile> InstallPackage(const std::string& package_path, bool force) {
     return new_apex.error();
   }
 
-  // 4. And activate new one.
-  auto activate_status = ActivatePackageImpl(*new_apex, new_id,
-                                             /* reuse_device= */ false);
-  if (!activate_status.ok()) {
-    return activate_status.error();
+  // 4. Mount the new version next to the current one, which keeps serving
+  // meanwhile: setting up loop and dm-verity devices is what takes time.
+  const std::string cur_mount_point = cur_mounted_data->mount_point;
+  const std::string new_mount_point =
+      apexd_private::GetPackageMountPoint(new_apex->GetManifest());
+  if (new_mount_point != cur_mount_point) {
+    auto exists = OR_RETURN(PathExists(new_mount_point));
+    if (exists && !IsEmptyDirectory(new_mount_point)) {
+      return Error() << new_mount_point << " is not empty";
+    }
   }
+  std::string staging_mount_point =
+      StringPrintf("%s/%s", kApexRoot, new_id.c_str());
+  auto new_data = MountPackageImpl(
+      *new_apex, staging_mount_point, new_id,
+      GetHashTreeFileName(*new_apex, /* is_new= */ false),
+      /* verify_image = */ false, /* reuse_device= */ false);
+  if (!new_data.ok()) {
+    return new_data.error();
+  }
+  auto unmount_new = android::base::make_scope_guard([&]() {
+    if (auto st = Unmount(*new_data, /* deferred= */ false); !st.ok()) {
+      LOG(ERROR) << "Failed to unmount " << staging_mount_point << " : "
+                 << st.error();
+    }
+  });
+
+  // 5. Switch over. Before that, unload the current apex from the init
+  // process: terminates services started from the apex and init scripts read
+  // from the apex.
+  OR_RETURN(UnloadApexFromInit(module_name));
+
+  // And then reload it from the init process whether it succeeds or not.
+  auto reload_apex = android::base::make_scope_guard([&]() {
+    if (auto status = LoadApexFromInit(module_name); !status.ok()) {
+      LOG(ERROR) << "Failed to load apex " << module_name
+                  << " : " << status.error().message();
+    }
+  });
+
+  OR_RETURN(apexd_private::SwapBindMount(
+      apexd_private::GetActiveMountPoint(new_apex->GetManifest()),
+      staging_mount_point));
 
   // Accept the install.
-  guard.Disable();
+  unmount_new.Disable();
+  unlink_target.Disable();
+  // derive_classpath would see the new version from now on.
+  InvalidateClassPathCache();
+
+  // 6. Retire the current version. Nothing can reach it through
+  // /apex/<name> anymore; files still open keep it alive until closed.
+  if (umount2(cur_mount_point.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0 &&
+      errno != EINVAL) {
+    PLOG(ERROR) << "Failed to unmount " << cur_mount_point;
+  }
+
+  // The new version takes over the regular mount point, which is free now
+  // even if the version didn't change.
+  if (auto st = MoveToMountPoint(staging_mount_point, new_mount_point);
+      st.ok()) {
+    new_data->mount_point = new_mount_point;
+  } else {
+    LOG(ERROR) << "Leaving " << new_apex->GetPath() << " mounted on "
+               << staging_mount_point << " : " << st.error();
+  }
+  // Swap the entries in a single update, so that readers always find an
+  // active version of the APEX.
+  gMountedApexes.Update([&](MountedApexDatabase::State* state) {
+    MountedApexDatabase::RemoveMountedApexFrom(
+        state, module_name, cur_mounted_data->full_path,
+        /* match_temp_mounts= */ false);
+    MountedApexDatabase::AddMountedApexTo(state, module_name, *new_data);
+  });
+  gMountedApexes.Persist();
+  TearDownDevicesInBackground(*cur_mounted_data);
 
-  // 4. Now we can unlink old APEX if it's not pre-installed.
+  // 7. Now we can unlink old APEX if it's not pre-installed.
   if (!ApexFileRepository::GetInstance().IsPreInstalledApex(*cur_apex)) {
     if (unlink(cur_mounted_data->full_path.c_str()) != 0) {
       PLOG(ERROR) << "Failed to unlink " << cur_mounted_data->full_path;
@@ -3944,6 +4687,10 @@ bool IsActiveApexChanged(const ApexFile& apex) {
          gChangedActiveApexes.end();
 }
 
+bool IsActiveApexChanged(const ApexMetadata& apex) {
+  return gChangedActiveApexes.find(apex.name) != gChangedActiveApexes.end();
+}
+
 std::set<std::string>& GetChangedActiveApexesForTesting() {
   return gChangedActiveApexes;
 }
@@ -20,8 +20,11 @@
 #include <android-base/macros.h>
 #include <android-base/result.h>
 
+#include <cstdint>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "apex_classpath.h"
@@ -29,6 +32,7 @@
 #include "apex_database.h"
 #include "apex_file.h"
 #include "apex_file_repository.h"
+#include "apex_info_list.h"
 #include "apexd_session.h"
 
 namespace android {
@@ -55,6 +59,12 @@ struct ApexdConfig {
   // and the subsequent numbers should point APEX files.
   const char* vm_payload_metadata_partition_prop;
   const char* active_apex_selinux_ctx;
+  // Where the activation plan of the last successful boot is kept. nullptr
+  // disables reusing it.
+  const char* activation_plan_path;
+  // Where the database of mounted APEXes is persisted for apexd restarts.
+  // nullptr disables persisting it.
+  const char* mounted_apex_database_path;
 };
 
 static const ApexdConfig kDefaultConfig = {
@@ -67,6 +77,8 @@ static const ApexdConfig kDefaultConfig = {
     kStagedSessionsDir,
     kVmPayloadMetadataPartitionProp,
     "u:object_r:staging_data_file",
+    kActivationPlanFile,
+    kMountedApexDatabaseFile,
 };
 
 class CheckpointInterface;
@@ -114,14 +126,29 @@ android::base::Result<void> ActivatePackage(const std::string& full_path)
 android::base::Result<void> DeactivatePackage(const std::string& full_path)
     WARN_UNUSED;
 
-std::vector<ApexFile> GetActivePackages();
-android::base::Result<ApexFile> GetActivePackage(
+// Metadata of active and factory packages is shared, not copied: it's
+// immutable.
+std::vector<std::shared_ptr<const ApexMetadata>> GetActivePackages();
+android::base::Result<std::shared_ptr<const ApexMetadata>> GetActivePackage(
     const std::string& package_name);
 
-std::vector<ApexFile> GetFactoryPackages();
+std::vector<std::shared_ptr<const ApexMetadata>> GetFactoryPackages();
+
+// Returns the packages, active or not, named |package_names|. Served from the
+// in-memory apex-info-list.
+std::vector<ApexInfoListModel::Package> GetPackagesByName(
+    const std::vector<std::string>& package_names);
+
+// Returns how the list of packages changed since |generation|. Served from
+// the in-memory apex-info-list.
+ApexInfoListModel::Changes GetPackageChangesSince(uint64_t generation);
 
 android::base::Result<void> AbortStagedSession(const int session_id);
 
+// Returns sessions known to the session manager. Served from memory.
+std::vector<ApexSession> GetSessions();
+android::base::Result<ApexSession> GetSession(int session_id);
+
 android::base::Result<void> SnapshotCeData(const int user_id,
                                            const int rollback_id,
                                            const std::string& apex_name);
@@ -221,7 +248,14 @@ android::base::Result<ApexFile> InstallPackage(const std::string& package_path,
 // Exposed for testing.
 android::base::Result<int> AddBlockApex(ApexFileRepository& instance);
 
+// Parses the package name and version out of the name of a file apexd created
+// in kActiveApexPackagesDataDir: `<name>@<version>[_<minor>].apex`. Returns
+// nullopt for files named differently.
+std::optional<std::pair<std::string, uint64_t>> ParseActiveApexFileName(
+    const std::string& path);
+
 bool IsActiveApexChanged(const ApexFile& apex);
+bool IsActiveApexChanged(const ApexMetadata& apex);
 
 // Shouldn't be used outside of apexd_test.cpp
 std::set<std::string>& GetChangedActiveApexesForTesting();
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_activation_plan.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/scopeguard.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "apexd_utils.h"
+#include "apexd_verity.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::GetProperty;
+using android::base::RemoveFileIfExists;
+using android::base::Result;
+using android::base::unique_fd;
+using ::apex::proto::ActivationPlan;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+int64_t GetMtimeNs(const struct stat& st) {
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+}
+
+}  // namespace
+
+Result<std::string> ComputeActivationPlanFingerprint(
+    const std::vector<std::string>& dirs) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  auto update = [&ctx](const std::string& s) {
+    // Include the terminating '\0' so that adjacent fields can't run together
+    SHA256_Update(&ctx, s.c_str(), s.size() + 1);
+  };
+
+  // A new build may ship the very same files, but still expect a full scan.
+  update(GetProperty("ro.build.fingerprint", ""));
+  for (const auto& dir : dirs) {
+    update(dir);
+    auto exists = PathExists(dir);
+    if (!exists.ok()) {
+      return exists.error();
+    }
+    if (!*exists) {
+      update("<missing>");
+      continue;
+    }
+    auto files = ReadDir(dir, [](auto _) { return true; });
+    if (!files.ok()) {
+      return files.error();
+    }
+    std::sort(files->begin(), files->end());
+    for (const auto& file : *files) {
+      struct stat st;
+      if (stat(file.c_str(), &st) != 0) {
+        return ErrnoError() << "Failed to stat " << file;
+      }
+      update(file);
+      update(std::to_string(static_cast<uint64_t>(st.st_ino)));
+      update(std::to_string(static_cast<int64_t>(st.st_size)));
+      update(std::to_string(GetMtimeNs(st)));
+    }
+  }
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  return BytesToHex(digest, sizeof(digest));
+}
+
+Result<ActivationPlanEntry> CreateActivationPlanEntry(
+    const ApexFile& apex, ActivationPlanEntry::Source source) {
+  struct stat st;
+  if (stat(apex.GetPath().c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << apex.GetPath();
+  }
+  ActivationPlanEntry entry;
+  entry.set_name(apex.GetManifest().name());
+  entry.set_path(apex.GetPath());
+  entry.set_inode(st.st_ino);
+  entry.set_mtime_ns(GetMtimeNs(st));
+  entry.set_version(apex.GetManifest().version());
+  entry.set_source(source);
+  return entry;
+}
+
+Result<void> VerifyActivationPlanEntry(const ActivationPlanEntry& entry) {
+  struct stat st;
+  if (stat(entry.path().c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << entry.path();
+  }
+  if (st.st_ino != entry.inode() || GetMtimeNs(st) != entry.mtime_ns()) {
+    return Error() << entry.path() << " has changed";
+  }
+  return {};
+}
+
+Result<ActivationPlan> ReadActivationPlan(const std::string& path) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  ActivationPlan plan;
+  if (!plan.ParseFromString(content)) {
+    return Error() << "Failed to parse " << path;
+  }
+  return plan;
+}
+
+Result<void> WriteActivationPlan(const ActivationPlan& plan,
+                                 const std::string& path) {
+  std::string content;
+  if (!plan.SerializeToString(&content)) {
+    return Error() << "Failed to serialize activation plan";
+  }
+  auto tmp_path = path + ".tmp";
+  unique_fd fd(open(tmp_path.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << tmp_path;
+  }
+  auto tmp_guard = android::base::make_scope_guard(
+      [&tmp_path]() { RemoveFileIfExists(tmp_path); });
+  if (!android::base::WriteStringToFd(content, fd) || fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  tmp_guard.Disable();
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
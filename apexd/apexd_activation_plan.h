@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_ACTIVATION_PLAN_H_
+#define ANDROID_APEXD_APEXD_ACTIVATION_PLAN_H_
+
+#include <android-base/result.h>
+
+#include <string>
+#include <vector>
+
+#include "activation_plan.pb.h"
+#include "apex_file.h"
+
+namespace android {
+namespace apex {
+
+using ActivationPlanEntry = ::apex::proto::ActivationPlan::Entry;
+
+// Computes a fingerprint of the given |dirs|. It covers the name, inode, size
+// and mtime of every file in them, so it changes as soon as an APEX is added,
+// removed or replaced in any of them.
+android::base::Result<std::string> ComputeActivationPlanFingerprint(
+    const std::vector<std::string>& dirs);
+
+// Describes |apex| as an entry of an activation plan.
+android::base::Result<ActivationPlanEntry> CreateActivationPlanEntry(
+    const ApexFile& apex, ActivationPlanEntry::Source source);
+
+// Checks that the file described by |entry| is still the very same file.
+android::base::Result<void> VerifyActivationPlanEntry(
+    const ActivationPlanEntry& entry);
+
+android::base::Result<::apex::proto::ActivationPlan> ReadActivationPlan(
+    const std::string& path);
+
+// Atomically replaces the activation plan stored at |path|.
+android::base::Result<void> WriteActivationPlan(
+    const ::apex::proto::ActivationPlan& plan, const std::string& path);
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_ACTIVATION_PLAN_H_
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_activation_plan.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+
+#include "apex_file.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+namespace {
+
+namespace fs = std::filesystem;
+
+using android::base::GetExecutableDirectory;
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+using android::base::testing::Ok;
+using ::apex::proto::ActivationPlan;
+using ::testing::Not;
+
+std::string GetTestFile(const std::string& name) {
+  return GetExecutableDirectory() + "/" + name;
+}
+
+TEST(ActivationPlanTest, FingerprintIsStableIfNothingChanged) {
+  TemporaryDir td;
+  fs::copy(GetTestFile("apex.apexd_test.apex"), td.path);
+
+  auto first = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(first, Ok());
+  auto second = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(second, Ok());
+  ASSERT_EQ(*first, *second);
+}
+
+TEST(ActivationPlanTest, FingerprintChangesIfFileIsAdded) {
+  TemporaryDir td;
+  fs::copy(GetTestFile("apex.apexd_test.apex"), td.path);
+  auto before = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(before, Ok());
+
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), td.path);
+  auto after = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(after, Ok());
+  ASSERT_NE(*before, *after);
+}
+
+TEST(ActivationPlanTest, FingerprintChangesIfFileIsReplaced) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex.apex", td.path);
+  fs::copy(GetTestFile("apex.apexd_test.apex"), path);
+  auto before = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(before, Ok());
+
+  fs::remove(path);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), path);
+  auto after = ComputeActivationPlanFingerprint({td.path});
+  ASSERT_THAT(after, Ok());
+  ASSERT_NE(*before, *after);
+}
+
+TEST(ActivationPlanTest, FingerprintOfMissingDir) {
+  TemporaryDir td;
+  auto missing = StringPrintf("%s/missing", td.path);
+  auto before = ComputeActivationPlanFingerprint({missing});
+  ASSERT_THAT(before, Ok());
+
+  ASSERT_EQ(mkdir(missing.c_str(), 0755), 0);
+  auto after = ComputeActivationPlanFingerprint({missing});
+  ASSERT_THAT(after, Ok());
+  ASSERT_NE(*before, *after);
+}
+
+TEST(ActivationPlanTest, WriteAndReadActivationPlan) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex.apex", td.path);
+  fs::copy(GetTestFile("apex.apexd_test.apex"), path);
+  auto apex = ApexFile::Open(path);
+  ASSERT_THAT(apex, Ok());
+
+  ActivationPlan plan;
+  plan.set_fingerprint("fingerprint");
+  auto entry = CreateActivationPlanEntry(*apex, ActivationPlanEntry::DATA);
+  ASSERT_THAT(entry, Ok());
+  *plan.add_entries() = *entry;
+
+  auto plan_path = StringPrintf("%s/plan", td.path);
+  ASSERT_THAT(WriteActivationPlan(plan, plan_path), Ok());
+  auto read_plan = ReadActivationPlan(plan_path);
+  ASSERT_THAT(read_plan, Ok());
+  ASSERT_EQ(read_plan->fingerprint(), "fingerprint");
+  ASSERT_EQ(read_plan->entries_size(), 1);
+  ASSERT_EQ(read_plan->entries(0).name(), apex->GetManifest().name());
+  ASSERT_EQ(read_plan->entries(0).path(), apex->GetPath());
+  ASSERT_EQ(read_plan->entries(0).version(), apex->GetManifest().version());
+  ASSERT_EQ(read_plan->entries(0).source(), ActivationPlanEntry::DATA);
+}
+
+TEST(ActivationPlanTest, ReadCorruptedActivationPlan) {
+  TemporaryDir td;
+  auto plan_path = StringPrintf("%s/plan", td.path);
+  ASSERT_TRUE(WriteStringToFile("not a proto", plan_path));
+  ASSERT_THAT(ReadActivationPlan(plan_path), Not(Ok()));
+}
+
+TEST(ActivationPlanTest, VerifyActivationPlanEntry) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/apex.apex", td.path);
+  fs::copy(GetTestFile("apex.apexd_test.apex"), path);
+  auto apex = ApexFile::Open(path);
+  ASSERT_THAT(apex, Ok());
+  auto entry = CreateActivationPlanEntry(*apex, ActivationPlanEntry::DATA);
+  ASSERT_THAT(entry, Ok());
+  ASSERT_THAT(VerifyActivationPlanEntry(*entry), Ok());
+
+  // A different file under the same path is detected
+  fs::remove(path);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), path);
+  ASSERT_THAT(VerifyActivationPlanEntry(*entry), Not(Ok()));
+
+  fs::remove(path);
+  ASSERT_THAT(VerifyActivationPlanEntry(*entry), Not(Ok()));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
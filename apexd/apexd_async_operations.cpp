@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_async_operations.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+#include <utility>
+
+using android::base::Error;
+using android::base::Result;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+Result<void> CancelledError(int64_t token) {
+  return Error() << "Operation " << token << " was cancelled";
+}
+
+}  // namespace
+
+AsyncOperationRunner::AsyncOperationRunner(size_t num_workers) {
+  for (size_t i = 0; i < std::max<size_t>(num_workers, 1); i++) {
+    workers_.emplace_back([this]() { WorkerLoop(); });
+  }
+}
+
+AsyncOperationRunner::~AsyncOperationRunner() {
+  std::list<std::shared_ptr<Operation>> pending;
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+    pending.swap(pending_);
+    for (auto& [token, operation] : running_) {
+      operation->cancelled = true;
+    }
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  for (const auto& operation : pending) {
+    if (operation->on_done) {
+      operation->on_done(operation->token, CancelledError(operation->token));
+    }
+  }
+}
+
+int64_t AsyncOperationRunner::Submit(int key, std::vector<Step> steps,
+                                     ProgressCallback on_progress,
+                                     DoneCallback on_done) {
+  auto operation = std::make_shared<Operation>();
+  operation->key = key;
+  operation->steps = std::move(steps);
+  operation->on_progress = std::move(on_progress);
+  operation->on_done = std::move(on_done);
+  {
+    std::lock_guard lock(mutex_);
+    operation->token = next_token_++;
+    pending_.push_back(operation);
+  }
+  cv_.notify_all();
+  return operation->token;
+}
+
+Result<void> AsyncOperationRunner::Run(int key, std::vector<Step> steps) {
+  auto operation = std::make_shared<Operation>();
+  operation->key = key;
+  operation->steps = std::move(steps);
+  operation->run_inline = true;
+  {
+    std::lock_guard lock(mutex_);
+    operation->token = next_token_++;
+    // Queued like any other operation, so that later operations with the same
+    // key wait for it. Workers leave it to this thread.
+    pending_.push_back(operation);
+    while (!stopping_ && !CanStartLocked(*operation)) {
+      cv_.wait(mutex_);
+    }
+    pending_.remove(operation);
+    if (stopping_) {
+      return CancelledError(operation->token);
+    }
+    busy_keys_.insert(key);
+  }
+
+  Result<void> result = RunSteps(*operation);
+
+  {
+    std::lock_guard lock(mutex_);
+    busy_keys_.erase(key);
+  }
+  cv_.notify_all();
+  return result;
+}
+
+bool AsyncOperationRunner::Cancel(int64_t token) {
+  std::shared_ptr<Operation> cancelled;
+  {
+    std::lock_guard lock(mutex_);
+    if (auto it = running_.find(token); it != running_.end()) {
+      it->second->cancelled = true;
+      return true;
+    }
+    for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+      if ((*it)->token == token && !(*it)->run_inline) {
+        cancelled = *it;
+        pending_.erase(it);
+        break;
+      }
+    }
+  }
+  if (!cancelled) {
+    return false;
+  }
+  // Later operations with the same key may be runnable now.
+  cv_.notify_all();
+  if (cancelled->on_done) {
+    cancelled->on_done(token, CancelledError(token));
+  }
+  return true;
+}
+
+std::shared_ptr<AsyncOperationRunner::Operation>
+AsyncOperationRunner::TakeRunnableLocked() {
+  std::set<int> blocked_keys = busy_keys_;
+  for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+    // An operation waits for earlier operations with the same key, running
+    // or pending.
+    if (!blocked_keys.insert((*it)->key).second || (*it)->run_inline) {
+      continue;
+    }
+    auto operation = *it;
+    pending_.erase(it);
+    busy_keys_.insert(operation->key);
+    running_.emplace(operation->token, operation);
+    return operation;
+  }
+  return nullptr;
+}
+
+bool AsyncOperationRunner::CanStartLocked(const Operation& operation) {
+  if (busy_keys_.count(operation.key) > 0) {
+    return false;
+  }
+  for (const auto& other : pending_) {
+    if (other.get() == &operation) {
+      return true;
+    }
+    if (other->key == operation.key) {
+      return false;
+    }
+  }
+  return false;
+}
+
+Result<void> AsyncOperationRunner::RunSteps(Operation& operation) {
+  const int64_t token = operation.token;
+  const size_t total = operation.steps.size();
+  for (size_t i = 0; i < total; i++) {
+    if (operation.cancelled) {
+      return CancelledError(token);
+    }
+    if (auto result = operation.steps[i](); !result.ok()) {
+      LOG(ERROR) << "Operation " << token << " failed : " << result.error();
+      return result;
+    }
+    if (operation.on_progress) {
+      operation.on_progress(token, i + 1, total);
+    }
+  }
+  return {};
+}
+
+void AsyncOperationRunner::WorkerLoop() {
+  while (true) {
+    std::shared_ptr<Operation> operation;
+    {
+      std::lock_guard lock(mutex_);
+      while (!stopping_ && (operation = TakeRunnableLocked()) == nullptr) {
+        cv_.wait(mutex_);
+      }
+    }
+    if (!operation) {
+      return;
+    }
+
+    const int64_t token = operation->token;
+    Result<void> result = RunSteps(*operation);
+
+    {
+      std::lock_guard lock(mutex_);
+      running_.erase(token);
+      busy_keys_.erase(operation->key);
+    }
+    cv_.notify_all();
+    if (operation->on_done) {
+      operation->on_done(token, result);
+    }
+  }
+}
+
+}  // namespace apex
+}  // namespace android
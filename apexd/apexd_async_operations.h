@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_ASYNC_OPERATIONS_H_
+#define ANDROID_APEXD_APEXD_ASYNC_OPERATIONS_H_
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+/**
+ * Runs long filesystem operations (e.g. snapshots of APEX data) on a pool of
+ * worker threads, so that binder threads don't block on them.
+ *
+ * An operation is a sequence of steps, identified by a token. Operations that
+ * share a key (e.g. the user whose data they touch) run one at a time, in
+ * submission order; others run concurrently.
+ */
+class AsyncOperationRunner {
+ public:
+  using Step = std::function<android::base::Result<void>()>;
+  // Called after each successful step with the number of steps done so far.
+  using ProgressCallback =
+      std::function<void(int64_t token, size_t done, size_t total)>;
+  // Called once the operation finished, failed or was cancelled.
+  using DoneCallback = std::function<void(
+      int64_t token, const android::base::Result<void>& result)>;
+
+  explicit AsyncOperationRunner(size_t num_workers);
+  // Cancels the pending operations and waits for the running ones.
+  ~AsyncOperationRunner();
+
+  AsyncOperationRunner(const AsyncOperationRunner&) = delete;
+  AsyncOperationRunner& operator=(const AsyncOperationRunner&) = delete;
+
+  // Queues |steps|, which run in order until one of them fails. Returns the
+  // token of the operation.
+  int64_t Submit(int key, std::vector<Step> steps,
+                 ProgressCallback on_progress, DoneCallback on_done);
+
+  // Runs |steps| on the calling thread and returns the result. Like an
+  // operation from Submit(), it runs after the earlier operations with the
+  // same key and before the later ones, but it never waits for a free worker.
+  // It can't be cancelled.
+  android::base::Result<void> Run(int key, std::vector<Step> steps);
+
+  // Cancels the operation |token|. Steps that haven't started yet are skipped
+  // and the operation completes with an error. Returns false if the operation
+  // already completed or doesn't exist.
+  bool Cancel(int64_t token);
+
+ private:
+  struct Operation {
+    int64_t token;
+    int key;
+    std::vector<Step> steps;
+    ProgressCallback on_progress;
+    DoneCallback on_done;
+    std::atomic<bool> cancelled = false;
+    // Run by the thread that called Run() rather than by a worker.
+    bool run_inline = false;
+  };
+
+  void WorkerLoop();
+  std::shared_ptr<Operation> TakeRunnableLocked() REQUIRES(mutex_);
+  bool CanStartLocked(const Operation& operation) REQUIRES(mutex_);
+  static android::base::Result<void> RunSteps(Operation& operation);
+
+  std::mutex mutex_;
+  // Waits on |mutex_| directly, which keeps the thread safety analysis happy.
+  std::condition_variable_any cv_;
+  std::list<std::shared_ptr<Operation>> pending_ GUARDED_BY(mutex_);
+  std::unordered_map<int64_t, std::shared_ptr<Operation>> running_
+      GUARDED_BY(mutex_);
+  std::set<int> busy_keys_ GUARDED_BY(mutex_);
+  int64_t next_token_ GUARDED_BY(mutex_) = 1;
+  bool stopping_ GUARDED_BY(mutex_) = false;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_ASYNC_OPERATIONS_H_
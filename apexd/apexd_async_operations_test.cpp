@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_async_operations.h"
+
+#include <android-base/result-gmock.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace apex {
+namespace {
+
+using android::base::Error;
+using android::base::Result;
+using android::base::testing::HasError;
+using android::base::testing::Ok;
+using android::base::testing::WithMessage;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+using Step = AsyncOperationRunner::Step;
+
+// Completion of an operation, as reported to its DoneCallback.
+struct Done {
+  std::promise<Result<void>> promise;
+
+  AsyncOperationRunner::DoneCallback Callback() {
+    return [this](int64_t, const Result<void>& result) {
+      if (result.ok()) {
+        promise.set_value({});
+      } else {
+        promise.set_value(result.error());
+      }
+    };
+  }
+
+  Result<void> Wait() { return promise.get_future().get(); }
+};
+
+TEST(AsyncOperationRunnerTest, RunsStepsInOrderAndReportsProgress) {
+  AsyncOperationRunner runner(2);
+  std::vector<int> order;
+  std::vector<size_t> progress;
+  std::vector<Step> steps;
+  for (int i = 0; i < 3; i++) {
+    steps.push_back([&order, i]() -> Result<void> {
+      order.push_back(i);
+      return {};
+    });
+  }
+  Done done;
+
+  runner.Submit(
+      0, std::move(steps),
+      [&progress](int64_t, size_t completed, size_t total) {
+        ASSERT_EQ(3u, total);
+        progress.push_back(completed);
+      },
+      done.Callback());
+
+  ASSERT_THAT(done.Wait(), Ok());
+  ASSERT_THAT(order, ElementsAre(0, 1, 2));
+  ASSERT_THAT(progress, ElementsAre(1, 2, 3));
+}
+
+TEST(AsyncOperationRunnerTest, StopsAtFirstFailure) {
+  AsyncOperationRunner runner(1);
+  bool ran_after_failure = false;
+  auto result = runner.Run(
+      0, {[]() -> Result<void> { return Error() << "boom"; },
+          [&]() -> Result<void> {
+            ran_after_failure = true;
+            return {};
+          }});
+
+  ASSERT_THAT(result, HasError(WithMessage(HasSubstr("boom"))));
+  ASSERT_FALSE(ran_after_failure);
+}
+
+TEST(AsyncOperationRunnerTest, OperationsWithSameKeyRunInOrder) {
+  AsyncOperationRunner runner(4);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  std::mutex mutex;
+  std::vector<int> order;
+  auto record = [&](int i) {
+    std::lock_guard lock(mutex);
+    order.push_back(i);
+  };
+  Done first;
+  Done second;
+
+  runner.Submit(
+      7,
+      {[&]() -> Result<void> {
+        released.wait();
+        record(1);
+        return {};
+      }},
+      nullptr, first.Callback());
+  runner.Submit(
+      7,
+      {[&]() -> Result<void> {
+        record(2);
+        return {};
+      }},
+      nullptr, second.Callback());
+  // An operation with another key isn't held up.
+  ASSERT_THAT(runner.Run(8, {[&]() -> Result<void> {
+                record(3);
+                return {};
+              }}),
+              Ok());
+  release.set_value();
+
+  ASSERT_THAT(first.Wait(), Ok());
+  ASSERT_THAT(second.Wait(), Ok());
+  ASSERT_THAT(order, ElementsAre(3, 1, 2));
+}
+
+TEST(AsyncOperationRunnerTest, RunDoesNotWaitForBusyWorkers) {
+  AsyncOperationRunner runner(1);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  Done blocker;
+
+  // The only worker is busy with another key.
+  runner.Submit(
+      1,
+      {[&]() -> Result<void> {
+        released.wait();
+        return {};
+      }},
+      nullptr, blocker.Callback());
+
+  bool ran = false;
+  ASSERT_THAT(runner.Run(2, {[&]() -> Result<void> {
+                ran = true;
+                return {};
+              }}),
+              Ok());
+  ASSERT_TRUE(ran);
+
+  release.set_value();
+  ASSERT_THAT(blocker.Wait(), Ok());
+}
+
+TEST(AsyncOperationRunnerTest, RunKeepsOrderWithSameKey) {
+  AsyncOperationRunner runner(2);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  std::mutex mutex;
+  std::vector<int> order;
+  auto record = [&](int i) {
+    std::lock_guard lock(mutex);
+    order.push_back(i);
+  };
+  Done first;
+  Done third;
+
+  runner.Submit(
+      7,
+      {[&]() -> Result<void> {
+        released.wait();
+        record(1);
+        return {};
+      }},
+      nullptr, first.Callback());
+  auto second = std::async(std::launch::async, [&]() {
+    return runner.Run(7, {[&]() -> Result<void> {
+      // Submitted while this call runs, so it has to wait for it.
+      runner.Submit(
+          7,
+          {[&]() -> Result<void> {
+            record(3);
+            return {};
+          }},
+          nullptr, third.Callback());
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      record(2);
+      return {};
+    }});
+  });
+  release.set_value();
+
+  ASSERT_THAT(first.Wait(), Ok());
+  ASSERT_THAT(second.get(), Ok());
+  ASSERT_THAT(third.Wait(), Ok());
+  ASSERT_THAT(order, ElementsAre(1, 2, 3));
+}
+
+TEST(AsyncOperationRunnerTest, CancelPendingOperation) {
+  AsyncOperationRunner runner(1);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  bool ran = false;
+  Done blocker;
+  Done cancelled;
+
+  runner.Submit(
+      0,
+      {[&]() -> Result<void> {
+        released.wait();
+        return {};
+      }},
+      nullptr, blocker.Callback());
+  int64_t token = runner.Submit(
+      0,
+      {[&]() -> Result<void> {
+        ran = true;
+        return {};
+      }},
+      nullptr, cancelled.Callback());
+
+  ASSERT_TRUE(runner.Cancel(token));
+  ASSERT_THAT(cancelled.Wait(),
+              HasError(WithMessage(HasSubstr("was cancelled"))));
+  release.set_value();
+  ASSERT_THAT(blocker.Wait(), Ok());
+  ASSERT_FALSE(ran);
+  ASSERT_FALSE(runner.Cancel(token));
+}
+
+TEST(AsyncOperationRunnerTest, CancelRunningOperationSkipsRemainingSteps) {
+  AsyncOperationRunner runner(1);
+  std::promise<void> started;
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  bool ran_second_step = false;
+  Done done;
+
+  int64_t token = runner.Submit(
+      0,
+      {[&]() -> Result<void> {
+         started.set_value();
+         released.wait();
+         return {};
+       },
+       [&]() -> Result<void> {
+         ran_second_step = true;
+         return {};
+       }},
+      nullptr, done.Callback());
+  started.get_future().wait();
+
+  ASSERT_TRUE(runner.Cancel(token));
+  release.set_value();
+
+  ASSERT_THAT(done.Wait(), HasError(WithMessage(HasSubstr("was cancelled"))));
+  ASSERT_FALSE(ran_second_step);
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
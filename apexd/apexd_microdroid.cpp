@@ -36,6 +36,8 @@ static const android::apex::ApexdConfig kMicrodroidConfig = {
     nullptr, /* staged_session_dir */
     android::apex::kVmPayloadMetadataPartitionProp,
     nullptr, /* active_apex_selinux_ctx */
+    nullptr, /* activation_plan_path */
+    nullptr, /* mounted_apex_database_path */
 };
 
 int main(int /*argc*/, char** argv) {
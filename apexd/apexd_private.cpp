@@ -16,16 +16,36 @@
 
 #include "apexd_private.h"
 
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <android-base/logging.h>
 #include <android-base/macros.h>
+#include <android-base/unique_fd.h>
 
 #include "string_log.h"
 
 using android::base::ErrnoError;
 using android::base::Result;
+using android::base::unique_fd;
+
+// From <linux/mount.h>, which clashes with <sys/mount.h> on some libcs.
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+// Added in Linux 6.5.
+#ifndef MOVE_MOUNT_BENEATH
+#define MOVE_MOUNT_BENEATH 0x00000200
+#endif
 
 namespace android {
 namespace apex {
@@ -88,6 +108,60 @@ Result<void> BindMount(const std::string& target, const std::string& source) {
   return ErrnoError() << "Could not bind-mount " << source << " to " << target;
 }
 
+Result<void> SwapBindMount(const std::string& target,
+                          const std::string& source) {
+  LOG(VERBOSE) << "Replacing bind-mount at " << target << " with " << source;
+  unique_fd tree(static_cast<int>(
+      syscall(__NR_open_tree, AT_FDCWD, source.c_str(),
+              OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC)));
+  if (tree.get() != -1 &&
+      syscall(__NR_move_mount, tree.get(), "", AT_FDCWD, target.c_str(),
+              MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_BENEATH) == 0) {
+    // |source| is tucked beneath the current bind-mount: lookups switch over
+    // to it as soon as the current one is detached.
+    if (umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0) {
+      Result<void> error = ErrnoError()
+                           << "Could not detach old bind-mount at " << target;
+      // Don't leave |source| hidden beneath the old bind-mount. |tree| still
+      // refers to it, so detach it through its magic link.
+      std::string tree_path = "/proc/self/fd/" + std::to_string(tree.get());
+      if (umount2(tree_path.c_str(), MNT_DETACH) != 0) {
+        PLOG(ERROR) << "Could not detach " << source << " beneath " << target;
+      }
+      return error;
+    }
+    return {};
+  }
+  PLOG(DEBUG) << "Could not mount " << source << " beneath " << target
+              << ", replacing it non-atomically";
+  // Without MOVE_MOUNT_BENEATH there's no way to swap the mount in place:
+  // mounting |source| on top would keep the old bind-mount, and with it the
+  // old APEX, alive underneath. So |target| is empty from the detach below
+  // until |source| is bind-mounted, and lookups in that window see an empty
+  // directory.
+  // Keep a copy of the current bind-mount to put back if |source| can't be
+  // mounted, rather than leaving |target| empty.
+  unique_fd old_tree(static_cast<int>(
+      syscall(__NR_open_tree, AT_FDCWD, target.c_str(),
+              OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC)));
+  bool detached = umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) == 0;
+  if (!detached && errno != EINVAL) {
+    return ErrnoError() << "Could not detach old bind-mount at " << target;
+  }
+  if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) != 0) {
+    Result<void> error = ErrnoError() << "Could not bind-mount " << source
+                                      << " to " << target;
+    if (detached &&
+        (old_tree.get() == -1 ||
+         syscall(__NR_move_mount, old_tree.get(), "", AT_FDCWD, target.c_str(),
+                 MOVE_MOUNT_F_EMPTY_PATH) != 0)) {
+      PLOG(ERROR) << "Could not restore old bind-mount at " << target;
+    }
+    return error;
+  }
+  return {};
+}
+
 }  // namespace apexd_private
 }  // namespace apex
 }  // namespace android
@@ -40,6 +40,15 @@ std::string GetActiveMountPoint(const ::apex::proto::ApexManifest& manifest);
 
 android::base::Result<void> BindMount(const std::string& target,
                                       const std::string& source);
+// Replaces the bind-mount at |target| with a bind-mount of |source|. On
+// failure |target| is left with the old bind-mount.
+//
+// The replacement is atomic only on kernels with MOVE_MOUNT_BENEATH (Linux
+// 6.5 and later). Older kernels fall back to detaching the old bind-mount
+// and then bind-mounting |source|: in between, |target| is an empty
+// directory, and lookups through it fail with ENOENT.
+android::base::Result<void> SwapBindMount(const std::string& target,
+                                          const std::string& source);
 android::base::Result<MountedApexDatabase::MountedApexData>
 GetTempMountedApexData(const std::string& package);
 android::base::Result<void> UnmountTempMount(const ApexFile& apex);
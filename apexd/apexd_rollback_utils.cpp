@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_rollback_utils.h"
+
+#include <android-base/unique_fd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "apexd_utils.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+using android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+Result<void> ListTreeImpl(const std::string& from, const std::string& to,
+                          const struct stat& st, Tree* tree) {
+  tree->dirs.push_back({from, to, st});
+
+  std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(from.c_str()), closedir);
+  if (!dir) {
+    return ErrnoError() << "Can't open " << from;
+  }
+  for (errno = 0; struct dirent* entry = readdir(dir.get()); errno = 0) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    std::string child_from = from + "/" + name;
+    std::string child_to = to + "/" + name;
+    struct stat child_st;
+    if (lstat(child_from.c_str(), &child_st) != 0) {
+      return ErrnoError() << "Can't stat " << child_from;
+    }
+    if (S_ISDIR(child_st.st_mode)) {
+      OR_RETURN(ListTreeImpl(child_from, child_to, child_st, tree));
+    } else {
+      tree->files.push_back({child_from, child_to, child_st});
+    }
+  }
+  if (errno != 0) {
+    return ErrnoError() << "Can't read " << from;
+  }
+  return {};
+}
+
+// Copies the extended attributes of |entry|. Uses the descriptors when given,
+// and otherwise the paths, without following symlinks.
+Result<void> CopyXattrs(const TreeEntry& entry, int from_fd, int to_fd) {
+  auto list = [&](char* buf, size_t size) {
+    return from_fd >= 0 ? flistxattr(from_fd, buf, size)
+                        : llistxattr(entry.from.c_str(), buf, size);
+  };
+  ssize_t size = list(nullptr, 0);
+  if (size < 0) {
+    if (errno == ENOTSUP) {
+      return {};
+    }
+    return ErrnoError() << "Can't list xattrs of " << entry.from;
+  }
+  std::string names(size, '\0');
+  size = list(names.data(), names.size());
+  if (size < 0) {
+    return ErrnoError() << "Can't list xattrs of " << entry.from;
+  }
+  names.resize(size);
+
+  for (size_t pos = 0; pos < names.size(); pos = names.find('\0', pos) + 1) {
+    const char* name = names.c_str() + pos;
+    auto get = [&](void* buf, size_t buf_size) {
+      return from_fd >= 0
+                 ? fgetxattr(from_fd, name, buf, buf_size)
+                 : lgetxattr(entry.from.c_str(), name, buf, buf_size);
+    };
+    ssize_t value_size = get(nullptr, 0);
+    if (value_size < 0) {
+      return ErrnoError() << "Can't read xattr " << name << " of "
+                          << entry.from;
+    }
+    std::string value(value_size, '\0');
+    value_size = get(value.data(), value.size());
+    if (value_size < 0) {
+      return ErrnoError() << "Can't read xattr " << name << " of "
+                          << entry.from;
+    }
+    int ret = to_fd >= 0 ? fsetxattr(to_fd, name, value.data(), value_size, 0)
+                         : lsetxattr(entry.to.c_str(), name, value.data(),
+                                     value_size, 0);
+    if (ret != 0 && errno != ENOTSUP) {
+      return ErrnoError() << "Can't set xattr " << name << " on " << entry.to;
+    }
+  }
+  return {};
+}
+
+// Applies ownership, mode, xattrs and timestamps of |entry| to the node
+// created at entry.to. |to_fd| is -1 for nodes that can't be opened.
+Result<void> CopyMetadata(const TreeEntry& entry, int from_fd, int to_fd) {
+  const struct stat& st = entry.st;
+  const struct timespec times[2] = {st.st_atim, st.st_mtim};
+  if (to_fd >= 0) {
+    if (fchown(to_fd, st.st_uid, st.st_gid) != 0) {
+      return ErrnoError() << "Can't chown " << entry.to;
+    }
+    if (fchmod(to_fd, st.st_mode & ALLPERMS) != 0) {
+      return ErrnoError() << "Can't chmod " << entry.to;
+    }
+    OR_RETURN(CopyXattrs(entry, from_fd, to_fd));
+    if (futimens(to_fd, times) != 0) {
+      return ErrnoError() << "Can't set timestamps of " << entry.to;
+    }
+    return {};
+  }
+
+  if (lchown(entry.to.c_str(), st.st_uid, st.st_gid) != 0) {
+    return ErrnoError() << "Can't chown " << entry.to;
+  }
+  if (!S_ISLNK(st.st_mode) &&
+      fchmodat(AT_FDCWD, entry.to.c_str(), st.st_mode & ALLPERMS, 0) != 0) {
+    return ErrnoError() << "Can't chmod " << entry.to;
+  }
+  OR_RETURN(CopyXattrs(entry, -1, -1));
+  if (utimensat(AT_FDCWD, entry.to.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+    return ErrnoError() << "Can't set timestamps of " << entry.to;
+  }
+  return {};
+}
+
+// Copies the contents of |from_fd| to |to_fd|, cheapest method first: a
+// reflink shares the extents, copy_file_range stays in the kernel (and may
+// itself reflink), and read/write is the last resort.
+Result<void> CopyContents(const TreeEntry& entry, int from_fd, int to_fd) {
+  if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+    return {};
+  }
+
+  off_t remaining = entry.st.st_size;
+  while (remaining > 0) {
+    ssize_t copied =
+        copy_file_range(from_fd, nullptr, to_fd, nullptr, remaining, 0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      break;
+    }
+    remaining -= copied;
+  }
+  if (remaining <= 0) {
+    return {};
+  }
+
+  // Fall back to a plain copy of whatever copy_file_range didn't transfer.
+  off_t offset = entry.st.st_size - remaining;
+  std::vector<char> buf(128 * 1024);
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(pread(from_fd, buf.data(), buf.size(),
+                                         offset));
+    if (n < 0) {
+      return ErrnoError() << "Can't read " << entry.from;
+    }
+    if (n == 0) {
+      return {};
+    }
+    for (ssize_t written = 0; written < n;) {
+      ssize_t w = TEMP_FAILURE_RETRY(
+          pwrite(to_fd, buf.data() + written, n - written, offset + written));
+      if (w < 0) {
+        return ErrnoError() << "Can't write " << entry.to;
+      }
+      written += w;
+    }
+    offset += n;
+  }
+}
+
+}  // namespace
+
+Result<Tree> ListTree(const std::string& from_path,
+                      const std::string& to_path) {
+  struct stat st;
+  if (lstat(from_path.c_str(), &st) != 0) {
+    return ErrnoError() << "Can't stat " << from_path;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return Error() << from_path << " is not a directory";
+  }
+  Tree tree;
+  OR_RETURN(ListTreeImpl(from_path, to_path, st, &tree));
+  return tree;
+}
+
+Result<void> CopyNode(const TreeEntry& entry) {
+  const mode_t mode = entry.st.st_mode;
+  if (S_ISREG(mode)) {
+    unique_fd from_fd(TEMP_FAILURE_RETRY(
+        open(entry.from.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW)));
+    if (from_fd.get() == -1) {
+      return ErrnoError() << "Can't open " << entry.from;
+    }
+    unique_fd to_fd(TEMP_FAILURE_RETRY(
+        open(entry.to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)));
+    if (to_fd.get() == -1) {
+      return ErrnoError() << "Can't create " << entry.to;
+    }
+    OR_RETURN(CopyContents(entry, from_fd.get(), to_fd.get()));
+    return CopyMetadata(entry, from_fd.get(), to_fd.get());
+  }
+
+  if (S_ISLNK(mode)) {
+    std::string target(entry.st.st_size + 1, '\0');
+    ssize_t size = readlink(entry.from.c_str(), target.data(), target.size());
+    if (size < 0) {
+      return ErrnoError() << "Can't read link " << entry.from;
+    }
+    target.resize(size);
+    if (symlink(target.c_str(), entry.to.c_str()) != 0) {
+      return ErrnoError() << "Can't create link " << entry.to;
+    }
+  } else if (mknod(entry.to.c_str(), mode & ~ALLPERMS, entry.st.st_rdev) !=
+             0) {
+    return ErrnoError() << "Can't create " << entry.to;
+  }
+  return CopyMetadata(entry, -1, -1);
+}
+
+Result<void> CopyDirMetadata(const TreeEntry& entry) {
+  unique_fd from_fd(TEMP_FAILURE_RETRY(
+      open(entry.from.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+  if (from_fd.get() == -1) {
+    return ErrnoError() << "Can't open " << entry.from;
+  }
+  unique_fd to_fd(TEMP_FAILURE_RETRY(
+      open(entry.to.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+  if (to_fd.get() == -1) {
+    return ErrnoError() << "Can't open " << entry.to;
+  }
+  return CopyMetadata(entry, from_fd.get(), to_fd.get());
+}
+
+}  // namespace apex
+}  // namespace android
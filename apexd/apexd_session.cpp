@@ -17,14 +17,27 @@
 #include "apexd_session.h"
 
 #include <android-base/errors.h>
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <thread>
 #include <utility>
 
 #include "apexd_utils.h"
@@ -32,8 +45,11 @@
 #include "string_log.h"
 
 using android::base::Error;
+using android::base::ErrnoError;
 using android::base::Result;
 using android::base::StringPrintf;
+using android::base::unique_fd;
+using android::base::WriteFully;
 using apex::proto::SessionState;
 
 namespace android {
@@ -42,6 +58,15 @@ namespace apex {
 namespace {
 
 static constexpr const char* kStateFileName = "state";
+static constexpr const char* kJournalFileName = "journal";
+
+// Every journal record starts with it, to tell records from garbage.
+static constexpr uint32_t kJournalRecordMagic = 0x4a534541;  // "AESJ"
+// Size of a record which marks its session as deleted.
+static constexpr uint32_t kDeletedRecordSize = UINT32_MAX;
+// Once the journal has that many records, they are written to the state files
+// of their sessions and the journal starts over.
+static constexpr size_t kMaxJournalRecords = 64;
 
 static Result<SessionState> ParseSessionState(const std::string& session_dir) {
   auto path = StringPrintf("%s/%s", session_dir.c_str(), kStateFileName);
@@ -58,8 +83,576 @@ static Result<SessionState> ParseSessionState(const std::string& session_dir) {
   return std::move(state);
 }
 
+// Writes |state| to the state file in |session_dir|. The file is replaced
+// atomically, but not synced: callers sync the whole file system once after
+// writing all state files they need.
+Result<void> WriteSessionState(const std::string& session_dir,
+                               const SessionState& state) {
+  auto path = StringPrintf("%s/%s", session_dir.c_str(), kStateFileName);
+  auto tmp_path = path + ".tmp";
+  {
+    std::fstream state_file(tmp_path,
+                            std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!state.SerializeToOstream(&state_file)) {
+      return Error() << "Failed to write state file " << tmp_path;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
+// State transition of a session, as stored in the journal. Deleted sessions
+// have no state.
+struct JournalRecord {
+  int session_id;
+  std::optional<SessionState> state;
+};
+
+// The journal of a sessions directory is a sequence of records:
+//
+//   uint32_t magic          kJournalRecordMagic
+//   int32_t session_id
+//   uint32_t size           size of the state, or kDeletedRecordSize
+//   uint32_t checksum       CRC-32 of the fields above and of the state
+//   SessionState state      serialized, |size| bytes
+//
+// Records carry the complete state of their session, so that replaying a
+// record more than once doesn't matter. Records are only ever appended; a
+// record torn by a power loss during an append is found by its checksum and
+// ignored, together with anything that follows it.
+struct JournalRecordHeader {
+  uint32_t magic;
+  int32_t session_id;
+  uint32_t size;
+  uint32_t checksum;
+};
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t size) {
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+    }
+  }
+  return ~crc;
+}
+
+uint32_t RecordChecksum(const JournalRecordHeader& header, const char* state,
+                        size_t state_size) {
+  uint32_t crc = Crc32(0, &header, offsetof(JournalRecordHeader, checksum));
+  return Crc32(crc, state, state_size);
+}
+
+std::string GetJournalPath(const std::string& sessions_base_dir) {
+  return sessions_base_dir + "/" + kJournalFileName;
+}
+
+// Appends |records| to the journal of |sessions_base_dir| with a single write
+// and a single fsync.
+Result<void> AppendToJournal(const std::string& sessions_base_dir,
+                             const std::vector<JournalRecord>& records) {
+  std::string data;
+  for (const auto& record : records) {
+    std::string state;
+    if (record.state.has_value() && !record.state->SerializeToString(&state)) {
+      return Error() << "Failed to serialize state of session "
+                     << record.session_id;
+    }
+    JournalRecordHeader header{
+        .magic = kJournalRecordMagic,
+        .session_id = record.session_id,
+        .size = record.state.has_value() ? static_cast<uint32_t>(state.size())
+                                         : kDeletedRecordSize,
+        .checksum = 0,
+    };
+    header.checksum = RecordChecksum(header, state.data(), state.size());
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(state);
+  }
+
+  auto path = GetJournalPath(sessions_base_dir);
+  bool created = false;
+  unique_fd fd(
+      TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)));
+  if (fd.get() == -1 && errno == ENOENT) {
+    fd.reset(TEMP_FAILURE_RETRY(
+        open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)));
+    created = true;
+  }
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+  if (!WriteFully(fd, data.data(), data.size()) || fsync(fd.get()) != 0) {
+    int saved_errno = errno;
+    // Don't leave a partial record behind: it would hide all the records
+    // appended after it.
+    if (ftruncate(fd.get(), st.st_size) != 0) {
+      PLOG(ERROR) << "Failed to truncate " << path;
+    }
+    errno = saved_errno;
+    return ErrnoError() << "Failed to append to " << path;
+  }
+  if (created) {
+    // The records are only durable once the journal's directory entry is.
+    unique_fd dir_fd(TEMP_FAILURE_RETRY(open(
+        sessions_base_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+    if (dir_fd.get() == -1 || fsync(dir_fd.get()) != 0) {
+      return ErrnoError() << "Failed to sync " << sessions_base_dir;
+    }
+  }
+  return {};
+}
+
+// Reads the records of the journal of |sessions_base_dir|, up to the first
+// one that is torn or corrupt.
+std::vector<JournalRecord> ReadJournal(const std::string& sessions_base_dir) {
+  auto path = GetJournalPath(sessions_base_dir);
+  std::string data;
+  if (!android::base::ReadFileToString(path, &data)) {
+    if (errno != ENOENT) {
+      PLOG(WARNING) << "Failed to read " << path;
+    }
+    return {};
+  }
+
+  std::vector<JournalRecord> records;
+  size_t pos = 0;
+  while (data.size() - pos >= sizeof(JournalRecordHeader)) {
+    JournalRecordHeader header;
+    memcpy(&header, data.data() + pos, sizeof(header));
+    bool deleted = header.size == kDeletedRecordSize;
+    size_t state_size = deleted ? 0 : header.size;
+    const char* state_data = data.data() + pos + sizeof(header);
+    if (header.magic != kJournalRecordMagic ||
+        data.size() - pos - sizeof(header) < state_size ||
+        header.checksum != RecordChecksum(header, state_data, state_size)) {
+      break;
+    }
+    JournalRecord record{.session_id = header.session_id, .state = {}};
+    if (!deleted) {
+      SessionState state;
+      if (!state.ParseFromArray(state_data, static_cast<int>(state_size))) {
+        break;
+      }
+      record.state = std::move(state);
+    }
+    records.push_back(std::move(record));
+    pos += sizeof(header) + state_size;
+  }
+  if (pos != data.size()) {
+    LOG(WARNING) << "Ignoring " << (data.size() - pos)
+                 << " bytes of torn or corrupt records at the end of " << path;
+  }
+  return records;
+}
+
 }  // namespace
 
+// In-memory index of the sessions stored in a sessions directory, by id and by
+// state. Only committed sessions are listed.
+//
+// Committed states and deletions are appended to the journal of the sessions
+// directory, which takes a single fsync for any number of them when they are
+// batched. The journal is folded into the state files of the sessions, and
+// then removed, once it has grown long enough and whenever sessions are read
+// from disk (e.g. on boot, which replays the journal left by the previous
+// boot).
+class ApexSessionCache
+    : public std::enable_shared_from_this<ApexSessionCache> {
+ public:
+  explicit ApexSessionCache(std::string sessions_base_dir)
+      : sessions_base_dir_(std::move(sessions_base_dir)) {}
+
+  std::optional<ApexSession> Get(int session_id) {
+    std::lock_guard lock(mutex_);
+    LoadIfNeeded();
+    auto it = sessions_.find(session_id);
+    if (it == sessions_.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  std::vector<ApexSession> GetAll() {
+    std::lock_guard lock(mutex_);
+    LoadIfNeeded();
+    std::vector<ApexSession> sessions;
+    sessions.reserve(sessions_.size());
+    for (const auto& [id, session] : sessions_) {
+      sessions.push_back(session);
+    }
+    return sessions;
+  }
+
+  std::vector<ApexSession> GetInState(SessionState::State state) {
+    std::lock_guard lock(mutex_);
+    LoadIfNeeded();
+    std::vector<ApexSession> sessions;
+    auto it = by_state_.find(state);
+    if (it == by_state_.end()) {
+      return sessions;
+    }
+    for (int id : it->second) {
+      sessions.push_back(sessions_.at(id));
+    }
+    return sessions;
+  }
+
+  // Persists the state of |session|. Within a batch of the calling thread,
+  // this only happens when the batch is flushed; the index is updated right
+  // away either way.
+  Result<void> Commit(const ApexSession& session) {
+    std::lock_guard lock(mutex_);
+    if (loaded_) {
+      RemoveLocked(session.GetId());
+      sessions_.emplace(session.GetId(), session);
+      by_state_[session.GetState()].insert(session.GetId());
+    }
+    return AppendLocked(JournalRecord{session.GetId(), session.state_});
+  }
+
+  // Persists the deletion of |session_id|, whose directory has just been
+  // removed.
+  Result<void> Delete(int session_id) {
+    std::lock_guard lock(mutex_);
+    RemoveLocked(session_id);
+    return AppendLocked(JournalRecord{session_id, std::nullopt});
+  }
+
+  // Starts batching the commits of |thread|.
+  void BeginBatch(std::thread::id thread) {
+    std::lock_guard lock(mutex_);
+    batches_[thread].depth++;
+  }
+
+  // Persists what |thread| committed so far within its batch.
+  Result<void> Flush(std::thread::id thread) {
+    std::lock_guard lock(mutex_);
+    return FlushLocked(thread);
+  }
+
+  Result<void> EndBatch(std::thread::id thread) {
+    std::lock_guard lock(mutex_);
+    auto it = batches_.find(thread);
+    if (it == batches_.end() || --it->second.depth > 0) {
+      return {};
+    }
+    auto status = FlushLocked(thread);
+    batches_.erase(thread);
+    return status;
+  }
+
+  // Folds the journal of |sessions_base_dir| into the state files of its
+  // sessions, and removes it.
+  static Result<void> CompactJournal(const std::string& sessions_base_dir) {
+    auto cache = std::make_shared<ApexSessionCache>(sessions_base_dir);
+    std::lock_guard lock(cache->mutex_);
+    // Loading compacts the journal as well, but only logs failures.
+    cache->LoadIfNeeded();
+    return cache->CompactLocked();
+  }
+
+  // Called after a session directory was created, so that it doesn't cause
+  // all sessions to be read again.
+  void RefreshStamp() {
+    std::lock_guard lock(mutex_);
+    RefreshStampLocked();
+  }
+
+  void Invalidate() {
+    std::lock_guard lock(mutex_);
+    loaded_ = false;
+    sessions_.clear();
+    by_state_.clear();
+  }
+
+  struct DiskSessions {
+    std::map<int, ApexSession> sessions;
+    // Sessions which have records in the journal.
+    std::set<int> journal_ids;
+    size_t journal_records = 0;
+  };
+
+  // Reads the sessions of |sessions_base_dir|: the state files, and then the
+  // journal on top of them. Sessions whose directory is gone are skipped, no
+  // matter what the journal says about them.
+  static DiskSessions ReadSessions(const std::string& sessions_base_dir,
+                                   std::weak_ptr<ApexSessionCache> cache) {
+    DiskSessions result;
+    auto walk_status = WalkDir(sessions_base_dir, [&](const auto& entry) {
+      if (!entry.is_directory()) {
+        return;
+      }
+      std::string session_dir = entry.path();
+      auto state = ParseSessionState(session_dir);
+      if (!state.ok()) {
+        // Sessions which were never compacted only live in the journal.
+        if (!IsStateFileMissing(session_dir)) {
+          LOG(WARNING) << state.error();
+        }
+        return;
+      }
+      int id = state->id();
+      result.sessions.insert_or_assign(
+          id, ApexSession(std::move(*state), std::move(session_dir), cache));
+    });
+    if (!walk_status.ok()) {
+      LOG(WARNING) << walk_status.error();
+    }
+
+    auto records = ReadJournal(sessions_base_dir);
+    result.journal_records = records.size();
+    for (auto& record : records) {
+      result.journal_ids.insert(record.session_id);
+      ApplyRecord(sessions_base_dir, std::move(record), cache,
+                  &result.sessions);
+    }
+    return result;
+  }
+
+ private:
+  // Identifies which session directories exist and what the journal holds.
+  // Changes when sessions are created, committed or deleted, also by other
+  // processes.
+  struct DirStamp {
+    ino_t ino;
+    nlink_t nlink;
+    struct timespec mtime;
+    ino_t journal_ino;
+    off_t journal_size;
+    struct timespec journal_mtime;
+
+    bool operator==(const DirStamp& other) const {
+      return ino == other.ino && nlink == other.nlink &&
+             mtime.tv_sec == other.mtime.tv_sec &&
+             mtime.tv_nsec == other.mtime.tv_nsec &&
+             journal_ino == other.journal_ino &&
+             journal_size == other.journal_size &&
+             journal_mtime.tv_sec == other.journal_mtime.tv_sec &&
+             journal_mtime.tv_nsec == other.journal_mtime.tv_nsec;
+    }
+  };
+
+  std::optional<DirStamp> GetDirStamp() const {
+    struct stat st;
+    if (stat(sessions_base_dir_.c_str(), &st) != 0) {
+      return std::nullopt;
+    }
+    DirStamp stamp{st.st_ino, st.st_nlink, st.st_mtim, 0, 0, {}};
+    if (stat(GetJournalPath(sessions_base_dir_).c_str(), &st) == 0) {
+      stamp.journal_ino = st.st_ino;
+      stamp.journal_size = st.st_size;
+      stamp.journal_mtime = st.st_mtim;
+    }
+    return stamp;
+  }
+
+  static bool IsStateFileMissing(const std::string& session_dir) {
+    struct stat st;
+    return stat((session_dir + "/" + kStateFileName).c_str(), &st) != 0 &&
+           errno == ENOENT;
+  }
+
+  static void ApplyRecord(const std::string& sessions_base_dir,
+                          JournalRecord record,
+                          std::weak_ptr<ApexSessionCache> cache,
+                          std::map<int, ApexSession>* sessions) {
+    if (!record.state.has_value()) {
+      sessions->erase(record.session_id);
+      return;
+    }
+    auto session_dir =
+        StringPrintf("%s/%d", sessions_base_dir.c_str(), record.session_id);
+    std::error_code ec;
+    if (!std::filesystem::is_directory(session_dir, ec)) {
+      return;
+    }
+    sessions->insert_or_assign(
+        record.session_id, ApexSession(std::move(*record.state),
+                                       std::move(session_dir), cache));
+  }
+
+  void LoadIfNeeded() REQUIRES(mutex_) {
+    // Sessions created, committed or deleted behind our back (e.g. by tests
+    // staging sessions directly on disk) change the stamp. Checking it is two
+    // stat() calls, unlike reading all the sessions again.
+    auto stamp = GetDirStamp();
+    if (loaded_ && stamp == stamp_) {
+      return;
+    }
+    auto disk = ReadSessions(sessions_base_dir_, weak_from_this());
+    sessions_ = std::move(disk.sessions);
+    journal_records_ = disk.journal_records;
+    dirty_ids_.insert(disk.journal_ids.begin(), disk.journal_ids.end());
+    loaded_ = true;
+    stamp_ = stamp;
+
+    if (journal_records_ > 0) {
+      if (auto status = CompactLocked(); !status.ok()) {
+        LOG(WARNING) << "Failed to compact session journal: "
+                     << status.error();
+      }
+    }
+
+    // Commits of ongoing batches aren't on disk yet. Applied after the
+    // compaction, so that it only writes what was persisted already.
+    for (const auto& [thread, batch] : batches_) {
+      for (const auto& record : batch.pending) {
+        ApplyRecord(sessions_base_dir_, record, weak_from_this(), &sessions_);
+      }
+    }
+    by_state_.clear();
+    for (const auto& [id, session] : sessions_) {
+      by_state_[session.GetState()].insert(id);
+    }
+  }
+
+  Result<void> AppendLocked(JournalRecord record) REQUIRES(mutex_) {
+    // Records carry the complete state of their session: a pending record of
+    // the same session, in any batch, is superseded and must not be written
+    // after this one.
+    for (auto& [thread, batch] : batches_) {
+      std::erase_if(batch.pending, [&](const JournalRecord& pending) {
+        return pending.session_id == record.session_id;
+      });
+    }
+    auto it = batches_.find(std::this_thread::get_id());
+    if (it != batches_.end()) {
+      it->second.pending.push_back(std::move(record));
+      return {};
+    }
+    // Not within a batch of this thread: persist right away.
+    std::vector<JournalRecord> records;
+    records.push_back(std::move(record));
+    return WriteLocked(std::move(records));
+  }
+
+  Result<void> FlushLocked(std::thread::id thread) REQUIRES(mutex_) {
+    auto it = batches_.find(thread);
+    if (it == batches_.end() || it->second.pending.empty()) {
+      return {};
+    }
+    auto records = std::move(it->second.pending);
+    it->second.pending.clear();
+    return WriteLocked(std::move(records));
+  }
+
+  bool HasPendingLocked() const REQUIRES(mutex_) {
+    return std::any_of(batches_.begin(), batches_.end(), [](const auto& entry) {
+      return !entry.second.pending.empty();
+    });
+  }
+
+  Result<void> WriteLocked(std::vector<JournalRecord> records)
+      REQUIRES(mutex_) {
+    if (auto status = AppendToJournal(sessions_base_dir_, records);
+        !status.ok()) {
+      // The index has states which didn't make it to disk.
+      loaded_ = false;
+      sessions_.clear();
+      by_state_.clear();
+      return status.error();
+    }
+    for (const auto& record : records) {
+      dirty_ids_.insert(record.session_id);
+    }
+    journal_records_ += records.size();
+    RefreshStampLocked();
+
+    // Compaction writes the states of |sessions_|, which include the pending
+    // commits of other batches. It waits until none is left.
+    if (journal_records_ >= kMaxJournalRecords && !HasPendingLocked()) {
+      // Compaction needs the latest state of every session in the journal.
+      LoadIfNeeded();
+      if (auto status = CompactLocked(); !status.ok()) {
+        // Nothing is lost: the journal is still there.
+        LOG(WARNING) << "Failed to compact session journal: "
+                     << status.error();
+      }
+    }
+    return {};
+  }
+
+  // Writes the state of the sessions which have records in the journal to
+  // their state files, and removes the journal. Must not be called while
+  // |sessions_| has states which are only pending.
+  Result<void> CompactLocked() REQUIRES(mutex_) {
+    if (!loaded_ || journal_records_ == 0) {
+      return {};
+    }
+    for (int id : dirty_ids_) {
+      auto it = sessions_.find(id);
+      if (it == sessions_.end()) {
+        // Deleted.
+        continue;
+      }
+      OR_RETURN(WriteSessionState(it->second.GetSessionDir(),
+                                  it->second.state_));
+    }
+    // State files must be on disk before the journal goes away. A single
+    // syncfs() is much cheaper than an fsync() of every state file.
+    unique_fd dir_fd(
+        open(sessions_base_dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd.get() == -1) {
+      return ErrnoError() << "Failed to open " << sessions_base_dir_;
+    }
+    if (syncfs(dir_fd.get()) != 0) {
+      return ErrnoError() << "Failed to sync " << sessions_base_dir_;
+    }
+    auto journal_path = GetJournalPath(sessions_base_dir_);
+    if (unlink(journal_path.c_str()) != 0 && errno != ENOENT) {
+      return ErrnoError() << "Failed to remove " << journal_path;
+    }
+    LOG(DEBUG) << "Compacted " << journal_records_ << " journal records of "
+               << dirty_ids_.size() << " sessions";
+    journal_records_ = 0;
+    dirty_ids_.clear();
+    RefreshStampLocked();
+    return {};
+  }
+
+  void RefreshStampLocked() REQUIRES(mutex_) {
+    if (loaded_) {
+      stamp_ = GetDirStamp();
+    }
+  }
+
+  void RemoveLocked(int session_id) REQUIRES(mutex_) {
+    auto it = sessions_.find(session_id);
+    if (it == sessions_.end()) {
+      return;
+    }
+    by_state_[it->second.GetState()].erase(session_id);
+    sessions_.erase(it);
+  }
+
+  std::mutex mutex_;
+  const std::string sessions_base_dir_;
+  bool loaded_ GUARDED_BY(mutex_) = false;
+  std::optional<DirStamp> stamp_ GUARDED_BY(mutex_);
+  std::map<int, ApexSession> sessions_ GUARDED_BY(mutex_);
+  std::map<SessionState::State, std::set<int>> by_state_ GUARDED_BY(mutex_);
+  // Commits of a thread are batched while it has a batch open. Batches of
+  // other threads, and commits outside of any batch, are not held back.
+  struct Batch {
+    int depth = 0;
+    // Records committed within the batch, not yet appended to the journal.
+    std::vector<JournalRecord> pending;
+  };
+  std::map<std::thread::id, Batch> batches_ GUARDED_BY(mutex_);
+  // Number of records in the journal, and the sessions they are about.
+  size_t journal_records_ GUARDED_BY(mutex_) = 0;
+  std::set<int> dirty_ids_ GUARDED_BY(mutex_);
+};
+
 std::string GetSessionsDir() {
   static std::string result;
   static std::once_flag once_flag;
@@ -74,10 +667,15 @@ std::string GetSessionsDir() {
   return result;
 }
 
-ApexSession::ApexSession(SessionState state, std::string session_dir)
-    : state_(std::move(state)), session_dir_(std::move(session_dir)) {}
+ApexSession::ApexSession(SessionState state, std::string session_dir,
+                         std::weak_ptr<ApexSessionCache> cache)
+    : state_(std::move(state)),
+      session_dir_(std::move(session_dir)),
+      cache_(std::move(cache)) {}
 
 Result<void> ApexSession::MigrateToMetadataSessionsDir() {
+  // Only session directories are moved, not the journal.
+  OR_RETURN(ApexSessionCache::CompactJournal(kOldApexSessionsDir));
   return MoveDir(kOldApexSessionsDir, kNewApexSessionsDir);
 }
 
@@ -93,45 +691,23 @@ Result<ApexSession> ApexSession::CreateSession(int session_id) {
   return ApexSession(state, std::move(session_dir));
 }
 
-Result<ApexSession> ApexSession::GetSessionFromDir(
-    const std::string& session_dir) {
-  auto state = ParseSessionState(session_dir);
-  if (!state.ok()) {
-    return state.error();
-  }
-  return ApexSession(*state, session_dir);
-}
-
 Result<ApexSession> ApexSession::GetSession(int session_id) {
-  auto session_dir =
-      StringPrintf("%s/%d", GetSessionsDir().c_str(), session_id);
-
-  return GetSessionFromDir(session_dir);
+  auto disk = ApexSessionCache::ReadSessions(GetSessionsDir(), {});
+  auto it = disk.sessions.find(session_id);
+  if (it == disk.sessions.end()) {
+    return Error() << "Failed to find session " << session_id << " in "
+                   << GetSessionsDir();
+  }
+  return std::move(it->second);
 }
 
 std::vector<ApexSession> ApexSession::GetSessions() {
+  auto disk = ApexSessionCache::ReadSessions(GetSessionsDir(), {});
   std::vector<ApexSession> sessions;
-
-  Result<std::vector<std::string>> session_paths = ReadDir(
-      GetSessionsDir(), [](const std::filesystem::directory_entry& entry) {
-        std::error_code ec;
-        return entry.is_directory(ec);
-      });
-
-  if (!session_paths.ok()) {
-    return sessions;
-  }
-
-  for (const std::string& session_dir_path : *session_paths) {
-    // Try to read session state
-    auto session = GetSessionFromDir(session_dir_path);
-    if (!session.ok()) {
-      LOG(WARNING) << session.error();
-      continue;
-    }
-    sessions.push_back(std::move(*session));
+  sessions.reserve(disk.sessions.size());
+  for (auto& [id, session] : disk.sessions) {
+    sessions.push_back(std::move(session));
   }
-
   return sessions;
 }
 
@@ -198,6 +774,11 @@ ApexSession::GetApexNames() const {
   return state_.apex_names();
 }
 
+const google::protobuf::RepeatedPtrField<SessionState::VerifiedApex>&
+ApexSession::GetVerifiedApexes() const {
+  return state_.verified_apexes();
+}
+
 const std::string& ApexSession::GetSessionDir() const { return session_dir_; }
 
 void ApexSession::SetBuildFingerprint(const std::string& fingerprint) {
@@ -229,20 +810,21 @@ void ApexSession::AddApexName(const std::string& apex_name) {
   state_.add_apex_names(apex_name);
 }
 
+void ApexSession::AddVerifiedApex(
+    const SessionState::VerifiedApex& verified_apex) {
+  *state_.add_verified_apexes() = verified_apex;
+}
+
 Result<void> ApexSession::UpdateStateAndCommit(
     const SessionState::State& session_state) {
   state_.set_state(session_state);
 
-  auto state_file_path =
-      StringPrintf("%s/%s", session_dir_.c_str(), kStateFileName);
-
-  std::fstream state_file(state_file_path,
-                          std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!state_.SerializeToOstream(&state_file)) {
-    return Error() << "Failed to write state file " << state_file_path;
+  if (auto cache = cache_.lock(); cache != nullptr) {
+    return cache->Commit(*this);
   }
-
-  return {};
+  auto sessions_base_dir =
+      std::filesystem::path(session_dir_).parent_path().string();
+  return AppendToJournal(sessions_base_dir, {JournalRecord{GetId(), state_}});
 }
 
 Result<void> ApexSession::DeleteSession() const {
@@ -250,11 +832,26 @@ Result<void> ApexSession::DeleteSession() const {
   auto path = std::filesystem::path(session_dir_);
   std::error_code error_code;
   std::filesystem::remove_all(path, error_code);
+  auto cache = cache_.lock();
   if (error_code) {
+    if (cache != nullptr) {
+      // Don't know what is left on disk.
+      cache->Invalidate();
+    }
     return Error() << "Failed to delete " << session_dir_ << " : "
                    << error_code.message();
   }
-  return {};
+  // Records of the session in the journal are ignored now that its directory
+  // is gone, but a session with the same id could be created again.
+  if (cache != nullptr) {
+    return cache->Delete(GetId());
+  }
+  auto sessions_base_dir = path.parent_path().string();
+  if (access(GetJournalPath(sessions_base_dir).c_str(), F_OK) != 0) {
+    return {};
+  }
+  return AppendToJournal(sessions_base_dir,
+                         {JournalRecord{GetId(), std::nullopt}});
 }
 
 std::ostream& operator<<(std::ostream& out, const ApexSession& session) {
@@ -277,14 +874,17 @@ void ApexSession::DeleteFinalizedSessions() {
 }
 
 ApexSessionManager::ApexSessionManager(std::string sessions_base_dir)
-    : sessions_base_dir_(std::move(sessions_base_dir)) {}
+    : sessions_base_dir_(std::move(sessions_base_dir)),
+      cache_(std::make_shared<ApexSessionCache>(sessions_base_dir_)) {}
 
 ApexSessionManager::ApexSessionManager(ApexSessionManager&& other) noexcept
-    : sessions_base_dir_(std::move(other.sessions_base_dir_)) {}
+    : sessions_base_dir_(std::move(other.sessions_base_dir_)),
+      cache_(std::move(other.cache_)) {}
 
 ApexSessionManager& ApexSessionManager::operator=(
     ApexSessionManager&& other) noexcept {
   sessions_base_dir_ = std::move(other.sessions_base_dir_);
+  cache_ = std::move(other.cache_);
   return *this;
 }
 
@@ -300,56 +900,55 @@ Result<ApexSession> ApexSessionManager::CreateSession(int session_id) {
   std::string session_dir =
       sessions_base_dir_ + "/" + std::to_string(session_id);
   OR_RETURN(CreateDirIfNeeded(session_dir, 0700));
+  cache_->RefreshStamp();
   state.set_id(session_id);
 
-  return ApexSession(std::move(state), std::move(session_dir));
+  return ApexSession(std::move(state), std::move(session_dir), cache_);
 }
 
 Result<ApexSession> ApexSessionManager::GetSession(int session_id) const {
-  auto session_dir =
-      StringPrintf("%s/%d", sessions_base_dir_.c_str(), session_id);
-
-  auto state = OR_RETURN(ParseSessionState(session_dir));
-  return ApexSession(std::move(state), std::move(session_dir));
+  if (auto session = cache_->Get(session_id); session.has_value()) {
+    return std::move(*session);
+  }
+  return Error() << "Failed to find session " << session_id << " in "
+                 << sessions_base_dir_;
 }
 
 std::vector<ApexSession> ApexSessionManager::GetSessions() const {
-  std::vector<ApexSession> sessions;
+  return cache_->GetAll();
+}
 
-  auto walk_status = WalkDir(sessions_base_dir_, [&](const auto& entry) {
-    if (!entry.is_directory()) {
-      return;
-    }
+std::vector<ApexSession> ApexSessionManager::GetSessionsInState(
+    const SessionState::State& state) const {
+  return cache_->GetInState(state);
+}
 
-    std::string session_dir = entry.path();
-    auto state = ParseSessionState(session_dir);
-    if (!state.ok()) {
-      LOG(WARNING) << state.error();
-      return;
-    }
+void ApexSessionManager::Invalidate() { cache_->Invalidate(); }
 
-    ApexSession session(std::move(*state), std::move(session_dir));
-    sessions.push_back(std::move(session));
-  });
+ApexSessionManager::CommitBatch ApexSessionManager::BatchCommits() {
+  auto thread = std::this_thread::get_id();
+  cache_->BeginBatch(thread);
+  return CommitBatch(cache_, thread);
+}
 
-  if (!walk_status.ok()) {
-    LOG(WARNING) << walk_status.error();
-    return std::move(sessions);
-  }
+ApexSessionManager::CommitBatch::CommitBatch(
+    std::shared_ptr<ApexSessionCache> cache, std::thread::id thread)
+    : cache_(std::move(cache)), thread_(thread) {}
 
-  return std::move(sessions);
-}
+ApexSessionManager::CommitBatch::CommitBatch(CommitBatch&& other) noexcept
+    : cache_(std::move(other.cache_)), thread_(other.thread_) {}
 
-std::vector<ApexSession> ApexSessionManager::GetSessionsInState(
-    const SessionState::State& state) const {
-  std::vector<ApexSession> sessions = GetSessions();
-  sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
-                                [&](const ApexSession& s) {
-                                  return s.GetState() != state;
-                                }),
-                 sessions.end());
+ApexSessionManager::CommitBatch::~CommitBatch() {
+  if (cache_ == nullptr) {
+    return;
+  }
+  if (auto status = cache_->EndBatch(thread_); !status.ok()) {
+    LOG(ERROR) << "Failed to commit sessions: " << status.error();
+  }
+}
 
-  return sessions;
+Result<void> ApexSessionManager::CommitBatch::Flush() {
+  return cache_->Flush(thread_);
 }
 
 Result<void> ApexSessionManager::MigrateFromOldSessionsDir(
@@ -361,7 +960,11 @@ Result<void> ApexSessionManager::MigrateFromOldSessionsDir(
     return {};
   }
 
-  return MoveDir(old_sessions_base_dir, sessions_base_dir_);
+  // Only session directories are moved, not the journal.
+  OR_RETURN(ApexSessionCache::CompactJournal(old_sessions_base_dir));
+  auto status = MoveDir(old_sessions_base_dir, sessions_base_dir_);
+  Invalidate();
+  return status;
 }
 
 }  // namespace apex
@@ -23,11 +23,15 @@
 
 #include "session_state.pb.h"
 
+#include <memory>
 #include <optional>
+#include <thread>
 
 namespace android {
 namespace apex {
 
+class ApexSessionCache;
+
 // Starting from R, apexd prefers /metadata partition (kNewApexSessionsDir) as
 // location for sessions-related information. For devices that don't have
 // /metadata partition, apexd will fallback to the /data one
@@ -67,6 +71,9 @@ class ApexSession {
   bool IsRollback() const;
   int GetRollbackId() const;
   const google::protobuf::RepeatedPtrField<std::string> GetApexNames() const;
+  const google::protobuf::RepeatedPtrField<
+      ::apex::proto::SessionState::VerifiedApex>&
+  GetVerifiedApexes() const;
   const std::string& GetSessionDir() const;
 
   void SetChildSessionIds(const std::vector<int>& child_session_ids);
@@ -77,6 +84,8 @@ class ApexSession {
   void SetCrashingNativeProcess(const std::string& crashing_process);
   void SetErrorMessage(const std::string& error_message);
   void AddApexName(const std::string& apex_name);
+  void AddVerifiedApex(
+      const ::apex::proto::SessionState::VerifiedApex& verified_apex);
 
   android::base::Result<void> UpdateStateAndCommit(
       const ::apex::proto::SessionState::State& state);
@@ -85,14 +94,16 @@ class ApexSession {
   static void DeleteFinalizedSessions();
 
   friend class ApexSessionManager;
+  friend class ApexSessionCache;
 
  private:
-  ApexSession(::apex::proto::SessionState state, std::string session_dir);
+  ApexSession(::apex::proto::SessionState state, std::string session_dir,
+              std::weak_ptr<ApexSessionCache> cache = {});
   ::apex::proto::SessionState state_;
   std::string session_dir_;
-
-  static android::base::Result<ApexSession> GetSessionFromDir(
-      const std::string& session_dir);
+  // Cache of the ApexSessionManager this session was obtained from, if any.
+  // Committed and deleted sessions are written through to it.
+  std::weak_ptr<ApexSessionCache> cache_;
 };
 
 class ApexSessionManager {
@@ -112,12 +123,49 @@ class ApexSessionManager {
   android::base::Result<void> MigrateFromOldSessionsDir(
       const std::string& old_sessions_base_dir);
 
+  // Sessions are read from disk once, and then served from memory. Sessions
+  // committed or deleted through ApexSession objects obtained from this
+  // manager update the in-memory copy as well. Call this if sessions were
+  // modified in some other way, so that they are read from disk again.
+  void Invalidate();
+
+  // Batches commits and deletions of sessions, so that they are persisted
+  // with a single write and a single fsync when the batch ends (or is flushed)
+  // instead of one each. The in-memory copy is updated right away.
+  //
+  // Batching only covers commits made by the thread which started the batch;
+  // commits made by other threads are persisted right away. Batches can be
+  // nested; commits are persisted when the outermost one ends.
+  class CommitBatch {
+   public:
+    CommitBatch(CommitBatch&&) noexcept;
+    // Ends the batch, persisting what was committed within it. Errors are
+    // logged; call Flush() first to handle them.
+    ~CommitBatch();
+
+    // Persists what was committed so far within the batch.
+    android::base::Result<void> Flush();
+
+   private:
+    friend class ApexSessionManager;
+    CommitBatch(std::shared_ptr<ApexSessionCache> cache,
+                std::thread::id thread);
+    CommitBatch(const CommitBatch&) = delete;
+    CommitBatch& operator=(const CommitBatch&) = delete;
+
+    std::shared_ptr<ApexSessionCache> cache_;
+    std::thread::id thread_;
+  };
+
+  [[nodiscard]] CommitBatch BatchCommits();
+
  private:
   explicit ApexSessionManager(std::string sessions_base_dir);
   ApexSessionManager(const ApexSessionManager&) = delete;
   ApexSessionManager& operator=(const ApexSessionManager&) = delete;
 
   std::string sessions_base_dir_;
+  std::shared_ptr<ApexSessionCache> cache_;
 };
 
 std::ostream& operator<<(std::ostream& out, const ApexSession& session);
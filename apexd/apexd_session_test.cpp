@@ -24,6 +24,7 @@
 #include <android-base/strings.h>
 #include <errno.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <filesystem>
@@ -335,6 +336,185 @@ TEST(ApexSessionManager, MigrateFromOldSessionsDirSameDir) {
   ASSERT_EQ(SessionState::STAGED, old_sessions[2].GetState());
 }
 
+TEST(ApexSessionManager, SessionsAreServedFromMemory) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+
+  auto session = manager->CreateSession(239);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+  ASSERT_EQ(1u, manager->GetSessions().size());
+
+  // Corrupt the state file behind the manager's back.
+  std::string state_file = std::string(td.path) + "/239/state";
+  ASSERT_TRUE(android::base::WriteStringToFile("garbage", state_file));
+
+  auto same_session = manager->GetSession(239);
+  ASSERT_RESULT_OK(same_session);
+  ASSERT_EQ(SessionState::STAGED, same_session->GetState());
+  ASSERT_EQ(1u, manager->GetSessionsInState(SessionState::STAGED).size());
+
+  // Disk is only read again after explicit invalidation.
+  manager->Invalidate();
+  ASSERT_THAT(manager->GetSession(239), Not(Ok()));
+  ASSERT_EQ(0u, manager->GetSessions().size());
+}
+
+TEST(ApexSessionManager, CommitAndDeleteUpdateMemory) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+
+  auto session = manager->CreateSession(43);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+  ASSERT_EQ(1u, manager->GetSessionsInState(SessionState::STAGED).size());
+
+  // Sessions returned by the manager write through as well.
+  auto same_session = manager->GetSession(43);
+  ASSERT_RESULT_OK(same_session);
+  ASSERT_RESULT_OK(same_session->UpdateStateAndCommit(SessionState::ACTIVATED));
+  ASSERT_EQ(0u, manager->GetSessionsInState(SessionState::STAGED).size());
+  auto activated = manager->GetSessionsInState(SessionState::ACTIVATED);
+  ASSERT_EQ(1u, activated.size());
+  ASSERT_EQ(43, activated[0].GetId());
+
+  ASSERT_RESULT_OK(activated[0].DeleteSession());
+  ASSERT_THAT(manager->GetSession(43), Not(Ok()));
+  ASSERT_EQ(0u, manager->GetSessions().size());
+  ASSERT_EQ(0u, manager->GetSessionsInState(SessionState::ACTIVATED).size());
+}
+
+TEST(ApexSessionManager, SessionsCreatedElsewhereAreVisible) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  ASSERT_EQ(0u, manager->GetSessions().size());
+
+  // E.g. tests staging sessions directly on disk.
+  auto other_manager = ApexSessionManager::Create(std::string(td.path));
+  auto session = other_manager->CreateSession(17);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::VERIFIED));
+
+  ASSERT_RESULT_OK(manager->GetSession(17));
+  auto sessions = manager->GetSessionsInState(SessionState::VERIFIED);
+  ASSERT_EQ(1u, sessions.size());
+  ASSERT_EQ(17, sessions[0].GetId());
+
+  ASSERT_RESULT_OK(session->DeleteSession());
+  ASSERT_EQ(0u, manager->GetSessions().size());
+}
+
+TEST(ApexSessionManager, JournalIsReplayedAndCompacted) {
+  TemporaryDir td;
+  std::string journal = std::string(td.path) + "/journal";
+  {
+    auto manager = ApexSessionManager::Create(std::string(td.path));
+    auto batch = manager->BatchCommits();
+    for (int id : {1, 2, 3}) {
+      auto session = manager->CreateSession(id);
+      ASSERT_RESULT_OK(session);
+      ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+      ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::ACTIVATED));
+    }
+  }
+  // Commits only went to the journal.
+  ASSERT_EQ(0, access(journal.c_str(), F_OK));
+  ASSERT_NE(0, access((std::string(td.path) + "/1/state").c_str(), F_OK));
+
+  // E.g. on the next boot.
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  auto sessions = manager->GetSessionsInState(SessionState::ACTIVATED);
+  ASSERT_EQ(3u, sessions.size());
+
+  // Loading folded the journal into the state files.
+  ASSERT_NE(0, access(journal.c_str(), F_OK));
+  manager->Invalidate();
+  ASSERT_EQ(3u, manager->GetSessionsInState(SessionState::ACTIVATED).size());
+}
+
+TEST(ApexSessionManager, BatchedCommitsArePersistedOnFlush) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  auto session = manager->CreateSession(7);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+
+  auto batch = manager->BatchCommits();
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::ACTIVATED));
+  // Served from memory right away...
+  ASSERT_EQ(1u, manager->GetSessionsInState(SessionState::ACTIVATED).size());
+  // ... but not on disk yet.
+  auto other_manager = ApexSessionManager::Create(std::string(td.path));
+  ASSERT_EQ(1u, other_manager->GetSessionsInState(SessionState::STAGED).size());
+
+  ASSERT_RESULT_OK(batch.Flush());
+  ASSERT_EQ(1u,
+            other_manager->GetSessionsInState(SessionState::ACTIVATED).size());
+}
+
+TEST(ApexSessionManager, BatchOnlyCoversItsThread) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  auto session = manager->CreateSession(7);
+  ASSERT_RESULT_OK(session);
+  auto other_session = manager->CreateSession(8);
+  ASSERT_RESULT_OK(other_session);
+
+  auto batch = manager->BatchCommits();
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+
+  // Commits made by another thread must not be held back by this batch.
+  android::base::Result<void> other_result;
+  std::thread([&]() {
+    other_result = other_session->UpdateStateAndCommit(SessionState::STAGED);
+  }).join();
+  ASSERT_RESULT_OK(other_result);
+
+  auto other_manager = ApexSessionManager::Create(std::string(td.path));
+  auto sessions = other_manager->GetSessionsInState(SessionState::STAGED);
+  ASSERT_EQ(1u, sessions.size());
+  ASSERT_EQ(8, sessions[0].GetId());
+
+  ASSERT_RESULT_OK(batch.Flush());
+  other_manager->Invalidate();
+  ASSERT_EQ(2u, other_manager->GetSessionsInState(SessionState::STAGED).size());
+}
+
+TEST(ApexSessionManager, TornJournalRecordIsIgnored) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  auto session = manager->CreateSession(11);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+
+  // E.g. power loss in the middle of an append.
+  std::string journal = std::string(td.path) + "/journal";
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(journal, &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      content + content.substr(0, content.size() - 1), journal));
+
+  auto other_manager = ApexSessionManager::Create(std::string(td.path));
+  auto same_session = other_manager->GetSession(11);
+  ASSERT_RESULT_OK(same_session);
+  ASSERT_EQ(SessionState::STAGED, same_session->GetState());
+}
+
+TEST(ApexSessionManager, DeletedSessionIsNotReplayed) {
+  TemporaryDir td;
+  auto manager = ApexSessionManager::Create(std::string(td.path));
+  auto session = manager->CreateSession(5);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::STAGED));
+  ASSERT_RESULT_OK(session->DeleteSession());
+
+  // Session with the same id is created again, but not committed yet.
+  ASSERT_RESULT_OK(manager->CreateSession(5));
+
+  auto other_manager = ApexSessionManager::Create(std::string(td.path));
+  ASSERT_THAT(other_manager->GetSession(5), Not(Ok()));
+}
+
 }  // namespace
 }  // namespace apex
 }  // namespace android
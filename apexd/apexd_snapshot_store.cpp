@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_snapshot_store.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/scopeguard.h>
+#include <android-base/unique_fd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "apexd_rollback_utils.h"
+#include "apexd_utils.h"
+#include "apexd_verity.h"
+#include "snapshot_manifest.pb.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+using android::base::unique_fd;
+using ::apex::proto::SnapshotManifest;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+using ManifestEntry = SnapshotManifest::Entry;
+
+constexpr const char* kObjectsDir = "objects";
+constexpr const char* kManifestSuffix = ".manifest";
+constexpr const char* kDedupSuffix = ".apexd-dedup";
+constexpr const char* kRestoreSuffix = ".apexd-restore";
+
+int64_t ToNs(const struct timespec& ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+ManifestEntry CreateManifestEntry(const std::string& path,
+                                  const std::string& digest,
+                                  const struct stat& st) {
+  ManifestEntry entry;
+  entry.set_path(path);
+  entry.set_digest(digest);
+  entry.set_inode(st.st_ino);
+  entry.set_size(st.st_size);
+  entry.set_mtime_ns(ToNs(st.st_mtim));
+  entry.set_ctime_ns(ToNs(st.st_ctim));
+  return entry;
+}
+
+// Whether |st| describes the very file |entry| was recorded from. The ctime
+// changes on every write and metadata update, so an unchanged identity means
+// an unchanged digest.
+bool HasIdentity(const ManifestEntry& entry, const struct stat& st) {
+  return entry.inode() == st.st_ino && entry.size() == st.st_size &&
+         entry.mtime_ns() == ToNs(st.st_mtim) &&
+         entry.ctime_ns() == ToNs(st.st_ctim);
+}
+
+std::string RelativePath(const std::string& root, const std::string& path) {
+  return path.substr(root.size() + 1);
+}
+
+std::string ManifestPath(const std::string& snapshot_dir) {
+  return snapshot_dir + kManifestSuffix;
+}
+
+Result<SnapshotManifest> ReadManifest(const std::string& path) {
+  SnapshotManifest manifest;
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    if (errno == ENOENT) {
+      // Snapshots taken before the store existed have no manifest.
+      return manifest;
+    }
+    return ErrnoError() << "Failed to read " << path;
+  }
+  if (!manifest.ParseFromString(content)) {
+    return Error() << "Failed to parse " << path;
+  }
+  return manifest;
+}
+
+Result<void> WriteManifest(const SnapshotManifest& manifest,
+                           const std::string& path) {
+  std::string tmp_path = path + ".tmp";
+  unique_fd fd(TEMP_FAILURE_RETRY(open(
+      tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to create " << tmp_path;
+  }
+  if (!manifest.SerializeToFileDescriptor(fd.get()) || fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
+// Digest of the contents and metadata of the regular file at |path|. Any
+// difference that a restore would have to reproduce changes the digest;
+// timestamps other than the mtime don't count.
+Result<std::string> ComputeDigest(const std::string& path) {
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  auto update = [&ctx](const std::string& s) {
+    // Include the terminating '\0' so that adjacent fields can't run together
+    SHA256_Update(&ctx, s.c_str(), s.size() + 1);
+  };
+  update(std::to_string(st.st_mode));
+  update(std::to_string(st.st_uid));
+  update(std::to_string(st.st_gid));
+  update(std::to_string(ToNs(st.st_mtim)));
+
+  std::string names(XATTR_LIST_MAX, '\0');
+  ssize_t size = flistxattr(fd.get(), names.data(), names.size());
+  if (size < 0 && errno != ENOTSUP) {
+    return ErrnoError() << "Failed to list xattrs of " << path;
+  }
+  names.resize(std::max<ssize_t>(size, 0));
+  std::map<std::string, std::string> xattrs;
+  for (size_t pos = 0; pos < names.size(); pos = names.find('\0', pos) + 1) {
+    const char* name = names.c_str() + pos;
+    std::string value(XATTR_SIZE_MAX, '\0');
+    ssize_t value_size = fgetxattr(fd.get(), name, value.data(), value.size());
+    if (value_size < 0) {
+      return ErrnoError() << "Failed to read xattr " << name << " of "
+                          << path;
+    }
+    value.resize(value_size);
+    xattrs.emplace(name, std::move(value));
+  }
+  for (const auto& [name, value] : xattrs) {
+    update(name);
+    update(value);
+  }
+
+  std::vector<char> buf(128 * 1024);
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd.get(), buf.data(), buf.size()));
+    if (n < 0) {
+      return ErrnoError() << "Failed to read " << path;
+    }
+    if (n == 0) {
+      break;
+    }
+    SHA256_Update(&ctx, buf.data(), n);
+  }
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  return BytesToHex(digest, sizeof(digest));
+}
+
+// Manifest entries of all snapshots of |apex_name| under |root|, by path.
+std::unordered_multimap<std::string, ManifestEntry> ReadKnownEntries(
+    const std::string& root, const std::string& apex_name) {
+  namespace fs = std::filesystem;
+
+  std::unordered_multimap<std::string, ManifestEntry> entries;
+  std::error_code ec;
+  for (const auto& dir : fs::directory_iterator(root, ec)) {
+    std::string path = dir.path().string() + "/" + apex_name + kManifestSuffix;
+    if (access(path.c_str(), F_OK) != 0) {
+      continue;
+    }
+    auto manifest = ReadManifest(path);
+    if (!manifest.ok()) {
+      LOG(WARNING) << manifest.error();
+      continue;
+    }
+    for (const auto& entry : manifest->entries()) {
+      entries.emplace(entry.path(), entry);
+    }
+  }
+  return entries;
+}
+
+// Returns the digest of the data file |path| described by |st|, reusing the
+// one recorded by a previous snapshot if the file hasn't changed since.
+Result<std::string> GetDigest(
+    const std::unordered_multimap<std::string, ManifestEntry>& known_entries,
+    const std::string& relative_path, const std::string& path,
+    const struct stat& st) {
+  auto [begin, end] = known_entries.equal_range(relative_path);
+  for (auto it = begin; it != end; ++it) {
+    if (HasIdentity(it->second, st)) {
+      return it->second.digest();
+    }
+  }
+  return ComputeDigest(path);
+}
+
+}  // namespace
+
+SnapshotStore::SnapshotStore(const std::string& root)
+    : root_(root), objects_dir_(root + "/" + kObjectsDir) {}
+
+std::string SnapshotStore::ObjectPath(const std::string& digest) const {
+  return objects_dir_ + "/" + digest;
+}
+
+Result<void> SnapshotStore::Snapshot(const std::string& data_dir,
+                                     const std::string& snapshot_dir) const {
+  LOG(DEBUG) << "Snapshotting " << data_dir << " to " << snapshot_dir;
+
+  OR_RETURN(Delete(snapshot_dir));
+  if (mkdir(objects_dir_.c_str(), 0700) != 0 && errno != EEXIST) {
+    return ErrnoError() << "Failed to create " << objects_dir_;
+  }
+  auto known_entries = ReadKnownEntries(
+      root_, std::filesystem::path(snapshot_dir).filename().string());
+
+  Tree tree = OR_RETURN(ListTree(data_dir, snapshot_dir));
+  auto scope_guard = android::base::make_scope_guard([&]() {
+    if (auto result = Delete(snapshot_dir); !result.ok()) {
+      LOG(ERROR) << "Failed to clean up " << snapshot_dir << " : "
+                 << result.error();
+    }
+  });
+  for (const TreeEntry& dir : tree.dirs) {
+    if (mkdir(dir.to.c_str(), 0700) != 0) {
+      return ErrnoError() << "Failed to create " << dir.to;
+    }
+  }
+
+  std::vector<std::optional<ManifestEntry>> entries(tree.files.size());
+  OR_RETURN(RunInParallel(
+      tree.files.size(), std::thread::hardware_concurrency(),
+      [&](size_t i) -> Result<void> {
+        const TreeEntry& file = tree.files[i];
+        if (!S_ISREG(file.st.st_mode)) {
+          return CopyNode(file);
+        }
+        std::string relative_path = RelativePath(data_dir, file.from);
+
+        // Unchanged files only need a link to the object holding them.
+        auto [begin, end] = known_entries.equal_range(relative_path);
+        for (auto it = begin; it != end; ++it) {
+          if (HasIdentity(it->second, file.st) &&
+              link(ObjectPath(it->second.digest()).c_str(), file.to.c_str()) ==
+                  0) {
+            entries[i] = CreateManifestEntry(relative_path, it->second.digest(),
+                                             file.st);
+            return {};
+          }
+        }
+
+        // Anything else is copied, and the copy digested: the data file may
+        // change under us, the copy doesn't. The copy then becomes the object,
+        // unless the store already has the same contents.
+        OR_RETURN(CopyNode(file));
+        std::string digest = OR_RETURN(ComputeDigest(file.to));
+        std::string object = ObjectPath(digest);
+        if (link(file.to.c_str(), object.c_str()) != 0) {
+          if (errno != EEXIST) {
+            return ErrnoError() << "Failed to link " << file.to << " to "
+                                << object;
+          }
+          std::string tmp_path = file.to + kDedupSuffix;
+          if (link(object.c_str(), tmp_path.c_str()) == 0 &&
+              rename(tmp_path.c_str(), file.to.c_str()) != 0) {
+            return ErrnoError() << "Failed to rename " << tmp_path << " to "
+                                << file.to;
+          }
+        }
+        entries[i] = CreateManifestEntry(relative_path, digest, file.st);
+        return {};
+      }));
+
+  // Directory metadata goes last, children first, so that creating entries
+  // doesn't bump the copied timestamps.
+  for (auto it = tree.dirs.rbegin(); it != tree.dirs.rend(); ++it) {
+    OR_RETURN(CopyDirMetadata(*it));
+  }
+
+  SnapshotManifest manifest;
+  for (auto& entry : entries) {
+    if (entry.has_value()) {
+      *manifest.add_entries() = std::move(*entry);
+    }
+  }
+  OR_RETURN(WriteManifest(manifest, ManifestPath(snapshot_dir)));
+  scope_guard.Disable();
+  return {};
+}
+
+Result<void> SnapshotStore::Restore(const std::string& snapshot_dir,
+                                    const std::string& data_dir) const {
+  namespace fs = std::filesystem;
+
+  LOG(DEBUG) << "Restoring " << snapshot_dir << " to " << data_dir;
+
+  Tree tree = OR_RETURN(ListTree(snapshot_dir, data_dir));
+  SnapshotManifest manifest =
+      OR_RETURN(ReadManifest(ManifestPath(snapshot_dir)));
+  std::unordered_map<std::string, std::string> digests;
+  for (const auto& entry : manifest.entries()) {
+    digests.emplace(entry.path(), entry.digest());
+  }
+  auto known_entries = ReadKnownEntries(
+      root_, fs::path(snapshot_dir).filename().string());
+
+  // Delete whatever the snapshot doesn't have, or has as another file type.
+  std::unordered_map<std::string, mode_t> types;
+  for (const auto* entries : {&tree.dirs, &tree.files}) {
+    for (const TreeEntry& entry : *entries) {
+      types.emplace(entry.to, entry.st.st_mode & S_IFMT);
+    }
+  }
+  struct stat data_st;
+  if (lstat(data_dir.c_str(), &data_st) == 0) {
+    Tree data_tree;
+    if (S_ISDIR(data_st.st_mode)) {
+      data_tree = OR_RETURN(ListTree(data_dir, snapshot_dir));
+    } else {
+      data_tree.files.push_back({data_dir, snapshot_dir, data_st});
+    }
+    for (const auto* entries : {&data_tree.dirs, &data_tree.files}) {
+      for (const TreeEntry& entry : *entries) {
+        auto it = types.find(entry.from);
+        if (it == types.end() || it->second != (entry.st.st_mode & S_IFMT)) {
+          std::error_code ec;
+          fs::remove_all(entry.from, ec);
+          if (ec) {
+            return Error() << "Failed to delete " << entry.from << " : "
+                           << ec.message();
+          }
+        }
+      }
+    }
+  } else if (errno != ENOENT) {
+    return ErrnoError() << "Failed to stat " << data_dir;
+  }
+
+  for (const TreeEntry& dir : tree.dirs) {
+    if (mkdir(dir.to.c_str(), 0700) != 0 && errno != EEXIST) {
+      return ErrnoError() << "Failed to create " << dir.to;
+    }
+  }
+
+  OR_RETURN(RunInParallel(
+      tree.files.size(), std::thread::hardware_concurrency(),
+      [&](size_t i) -> Result<void> {
+        const TreeEntry& file = tree.files[i];
+        std::string relative_path = RelativePath(snapshot_dir, file.from);
+        if (auto it = digests.find(relative_path); it != digests.end()) {
+          struct stat st;
+          if (lstat(file.to.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            auto digest = GetDigest(known_entries, relative_path, file.to, st);
+            if (digest.ok() && *digest == it->second) {
+              // The data file already matches the snapshot.
+              return {};
+            }
+          }
+        }
+
+        // Restore a private copy, so that later writes don't reach the store.
+        std::string tmp_path = file.to + kRestoreSuffix;
+        unlink(tmp_path.c_str());
+        OR_RETURN(CopyNode({file.from, tmp_path, file.st}));
+        if (rename(tmp_path.c_str(), file.to.c_str()) != 0) {
+          return ErrnoError() << "Failed to rename " << tmp_path << " to "
+                              << file.to;
+        }
+        return {};
+      }));
+
+  for (auto it = tree.dirs.rbegin(); it != tree.dirs.rend(); ++it) {
+    OR_RETURN(CopyDirMetadata(*it));
+  }
+
+  if (auto result = Delete(snapshot_dir); !result.ok()) {
+    LOG(ERROR) << "Failed to delete the snapshot: " << result.error();
+  }
+  return {};
+}
+
+Result<void> SnapshotStore::Delete(const std::string& snapshot_dir) const {
+  std::error_code ec;
+  std::filesystem::remove_all(snapshot_dir, ec);
+  if (ec) {
+    return Error() << "Failed to delete " << snapshot_dir << " : "
+                   << ec.message();
+  }
+  std::string manifest_path = ManifestPath(snapshot_dir);
+  if (unlink(manifest_path.c_str()) != 0 && errno != ENOENT) {
+    return ErrnoError() << "Failed to delete " << manifest_path;
+  }
+  return {};
+}
+
+Result<void> SnapshotStore::CollectGarbage() const {
+  std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(objects_dir_.c_str()),
+                                          closedir);
+  if (!dir) {
+    if (errno == ENOENT) {
+      return {};
+    }
+    return ErrnoError() << "Failed to open " << objects_dir_;
+  }
+  size_t deleted = 0;
+  for (errno = 0; struct dirent* entry = readdir(dir.get()); errno = 0) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir.get()), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) !=
+        0) {
+      return ErrnoError() << "Failed to stat " << objects_dir_ << "/" << name;
+    }
+    // The store's own link is the last one.
+    if (st.st_nlink <= 1) {
+      if (unlinkat(dirfd(dir.get()), name.c_str(), 0) != 0) {
+        return ErrnoError() << "Failed to delete " << objects_dir_ << "/"
+                            << name;
+      }
+      deleted++;
+    }
+  }
+  if (errno != 0) {
+    return ErrnoError() << "Failed to read " << objects_dir_;
+  }
+  LOG(DEBUG) << "Deleted " << deleted << " unused objects from "
+             << objects_dir_;
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_SNAPSHOT_STORE_H_
+#define ANDROID_APEXD_APEXD_SNAPSHOT_STORE_H_
+
+#include <android-base/result.h>
+
+#include <string>
+
+namespace android {
+namespace apex {
+
+/**
+ * Content-addressed storage for the APEX data snapshots of one base directory
+ * (e.g. /data/misc/apexrollback).
+ *
+ * Snapshots keep their usual layout, <root>/<rollback id>/<apex name>, but
+ * their regular files are hard links to immutable objects in <root>/objects,
+ * named after a digest of the file contents and metadata. A file that doesn't
+ * change across rollback ids is therefore stored once. The link count of an
+ * object tells whether a snapshot still uses it.
+ *
+ * Each snapshot is described by a manifest, <root>/<rollback id>/<apex
+ * name>.manifest, which records the digest of every file along with the
+ * identity of the data file it was taken from. Later snapshots use it to avoid
+ * copying unchanged files, and restores to skip files whose data copy already
+ * matches the snapshot.
+ *
+ * Files are never shared between a snapshot and live data: restored files are
+ * private copies.
+ */
+class SnapshotStore {
+ public:
+  explicit SnapshotStore(const std::string& root);
+
+  // Snapshots data_dir to snapshot_dir, replacing any existing snapshot there.
+  // Objects only the replaced snapshot used are left for CollectGarbage().
+  android::base::Result<void> Snapshot(const std::string& data_dir,
+                                       const std::string& snapshot_dir) const;
+
+  // Makes data_dir identical to snapshot_dir, rewriting only the files that
+  // differ. The snapshot is deleted afterwards, and objects only it used are
+  // left for CollectGarbage().
+  android::base::Result<void> Restore(const std::string& snapshot_dir,
+                                      const std::string& data_dir) const;
+
+  // Deletes the snapshot at snapshot_dir together with its manifest.
+  android::base::Result<void> Delete(const std::string& snapshot_dir) const;
+
+  // Deletes the objects no snapshot links to anymore. Scans every object, so
+  // callers run it once per batch of snapshots or restores.
+  android::base::Result<void> CollectGarbage() const;
+
+ private:
+  std::string ObjectPath(const std::string& digest) const;
+
+  std::string root_;
+  std::string objects_dir_;
+};
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_SNAPSHOT_STORE_H_
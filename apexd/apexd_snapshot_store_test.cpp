@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_snapshot_store.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+
+namespace android {
+namespace apex {
+namespace {
+
+namespace fs = std::filesystem;
+
+using android::base::ReadFileToString;
+using android::base::WriteStringToFile;
+using android::base::testing::Ok;
+using ::testing::Not;
+
+class SnapshotStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    root_ = std::string(td_.path) + "/apexrollback";
+    data_dir_ = std::string(td_.path) + "/apexdata/com.android.foo";
+    ASSERT_EQ(0, mkdir(root_.c_str(), 0700));
+    ASSERT_EQ(0, mkdir((std::string(td_.path) + "/apexdata").c_str(), 0700));
+    ASSERT_EQ(0, mkdir(data_dir_.c_str(), 0700));
+  }
+
+  std::string SnapshotDir(int rollback_id) {
+    std::string dir = root_ + "/" + std::to_string(rollback_id);
+    mkdir(dir.c_str(), 0700);
+    return dir + "/com.android.foo";
+  }
+
+  void WriteData(const std::string& name, const std::string& content) {
+    ASSERT_TRUE(WriteStringToFile(content, data_dir_ + "/" + name));
+  }
+
+  std::string ReadFile(const std::string& path) {
+    std::string content;
+    EXPECT_TRUE(ReadFileToString(path, &content)) << path;
+    return content;
+  }
+
+  ino_t Inode(const std::string& path) {
+    struct stat st;
+    EXPECT_EQ(0, lstat(path.c_str(), &st)) << path;
+    return st.st_ino;
+  }
+
+  size_t NumObjects() {
+    size_t count = 0;
+    for ([[maybe_unused]] const auto& entry :
+         fs::directory_iterator(root_ + "/objects")) {
+      count++;
+    }
+    return count;
+  }
+
+  TemporaryDir td_;
+  std::string root_;
+  std::string data_dir_;
+};
+
+TEST_F(SnapshotStoreTest, SnapshotCopiesTree) {
+  SnapshotStore store(root_);
+  WriteData("file", "contents");
+  ASSERT_EQ(0, mkdir((data_dir_ + "/dir").c_str(), 0750));
+  WriteData("dir/nested", "nested");
+  ASSERT_EQ(0, symlink("file", (data_dir_ + "/link").c_str()));
+
+  std::string snapshot = SnapshotDir(1);
+  ASSERT_THAT(store.Snapshot(data_dir_, snapshot), Ok());
+
+  ASSERT_EQ("contents", ReadFile(snapshot + "/file"));
+  ASSERT_EQ("nested", ReadFile(snapshot + "/dir/nested"));
+  ASSERT_EQ("file", fs::read_symlink(snapshot + "/link").string());
+  ASSERT_EQ(fs::perms(0750),
+            fs::status(snapshot + "/dir").permissions() & fs::perms::mask);
+  ASSERT_TRUE(fs::exists(snapshot + ".manifest"));
+
+  // Writing to the data afterwards doesn't affect the snapshot.
+  WriteData("file", "changed");
+  ASSERT_EQ("contents", ReadFile(snapshot + "/file"));
+}
+
+TEST_F(SnapshotStoreTest, IdenticalFilesAreStoredOnce) {
+  SnapshotStore store(root_);
+  WriteData("a", "same");
+  WriteData("b", "other");
+
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(1)), Ok());
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(2)), Ok());
+
+  ASSERT_EQ(2u, NumObjects());
+  ASSERT_EQ(Inode(SnapshotDir(1) + "/a"), Inode(SnapshotDir(2) + "/a"));
+  ASSERT_NE(Inode(SnapshotDir(1) + "/a"), Inode(data_dir_ + "/a"));
+}
+
+TEST_F(SnapshotStoreTest, ChangedFilesAreStoredAgain) {
+  SnapshotStore store(root_);
+  WriteData("a", "first");
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(1)), Ok());
+
+  WriteData("a", "second");
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(2)), Ok());
+
+  ASSERT_EQ(2u, NumObjects());
+  ASSERT_EQ("first", ReadFile(SnapshotDir(1) + "/a"));
+  ASSERT_EQ("second", ReadFile(SnapshotDir(2) + "/a"));
+}
+
+TEST_F(SnapshotStoreTest, RestoreRewritesOnlyChangedFiles) {
+  SnapshotStore store(root_);
+  WriteData("unchanged", "u");
+  WriteData("changed", "before");
+  WriteData("deleted", "d");
+  std::string snapshot = SnapshotDir(1);
+  ASSERT_THAT(store.Snapshot(data_dir_, snapshot), Ok());
+
+  ino_t unchanged_inode = Inode(data_dir_ + "/unchanged");
+  WriteData("changed", "after");
+  ASSERT_EQ(0, unlink((data_dir_ + "/deleted").c_str()));
+  WriteData("added", "a");
+
+  ASSERT_THAT(store.Restore(snapshot, data_dir_), Ok());
+
+  ASSERT_EQ(unchanged_inode, Inode(data_dir_ + "/unchanged"));
+  ASSERT_EQ("before", ReadFile(data_dir_ + "/changed"));
+  ASSERT_EQ("d", ReadFile(data_dir_ + "/deleted"));
+  ASSERT_FALSE(fs::exists(data_dir_ + "/added"));
+  ASSERT_FALSE(fs::exists(snapshot));
+  ASSERT_FALSE(fs::exists(snapshot + ".manifest"));
+  // Objects of the deleted snapshot stay until garbage is collected.
+  ASSERT_EQ(3u, NumObjects());
+  ASSERT_THAT(store.CollectGarbage(), Ok());
+  ASSERT_EQ(0u, NumObjects());
+}
+
+TEST_F(SnapshotStoreTest, RestoredFilesAreNotSharedWithTheStore) {
+  SnapshotStore store(root_);
+  WriteData("a", "snapshot");
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(1)), Ok());
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(2)), Ok());
+  WriteData("a", "live");
+
+  ASSERT_THAT(store.Restore(SnapshotDir(1), data_dir_), Ok());
+  WriteData("a", "written after restore");
+
+  ASSERT_EQ("snapshot", ReadFile(SnapshotDir(2) + "/a"));
+}
+
+TEST_F(SnapshotStoreTest, RestoreHandlesFilesWithoutManifest) {
+  SnapshotStore store(root_);
+  WriteData("a", "a");
+  std::string snapshot = SnapshotDir(1);
+  ASSERT_THAT(store.Snapshot(data_dir_, snapshot), Ok());
+  ASSERT_TRUE(WriteStringToFile("extra", snapshot + "/extra"));
+
+  ASSERT_THAT(store.Restore(snapshot, data_dir_), Ok());
+
+  ASSERT_EQ("a", ReadFile(data_dir_ + "/a"));
+  ASSERT_EQ("extra", ReadFile(data_dir_ + "/extra"));
+}
+
+TEST_F(SnapshotStoreTest, RestoreReplacesFileTypes) {
+  SnapshotStore store(root_);
+  ASSERT_EQ(0, mkdir((data_dir_ + "/node").c_str(), 0700));
+  WriteData("node/child", "child");
+  std::string snapshot = SnapshotDir(1);
+  ASSERT_THAT(store.Snapshot(data_dir_, snapshot), Ok());
+
+  fs::remove_all(data_dir_ + "/node");
+  WriteData("node", "now a file");
+
+  ASSERT_THAT(store.Restore(snapshot, data_dir_), Ok());
+  ASSERT_EQ("child", ReadFile(data_dir_ + "/node/child"));
+}
+
+TEST_F(SnapshotStoreTest, CollectGarbageKeepsObjectsInUse) {
+  SnapshotStore store(root_);
+  WriteData("a", "first");
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(1)), Ok());
+  WriteData("a", "second");
+  ASSERT_THAT(store.Snapshot(data_dir_, SnapshotDir(2)), Ok());
+  ASSERT_EQ(2u, NumObjects());
+
+  fs::remove_all(root_ + "/1");
+  ASSERT_THAT(store.CollectGarbage(), Ok());
+
+  ASSERT_EQ(1u, NumObjects());
+  ASSERT_EQ("second", ReadFile(SnapshotDir(2) + "/a"));
+}
+
+TEST_F(SnapshotStoreTest, SnapshotOfMissingDataFails) {
+  SnapshotStore store(root_);
+  ASSERT_THAT(store.Snapshot(data_dir_ + "/missing", SnapshotDir(1)),
+              Not(Ok()));
+  ASSERT_FALSE(fs::exists(SnapshotDir(1)));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
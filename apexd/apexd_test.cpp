@@ -21,12 +21,16 @@
 #include <android-base/result-gmock.h>
 #include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
+#include <fcntl.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <libdm/dm.h>
 #include <microdroid/metadata.h>
 #include <selinux/selinux.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
 
 #include <functional>
 #include <optional>
@@ -39,11 +43,14 @@
 #include "apex_file.h"
 #include "apex_file_repository.h"
 #include "apex_manifest.pb.h"
+#include "apexd_activation_plan.h"
 #include "apexd_checkpoint.h"
 #include "apexd_loop.h"
+#include "apexd_private.h"
 #include "apexd_session.h"
 #include "apexd_test_utils.h"
 #include "apexd_utils.h"
+#include "apexd_verity.h"
 #include "com_android_apex.h"
 #include "gmock/gmock-matchers.h"
 
@@ -71,6 +78,7 @@ using android::base::testing::HasValue;
 using android::base::testing::Ok;
 using android::base::testing::WithMessage;
 using android::dm::DeviceMapper;
+using ::apex::proto::ActivationPlan;
 using ::apex::proto::SessionState;
 using com::android::apex::testing::ApexInfoXmlEq;
 using ::testing::ByRef;
@@ -80,6 +88,8 @@ using ::testing::EndsWith;
 using ::testing::HasSubstr;
 using ::testing::IsEmpty;
 using ::testing::Not;
+using ::testing::Optional;
+using ::testing::Pair;
 using ::testing::StartsWith;
 using ::testing::UnorderedElementsAre;
 using ::testing::UnorderedElementsAreArray;
@@ -144,6 +154,7 @@ class ApexdUnitTest : public ::testing::Test {
     ota_reserved_dir_ = StringPrintf("%s/ota-reserved", td_.path);
     hash_tree_dir_ = StringPrintf("%s/apex-hash-tree", td_.path);
     staged_session_dir_ = StringPrintf("%s/staged-session-dir", td_.path);
+    activation_plan_path_ = StringPrintf("%s/activation-plan", td_.path);
 
     sessions_metadata_dir_ =
         StringPrintf("%s/metadata-staged-session-dir", td_.path);
@@ -157,7 +168,9 @@ class ApexdUnitTest : public ::testing::Test {
                hash_tree_dir_.c_str(),
                staged_session_dir_.c_str(),
                kTestVmPayloadMetadataPartitionProp,
-               kTestActiveApexSelinuxCtx};
+               kTestActiveApexSelinuxCtx,
+               activation_plan_path_.c_str(),
+               /* mounted_apex_database_path= */ nullptr};
   }
 
   const std::string& GetBuiltInDir() { return built_in_dir_; }
@@ -165,6 +178,7 @@ class ApexdUnitTest : public ::testing::Test {
   const std::string& GetDecompressionDir() { return decompression_dir_; }
   const std::string& GetOtaReservedDir() { return ota_reserved_dir_; }
   const std::string& GetHashTreeDir() { return hash_tree_dir_; }
+  const std::string& GetActivationPlanPath() { return activation_plan_path_; }
   const std::string GetStagedDir(int session_id) {
     return StringPrintf("%s/session_%d", staged_session_dir_.c_str(),
                         session_id);
@@ -275,6 +289,7 @@ class ApexdUnitTest : public ::testing::Test {
   std::string hash_tree_dir_;
 
   std::string staged_session_dir_;
+  std::string activation_plan_path_;
   std::string sessions_metadata_dir_;
   std::unique_ptr<ApexSessionManager> session_manager_;
 
@@ -282,6 +297,33 @@ class ApexdUnitTest : public ::testing::Test {
 };
 
 // Apex that does not have pre-installed version, does not get selected
+TEST(ApexdTest, ParseActiveApexFileName) {
+  ASSERT_THAT(
+      ParseActiveApexFileName("/data/apex/active/com.android.foo@3.apex"),
+      Optional(Pair("com.android.foo", 3)));
+  ASSERT_THAT(ParseActiveApexFileName("com.android.foo@3_1.apex"),
+              Optional(Pair("com.android.foo", 3)));
+  ASSERT_THAT(ParseActiveApexFileName("com.android.test_package@2.apex"),
+              Optional(Pair("com.android.test_package", 2)));
+}
+
+TEST(ApexdTest, ParseActiveApexFileNameMalformed) {
+  for (const auto& name : {
+           "com.android.foo.apex",
+           "@3.apex",
+           "com.android.foo@.apex",
+           "com.android.foo@abc.apex",
+           "com.android.foo@-3.apex",
+           "com.android.foo@3x.apex",
+           "com.android.foo@3_.apex",
+           "com.android.foo@3_x.apex",
+           "com.android.foo@3@4.apex",
+           "com.android.foo@18446744073709551616.apex",
+       }) {
+    ASSERT_EQ(ParseActiveApexFileName(name), std::nullopt) << name;
+  }
+}
+
 TEST_F(ApexdUnitTest, ApexMustHavePreInstalledVersionForSelection) {
   AddPreInstalledApex("apex.apexd_test.apex");
   AddPreInstalledApex("com.android.apex.cts.shim.apex");
@@ -437,6 +479,59 @@ TEST_F(ApexdUnitTest, ProcessCompressedApexRunsVerification) {
   ASSERT_EQ(return_value.size(), 0u);
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexFailureLeavesNoFiles) {
+  auto compressed_apex = ApexFile::Open(AddPreInstalledApex(
+      "com.android.apex.compressed_key_mismatch_with_original.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 0u);
+
+  // Neither the decompressed APEX nor its temporary file should be left behind
+  std::error_code ec;
+  ASSERT_TRUE(fs::is_empty(GetDecompressionDir(), ec));
+  ASSERT_FALSE(ec) << "Failed to read " << GetDecompressionDir();
+}
+
+TEST_F(ApexdUnitTest, ProcessCompressedApexHashtreeMatchesDecompressedApex) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+  const ApexFile& decompressed_apex = return_value[0];
+
+  // AVB verification of the published APEX gives the root digest that was
+  // checked right after decompression
+  auto verity_data = decompressed_apex.VerifyApexVerity(
+      decompressed_apex.GetBundledPublicKey());
+  ASSERT_THAT(verity_data, Ok());
+  ASSERT_EQ(compressed_apex->GetManifest().capexmetadata().originalapexdigest(),
+            verity_data->root_digest);
+
+  // The hashtree generated right after decompression is the one activation
+  // would generate from the published APEX
+  ASSERT_EQ(0u, verity_data->desc->tree_size);
+  std::string hashtree_file =
+      GetHashTreeDir() + "/com.android.apex.compressed@1";
+  ASSERT_THAT(PrepareHashTree(decompressed_apex, *verity_data, hashtree_file),
+              HasValue(PrepareHashTreeResult::kReuse));
+  std::string expected_hashtree_file = GetHashTreeDir() + "/expected";
+  ASSERT_THAT(
+      PrepareHashTree(decompressed_apex, *verity_data, expected_hashtree_file),
+      HasValue(PrepareHashTreeResult::KRegenerate));
+  std::string hashtree;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &hashtree));
+  std::string expected_hashtree;
+  ASSERT_TRUE(ReadFileToString(expected_hashtree_file, &expected_hashtree));
+  ASSERT_EQ(expected_hashtree, hashtree);
+}
+
 TEST_F(ApexdUnitTest, ValidateDecompressedApex) {
   auto capex = ApexFile::Open(
       AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
@@ -476,6 +571,105 @@ TEST_F(ApexdUnitTest, ValidateDecompressedApex) {
           "Public key of compressed APEX is different than original"))));
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexRecordsVerifiedDigest) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  std::string decompressed_apex_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  std::string record;
+  ASSERT_TRUE(ReadFileToString(decompressed_apex_path + ".verified", &record))
+      << "Verified digest was not recorded";
+  ASSERT_THAT(record, StartsWith(compressed_apex->GetManifest()
+                                     .capexmetadata()
+                                     .originalapexdigest()));
+}
+
+TEST_F(ApexdUnitTest, ProcessCompressedApexIgnoresForgedVerifiedDigest) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  const auto& digest =
+      compressed_apex->GetManifest().capexmetadata().originalapexdigest();
+  // Same name, version and key as the CAPEX, but a different root digest
+  auto decompressed_apex_path = AddDecompressedApex(
+      "com.android.apex.compressed.v1_different_digest_original.apex");
+
+  // Anyone who can write the file can set a user xattr claiming that it was
+  // verified. apexd must not trust it.
+  struct stat st;
+  ASSERT_EQ(0, stat(decompressed_apex_path.c_str(), &st));
+  std::string forged =
+      digest + " ino=" + std::to_string(static_cast<uint64_t>(st.st_ino)) +
+      " size=" + std::to_string(static_cast<int64_t>(st.st_size)) +
+      " mtime=" +
+      std::to_string(static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                     st.st_mtim.tv_nsec);
+  ASSERT_EQ(0, setxattr(decompressed_apex_path.c_str(),
+                        "user.apexd.verified_digest", forged.data(),
+                        forged.size(), 0));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  // The forged APEX was replaced by a freshly decompressed one
+  auto verity_data =
+      return_value[0].VerifyApexVerity(return_value[0].GetBundledPublicKey());
+  ASSERT_THAT(verity_data, Ok());
+  ASSERT_EQ(digest, verity_data->root_digest);
+}
+
+TEST_F(ApexdUnitTest, ProcessCompressedApexRejectsStaleVerifiedDigest) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  std::string decompressed_apex_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  std::string record_path = decompressed_apex_path + ".verified";
+  std::string record;
+  ASSERT_TRUE(ReadFileToString(record_path, &record));
+
+  // Rewrite the APEX in place and set its mtime back, so that the inode, size
+  // and mtime all match the record. Only the ctime tells that it was written.
+  struct stat st;
+  ASSERT_EQ(0, stat(decompressed_apex_path.c_str(), &st));
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(decompressed_apex_path, &content));
+  usleep(10'000);
+  ASSERT_TRUE(WriteStringToFile(content, decompressed_apex_path));
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, decompressed_apex_path.c_str(), times, 0));
+
+  return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  // The stale record wasn't trusted: the APEX was verified again and the
+  // record refreshed.
+  std::string new_record;
+  ASSERT_TRUE(ReadFileToString(record_path, &new_record));
+  ASSERT_NE(record, new_record);
+  struct stat new_st;
+  ASSERT_EQ(0, stat(decompressed_apex_path.c_str(), &new_st));
+  ASSERT_EQ(st.st_ino, new_st.st_ino);
+}
+
 TEST_F(ApexdUnitTest, ProcessCompressedApexCanBeCalledMultipleTimes) {
   auto compressed_apex = ApexFile::Open(
       AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
@@ -708,6 +902,18 @@ TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexCreatesSingleFile) {
   EXPECT_EQ(fs::file_size((*files)[0]), 100u);
 }
 
+TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexAllocatesBlocks) {
+  TemporaryDir dest_dir;
+  // Reserved space must be backed by real blocks, not a sparse file
+  ASSERT_THAT(ReserveSpaceForCompressedApex(1024 * 1024, dest_dir.path), Ok());
+  auto files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_THAT(files, Ok());
+  ASSERT_EQ(files->size(), 1u);
+  struct stat st;
+  ASSERT_EQ(stat((*files)[0].c_str(), &st), 0);
+  EXPECT_GE(st.st_blocks * 512, 1024 * 1024);
+}
+
 TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexSafeToCallMultipleTimes) {
   TemporaryDir dest_dir;
   // Calling ReserveSpaceForCompressedApex multiple times should still create
@@ -784,6 +990,24 @@ TEST_F(ApexdUnitTest, ReserveSpaceForCapexCleansOtaApex) {
   ASSERT_THAT(PathExists(ota_apex_path), HasValue(false));
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexConsumesReservedSpace) {
+  ASSERT_THAT(
+      ReserveSpaceForCompressedApex(1024 * 1024, GetOtaReservedDir()), Ok());
+
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  // Reservation is released once decompression is done
+  auto files = ReadDir(GetOtaReservedDir(), [](auto _) { return true; });
+  ASSERT_THAT(files, Ok());
+  ASSERT_EQ(files->size(), 0u);
+}
+
 TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexErrorForNegativeValue) {
   TemporaryDir dest_dir;
   // Should return error if negative value is passed
@@ -1147,7 +1371,7 @@ TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActive) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"),
@@ -1169,7 +1393,7 @@ TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActive) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), ret->GetPath());
+  ASSERT_EQ((*active_apex)->path, ret->GetPath());
 
   // Check that pre-installed APEX is still around
   ASSERT_EQ(0, access(file_path.c_str(), F_OK))
@@ -1195,7 +1419,7 @@ TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActiveSamegrade) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v1.apex"),
@@ -1211,7 +1435,7 @@ TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActiveSamegrade) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), ret->GetPath());
+  ASSERT_EQ((*active_apex)->path, ret->GetPath());
 
   // Check that pre-installed APEX is still around
   ASSERT_EQ(0, access(file_path.c_str(), F_OK))
@@ -1279,7 +1503,7 @@ TEST_F(ApexdMountTest, InstallPackageDataVersionActive) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"),
@@ -1301,7 +1525,7 @@ TEST_F(ApexdMountTest, InstallPackageDataVersionActive) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), ret->GetPath());
+  ASSERT_EQ((*active_apex)->path, ret->GetPath());
 
   // Check that previously active APEX was deleted.
   ASSERT_EQ(-1, access(file_path.c_str(), F_OK));
@@ -1317,6 +1541,38 @@ TEST_F(ApexdMountTest, InstallPackageDataVersionActive) {
       });
 }
 
+TEST_F(ApexdMountTest, InstallPackageSwitchesOverFromStagingMountPoint) {
+  std::string file_path = AddPreInstalledApex("test.rebootless_apex_v1.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_THAT(ActivatePackage(file_path), Ok());
+  UnmountOnTearDown(file_path);
+
+  auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"),
+                            /* force= */ false);
+  ASSERT_THAT(ret, Ok());
+  UnmountOnTearDown(ret->GetPath());
+
+  // New version was mounted on /apex/<name>@<version>_<minor> while the old
+  // one was still active, and then moved to its regular mount point.
+  ASSERT_EQ(-1, access("/apex/test.apex.rebootless@2_1", F_OK));
+  ASSERT_EQ(ENOENT, errno);
+
+  auto& db = GetApexDatabaseForTesting();
+  size_t mounted = 0;
+  db.ForallMountedApexes(
+      "test.apex.rebootless", [&](const MountedApexData& data, bool latest) {
+        mounted++;
+        ASSERT_TRUE(latest);
+        ASSERT_EQ(data.mount_point, "/apex/test.apex.rebootless@2");
+      });
+  ASSERT_EQ(1u, mounted);
+
+  auto manifest = ReadManifest("/apex/test.apex.rebootless/apex_manifest.pb");
+  ASSERT_THAT(manifest, Ok());
+  ASSERT_EQ(2u, manifest->version());
+}
+
 TEST_F(ApexdMountTest, InstallPackageResolvesPathCollision) {
   AddPreInstalledApex("test.rebootless_apex_v1.apex");
   ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
@@ -1329,7 +1585,7 @@ TEST_F(ApexdMountTest, InstallPackageResolvesPathCollision) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v1.apex"),
@@ -1351,10 +1607,10 @@ TEST_F(ApexdMountTest, InstallPackageResolvesPathCollision) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), ret->GetPath());
+  ASSERT_EQ((*active_apex)->path, ret->GetPath());
 
   // Check that we correctly resolved active apex path collision.
-  ASSERT_EQ(active_apex->GetPath(),
+  ASSERT_EQ((*active_apex)->path,
             GetDataDir() + "/test.apex.rebootless@1_2.apex");
 
   // Check that previously active APEX was deleted.
@@ -1382,7 +1638,7 @@ TEST_F(ApexdMountTest, InstallPackageDataVersionActiveSamegrade) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"),
@@ -1404,7 +1660,7 @@ TEST_F(ApexdMountTest, InstallPackageDataVersionActiveSamegrade) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), ret->GetPath());
+  ASSERT_EQ((*active_apex)->path, ret->GetPath());
 
   // Check that previously active APEX was deleted.
   ASSERT_EQ(-1, access(file_path.c_str(), F_OK));
@@ -1430,7 +1686,7 @@ TEST_F(ApexdMountTest, InstallPackageUnmountFailsPreInstalledApexActive) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   unique_fd fd(open("/apex/test.apex.rebootless/apex_manifest.pb",
@@ -1449,7 +1705,7 @@ TEST_F(ApexdMountTest, InstallPackageUnmountFailsPreInstalledApexActive) {
   // Check that GetActivePackage correctly reports upgraded version.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), file_path);
+  ASSERT_EQ((*active_apex)->path, file_path);
 
   // Check that old APEX is still around
   ASSERT_EQ(0, access(file_path.c_str(), F_OK))
@@ -1476,7 +1732,7 @@ TEST_F(ApexdMountTest, InstallPackageUnmountFailedUpdatedApexActive) {
   {
     auto active_apex = GetActivePackage("test.apex.rebootless");
     ASSERT_THAT(active_apex, Ok());
-    ASSERT_EQ(active_apex->GetPath(), file_path);
+    ASSERT_EQ((*active_apex)->path, file_path);
   }
 
   unique_fd fd(open("/apex/test.apex.rebootless/apex_manifest.pb",
@@ -1495,7 +1751,7 @@ TEST_F(ApexdMountTest, InstallPackageUnmountFailedUpdatedApexActive) {
   // Check that GetActivePackage correctly reports old apex.
   auto active_apex = GetActivePackage("test.apex.rebootless");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), file_path);
+  ASSERT_EQ((*active_apex)->path, file_path);
 
   // Check that old APEX is still around
   ASSERT_EQ(0, access(file_path.c_str(), F_OK))
@@ -1560,6 +1816,128 @@ TEST_F(ApexdMountTest, InstallPackageUpdatesApexInfoList) {
                                    ApexInfoXmlEq(apex_info_xml_3)));
 }
 
+TEST_F(ApexdMountTest, InstallPackageDoesNotStackApexInfoListMounts) {
+  auto apex_1 = AddPreInstalledApex("test.rebootless_apex_v1.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  UnmountOnTearDown(apex_1);
+  ASSERT_THAT(ActivatePackage(apex_1), Ok());
+  OnAllPackagesActivated(/* is_bootstrap= */ false);
+
+  for (int i = 0; i < 2; i++) {
+    auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"),
+                              /* force= */ false);
+    ASSERT_THAT(ret, Ok());
+    UnmountOnTearDown(ret->GetPath());
+  }
+
+  std::string mountinfo;
+  ASSERT_TRUE(ReadFileToString("/proc/self/mountinfo", &mountinfo));
+  size_t xml_mounts = 0;
+  size_t index_mounts = 0;
+  for (const auto& line : Split(mountinfo, "\n")) {
+    std::vector<std::string> tokens = Split(line, " ");
+    if (tokens.size() < 5) {
+      continue;
+    }
+    if (tokens[4] == "/apex/apex-info-list.xml") {
+      xml_mounts++;
+    } else if (tokens[4] == "/apex/apex-info-list.bin") {
+      index_mounts++;
+    }
+  }
+  ASSERT_EQ(xml_mounts, 1u);
+  ASSERT_EQ(index_mounts, 1u);
+}
+
+static size_t CountMountsAt(const std::string& path) {
+  std::string mountinfo;
+  if (!ReadFileToString("/proc/self/mountinfo", &mountinfo)) {
+    return 0;
+  }
+  size_t count = 0;
+  for (const auto& line : Split(mountinfo, "\n")) {
+    std::vector<std::string> tokens = Split(line, " ");
+    if (tokens.size() >= 5 && tokens[4] == path) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Creates |td|/old and |td|/new, each with a file telling them apart, and an
+// empty |td|/target.
+static void SetUpSwapBindMountDirs(const TemporaryDir& td) {
+  for (const auto& name : {"old", "new"}) {
+    std::string dir = StringPrintf("%s/%s", td.path, name);
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    ASSERT_TRUE(WriteStringToFile(name, dir + "/file"));
+  }
+  std::string target = StringPrintf("%s/target", td.path);
+  ASSERT_EQ(0, mkdir(target.c_str(), 0755));
+}
+
+TEST_F(ApexdMountTest, SwapBindMountReplacesBindMount) {
+  ASSERT_NO_FATAL_FAILURE(SetUpSwapBindMountDirs(td_));
+  std::string target = StringPrintf("%s/target", td_.path);
+  auto unmount = make_scope_guard([&]() {
+    while (umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) == 0) {
+    }
+  });
+  ASSERT_THAT(
+      apexd_private::BindMount(target, StringPrintf("%s/old", td_.path)),
+      Ok());
+
+  ASSERT_THAT(
+      apexd_private::SwapBindMount(target, StringPrintf("%s/new", td_.path)),
+      Ok());
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(target + "/file", &content));
+  ASSERT_EQ("new", content);
+  ASSERT_EQ(1u, CountMountsAt(target));
+}
+
+TEST_F(ApexdMountTest, SwapBindMountFallsBackToPlainBindMount) {
+  ASSERT_NO_FATAL_FAILURE(SetUpSwapBindMountDirs(td_));
+  std::string target = StringPrintf("%s/target", td_.path);
+  auto unmount = make_scope_guard([&]() {
+    while (umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) == 0) {
+    }
+  });
+
+  // Nothing is mounted on |target|, so there's nothing to mount beneath.
+  ASSERT_THAT(
+      apexd_private::SwapBindMount(target, StringPrintf("%s/new", td_.path)),
+      Ok());
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(target + "/file", &content));
+  ASSERT_EQ("new", content);
+  ASSERT_EQ(1u, CountMountsAt(target));
+}
+
+TEST_F(ApexdMountTest, SwapBindMountKeepsOldBindMountOnFailure) {
+  ASSERT_NO_FATAL_FAILURE(SetUpSwapBindMountDirs(td_));
+  std::string target = StringPrintf("%s/target", td_.path);
+  auto unmount = make_scope_guard([&]() {
+    while (umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) == 0) {
+    }
+  });
+  ASSERT_THAT(
+      apexd_private::BindMount(target, StringPrintf("%s/old", td_.path)),
+      Ok());
+
+  ASSERT_THAT(apexd_private::SwapBindMount(
+                  target, StringPrintf("%s/missing", td_.path)),
+              Not(Ok()));
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(target + "/file", &content));
+  ASSERT_EQ("old", content);
+  ASSERT_EQ(1u, CountMountsAt(target));
+}
+
 TEST_F(ApexdMountTest, ActivatePackageBannedName) {
   auto status = ActivatePackage(GetTestFile("sharedlibs.apex"));
   ASSERT_THAT(status,
@@ -1614,7 +1992,7 @@ TEST_F(ApexdMountTest, ActivatePackage) {
 
   auto active_apex = GetActivePackage("com.android.apex.test_package");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), file_path);
+  ASSERT_EQ((*active_apex)->path, file_path);
 
   auto apex_mounts = GetApexMounts();
   ASSERT_THAT(apex_mounts,
@@ -1637,7 +2015,7 @@ TEST_F(ApexdMountTest, ActivatePackageShowsUpInMountedApexDatabase) {
 
   auto active_apex = GetActivePackage("com.android.apex.test_package");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), file_path);
+  ASSERT_EQ((*active_apex)->path, file_path);
 
   auto apex_mounts = GetApexMounts();
   ASSERT_THAT(apex_mounts,
@@ -1658,6 +2036,39 @@ TEST_F(ApexdMountTest, ActivatePackageShowsUpInMountedApexDatabase) {
       << "mounted apexes";
 }
 
+TEST_F(ApexdMountTest, MountedApexDatabaseKeepsApexMetadata) {
+  std::string file_path = AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_THAT(ActivatePackage(file_path), Ok());
+  UnmountOnTearDown(file_path);
+
+  auto apex_file = ApexFile::Open(file_path);
+  ASSERT_THAT(apex_file, Ok());
+
+  auto& db = GetApexDatabaseForTesting();
+  auto check_metadata = [&]() {
+    auto data = db.GetLatestMountedApex("com.android.apex.test_package");
+    ASSERT_TRUE(data.has_value());
+    ASSERT_NE(data->metadata, nullptr);
+    ASSERT_EQ(data->metadata->path, file_path);
+    ASSERT_EQ(data->metadata->version, 1);
+    ASSERT_EQ(data->metadata->public_key, apex_file->GetBundledPublicKey());
+  };
+  check_metadata();
+
+  // Metadata should also be restored when the database is rebuilt from
+  // mounts.
+  db.Reset();
+  db.PopulateFromMounts(GetDataDir(), GetDecompressionDir(), GetHashTreeDir());
+  check_metadata();
+
+  auto active_apex = GetActivePackage("com.android.apex.test_package");
+  ASSERT_THAT(active_apex, Ok());
+  ASSERT_EQ((*active_apex)->path, file_path);
+  ASSERT_EQ((*active_apex)->name, "com.android.apex.test_package");
+}
+
 TEST_F(ApexdMountTest, ActivatePackageNoHashtree) {
   AddPreInstalledApex("apex.apexd_test.apex");
   ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
@@ -1871,7 +2282,7 @@ TEST_F(ApexdMountTest, ActivateDeactivateSharedLibsApex) {
 
   auto active_apex = GetActivePackage("com.android.apex.test.sharedlibs");
   ASSERT_THAT(active_apex, Ok());
-  ASSERT_EQ(active_apex->GetPath(), file_path);
+  ASSERT_EQ((*active_apex)->path, file_path);
 
   auto apex_mounts = GetApexMounts();
   ASSERT_THAT(apex_mounts,
@@ -3154,6 +3565,80 @@ TEST_F(ApexdMountTest, OnStartDataHasHigherVersion) {
                                    "/apex/com.android.apex.test_package_2@1"));
 }
 
+// Writes an activation plan activating the pre-installed |apex_path|, with
+// the fingerprint the APEX directories have right now.
+static void WritePreInstalledActivationPlan(
+    const std::string& apex_path, const std::vector<std::string>& dirs,
+    const std::string& plan_path) {
+  auto apex = ApexFile::Open(apex_path);
+  ASSERT_THAT(apex, Ok());
+  auto entry =
+      CreateActivationPlanEntry(*apex, ActivationPlanEntry::PRE_INSTALLED);
+  ASSERT_THAT(entry, Ok());
+  auto fingerprint = ComputeActivationPlanFingerprint(dirs);
+  ASSERT_THAT(fingerprint, Ok());
+  ActivationPlan plan;
+  *plan.add_entries() = std::move(*entry);
+  plan.set_fingerprint(*fingerprint);
+  ASSERT_THAT(WriteActivationPlan(plan, plan_path), Ok());
+}
+
+TEST_F(ApexdMountTest, OnStartReusesActivationPlan) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
+  AddDataApex("apex.apexd_test_v2.apex");
+
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  // The previous boot settled on the pre-installed version, and no APEX has
+  // changed since. Selecting from scratch would activate the data version.
+  ASSERT_NO_FATAL_FAILURE(WritePreInstalledActivationPlan(
+      apex_path_1, {GetBuiltInDir(), GetDataDir(), GetDecompressionDir()},
+      GetActivationPlanPath()));
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path_1);
+
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.test_package",
+                                   "/apex/com.android.apex.test_package@1"));
+}
+
+TEST_F(ApexdMountTest, OnStartIgnoresActivationPlanAfterDataDirChanged) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
+
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  ASSERT_NO_FATAL_FAILURE(WritePreInstalledActivationPlan(
+      apex_path_1, {GetBuiltInDir(), GetDataDir(), GetDecompressionDir()},
+      GetActivationPlanPath()));
+
+  // A newer version lands on /data after the plan was written.
+  std::string apex_path_2 = AddDataApex("apex.apexd_test_v2.apex");
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path_2);
+
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.test_package",
+                                   "/apex/com.android.apex.test_package@2"));
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasWrongSHA) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -4158,7 +4643,7 @@ TEST_F(ApexdMountTest, GetActivePackagesReturningBlockApexesAsWell) {
 
   auto active_apexes = GetActivePackages();
   ASSERT_EQ(1u, active_apexes.size());
-  ASSERT_EQ(path1, active_apexes[0].GetPath());
+  ASSERT_EQ(path1, active_apexes[0]->path);
 }
 
 TEST_F(ApexdMountTest, OnStartInVmModeFailsWithWrongRootDigest) {
@@ -4669,6 +5154,27 @@ TEST_F(ApexdUnitTest, StagePackagesMultiplePackages) {
   ASSERT_EQ(0, access(staged_path2.c_str(), F_OK));
 }
 
+TEST_F(ApexdUnitTest, StagePackagesClearsPreviouslyActiveRebootlessPackage) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  AddPreInstalledApex("apex.apexd_test_different_app.apex");
+  auto& instance = ApexFileRepository::GetInstance();
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  auto current_apex = AddDataApex("apex.apexd_test.apex",
+                                  "com.android.apex.test_package@1_1.apex");
+  auto other_apex = AddDataApex("apex.apexd_test_different_app.apex");
+
+  auto status = StagePackages({GetTestFile("apex.apexd_test_v2.apex")});
+  ASSERT_THAT(status, Ok());
+
+  auto staged_path = StringPrintf("%s/com.android.apex.test_package@2.apex",
+                                  GetDataDir().c_str());
+  ASSERT_EQ(0, access(staged_path.c_str(), F_OK));
+  ASSERT_EQ(-1, access(current_apex.c_str(), F_OK));
+  ASSERT_EQ(ENOENT, errno);
+  ASSERT_EQ(0, access(other_apex.c_str(), F_OK));
+}
+
 TEST_F(ApexdUnitTest, UnstagePackages) {
   auto file_path1 = AddDataApex("apex.apexd_test.apex");
   auto file_path2 = AddDataApex("apex.apexd_test_different_app.apex");
@@ -4756,6 +5262,22 @@ TEST_F(ApexdUnitTest, MountAndDeriveClassPathJarsPresent) {
   ASSERT_THAT(class_path->HasClassPathJars(package_name), true);
 }
 
+TEST_F(ApexdUnitTest, MountAndDeriveClassPathTwiceReturnsSameResult) {
+  AddPreInstalledApex("apex.apexd_test_classpath.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  auto apex_file =
+      ApexFile::Open(GetTestFile("apex.apexd_test_classpath.apex"));
+  auto package_name = apex_file->GetManifest().name();
+  std::vector<ApexFile> apex_files;
+  apex_files.emplace_back(std::move(*apex_file));
+  for (int i = 0; i < 2; i++) {
+    auto class_path = MountAndDeriveClassPath(apex_files);
+    ASSERT_THAT(class_path, Ok());
+    ASSERT_THAT(class_path->HasClassPathJars(package_name), true);
+  }
+}
+
 TEST_F(ApexdUnitTest, ProcessCompressedApexWrongSELinuxContext) {
   auto compressed_apex = ApexFile::Open(
       AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
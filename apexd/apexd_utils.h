@@ -17,9 +17,12 @@
 #ifndef ANDROID_APEXD_APEXD_UTILS_H_
 #define ANDROID_APEXD_APEXD_UTILS_H_
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <future>
 #include <string>
 #include <thread>
 #include <type_traits>
@@ -78,6 +81,47 @@ android::base::Result<std::vector<std::string>> ReadDir(const std::string& path,
   return ret;
 }
 
+// Runs fn(0), ..., fn(count - 1) on up to |max_workers| threads, the calling
+// thread being one of them, and returns the first failure in index order.
+// Indices past a failed one may be skipped.
+template <typename Fn>
+android::base::Result<void> RunInParallel(size_t count, size_t max_workers,
+                                          Fn fn) {
+  if (count == 0) {
+    return {};
+  }
+  std::vector<android::base::Result<void>> results(count);
+  std::atomic<size_t> next_index = 0;
+  std::atomic<size_t> first_failure = count;
+  auto worker = [&]() {
+    for (size_t i = next_index++; i < count && i < first_failure;
+         i = next_index++) {
+      results[i] = fn(i);
+      if (!results[i].ok()) {
+        size_t failure = first_failure;
+        while (i < failure &&
+               !first_failure.compare_exchange_weak(failure, i)) {
+        }
+      }
+    }
+  };
+  size_t num_workers = std::clamp<size_t>(max_workers, 1, count);
+  std::vector<std::future<void>> futures;
+  for (size_t i = 1; i < num_workers; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  worker();
+  for (auto& future : futures) {
+    future.get();
+  }
+  for (auto& result : results) {
+    if (!result.ok()) {
+      return result.error();
+    }
+  }
+  return {};
+}
+
 inline bool IsEmptyDirectory(const std::string& path) {
   auto res = ReadDir(path, [](auto _) { return true; });
   return res.ok() && res->empty();
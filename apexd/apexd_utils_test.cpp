@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <new>
@@ -39,9 +40,13 @@ namespace {
 namespace fs = std::filesystem;
 
 using android::base::Basename;
+using android::base::Error;
 using android::base::Join;
+using android::base::Result;
 using android::base::StringPrintf;
+using android::base::testing::HasError;
 using android::base::testing::Ok;
+using android::base::testing::WithMessage;
 using ::testing::Not;
 using ::testing::UnorderedElementsAre;
 using ::testing::UnorderedElementsAreArray;
@@ -204,6 +209,35 @@ TEST(ApexdUtilTest, MoveDirToDoesNotExist) {
               UnorderedElementsAre(from_1.path, from_subdir, from_2.path));
 }
 
+TEST(ApexdUtilTest, RunInParallelNothingToRun) {
+  ASSERT_THAT(RunInParallel(0, 4, [](size_t) -> Result<void> {
+                return Error() << "unexpected call";
+              }),
+              Ok());
+}
+
+TEST(ApexdUtilTest, RunInParallelRunsEveryIndexOnce) {
+  std::vector<std::atomic<int>> calls(100);
+  ASSERT_THAT(RunInParallel(calls.size(), 4, [&](size_t i) -> Result<void> {
+                calls[i]++;
+                return {};
+              }),
+              Ok());
+  for (const auto& count : calls) {
+    ASSERT_EQ(1, count);
+  }
+}
+
+TEST(ApexdUtilTest, RunInParallelReturnsFirstFailureInIndexOrder) {
+  auto result = RunInParallel(100, 4, [](size_t i) -> Result<void> {
+    if (i % 10 == 3) {
+      return Error() << "failed " << i;
+    }
+    return {};
+  });
+  ASSERT_THAT(result, HasError(WithMessage("failed 3")));
+}
+
 TEST(ApexdUtilTest, FindFilesBySuffix) {
   TemporaryDir td;
 
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_verified_apex.h"
+
+#include <openssl/sha.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <memory>
+#include <string>
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+int64_t GetMtimeNs(const struct stat& st) {
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+}
+
+std::string Sha256(const std::string& data) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return std::string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+}  // namespace
+
+Result<VerifiedApex> CreateVerifiedApex(const ApexFile& apex,
+                                        const std::string& public_key,
+                                        const ApexVerityData& verity_data,
+                                        const std::string& hashtree_file) {
+  struct stat st;
+  if (stat(apex.GetPath().c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << apex.GetPath();
+  }
+  VerifiedApex verified;
+  verified.set_name(apex.GetManifest().name());
+  verified.set_inode(st.st_ino);
+  verified.set_size(st.st_size);
+  verified.set_mtime_ns(GetMtimeNs(st));
+  verified.set_public_key_sha256(Sha256(public_key));
+
+  const AvbHashtreeDescriptor& desc = *verity_data.desc;
+  verified.set_dm_verity_version(desc.dm_verity_version);
+  verified.set_image_size(desc.image_size);
+  verified.set_tree_offset(desc.tree_offset);
+  verified.set_tree_size(desc.tree_size);
+  verified.set_data_block_size(desc.data_block_size);
+  verified.set_hash_block_size(desc.hash_block_size);
+  verified.set_fec_num_roots(desc.fec_num_roots);
+  verified.set_fec_offset(desc.fec_offset);
+  verified.set_fec_size(desc.fec_size);
+  verified.set_flags(desc.flags);
+  verified.set_hash_algorithm(verity_data.hash_algorithm);
+  verified.set_salt(verity_data.salt);
+  verified.set_root_digest(verity_data.root_digest);
+
+  if (desc.tree_size == 0) {
+    if (stat(hashtree_file.c_str(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << hashtree_file;
+    }
+    verified.set_hashtree_inode(st.st_ino);
+    verified.set_hashtree_size(st.st_size);
+    verified.set_hashtree_mtime_ns(GetMtimeNs(st));
+  }
+  return verified;
+}
+
+Result<void> CheckVerifiedApex(const VerifiedApex& verified,
+                               const ApexFile& apex,
+                               const std::string& public_key) {
+  if (verified.name() != apex.GetManifest().name()) {
+    return Error() << "Verified APEX " << verified.name() << " is not "
+                   << apex.GetManifest().name();
+  }
+  struct stat st;
+  if (stat(apex.GetPath().c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << apex.GetPath();
+  }
+  if (st.st_ino != verified.inode() || st.st_size != verified.size() ||
+      GetMtimeNs(st) != verified.mtime_ns()) {
+    return Error() << apex.GetPath() << " has changed since it was verified";
+  }
+  if (Sha256(public_key) != verified.public_key_sha256()) {
+    return Error() << apex.GetPath() << " was verified with another key";
+  }
+  return {};
+}
+
+ApexVerityData GetVerifiedVerityData(const VerifiedApex& verified) {
+  ApexVerityData verity_data;
+  verity_data.desc = std::make_unique<AvbHashtreeDescriptor>();
+  AvbHashtreeDescriptor& desc = *verity_data.desc;
+  desc.dm_verity_version = verified.dm_verity_version();
+  desc.image_size = verified.image_size();
+  desc.tree_offset = verified.tree_offset();
+  desc.tree_size = verified.tree_size();
+  desc.data_block_size = verified.data_block_size();
+  desc.hash_block_size = verified.hash_block_size();
+  desc.fec_num_roots = verified.fec_num_roots();
+  desc.fec_offset = verified.fec_offset();
+  desc.fec_size = verified.fec_size();
+  desc.flags = verified.flags();
+  // Leaves room for the terminating '\0'.
+  strncpy(reinterpret_cast<char*>(desc.hash_algorithm),
+          verified.hash_algorithm().c_str(), sizeof(desc.hash_algorithm) - 1);
+  desc.salt_len = verified.salt().size() / 2;
+  desc.root_digest_len = verified.root_digest().size() / 2;
+  verity_data.hash_algorithm = verified.hash_algorithm();
+  verity_data.salt = verified.salt();
+  verity_data.root_digest = verified.root_digest();
+  return verity_data;
+}
+
+Result<void> CheckVerifiedHashtree(const VerifiedApex& verified,
+                                   const std::string& hashtree_file) {
+  if (verified.tree_size() != 0) {
+    return Error() << verified.name() << " has an embedded hashtree";
+  }
+  struct stat st;
+  if (stat(hashtree_file.c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << hashtree_file;
+  }
+  if (st.st_ino != verified.hashtree_inode() ||
+      st.st_size != verified.hashtree_size() ||
+      GetMtimeNs(st) != verified.hashtree_mtime_ns()) {
+    return Error() << hashtree_file << " has changed since it was verified";
+  }
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
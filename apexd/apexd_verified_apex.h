@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_VERIFIED_APEX_H_
+#define ANDROID_APEXD_APEXD_VERIFIED_APEX_H_
+
+#include <android-base/result.h>
+
+#include <string>
+
+#include "apex_file.h"
+#include "session_state.pb.h"
+
+namespace android {
+namespace apex {
+
+using VerifiedApex = ::apex::proto::SessionState::VerifiedApex;
+
+// Describes |apex|, whose |verity_data| was verified with |public_key|.
+// |hashtree_file| is the hashtree generated for it, if it doesn't have an
+// embedded one.
+android::base::Result<VerifiedApex> CreateVerifiedApex(
+    const ApexFile& apex, const std::string& public_key,
+    const ApexVerityData& verity_data, const std::string& hashtree_file);
+
+// Checks that |verified| describes the very same file as |apex|, verified with
+// |public_key|.
+android::base::Result<void> CheckVerifiedApex(const VerifiedApex& verified,
+                                              const ApexFile& apex,
+                                              const std::string& public_key);
+
+// Returns the verity data recorded in |verified|.
+ApexVerityData GetVerifiedVerityData(const VerifiedApex& verified);
+
+// Checks that |hashtree_file| is the very same hashtree file as the one
+// recorded in |verified|.
+android::base::Result<void> CheckVerifiedHashtree(
+    const VerifiedApex& verified, const std::string& hashtree_file);
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_VERIFIED_APEX_H_
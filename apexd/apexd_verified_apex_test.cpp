@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_verified_apex.h"
+
+#include <android-base/file.h>
+#include <android-base/result-gmock.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+#include "apex_file.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+namespace {
+
+namespace fs = std::filesystem;
+
+using android::base::GetExecutableDirectory;
+using android::base::StringPrintf;
+using android::base::testing::Ok;
+using ::testing::Not;
+
+std::string GetTestFile(const std::string& name) {
+  return GetExecutableDirectory() + "/" + name;
+}
+
+TEST(VerifiedApexTest, RecordsVerityData) {
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test.apex"));
+  ASSERT_THAT(apex, Ok());
+  const auto& key = apex->GetBundledPublicKey();
+  auto verity_data = apex->VerifyApexVerity(key);
+  ASSERT_THAT(verity_data, Ok());
+
+  auto verified = CreateVerifiedApex(*apex, key, *verity_data, "");
+  ASSERT_THAT(verified, Ok());
+  ASSERT_THAT(CheckVerifiedApex(*verified, *apex, key), Ok());
+
+  auto recorded = GetVerifiedVerityData(*verified);
+  ASSERT_EQ(verity_data->root_digest, recorded.root_digest);
+  ASSERT_EQ(verity_data->salt, recorded.salt);
+  ASSERT_EQ(verity_data->hash_algorithm, recorded.hash_algorithm);
+  ASSERT_EQ(verity_data->desc->dm_verity_version,
+            recorded.desc->dm_verity_version);
+  ASSERT_EQ(verity_data->desc->image_size, recorded.desc->image_size);
+  ASSERT_EQ(verity_data->desc->tree_offset, recorded.desc->tree_offset);
+  ASSERT_EQ(verity_data->desc->tree_size, recorded.desc->tree_size);
+  ASSERT_EQ(verity_data->desc->data_block_size,
+            recorded.desc->data_block_size);
+  ASSERT_EQ(verity_data->desc->hash_block_size,
+            recorded.desc->hash_block_size);
+}
+
+TEST(VerifiedApexTest, HardLinkIsTheSameApex) {
+  TemporaryDir td;
+  auto staged = StringPrintf("%s/staged.apex", td.path);
+  auto active = StringPrintf("%s/active.apex", td.path);
+  fs::copy(GetTestFile("apex.apexd_test.apex"), staged);
+  auto apex = ApexFile::Open(staged);
+  ASSERT_THAT(apex, Ok());
+  const auto& key = apex->GetBundledPublicKey();
+  auto verity_data = apex->VerifyApexVerity(key);
+  ASSERT_THAT(verity_data, Ok());
+  auto verified = CreateVerifiedApex(*apex, key, *verity_data, "");
+  ASSERT_THAT(verified, Ok());
+
+  // Like staging does.
+  ASSERT_EQ(0, link(staged.c_str(), active.c_str()));
+  auto active_apex = ApexFile::Open(active);
+  ASSERT_THAT(active_apex, Ok());
+  ASSERT_THAT(CheckVerifiedApex(*verified, *active_apex, key), Ok());
+}
+
+TEST(VerifiedApexTest, ModifiedApexIsRejected) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/staged.apex", td.path);
+  fs::copy(GetTestFile("apex.apexd_test.apex"), path);
+  auto apex = ApexFile::Open(path);
+  ASSERT_THAT(apex, Ok());
+  const auto& key = apex->GetBundledPublicKey();
+  auto verity_data = apex->VerifyApexVerity(key);
+  ASSERT_THAT(verity_data, Ok());
+  auto verified = CreateVerifiedApex(*apex, key, *verity_data, "");
+  ASSERT_THAT(verified, Ok());
+
+  fs::last_write_time(path,
+                      fs::last_write_time(path) + std::chrono::seconds(1));
+  ASSERT_THAT(CheckVerifiedApex(*verified, *apex, key), Not(Ok()));
+}
+
+TEST(VerifiedApexTest, OtherKeyIsRejected) {
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test.apex"));
+  ASSERT_THAT(apex, Ok());
+  const auto& key = apex->GetBundledPublicKey();
+  auto verity_data = apex->VerifyApexVerity(key);
+  ASSERT_THAT(verity_data, Ok());
+  auto verified = CreateVerifiedApex(*apex, key, *verity_data, "");
+  ASSERT_THAT(verified, Ok());
+
+  ASSERT_THAT(CheckVerifiedApex(*verified, *apex, key + "x"), Not(Ok()));
+}
+
+TEST(VerifiedApexTest, RecordsGeneratedHashtree) {
+  TemporaryDir td;
+  auto apex =
+      ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_THAT(apex, Ok());
+  const auto& key = apex->GetBundledPublicKey();
+  auto verity_data = apex->VerifyApexVerity(key);
+  ASSERT_THAT(verity_data, Ok());
+  ASSERT_EQ(0u, verity_data->desc->tree_size);
+
+  auto hashtree_file = StringPrintf("%s/hashtree.new", td.path);
+  ASSERT_TRUE(android::base::WriteStringToFile("hashtree", hashtree_file));
+  auto verified = CreateVerifiedApex(*apex, key, *verity_data, hashtree_file);
+  ASSERT_THAT(verified, Ok());
+
+  // Like staging does.
+  auto promoted = StringPrintf("%s/hashtree", td.path);
+  ASSERT_EQ(0, rename(hashtree_file.c_str(), promoted.c_str()));
+  ASSERT_THAT(CheckVerifiedHashtree(*verified, promoted), Ok());
+
+  ASSERT_TRUE(android::base::WriteStringToFile("regenerated", promoted));
+  ASSERT_THAT(CheckVerifiedHashtree(*verified, promoted), Not(Ok()));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
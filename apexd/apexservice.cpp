@@ -38,6 +38,7 @@
 #include "apex_file.h"
 #include "apex_file_repository.h"
 #include "apexd.h"
+#include "apexd_async_operations.h"
 #include "apexd_session.h"
 #include "string_log.h"
 
@@ -73,6 +74,41 @@ BinderStatus CheckCallerSystemOrRoot(const std::string& name) {
   return BinderStatus::ok();
 }
 
+// Number of threads asynchronous CE data operations run on. Synchronous calls
+// run on their own binder thread, in order with the operations for the same
+// user, so they never wait behind another user's operation.
+constexpr size_t kNumCeDataWorkers = 2;
+
+AsyncOperationRunner& GetCeDataRunner() {
+  static auto* runner = new AsyncOperationRunner(kNumCeDataWorkers);
+  return *runner;
+}
+
+// Starts a CE data operation for |user_id|, reporting to |callback|. Returns
+// the token of the operation.
+int64_t StartCeDataOperation(int user_id,
+                             std::vector<AsyncOperationRunner::Step> steps,
+                             const sp<IApexDataCallback>& callback) {
+  return GetCeDataRunner().Submit(
+      user_id, std::move(steps),
+      [callback](int64_t token, size_t done, size_t total) {
+        callback->onProgress(token, static_cast<int32_t>(done),
+                             static_cast<int32_t>(total));
+      },
+      [callback](int64_t token, const Result<void>& result) {
+        callback->onComplete(token, result.ok(),
+                             result.ok() ? "" : result.error().message());
+      });
+}
+
+BinderStatus CheckCallback(const sp<IApexDataCallback>& callback) {
+  if (callback == nullptr) {
+    return BinderStatus::fromExceptionCode(BinderStatus::EX_ILLEGAL_ARGUMENT,
+                                           String8("callback is null"));
+  }
+  return BinderStatus::ok();
+}
+
 class ApexService : public BnApexService {
  public:
   using BinderStatus = ::android::binder::Status;
@@ -95,6 +131,10 @@ class ApexService : public BnApexService {
   BinderStatus getActivePackage(const std::string& package_name,
                                 ApexInfo* aidl_return) override;
   BinderStatus getAllPackages(std::vector<ApexInfo>* aidl_return) override;
+  BinderStatus getPackagesByName(const std::vector<std::string>& package_names,
+                                 std::vector<ApexInfo>* aidl_return) override;
+  BinderStatus getChangesSince(int64_t generation,
+                               ApexInfoChanges* aidl_return) override;
   BinderStatus abortStagedSession(int session_id) override;
   BinderStatus revertActiveSessions() override;
   BinderStatus resumeRevertIfNeeded() override;
@@ -106,6 +146,21 @@ class ApexService : public BnApexService {
   BinderStatus destroyCeSnapshots(int user_id, int rollback_id) override;
   BinderStatus destroyCeSnapshotsNotSpecified(
       int user_id, const std::vector<int>& retain_rollback_ids) override;
+  BinderStatus snapshotCeDataAsync(int user_id, int rollback_id,
+                                   const std::vector<std::string>& apex_names,
+                                   const sp<IApexDataCallback>& callback,
+                                   int64_t* aidl_return) override;
+  BinderStatus restoreCeDataAsync(int user_id, int rollback_id,
+                                  const std::vector<std::string>& apex_names,
+                                  const sp<IApexDataCallback>& callback,
+                                  int64_t* aidl_return) override;
+  BinderStatus destroyCeSnapshotsAsync(int user_id, int rollback_id,
+                                       const sp<IApexDataCallback>& callback,
+                                       int64_t* aidl_return) override;
+  BinderStatus destroyCeSnapshotsNotSpecifiedAsync(
+      int user_id, const std::vector<int>& retain_rollback_ids,
+      const sp<IApexDataCallback>& callback, int64_t* aidl_return) override;
+  BinderStatus cancelCeDataOperation(int64_t token, bool* aidl_return) override;
   BinderStatus remountPackages() override;
   BinderStatus recollectPreinstalledData(
       const std::vector<std::string>& paths) override;
@@ -355,6 +410,20 @@ void ConvertToApexSessionInfo(const ApexSession& session,
   }
 }
 
+static std::string GetPreinstalledModulePath(
+    const std::string& preinstalled_path) {
+  // We replace the preinstalled paths for block devices to /system/apex
+  // because PackageManager will not resolve them if they aren't in one of
+  // the SYSTEM_PARTITIONS defined in PackagePartitions.java.
+  // b/195363518 for more context.
+  const std::string block_path = "/dev/block/";
+  if (!preinstalled_path.starts_with(block_path)) {
+    return preinstalled_path;
+  }
+  return std::string(kApexPackageSystemDir) + "/" +
+         preinstalled_path.substr(block_path.length());
+}
+
 static ApexInfo GetApexInfo(const ApexFile& package) {
   auto& instance = ApexFileRepository::GetInstance();
   ApexInfo out;
@@ -367,22 +436,47 @@ static ApexInfo GetApexInfo(const ApexFile& package) {
   Result<std::string> preinstalled_path =
       instance.GetPreinstalledPath(package.GetManifest().name());
   if (preinstalled_path.ok()) {
-    // We replace the preinstalled paths for block devices to /system/apex
-    // because PackageManager will not resolve them if they aren't in one of
-    // the SYSTEM_PARTITIONS defined in PackagePartitions.java.
-    // b/195363518 for more context.
-    const std::string block_path = "/dev/block/";
-    const std::string sys_apex_path =
-        std::string(kApexPackageSystemDir) + "/" +
-        preinstalled_path->substr(block_path.length());
-    out.preinstalledModulePath = preinstalled_path->starts_with(block_path)
-                                     ? sys_apex_path
-                                     : *preinstalled_path;
+    out.preinstalledModulePath = GetPreinstalledModulePath(*preinstalled_path);
   }
   out.activeApexChanged = ::android::apex::IsActiveApexChanged(package);
   return out;
 }
 
+static ApexInfo GetApexInfo(const ApexMetadata& package) {
+  auto& instance = ApexFileRepository::GetInstance();
+  ApexInfo out;
+  out.moduleName = package.name;
+  out.modulePath = package.path;
+  out.versionCode = package.version;
+  out.versionName = package.version_name;
+  out.isFactory = instance.IsPreInstalledApex(package);
+  out.isActive = false;
+  Result<std::string> preinstalled_path =
+      instance.GetPreinstalledPath(package.name);
+  if (preinstalled_path.ok()) {
+    out.preinstalledModulePath = GetPreinstalledModulePath(*preinstalled_path);
+  }
+  out.activeApexChanged = ::android::apex::IsActiveApexChanged(package);
+  return out;
+}
+
+static ApexInfo GetApexInfo(const ApexInfoListModel::Package& package) {
+  const ApexInfoEntry& entry = package.entry;
+  ApexInfo out;
+  out.moduleName = entry.module_name;
+  out.modulePath = entry.module_path;
+  out.versionCode = entry.version_code;
+  out.versionName = entry.version_name;
+  out.isFactory = entry.is_factory;
+  out.isActive = entry.is_active;
+  if (entry.preinstalled_module_path.has_value()) {
+    out.preinstalledModulePath =
+        GetPreinstalledModulePath(*entry.preinstalled_module_path);
+  }
+  out.activeApexChanged = package.active_apex_changed;
+  return out;
+}
+
 static std::string ToString(const ApexInfo& package) {
   std::string msg = StringLog()
                     << "Module: " << package.moduleName
@@ -404,7 +498,7 @@ BinderStatus ApexService::getSessions(
     return check;
   }
 
-  auto sessions = ApexSession::GetSessions();
+  auto sessions = ::android::apex::GetSessions();
   for (const auto& session : sessions) {
     ApexSessionInfo session_info;
     ConvertToApexSessionInfo(session, &session_info);
@@ -424,7 +518,7 @@ BinderStatus ApexService::getStagedSessionInfo(
     return check;
   }
 
-  auto session = ApexSession::GetSession(session_id);
+  auto session = ::android::apex::GetSession(session_id);
   if (!session.ok()) {
     // Unknown session.
     ClearSessionInfo(apex_session_info);
@@ -489,7 +583,7 @@ BinderStatus ApexService::getActivePackages(
 
   auto packages = ::android::apex::GetActivePackages();
   for (const auto& package : packages) {
-    ApexInfo apex_info = GetApexInfo(package);
+    ApexInfo apex_info = GetApexInfo(*package);
     apex_info.isActive = true;
     aidl_return->push_back(std::move(apex_info));
   }
@@ -507,9 +601,9 @@ BinderStatus ApexService::getActivePackage(const std::string& package_name,
     return check;
   }
 
-  Result<ApexFile> apex = ::android::apex::GetActivePackage(package_name);
+  auto apex = ::android::apex::GetActivePackage(package_name);
   if (apex.ok()) {
-    *aidl_return = GetApexInfo(*apex);
+    *aidl_return = GetApexInfo(**apex);
     aidl_return->isActive = true;
   }
   return BinderStatus::ok();
@@ -525,22 +619,61 @@ BinderStatus ApexService::getAllPackages(std::vector<ApexInfo>* aidl_return) {
 
   const auto& active = ::android::apex::GetActivePackages();
   const auto& factory = ::android::apex::GetFactoryPackages();
-  for (const ApexFile& pkg : active) {
-    ApexInfo apex_info = GetApexInfo(pkg);
+  for (const auto& pkg : active) {
+    ApexInfo apex_info = GetApexInfo(*pkg);
     apex_info.isActive = true;
     aidl_return->push_back(std::move(apex_info));
   }
-  for (const ApexFile& pkg : factory) {
+  for (const auto& pkg : factory) {
     const auto& same_path = [&pkg](const auto& o) {
-      return o.GetPath() == pkg.GetPath();
+      return o->path == pkg->path;
     };
     if (std::find_if(active.begin(), active.end(), same_path) == active.end()) {
-      aidl_return->push_back(GetApexInfo(pkg));
+      aidl_return->push_back(GetApexInfo(*pkg));
     }
   }
   return BinderStatus::ok();
 }
 
+BinderStatus ApexService::getPackagesByName(
+    const std::vector<std::string>& package_names,
+    std::vector<ApexInfo>* aidl_return) {
+  LOG(DEBUG) << "getPackagesByName received by ApexService package_names : ["
+             << Join(package_names, ',') << "]";
+
+  auto check = CheckCallerSystemOrRoot("getPackagesByName");
+  if (!check.isOk()) {
+    return check;
+  }
+
+  for (const auto& package :
+       ::android::apex::GetPackagesByName(package_names)) {
+    aidl_return->push_back(GetApexInfo(package));
+  }
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::getChangesSince(int64_t generation,
+                                          ApexInfoChanges* aidl_return) {
+  LOG(DEBUG) << "getChangesSince received by ApexService generation : "
+             << generation;
+
+  auto check = CheckCallerSystemOrRoot("getChangesSince");
+  if (!check.isOk()) {
+    return check;
+  }
+
+  auto changes = ::android::apex::GetPackageChangesSince(
+      static_cast<uint64_t>(generation));
+  aidl_return->generation = static_cast<int64_t>(changes.generation);
+  aidl_return->isFullList = changes.is_full_list;
+  for (const auto& package : changes.changed) {
+    aidl_return->changed.push_back(GetApexInfo(package));
+  }
+  aidl_return->removedPaths = std::move(changes.removed_paths);
+  return BinderStatus::ok();
+}
+
 BinderStatus ApexService::installAndActivatePackage(
     const std::string& package_path, bool force, ApexInfo* aidl_return) {
   LOG(INFO) << "installAndActivatePackage() received by ApexService, path: "
@@ -638,8 +771,9 @@ BinderStatus ApexService::snapshotCeData(int user_id, int rollback_id,
     return check;
   }
 
-  Result<void> res =
-      ::android::apex::SnapshotCeData(user_id, rollback_id, apex_name);
+  Result<void> res = GetCeDataRunner().Run(user_id, {[&]() {
+    return ::android::apex::SnapshotCeData(user_id, rollback_id, apex_name);
+  }});
   if (!res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -658,8 +792,9 @@ BinderStatus ApexService::restoreCeData(int user_id, int rollback_id,
     return check;
   }
 
-  Result<void> res =
-      ::android::apex::RestoreCeData(user_id, rollback_id, apex_name);
+  Result<void> res = GetCeDataRunner().Run(user_id, {[&]() {
+    return ::android::apex::RestoreCeData(user_id, rollback_id, apex_name);
+  }});
   if (!res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -695,7 +830,9 @@ BinderStatus ApexService::destroyCeSnapshots(int user_id, int rollback_id) {
     return check;
   }
 
-  Result<void> res = ::android::apex::DestroyCeSnapshots(user_id, rollback_id);
+  Result<void> res = GetCeDataRunner().Run(user_id, {[&]() {
+    return ::android::apex::DestroyCeSnapshots(user_id, rollback_id);
+  }});
   if (!res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -716,8 +853,10 @@ BinderStatus ApexService::destroyCeSnapshotsNotSpecified(
     return check;
   }
 
-  Result<void> res = ::android::apex::DestroyCeSnapshotsNotSpecified(
-      user_id, retain_rollback_ids);
+  Result<void> res = GetCeDataRunner().Run(user_id, {[&]() {
+    return ::android::apex::DestroyCeSnapshotsNotSpecified(user_id,
+                                                           retain_rollback_ids);
+  }});
   if (!res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -726,6 +865,119 @@ BinderStatus ApexService::destroyCeSnapshotsNotSpecified(
   return BinderStatus::ok();
 }
 
+BinderStatus ApexService::snapshotCeDataAsync(
+    int user_id, int rollback_id, const std::vector<std::string>& apex_names,
+    const sp<IApexDataCallback>& callback, int64_t* aidl_return) {
+  LOG(INFO) << "snapshotCeDataAsync() received by ApexService user_id : "
+            << user_id << " rollback_id : " << rollback_id
+            << " apex_names : [" << Join(apex_names, ',') << "]";
+
+  auto check = CheckCallerSystemOrRoot("snapshotCeDataAsync");
+  if (!check.isOk()) {
+    return check;
+  }
+  if (auto status = CheckCallback(callback); !status.isOk()) {
+    return status;
+  }
+
+  std::vector<AsyncOperationRunner::Step> steps;
+  for (const auto& apex_name : apex_names) {
+    steps.push_back([user_id, rollback_id, apex_name]() {
+      return ::android::apex::SnapshotCeData(user_id, rollback_id, apex_name);
+    });
+  }
+  *aidl_return = StartCeDataOperation(user_id, std::move(steps), callback);
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::restoreCeDataAsync(
+    int user_id, int rollback_id, const std::vector<std::string>& apex_names,
+    const sp<IApexDataCallback>& callback, int64_t* aidl_return) {
+  LOG(INFO) << "restoreCeDataAsync() received by ApexService user_id : "
+            << user_id << " rollback_id : " << rollback_id
+            << " apex_names : [" << Join(apex_names, ',') << "]";
+
+  auto check = CheckCallerSystemOrRoot("restoreCeDataAsync");
+  if (!check.isOk()) {
+    return check;
+  }
+  if (auto status = CheckCallback(callback); !status.isOk()) {
+    return status;
+  }
+
+  std::vector<AsyncOperationRunner::Step> steps;
+  for (const auto& apex_name : apex_names) {
+    steps.push_back([user_id, rollback_id, apex_name]() {
+      return ::android::apex::RestoreCeData(user_id, rollback_id, apex_name);
+    });
+  }
+  *aidl_return = StartCeDataOperation(user_id, std::move(steps), callback);
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::destroyCeSnapshotsAsync(
+    int user_id, int rollback_id, const sp<IApexDataCallback>& callback,
+    int64_t* aidl_return) {
+  LOG(INFO) << "destroyCeSnapshotsAsync() received by ApexService user_id : "
+            << user_id << " rollback_id : " << rollback_id;
+
+  auto check = CheckCallerSystemOrRoot("destroyCeSnapshotsAsync");
+  if (!check.isOk()) {
+    return check;
+  }
+  if (auto status = CheckCallback(callback); !status.isOk()) {
+    return status;
+  }
+
+  *aidl_return = StartCeDataOperation(
+      user_id,
+      {[user_id, rollback_id]() {
+        return ::android::apex::DestroyCeSnapshots(user_id, rollback_id);
+      }},
+      callback);
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::destroyCeSnapshotsNotSpecifiedAsync(
+    int user_id, const std::vector<int>& retain_rollback_ids,
+    const sp<IApexDataCallback>& callback, int64_t* aidl_return) {
+  LOG(INFO) << "destroyCeSnapshotsNotSpecifiedAsync() received by ApexService "
+               "user_id : "
+            << user_id << " retain_rollback_ids : ["
+            << Join(retain_rollback_ids, ',') << "]";
+
+  auto check = CheckCallerSystemOrRoot("destroyCeSnapshotsNotSpecifiedAsync");
+  if (!check.isOk()) {
+    return check;
+  }
+  if (auto status = CheckCallback(callback); !status.isOk()) {
+    return status;
+  }
+
+  *aidl_return = StartCeDataOperation(
+      user_id,
+      {[user_id, retain_rollback_ids]() {
+        return ::android::apex::DestroyCeSnapshotsNotSpecified(
+            user_id, retain_rollback_ids);
+      }},
+      callback);
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::cancelCeDataOperation(int64_t token,
+                                                bool* aidl_return) {
+  LOG(INFO) << "cancelCeDataOperation() received by ApexService token : "
+            << token;
+
+  auto check = CheckCallerSystemOrRoot("cancelCeDataOperation");
+  if (!check.isOk()) {
+    return check;
+  }
+
+  *aidl_return = GetCeDataRunner().Cancel(token);
+  return BinderStatus::ok();
+}
+
 BinderStatus ApexService::remountPackages() {
   LOG(INFO) << "remountPackages() received by ApexService";
 
@@ -833,7 +1085,7 @@ status_t ApexService::dump(int fd, const Vector<String16>& /*args*/) {
   }
 
   dprintf(fd, "SESSIONS:\n");
-  std::vector<ApexSession> sessions = ApexSession::GetSessions();
+  std::vector<ApexSession> sessions = ::android::apex::GetSessions();
 
   for (const auto& session : sessions) {
     std::string child_ids_str = "";
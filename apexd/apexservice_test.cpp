@@ -23,9 +23,11 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android/apex/ApexInfo.h>
+#include <android/apex/BnApexDataCallback.h>
 #include <android/apex/IApexService.h>
 #include <android/os/IVold.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 #include <fs_mgr_overlayfs.h>
 #include <fstab/fstab.h>
 #include <gmock/gmock.h>
@@ -41,10 +43,13 @@
 #include <sys/xattr.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_set>
@@ -84,7 +89,10 @@ using android::base::testing::Ok;
 using android::dm::DeviceMapper;
 using ::apex::proto::ApexManifest;
 using ::apex::proto::SessionState;
+using ::testing::Each;
+using ::testing::ElementsAre;
 using ::testing::EndsWith;
+using ::testing::HasSubstr;
 using ::testing::Not;
 using ::testing::SizeIs;
 using ::testing::UnorderedElementsAre;
@@ -387,6 +395,7 @@ class ApexServiceTest : public ::testing::Test {
   void CleanUp() {
     DeleteDirContent(kActiveApexPackagesDataDir);
     DeleteDirContent(kApexBackupDir);
+    DeleteIfExists(std::string(kApexBackupDir) + ".new");
     DeleteDirContent(kApexHashTreeDir);
     DeleteDirContent(GetSessionsDir());
 
@@ -712,6 +721,178 @@ TEST_F(ApexServiceTest, DestroyCeSnapshotsNotSpecified) {
   ASSERT_FALSE(DirExists("/data/misc_ce/0/apexrollback/98765"));
 }
 
+// Records what an asynchronous CE data operation reports to its callback.
+class DataCallback : public android::apex::BnApexDataCallback {
+ public:
+  android::binder::Status onProgress(int64_t token, int32_t completed,
+                                     int32_t total) override {
+    std::lock_guard lock(mutex_);
+    tokens_.push_back(token);
+    progress_.push_back(completed);
+    total_ = total;
+    return android::binder::Status::ok();
+  }
+
+  android::binder::Status onComplete(
+      int64_t token, bool success, const std::string& error_message) override {
+    {
+      std::lock_guard lock(mutex_);
+      tokens_.push_back(token);
+      completed_ = true;
+      success_ = success;
+      error_message_ = error_message;
+    }
+    cv_.notify_all();
+    return android::binder::Status::ok();
+  }
+
+  // Waits for onComplete(). Returns false if it doesn't come in time.
+  bool WaitForCompletion() {
+    std::unique_lock lock(mutex_);
+    return cv_.wait_for(lock, std::chrono::seconds(10),
+                        [this]() { return completed_; });
+  }
+
+  std::vector<int64_t> GetTokens() {
+    std::lock_guard lock(mutex_);
+    return tokens_;
+  }
+  std::vector<int32_t> GetProgress() {
+    std::lock_guard lock(mutex_);
+    return progress_;
+  }
+  int32_t GetTotal() {
+    std::lock_guard lock(mutex_);
+    return total_;
+  }
+  bool Succeeded() {
+    std::lock_guard lock(mutex_);
+    return success_;
+  }
+  std::string GetErrorMessage() {
+    std::lock_guard lock(mutex_);
+    return error_message_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<int64_t> tokens_;
+  std::vector<int32_t> progress_;
+  int32_t total_ = 0;
+  bool completed_ = false;
+  bool success_ = false;
+  std::string error_message_;
+};
+
+TEST_F(ApexServiceTest, SnapshotCeDataAsync) {
+  CreateDir("/data/misc_ce/0/apexdata/apex.apexd_test");
+  CreateFileWithExpectedProperties(
+      "/data/misc_ce/0/apexdata/apex.apexd_test/hello.txt");
+
+  auto callback = sp<DataCallback>::make();
+  int64_t token;
+  ASSERT_TRUE(IsOk(service_->snapshotCeDataAsync(
+      0, 123456, {"apex.apexd_test"}, callback, &token)));
+
+  ASSERT_TRUE(callback->WaitForCompletion());
+  ASSERT_TRUE(callback->Succeeded()) << callback->GetErrorMessage();
+  ASSERT_THAT(callback->GetProgress(), ElementsAre(1));
+  ASSERT_EQ(1, callback->GetTotal());
+  ASSERT_THAT(callback->GetTokens(), Each(token));
+  ExpectFileWithExpectedProperties(
+      "/data/misc_ce/0/apexrollback/123456/apex.apexd_test/hello.txt");
+}
+
+TEST_F(ApexServiceTest, RestoreCeDataAsync) {
+  CreateDir("/data/misc_ce/0/apexdata/apex.apexd_test");
+  CreateDir("/data/misc_ce/0/apexrollback/123456");
+  CreateDir("/data/misc_ce/0/apexrollback/123456/apex.apexd_test");
+  CreateFile("/data/misc_ce/0/apexdata/apex.apexd_test/newfile.txt");
+  CreateFileWithExpectedProperties(
+      "/data/misc_ce/0/apexrollback/123456/apex.apexd_test/oldfile.txt");
+
+  auto callback = sp<DataCallback>::make();
+  int64_t token;
+  ASSERT_TRUE(IsOk(service_->restoreCeDataAsync(
+      0, 123456, {"apex.apexd_test"}, callback, &token)));
+
+  ASSERT_TRUE(callback->WaitForCompletion());
+  ASSERT_TRUE(callback->Succeeded()) << callback->GetErrorMessage();
+  ExpectFileWithExpectedProperties(
+      "/data/misc_ce/0/apexdata/apex.apexd_test/oldfile.txt");
+  EXPECT_FALSE(RegularFileExists(
+      "/data/misc_ce/0/apexdata/apex.apexd_test/newfile.txt"));
+}
+
+TEST_F(ApexServiceTest, DestroyCeSnapshotsAsync) {
+  CreateDir("/data/misc_ce/0/apexrollback/123456");
+  CreateDir("/data/misc_ce/0/apexrollback/123456/apex.apexd_test");
+  CreateFile("/data/misc_ce/0/apexrollback/123456/apex.apexd_test/file.txt");
+  CreateDir("/data/misc_ce/0/apexrollback/77777");
+  CreateDir("/data/misc_ce/0/apexrollback/77777/apex.apexd_test");
+  CreateFile("/data/misc_ce/0/apexrollback/77777/apex.apexd_test/thing.txt");
+
+  auto callback = sp<DataCallback>::make();
+  int64_t token;
+  ASSERT_TRUE(
+      IsOk(service_->destroyCeSnapshotsAsync(0, 123456, callback, &token)));
+  ASSERT_TRUE(callback->WaitForCompletion());
+  ASSERT_TRUE(callback->Succeeded()) << callback->GetErrorMessage();
+  ASSERT_FALSE(DirExists("/data/misc_ce/0/apexrollback/123456"));
+
+  auto not_specified_callback = sp<DataCallback>::make();
+  ASSERT_TRUE(IsOk(service_->destroyCeSnapshotsNotSpecifiedAsync(
+      0, {123}, not_specified_callback, &token)));
+  ASSERT_TRUE(not_specified_callback->WaitForCompletion());
+  ASSERT_TRUE(not_specified_callback->Succeeded())
+      << not_specified_callback->GetErrorMessage();
+  ASSERT_FALSE(DirExists("/data/misc_ce/0/apexrollback/77777"));
+}
+
+TEST_F(ApexServiceTest, CeDataAsyncRequiresCallback) {
+  int64_t token;
+  ASSERT_FALSE(IsOk(service_->snapshotCeDataAsync(
+      0, 123456, {"apex.apexd_test"}, nullptr, &token)));
+  ASSERT_FALSE(
+      IsOk(service_->destroyCeSnapshotsAsync(0, 123456, nullptr, &token)));
+}
+
+TEST_F(ApexServiceTest, CancelCeDataOperation) {
+  CreateDir("/data/misc_ce/0/apexdata/apex.apexd_test");
+  CreateFile("/data/misc_ce/0/apexdata/apex.apexd_test/hello.txt");
+
+  // Operations for the same user run one at a time, so the second one is
+  // likely still waiting for the first when it is cancelled.
+  auto first = sp<DataCallback>::make();
+  auto second = sp<DataCallback>::make();
+  int64_t first_token;
+  int64_t second_token;
+  ASSERT_TRUE(IsOk(service_->snapshotCeDataAsync(
+      0, 123456, {"apex.apexd_test"}, first, &first_token)));
+  ASSERT_TRUE(IsOk(service_->snapshotCeDataAsync(
+      0, 77777, {"apex.apexd_test"}, second, &second_token)));
+  bool cancelled;
+  ASSERT_TRUE(IsOk(service_->cancelCeDataOperation(second_token, &cancelled)));
+
+  ASSERT_TRUE(first->WaitForCompletion());
+  ASSERT_TRUE(first->Succeeded()) << first->GetErrorMessage();
+  ASSERT_TRUE(second->WaitForCompletion());
+  if (cancelled) {
+    ASSERT_FALSE(second->Succeeded());
+    ASSERT_THAT(second->GetErrorMessage(), HasSubstr("cancelled"));
+  } else {
+    // It completed before it could be cancelled.
+    ASSERT_TRUE(second->Succeeded()) << second->GetErrorMessage();
+  }
+
+  // Completed operations, and unknown ones, can't be cancelled.
+  ASSERT_TRUE(IsOk(service_->cancelCeDataOperation(first_token, &cancelled)));
+  ASSERT_FALSE(cancelled);
+  ASSERT_TRUE(IsOk(service_->cancelCeDataOperation(-1, &cancelled)));
+  ASSERT_FALSE(cancelled);
+}
+
 TEST_F(ApexServiceTest, SubmitStagedSessionCleanupsTempMountOnFailure) {
   // Parent session id: 23
   // Children session ids: 37 73
@@ -815,6 +996,45 @@ TEST_F(ApexServiceTest, GetAllPackages) {
   }
 }
 
+TEST_F(ApexServiceTest, GetChangesSinceZeroListsAllPackages) {
+  Result<std::vector<ApexInfo>> all_packages = GetAllPackages();
+  ASSERT_RESULT_OK(all_packages);
+
+  ApexInfoChanges changes;
+  ASSERT_TRUE(IsOk(service_->getChangesSince(0, &changes)));
+  ASSERT_TRUE(changes.isFullList);
+  ASSERT_THAT(GetPackagesStrings(changes.changed),
+              UnorderedElementsAreArray(GetPackagesStrings(*all_packages)));
+
+  // Nothing changed since.
+  ApexInfoChanges no_changes;
+  ASSERT_TRUE(
+      IsOk(service_->getChangesSince(changes.generation, &no_changes)));
+  ASSERT_FALSE(no_changes.isFullList);
+  ASSERT_EQ(no_changes.generation, changes.generation);
+  ASSERT_TRUE(no_changes.changed.empty());
+  ASSERT_TRUE(no_changes.removedPaths.empty());
+}
+
+TEST_F(ApexServiceTest, GetPackagesByName) {
+  Result<std::vector<ApexInfo>> all_packages = GetAllPackages();
+  ASSERT_RESULT_OK(all_packages);
+  ASSERT_FALSE(all_packages->empty());
+  const std::string& name = all_packages->front().moduleName;
+  std::vector<ApexInfo> expected;
+  for (const ApexInfo& info : *all_packages) {
+    if (info.moduleName == name) {
+      expected.push_back(info);
+    }
+  }
+
+  std::vector<ApexInfo> packages;
+  ASSERT_TRUE(IsOk(service_->getPackagesByName(
+      {name, "com.android.apex.not_there"}, &packages)));
+  ASSERT_THAT(GetPackagesStrings(packages),
+              UnorderedElementsAreArray(GetPackagesStrings(expected)));
+}
+
 TEST_F(ApexServiceTest, SubmitSingleSessionTestSuccess) {
   PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test.apex"),
                                       "/data/app-staging/session_123",
@@ -1207,6 +1427,54 @@ TEST_F(ApexServiceTest, BackupActivePackagesClearsPreviousBackup) {
   ASSERT_THAT(*backups, UnorderedElementsAre(backup1, backup2));
 }
 
+TEST_F(ApexServiceTest, BackupActivePackagesIgnoresLeftoverNewBackup) {
+  if (supports_fs_checkpointing_) {
+    GTEST_SKIP() << "Can't run if filesystem checkpointing is enabled";
+  }
+  PrepareTestApexForInstall installer1(GetTestFile("apex.apexd_test.apex"));
+  PrepareTestApexForInstall installer2(
+      GetTestFile("apex.apexd_test_different_app.apex"));
+  PrepareTestApexForInstall installer3(GetTestFile("apex.apexd_test_v2.apex"),
+                                       "/data/app-staging/session_47",
+                                       "staging_data_file");
+
+  if (!installer1.Prepare() || !installer2.Prepare() || !installer3.Prepare()) {
+    return;
+  }
+
+  // A backup interrupted by a crash leaves its half-built directory behind.
+  const std::string new_backup_dir = std::string(kApexBackupDir) + ".new";
+  ASSERT_RESULT_OK(CreateDirIfNeeded(new_backup_dir, 0700));
+  std::ofstream leftover(new_backup_dir +
+                         "/com.android.apex.test_package@1.apex");
+  ASSERT_TRUE(leftover.good());
+  leftover.close();
+
+  std::vector<std::string> pkgs = {installer1.test_file, installer2.test_file};
+  ASSERT_TRUE(IsOk(service_->stagePackages(pkgs)));
+
+  ApexInfoList list;
+  ApexSessionParams params;
+  params.sessionId = 47;
+  ASSERT_TRUE(IsOk(service_->submitStagedSession(params, &list)));
+
+  auto backups = ReadEntireDir(kApexBackupDir);
+  ASSERT_RESULT_OK(backups);
+  auto backup1 =
+      StringPrintf("%s/com.android.apex.test_package@1.apex", kApexBackupDir);
+  auto backup2 =
+      StringPrintf("%s/com.android.apex.test_package_2@1.apex", kApexBackupDir);
+  ASSERT_THAT(*backups, UnorderedElementsAre(backup1, backup2));
+  // The backup links the active files rather than reusing the leftover.
+  struct stat backup_st;
+  struct stat active_st;
+  ASSERT_EQ(0, stat(backup1.c_str(), &backup_st));
+  ASSERT_EQ(0, stat(installer1.test_installed_file.c_str(), &active_st));
+  ASSERT_EQ(active_st.st_ino, backup_st.st_ino);
+  // Neither the leftover nor the previous backup is kept around.
+  ASSERT_FALSE(fs::exists(new_backup_dir));
+}
+
 TEST_F(ApexServiceTest, BackupActivePackagesZeroActivePackages) {
   if (supports_fs_checkpointing_) {
     GTEST_SKIP() << "Can't run if filesystem checkpointing is enabled";
@@ -1321,6 +1589,38 @@ TEST_F(ApexServiceRevertTest, RevertActiveSessionsSuccessful) {
   CheckActiveApexContents({pkg});
 }
 
+TEST_F(ApexServiceRevertTest, RevertActiveSessionsReplacesActivePackages) {
+  if (supports_fs_checkpointing_) {
+    GTEST_SKIP() << "Can't run if filesystem checkpointing is enabled";
+  }
+
+  PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test_v2.apex"));
+  if (!installer.Prepare()) {
+    return;
+  }
+
+  auto session = ApexSession::CreateSession(1547);
+  ASSERT_RESULT_OK(session);
+  ASSERT_RESULT_OK(session->UpdateStateAndCommit(SessionState::ACTIVATED));
+
+  ASSERT_TRUE(IsOk(service_->stagePackages({installer.test_file})));
+
+  PrepareBackup({GetTestFile("apex.apexd_test.apex"),
+                 GetTestFile("apex.apexd_test_different_app.apex")});
+
+  ASSERT_TRUE(IsOk(service_->revertActiveSessions()));
+
+  // The backup took the place of the active directory as a whole: none of the
+  // previously active packages is left, and the backup is consumed.
+  auto pkg1 = StringPrintf("%s/com.android.apex.test_package@1.apex",
+                           kActiveApexPackagesDataDir);
+  auto pkg2 = StringPrintf("%s/com.android.apex.test_package_2@1.apex",
+                           kActiveApexPackagesDataDir);
+  SCOPED_TRACE("");
+  CheckActiveApexContents({pkg1, pkg2});
+  ASSERT_FALSE(fs::exists(kApexBackupDir));
+}
+
 // Calling revertActiveSessions should not restore backup on checkpointing
 // devices
 TEST_F(ApexServiceRevertTest,
@@ -1822,6 +2122,8 @@ class LogTestToLogcat : public ::testing::EmptyTestEventListener {
 
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
+  // Receives the callbacks of asynchronous calls.
+  android::ProcessState::self()->startThreadPool();
   android::base::InitLogging(argv, &android::base::StderrLogger);
   android::base::SetMinimumLogSeverity(android::base::VERBOSE);
   ::testing::UnitTest::GetInstance()->listeners().Append(
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "libapexinfo"
+
+#include "apexinfo_index.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+using ::android::base::ErrnoError;
+using ::android::base::Error;
+using ::android::base::ReadFully;
+using ::android::base::Result;
+using ::android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+class StringPool {
+public:
+  ApexInfoIndexString Add(const std::string &str) {
+    ApexInfoIndexString ref{static_cast<uint32_t>(pool_.size()),
+                            static_cast<uint32_t>(str.size())};
+    pool_ += str;
+    return ref;
+  }
+  const std::string &Get() const { return pool_; }
+
+private:
+  std::string pool_;
+};
+
+bool IsValidString(const ApexInfoIndexString &str, uint32_t pool_size) {
+  return str.offset <= pool_size && str.size <= pool_size - str.offset;
+}
+
+Result<void> ValidateHeader(const ApexInfoIndexHeader &header, size_t size) {
+  if (memcmp(header.magic, kApexInfoIndexMagic, sizeof(header.magic)) != 0) {
+    return Error() << "Bad magic";
+  }
+  if (header.version != kApexInfoIndexVersion) {
+    return Error() << "Unsupported version " << header.version;
+  }
+  uint64_t records_end =
+      uint64_t{header.records_offset} +
+      uint64_t{header.count} * sizeof(ApexInfoIndexRecord);
+  if (header.records_offset < sizeof(ApexInfoIndexHeader) ||
+      header.records_offset % alignof(ApexInfoIndexRecord) != 0 ||
+      records_end > size) {
+    return Error() << "Records are out of bounds";
+  }
+  uint64_t strings_end =
+      uint64_t{header.strings_offset} + uint64_t{header.strings_size};
+  if (header.strings_offset < records_end || strings_end > size) {
+    return Error() << "String pool is out of bounds";
+  }
+  return {};
+}
+
+} // namespace
+
+std::string SerializeApexInfoIndex(std::vector<ApexInfoEntry> entries,
+                                   uint64_t generation) {
+  // Sort by name, so that readers can binary search. Active entry comes first.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const ApexInfoEntry &lhs, const ApexInfoEntry &rhs) {
+                     if (lhs.module_name != rhs.module_name) {
+                       return lhs.module_name < rhs.module_name;
+                     }
+                     return lhs.is_active && !rhs.is_active;
+                   });
+
+  StringPool strings;
+  std::vector<ApexInfoIndexRecord> records;
+  records.reserve(entries.size());
+  for (const auto &entry : entries) {
+    ApexInfoIndexRecord record = {};
+    record.module_name = strings.Add(entry.module_name);
+    record.module_path = strings.Add(entry.module_path);
+    if (entry.preinstalled_module_path.has_value()) {
+      record.preinstalled_module_path =
+          strings.Add(*entry.preinstalled_module_path);
+      record.flags |= kApexInfoHasPreinstalledPath;
+    }
+    record.version_name = strings.Add(entry.version_name);
+    record.version_code = entry.version_code;
+    if (entry.last_update_millis.has_value()) {
+      record.last_update_millis = *entry.last_update_millis;
+      record.flags |= kApexInfoHasLastUpdateMillis;
+    }
+    if (entry.is_factory) {
+      record.flags |= kApexInfoIsFactory;
+    }
+    if (entry.is_active) {
+      record.flags |= kApexInfoIsActive;
+    }
+    if (entry.provide_shared_apex_libs) {
+      record.flags |= kApexInfoProvideSharedApexLibs;
+    }
+    records.push_back(record);
+  }
+
+  ApexInfoIndexHeader header = {};
+  memcpy(header.magic, kApexInfoIndexMagic, sizeof(header.magic));
+  header.version = kApexInfoIndexVersion;
+  header.count = static_cast<uint32_t>(records.size());
+  header.generation = generation;
+  header.records_offset = sizeof(ApexInfoIndexHeader);
+  header.strings_offset = static_cast<uint32_t>(
+      header.records_offset + records.size() * sizeof(ApexInfoIndexRecord));
+  header.strings_size = static_cast<uint32_t>(strings.Get().size());
+
+  std::string out;
+  out.reserve(header.strings_offset + header.strings_size);
+  out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.append(reinterpret_cast<const char *>(records.data()),
+             records.size() * sizeof(ApexInfoIndexRecord));
+  out += strings.Get();
+  return out;
+}
+
+Result<ApexInfoIndex> ApexInfoIndex::Open(const std::string &path) {
+  unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  if (size < sizeof(ApexInfoIndexHeader)) {
+    return Error() << path << " is too small";
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+  if (data == MAP_FAILED) {
+    return ErrnoError() << "Failed to mmap " << path;
+  }
+  ApexInfoIndex index(data, size);
+  if (auto valid = ValidateHeader(*index.header(), size); !valid.ok()) {
+    return Error() << "Invalid " << path << " : " << valid.error();
+  }
+  uint32_t pool_size = index.header()->strings_size;
+  for (size_t i = 0; i < index.Size(); i++) {
+    const auto &record = index.records()[i];
+    for (const auto *str : {&record.module_name, &record.module_path,
+                            &record.preinstalled_module_path,
+                            &record.version_name}) {
+      if (!IsValidString(*str, pool_size)) {
+        return Error() << "Invalid " << path << " : record " << i
+                       << " has a string out of bounds";
+      }
+    }
+  }
+  return index;
+}
+
+ApexInfoIndex::ApexInfoIndex(ApexInfoIndex &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+ApexInfoIndex &ApexInfoIndex::operator=(ApexInfoIndex &&other) noexcept {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      munmap(const_cast<void *>(data_), size_);
+    }
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+ApexInfoIndex::~ApexInfoIndex() {
+  if (data_ != nullptr) {
+    munmap(const_cast<void *>(data_), size_);
+  }
+}
+
+const ApexInfoIndexRecord *ApexInfoIndex::records() const {
+  return reinterpret_cast<const ApexInfoIndexRecord *>(
+      static_cast<const char *>(data_) + header()->records_offset);
+}
+
+std::string_view
+ApexInfoIndex::GetString(const ApexInfoIndexString &str) const {
+  const char *pool =
+      static_cast<const char *>(data_) + header()->strings_offset;
+  return std::string_view(pool + str.offset, str.size);
+}
+
+ApexInfoIndex::Entry ApexInfoIndex::Get(size_t i) const {
+  const auto &record = records()[i];
+  Entry entry;
+  entry.module_name = GetString(record.module_name);
+  entry.module_path = GetString(record.module_path);
+  if (record.flags & kApexInfoHasPreinstalledPath) {
+    entry.preinstalled_module_path = GetString(record.preinstalled_module_path);
+  }
+  entry.version_code = record.version_code;
+  entry.version_name = GetString(record.version_name);
+  entry.is_factory = record.flags & kApexInfoIsFactory;
+  entry.is_active = record.flags & kApexInfoIsActive;
+  if (record.flags & kApexInfoHasLastUpdateMillis) {
+    entry.last_update_millis = record.last_update_millis;
+  }
+  entry.provide_shared_apex_libs =
+      record.flags & kApexInfoProvideSharedApexLibs;
+  return entry;
+}
+
+std::pair<size_t, size_t>
+ApexInfoIndex::EqualRange(std::string_view module_name) const {
+  size_t lo = 0;
+  size_t hi = Size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (GetString(records()[mid].module_name) < module_name) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  size_t last = lo;
+  while (last < Size() &&
+         GetString(records()[last].module_name) == module_name) {
+    last++;
+  }
+  return {lo, last};
+}
+
+std::vector<ApexInfoIndex::Entry>
+ApexInfoIndex::Find(std::string_view module_name) const {
+  auto [first, last] = EqualRange(module_name);
+  std::vector<Entry> entries;
+  entries.reserve(last - first);
+  for (size_t i = first; i < last; i++) {
+    entries.push_back(Get(i));
+  }
+  return entries;
+}
+
+std::optional<ApexInfoIndex::Entry>
+ApexInfoIndex::FindActive(std::string_view module_name) const {
+  auto [first, last] = EqualRange(module_name);
+  for (size_t i = first; i < last; i++) {
+    if (records()[i].flags & kApexInfoIsActive) {
+      return Get(i);
+    }
+  }
+  return std::nullopt;
+}
+
+Result<uint64_t> ReadApexInfoIndexGeneration(const std::string &path) {
+  unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+  ApexInfoIndexHeader header;
+  if (!ReadFully(fd.get(), &header, sizeof(header))) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  if (memcmp(header.magic, kApexInfoIndexMagic, sizeof(header.magic)) != 0 ||
+      header.version != kApexInfoIndexVersion) {
+    return Error() << path << " is not a supported APEX info index";
+  }
+  return header.generation;
+}
+
+} // namespace apex
+} // namespace android
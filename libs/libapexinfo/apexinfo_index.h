@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+namespace apex {
+
+// Binary, mmap-able companion of /apex/apex-info-list.xml.
+//
+// Layout (integers in native byte order, i.e. little-endian on all Android
+// ABIs):
+//   ApexInfoIndexHeader
+//   ApexInfoIndexRecord[count], sorted by module name
+//   string pool
+// Strings are referenced from records by (offset, size) into the pool, and
+// aren't NUL-terminated. The generation changes whenever apexd writes
+// different content, and only then, so clients can cheaply tell whether they
+// need to reload.
+
+constexpr const char *const kApexInfoIndexPath = "/apex/apex-info-list.bin";
+
+constexpr char kApexInfoIndexMagic[8] = {'A', 'P', 'X', 'I',
+                                         'N', 'F', 'O', '\0'};
+constexpr uint32_t kApexInfoIndexVersion = 1;
+
+struct ApexInfoIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t generation;
+  uint32_t records_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+  uint32_t reserved;
+};
+static_assert(sizeof(ApexInfoIndexHeader) == 40);
+
+struct ApexInfoIndexString {
+  uint32_t offset;
+  uint32_t size;
+};
+
+enum ApexInfoIndexFlags : uint32_t {
+  kApexInfoIsFactory = 1 << 0,
+  kApexInfoIsActive = 1 << 1,
+  kApexInfoProvideSharedApexLibs = 1 << 2,
+  kApexInfoHasPreinstalledPath = 1 << 3,
+  kApexInfoHasLastUpdateMillis = 1 << 4,
+};
+
+struct ApexInfoIndexRecord {
+  ApexInfoIndexString module_name;
+  ApexInfoIndexString module_path;
+  ApexInfoIndexString preinstalled_module_path;
+  ApexInfoIndexString version_name;
+  int64_t version_code;
+  int64_t last_update_millis;
+  uint32_t flags;
+  uint32_t reserved;
+};
+static_assert(sizeof(ApexInfoIndexRecord) == 56);
+
+// Content of one entry of the index. Mirrors <apex-info> element of
+// apex-info-list.xml.
+struct ApexInfoEntry {
+  std::string module_name;
+  std::string module_path;
+  std::optional<std::string> preinstalled_module_path;
+  int64_t version_code = 0;
+  std::string version_name;
+  bool is_factory = false;
+  bool is_active = false;
+  std::optional<int64_t> last_update_millis;
+  bool provide_shared_apex_libs = false;
+};
+
+// Serializes |entries| in the index format.
+std::string SerializeApexInfoIndex(std::vector<ApexInfoEntry> entries,
+                                   uint64_t generation);
+
+// Read-only view of an index file. Lookups don't allocate and return views
+// into the mapping, which are valid for as long as the ApexInfoIndex is alive.
+class ApexInfoIndex {
+public:
+  struct Entry {
+    std::string_view module_name;
+    std::string_view module_path;
+    std::optional<std::string_view> preinstalled_module_path;
+    int64_t version_code;
+    std::string_view version_name;
+    bool is_factory;
+    bool is_active;
+    std::optional<int64_t> last_update_millis;
+    bool provide_shared_apex_libs;
+  };
+
+  // Maps and validates the index at |path|.
+  static android::base::Result<ApexInfoIndex>
+  Open(const std::string &path = kApexInfoIndexPath);
+
+  ApexInfoIndex(ApexInfoIndex &&other) noexcept;
+  ApexInfoIndex &operator=(ApexInfoIndex &&other) noexcept;
+  ApexInfoIndex(const ApexInfoIndex &) = delete;
+  ApexInfoIndex &operator=(const ApexInfoIndex &) = delete;
+  ~ApexInfoIndex();
+
+  uint64_t Generation() const { return header()->generation; }
+  size_t Size() const { return header()->count; }
+  Entry Get(size_t i) const;
+
+  // Returns all entries (active and inactive) of |module_name|.
+  std::vector<Entry> Find(std::string_view module_name) const;
+  // Returns the active entry of |module_name|, if any.
+  std::optional<Entry> FindActive(std::string_view module_name) const;
+
+private:
+  ApexInfoIndex(const void *data, size_t size) : data_(data), size_(size) {}
+
+  const ApexInfoIndexHeader *header() const {
+    return static_cast<const ApexInfoIndexHeader *>(data_);
+  }
+  const ApexInfoIndexRecord *records() const;
+  std::string_view GetString(const ApexInfoIndexString &str) const;
+  // Returns [first, last) range of records of |module_name|.
+  std::pair<size_t, size_t> EqualRange(std::string_view module_name) const;
+
+  const void *data_;
+  size_t size_;
+};
+
+// Reads only the generation of the index at |path|, without mapping it.
+android::base::Result<uint64_t>
+ReadApexInfoIndexGeneration(const std::string &path = kApexInfoIndexPath);
+
+} // namespace apex
+} // namespace android
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexinfo_index.h"
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+using namespace std::literals;
+
+using ::android::apex::ApexInfoEntry;
+using ::android::apex::ApexInfoIndex;
+using ::android::apex::ApexInfoIndexHeader;
+using ::android::apex::ReadApexInfoIndexGeneration;
+using ::android::apex::SerializeApexInfoIndex;
+using ::android::base::GetExecutableDirectory;
+using ::android::base::ReadFileToString;
+using ::android::base::WriteStringToFile;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+namespace {
+
+ApexInfoEntry CreateEntry(std::string name, std::string path, int64_t version,
+                          bool is_active) {
+  ApexInfoEntry entry;
+  entry.module_name = name;
+  entry.module_path = path;
+  entry.version_code = version;
+  entry.version_name = std::to_string(version);
+  entry.is_active = is_active;
+  return entry;
+}
+
+std::string WriteIndex(const TemporaryDir &td, const std::string &content) {
+  std::string path = td.path + "/apex-info-list.bin"s;
+  EXPECT_TRUE(WriteStringToFile(content, path));
+  return path;
+}
+
+} // namespace
+
+TEST(ApexInfoIndex, RoundTrip) {
+  auto foo = CreateEntry("com.android.foo", "/system/apex/foo.apex", 1, false);
+  foo.preinstalled_module_path = "/system/apex/foo.apex";
+  foo.is_factory = true;
+  foo.last_update_millis = 1234;
+  auto bar = CreateEntry("com.android.bar", "/data/apex/active/bar.apex", 2,
+                         true);
+  bar.provide_shared_apex_libs = true;
+
+  TemporaryDir td;
+  auto path = WriteIndex(td, SerializeApexInfoIndex({foo, bar}, 42));
+  auto index = ApexInfoIndex::Open(path);
+  ASSERT_TRUE(index.ok()) << index.error();
+
+  ASSERT_EQ(42u, index->Generation());
+  ASSERT_EQ(2u, index->Size());
+  // Entries are sorted by name.
+  auto first = index->Get(0);
+  ASSERT_EQ("com.android.bar", first.module_name);
+  ASSERT_EQ("/data/apex/active/bar.apex", first.module_path);
+  ASSERT_EQ(std::nullopt, first.preinstalled_module_path);
+  ASSERT_EQ(2, first.version_code);
+  ASSERT_EQ("2", first.version_name);
+  ASSERT_FALSE(first.is_factory);
+  ASSERT_TRUE(first.is_active);
+  ASSERT_EQ(std::nullopt, first.last_update_millis);
+  ASSERT_TRUE(first.provide_shared_apex_libs);
+
+  auto second = index->Get(1);
+  ASSERT_EQ("com.android.foo", second.module_name);
+  ASSERT_EQ("/system/apex/foo.apex", second.module_path);
+  ASSERT_EQ("/system/apex/foo.apex", second.preinstalled_module_path);
+  ASSERT_EQ(1, second.version_code);
+  ASSERT_TRUE(second.is_factory);
+  ASSERT_FALSE(second.is_active);
+  ASSERT_EQ(1234, second.last_update_millis);
+  ASSERT_FALSE(second.provide_shared_apex_libs);
+}
+
+TEST(ApexInfoIndex, Find) {
+  TemporaryDir td;
+  auto path = WriteIndex(
+      td, SerializeApexInfoIndex(
+              {
+                  CreateEntry("com.android.foo", "/system/apex/foo.apex", 1,
+                              false),
+                  CreateEntry("com.android.baz", "/system/apex/baz.apex", 1,
+                              false),
+                  CreateEntry("com.android.foo", "/data/apex/active/foo.apex",
+                              2, true),
+                  CreateEntry("com.android.bar", "/system/apex/bar.apex", 1,
+                              true),
+              },
+              1));
+  auto index = ApexInfoIndex::Open(path);
+  ASSERT_TRUE(index.ok()) << index.error();
+
+  std::vector<std::string_view> foo_paths;
+  for (const auto &entry : index->Find("com.android.foo")) {
+    foo_paths.push_back(entry.module_path);
+  }
+  // Active entry comes first.
+  ASSERT_THAT(foo_paths, ElementsAre("/data/apex/active/foo.apex",
+                                     "/system/apex/foo.apex"));
+
+  auto active_foo = index->FindActive("com.android.foo");
+  ASSERT_TRUE(active_foo.has_value());
+  ASSERT_EQ(2, active_foo->version_code);
+  ASSERT_TRUE(index->FindActive("com.android.bar").has_value());
+  ASSERT_FALSE(index->FindActive("com.android.baz").has_value());
+
+  ASSERT_TRUE(index->Find("com.android.unknown").empty());
+  ASSERT_FALSE(index->FindActive("com.android.unknown").has_value());
+  ASSERT_TRUE(index->Find("").empty());
+  ASSERT_TRUE(index->Find("com.android.zzz").empty());
+}
+
+TEST(ApexInfoIndex, Empty) {
+  TemporaryDir td;
+  auto path = WriteIndex(td, SerializeApexInfoIndex({}, 7));
+  auto index = ApexInfoIndex::Open(path);
+  ASSERT_TRUE(index.ok()) << index.error();
+  ASSERT_EQ(0u, index->Size());
+  ASSERT_TRUE(index->Find("com.android.foo").empty());
+}
+
+TEST(ApexInfoIndex, ReadGeneration) {
+  TemporaryDir td;
+  auto path = WriteIndex(
+      td, SerializeApexInfoIndex(
+              {CreateEntry("com.android.foo", "/system/apex/foo.apex", 1,
+                           true)},
+              1234));
+  auto generation = ReadApexInfoIndexGeneration(path);
+  ASSERT_TRUE(generation.ok()) << generation.error();
+  ASSERT_EQ(1234u, *generation);
+
+  ASSERT_FALSE(ReadApexInfoIndexGeneration(td.path + "/missing"s).ok());
+}
+
+TEST(ApexInfoIndex, RejectsCorruptFiles) {
+  auto valid = SerializeApexInfoIndex(
+      {CreateEntry("com.android.foo", "/system/apex/foo.apex", 1, true)}, 1);
+  TemporaryDir td;
+
+  {
+    auto index = ApexInfoIndex::Open(WriteIndex(td, "short"));
+    ASSERT_FALSE(index.ok());
+  }
+  {
+    auto content = valid;
+    content[0] = 'X';
+    auto index = ApexInfoIndex::Open(WriteIndex(td, content));
+    ASSERT_FALSE(index.ok());
+    ASSERT_THAT(index.error().message(), HasSubstr("Bad magic"));
+  }
+  {
+    auto content = valid;
+    reinterpret_cast<ApexInfoIndexHeader *>(content.data())->version = 100;
+    auto index = ApexInfoIndex::Open(WriteIndex(td, content));
+    ASSERT_FALSE(index.ok());
+    ASSERT_THAT(index.error().message(), HasSubstr("Unsupported version"));
+  }
+  {
+    auto content = valid;
+    reinterpret_cast<ApexInfoIndexHeader *>(content.data())->count = 1000;
+    auto index = ApexInfoIndex::Open(WriteIndex(td, content));
+    ASSERT_FALSE(index.ok());
+    ASSERT_THAT(index.error().message(), HasSubstr("out of bounds"));
+  }
+  {
+    // Truncated string pool
+    auto content = valid.substr(0, valid.size() - 4);
+    auto index = ApexInfoIndex::Open(WriteIndex(td, content));
+    ASSERT_FALSE(index.ok());
+    ASSERT_THAT(index.error().message(), HasSubstr("out of bounds"));
+  }
+}
+
+// testdata/apex-info-list.bin is also what libapexsupport's Rust reader is
+// tested against. If the format changes, regenerate it from these entries.
+TEST(ApexInfoIndex, MatchesGoldenFile) {
+  auto foo_v1 = CreateEntry("com.android.foo",
+                            "/system/apex/com.android.foo.apex", 1, false);
+  foo_v1.preinstalled_module_path = "/system/apex/com.android.foo.apex";
+  foo_v1.is_factory = true;
+  foo_v1.last_update_millis = 1234;
+  auto foo_v3 = CreateEntry("com.android.foo",
+                            "/data/apex/active/com.android.foo@3.apex", 3,
+                            true);
+  foo_v3.preinstalled_module_path = "/system/apex/com.android.foo.apex";
+  auto bar = CreateEntry("com.android.bar",
+                         "/system/apex/com.android.bar.apex", 2, true);
+  bar.is_factory = true;
+  bar.provide_shared_apex_libs = true;
+
+  std::string golden;
+  ASSERT_TRUE(ReadFileToString(
+      GetExecutableDirectory() + "/testdata/apex-info-list.bin", &golden));
+  ASSERT_EQ(golden, SerializeApexInfoIndex({foo_v1, foo_v3, bar}, 42));
+}
@@ -30,12 +30,15 @@ struct AApexInfo;
 typedef struct AApexInfo AApexInfo;
 
 /**
- * AApexInfoError tells the error when AApexInfo_create() fails.
+ * AApexInfoError tells the error when AApexInfo_create() (or one of its
+ * variants) fails.
  */
 typedef enum AApexInfoError : int32_t {
   /* No error */
   AAPEXINFO_OK,
-  /* The calling process is not from an APEX. */
+  /* The calling process is not from an APEX. For AApexInfo_createWithName()
+   * and AApexInfo_createWithPath(), there's no such active APEX.
+   */
   AAPEXINFO_NO_APEX,
   /* Failed to get the executable path of the calling process.
    * See the log for details.
@@ -54,6 +57,9 @@ typedef enum AApexInfoError : int32_t {
  * "com.android.foo". The allocated AApexInfo object has to be deallocated using
  * AApexInfo_destroy().
  *
+ * The APEX of the calling executable is resolved only once per process.
+ * Subsequent calls don't read the APEX manifest again.
+ *
  * \param info out parameter for an AApexInfo object for the current APEX. Null
  * when called from a non-APEX executable.
  *
@@ -63,6 +69,42 @@ __attribute__((warn_unused_result)) AApexInfoError
 AApexInfo_create(AApexInfo *_Nullable *_Nonnull info)
     __INTRODUCED_IN(__ANDROID_API_V__);
 
+/**
+ * Creates an AApexInfo object for the active APEX |name|, e.g.
+ * "com.android.foo". The allocated AApexInfo object has to be deallocated using
+ * AApexInfo_destroy().
+ *
+ * Versions of active APEXes are read from /apex/apex-info-list.bin when it is
+ * readable by the calling process, and cached until it changes. Otherwise the
+ * manifest of the APEX is read.
+ *
+ * \param name the name of the APEX.
+ * \param info out parameter for an AApexInfo object for the APEX. Not set
+ * when there's no such active APEX.
+ *
+ * \returns AApexInfoError
+ */
+__attribute__((warn_unused_result)) AApexInfoError
+AApexInfo_createWithName(const char *_Nonnull name,
+                         AApexInfo *_Nullable *_Nonnull info)
+    __INTRODUCED_IN(AAPEXSUPPORT_API);
+
+/**
+ * Creates an AApexInfo object for the active APEX which |path| belongs to. For
+ * example, /apex/com.android.foo/lib64/libfoo.so belongs to "com.android.foo".
+ * See AApexInfo_createWithName() for details.
+ *
+ * \param path an absolute path under /apex.
+ * \param info out parameter for an AApexInfo object for the APEX. Not set
+ * when |path| doesn't belong to an active APEX.
+ *
+ * \returns AApexInfoError
+ */
+__attribute__((warn_unused_result)) AApexInfoError
+AApexInfo_createWithPath(const char *_Nonnull path,
+                         AApexInfo *_Nullable *_Nonnull info)
+    __INTRODUCED_IN(AAPEXSUPPORT_API);
+
 /**
  * Destroys an AApexInfo object created by AApexInfo_create().
  *
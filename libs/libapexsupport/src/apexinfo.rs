@@ -16,12 +16,19 @@
 
 //! Provides AApexInfo (name, version) from the calling process
 
+use crate::apexinfo_index;
 use apex_manifest::apex_manifest::ApexManifest;
 use protobuf::Message;
+use std::collections::HashMap;
 use std::env;
 use std::ffi::CString;
-use std::fs::File;
+use std::fs::{self, File};
+use std::io::ErrorKind;
+use std::os::unix::fs::MetadataExt;
 use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, OnceLock};
+
+const APEX_INFO_INDEX_PATH: &str = "/apex/apex-info-list.bin";
 
 #[derive(Debug)]
 pub enum AApexInfoError {
@@ -31,14 +38,16 @@ pub enum AApexInfoError {
     ExePathUnavailable(std::io::Error),
     /// Fail to read apex_manifest.pb from an APEX
     InvalidApex(String),
+    /// There's no active APEX with the given name
+    ApexNotFound(String),
 }
 
 /// AApexInfo is used as an opaque object from FFI clients. This just wraps
 /// ApexManifest protobuf message.
 ///
 /// NOTE: that we don't want to provide too many details about APEX. It provides
-/// minimal information (for now, name and version) only for the APEX where the
-/// current process is loaded from.
+/// minimal information (for now, name and version) only for active APEXes.
+#[derive(Clone, Debug)]
 pub struct AApexInfo {
     pub name: CString,
     pub version: i64,
@@ -46,18 +55,72 @@ pub struct AApexInfo {
 
 impl AApexInfo {
     /// Returns AApexInfo object when called by an executable from an APEX.
-    pub fn create() -> Result<Self, AApexInfoError> {
+    ///
+    /// The APEX of the calling executable can't change during the lifetime of the process, so it
+    /// is resolved only once.
+    pub fn current() -> Result<&'static Self, &'static AApexInfoError> {
+        static CURRENT: OnceLock<Result<AApexInfo, AApexInfoError>> = OnceLock::new();
+        CURRENT.get_or_init(Self::create).as_ref()
+    }
+
+    fn create() -> Result<Self, AApexInfoError> {
         let exe_path = env::current_exe().map_err(AApexInfoError::ExePathUnavailable)?;
         let manifest_path = get_apex_manifest_path(exe_path)?;
         let manifest = parse_apex_manifest(manifest_path)?;
+        Self::new(manifest.name, manifest.version)
+    }
+
+    /// Returns AApexInfo object of the active APEX |name|.
+    pub fn with_name(name: &str) -> Result<Self, AApexInfoError> {
+        if name.is_empty() || name.starts_with('.') || name.contains(['/', '@']) {
+            return Err(AApexInfoError::ApexNotFound(name.to_owned()));
+        }
+        if let Some(versions) = active_versions_from_index() {
+            return match versions.get(name) {
+                Some(version) => Self::new(name.to_owned(), *version),
+                None => Err(AApexInfoError::ApexNotFound(name.to_owned())),
+            };
+        }
+        // No index: fall back to reading the manifest of the APEX.
+        let manifest_path = Path::new("/apex").join(name).join("apex_manifest.pb");
+        let mut f = File::open(manifest_path).map_err(|err| match err.kind() {
+            ErrorKind::NotFound => AApexInfoError::ApexNotFound(name.to_owned()),
+            _ => AApexInfoError::InvalidApex(format!("{err:?}")),
+        })?;
+        let manifest: ApexManifest = Message::parse_from_reader(&mut f)
+            .map_err(|err| AApexInfoError::InvalidApex(format!("{err:?}")))?;
+        Self::new(manifest.name, manifest.version)
+    }
+
+    /// Returns AApexInfo object of the active APEX which |path| belongs to.
+    pub fn with_path<P: AsRef<Path>>(path: P) -> Result<Self, AApexInfoError> {
+        Self::with_name(&get_apex_name(path)?)
+    }
+
+    fn new(name: String, version: i64) -> Result<Self, AApexInfoError> {
         Ok(AApexInfo {
-            name: CString::new(manifest.name)
+            name: CString::new(name)
                 .map_err(|err| AApexInfoError::InvalidApex(format!("{err:?}")))?,
-            version: manifest.version,
+            version,
         })
     }
 }
 
+/// Returns the name of the APEX a given path belongs to.
+fn get_apex_name<P: AsRef<Path>>(path: P) -> Result<String, AApexInfoError> {
+    let remain = path
+        .as_ref()
+        .strip_prefix("/apex")
+        .map_err(|_| AApexInfoError::PathNotFromApex(path.as_ref().to_owned()))?;
+    let apex_dir = remain
+        .iter()
+        .next()
+        .and_then(|dir| dir.to_str())
+        .ok_or_else(|| AApexInfoError::PathNotFromApex(path.as_ref().to_owned()))?;
+    // Versioned mount points (/apex/<name>@<version>) belong to the same APEX.
+    Ok(apex_dir.split('@').next().unwrap_or(apex_dir).to_owned())
+}
+
 /// Returns the apex_manifest.pb path when a given path belongs to an apex.
 fn get_apex_manifest_path<P: AsRef<Path>>(path: P) -> Result<PathBuf, AApexInfoError> {
     let remain = path
@@ -71,6 +134,55 @@ fn get_apex_manifest_path<P: AsRef<Path>>(path: P) -> Result<PathBuf, AApexInfoE
     Ok(Path::new("/apex").join(apex_name).join("apex_manifest.pb"))
 }
 
+/// Identifies a version of the index file. apexd replaces the file (and
+/// remounts it) whenever active APEXes change.
+#[derive(PartialEq, Eq)]
+struct FileId {
+    dev: u64,
+    ino: u64,
+    mtime: i64,
+    mtime_nsec: i64,
+    size: u64,
+}
+
+struct ActiveVersions {
+    id: FileId,
+    versions: Arc<HashMap<String, i64>>,
+}
+
+/// Returns versions of active APEXes from the index, or None if the index is
+/// unavailable. The index is parsed again only when the file changes; until
+/// then, all callers share the same map.
+fn active_versions_from_index() -> Option<Arc<HashMap<String, i64>>> {
+    static CACHE: Mutex<Option<ActiveVersions>> = Mutex::new(None);
+
+    let metadata = fs::metadata(APEX_INFO_INDEX_PATH).ok()?;
+    let id = FileId {
+        dev: metadata.dev(),
+        ino: metadata.ino(),
+        mtime: metadata.mtime(),
+        mtime_nsec: metadata.mtime_nsec(),
+        size: metadata.size(),
+    };
+    let mut cache = CACHE.lock().unwrap_or_else(|e| e.into_inner());
+    if let Some(cached) = cache.as_ref().filter(|cached| cached.id == id) {
+        return Some(Arc::clone(&cached.versions));
+    }
+    let data = fs::read(APEX_INFO_INDEX_PATH).ok()?;
+    let entries = match apexinfo_index::parse(&data) {
+        Ok(entries) => entries,
+        Err(err) => {
+            eprintln!("Ignoring {APEX_INFO_INDEX_PATH}: {err}");
+            return None;
+        }
+    };
+    let versions: Arc<HashMap<_, _>> = Arc::new(
+        entries.into_iter().filter(|e| e.is_active).map(|e| (e.name, e.version)).collect(),
+    );
+    *cache = Some(ActiveVersions { id, versions: Arc::clone(&versions) });
+    Some(versions)
+}
+
 /// Parses the apex_manifest.pb protobuf message from a given path.
 fn parse_apex_manifest<P: AsRef<Path>>(path: P) -> Result<ApexManifest, AApexInfoError> {
     let mut f = File::open(path).map_err(|err| AApexInfoError::InvalidApex(format!("{err:?}")))?;
@@ -92,4 +204,31 @@ mod test {
         assert!(get_apex_manifest_path("/com.android.foo/bin/foo").is_err());
         assert!(get_apex_manifest_path("/system/apex/com.android.foo/bin/foo").is_err());
     }
+
+    #[test]
+    fn test_get_apex_name() {
+        assert_eq!(get_apex_name("/apex/com.android.foo/bin/foo").unwrap(), "com.android.foo");
+        assert_eq!(
+            get_apex_name("/apex/com.android.foo@2/lib/libfoo.so").unwrap(),
+            "com.android.foo"
+        );
+        assert_eq!(get_apex_name("/apex/com.android.foo").unwrap(), "com.android.foo");
+        assert!(get_apex_name("/apex").is_err());
+        assert!(get_apex_name("/system/apex/com.android.foo/bin/foo").is_err());
+    }
+
+    #[test]
+    fn test_with_name_rejects_invalid_names() {
+        for name in ["", ".", "..", "com.android.foo/bin", "com.android.foo@1", ".com.android.foo"]
+        {
+            assert!(matches!(AApexInfo::with_name(name), Err(AApexInfoError::ApexNotFound(_))));
+        }
+    }
+
+    #[test]
+    fn test_current_is_cached() {
+        // Test binaries don't run from an APEX.
+        assert!(AApexInfo::current().is_err());
+        assert!(std::ptr::eq(AApexInfo::current().unwrap_err(), AApexInfo::current().unwrap_err()));
+    }
 }
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Reader for /apex/apex-info-list.bin, the binary companion of
+//! /apex/apex-info-list.xml written by apexd.
+//!
+//! NOTE: Keep the layout in sync with libs/libapexinfo/apexinfo_index.h
+
+const MAGIC: &[u8; 8] = b"APXINFO\0";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 40;
+const RECORD_SIZE: usize = 56;
+const RECORD_ALIGN: usize = 8;
+const FLAG_IS_ACTIVE: u32 = 1 << 1;
+
+/// An entry of the index. Only the fields libapexsupport exposes are kept.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct IndexEntry {
+    pub name: String,
+    pub version: i64,
+    pub is_active: bool,
+}
+
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    Some(u32::from_le_bytes(data.get(offset..offset + 4)?.try_into().ok()?))
+}
+
+fn read_i64(data: &[u8], offset: usize) -> Option<i64> {
+    Some(i64::from_le_bytes(data.get(offset..offset + 8)?.try_into().ok()?))
+}
+
+fn read_string(record: &[u8], offset: usize, pool: &[u8]) -> Option<String> {
+    let start = read_u32(record, offset)? as usize;
+    let size = read_u32(record, offset + 4)? as usize;
+    let bytes = pool.get(start..start.checked_add(size)?)?;
+    String::from_utf8(bytes.to_vec()).ok()
+}
+
+/// Parses the content of an index file.
+pub fn parse(data: &[u8]) -> Result<Vec<IndexEntry>, String> {
+    if data.get(0..8) != Some(&MAGIC[..]) {
+        return Err("Bad magic".to_owned());
+    }
+    let header = data.get(0..HEADER_SIZE).ok_or("Truncated header")?;
+    let version = read_u32(header, 8).ok_or("Truncated header")?;
+    if version != VERSION {
+        return Err(format!("Unsupported version {version}"));
+    }
+    let count = read_u32(header, 12).ok_or("Truncated header")? as usize;
+    let records_offset = read_u32(header, 24).ok_or("Truncated header")? as usize;
+    let strings_offset = read_u32(header, 28).ok_or("Truncated header")? as usize;
+    let strings_size = read_u32(header, 32).ok_or("Truncated header")? as usize;
+
+    // Same checks as ValidateHeader() in apexinfo_index.cpp.
+    if records_offset < HEADER_SIZE || records_offset % RECORD_ALIGN != 0 {
+        return Err("Records are out of bounds".to_owned());
+    }
+    let records_end = count
+        .checked_mul(RECORD_SIZE)
+        .and_then(|size| records_offset.checked_add(size))
+        .ok_or("Records are out of bounds")?;
+    let records = data.get(records_offset..records_end).ok_or("Records are out of bounds")?;
+    if strings_offset < records_end {
+        return Err("String pool is out of bounds".to_owned());
+    }
+    let pool = strings_offset
+        .checked_add(strings_size)
+        .and_then(|end| data.get(strings_offset..end))
+        .ok_or("String pool is out of bounds")?;
+
+    records
+        .chunks_exact(RECORD_SIZE)
+        .enumerate()
+        .map(|(i, record)| {
+            let invalid = || format!("Invalid record {i}");
+            Ok(IndexEntry {
+                name: read_string(record, 0, pool).ok_or_else(invalid)?,
+                version: read_i64(record, 32).ok_or_else(invalid)?,
+                is_active: read_u32(record, 48).ok_or_else(invalid)? & FLAG_IS_ACTIVE != 0,
+            })
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    /// Written by SerializeApexInfoIndex() of libapexinfo, see
+    /// MatchesGoldenFile in apexinfo_index_test.cpp.
+    const GOLDEN: &[u8] = include_bytes!("../../libapexinfo/testdata/apex-info-list.bin");
+
+    fn set_u32(data: &mut [u8], offset: usize, value: u32) {
+        data[offset..offset + 4].copy_from_slice(&value.to_le_bytes());
+    }
+
+    #[test]
+    fn test_parse() {
+        assert_eq!(
+            parse(GOLDEN).unwrap(),
+            vec![
+                IndexEntry { name: "com.android.bar".to_owned(), version: 2, is_active: true },
+                IndexEntry { name: "com.android.foo".to_owned(), version: 3, is_active: true },
+                IndexEntry { name: "com.android.foo".to_owned(), version: 1, is_active: false },
+            ]
+        );
+    }
+
+    #[test]
+    fn test_parse_empty() {
+        let mut data = GOLDEN[..HEADER_SIZE].to_vec();
+        set_u32(&mut data, 12, 0); // count
+        set_u32(&mut data, 28, HEADER_SIZE as u32); // strings_offset
+        set_u32(&mut data, 32, 0); // strings_size
+        assert_eq!(parse(&data).unwrap(), vec![]);
+    }
+
+    #[test]
+    fn test_parse_rejects_corrupt_data() {
+        assert!(parse(&GOLDEN[..20]).is_err());
+        assert!(parse(&GOLDEN[..GOLDEN.len() - 1]).is_err());
+
+        let mut bad_magic = GOLDEN.to_vec();
+        bad_magic[0] = b'X';
+        assert!(parse(&bad_magic).is_err());
+
+        let mut bad_version = GOLDEN.to_vec();
+        set_u32(&mut bad_version, 8, 2);
+        assert!(parse(&bad_version).is_err());
+
+        let mut bad_count = GOLDEN.to_vec();
+        set_u32(&mut bad_count, 12, 100);
+        assert!(parse(&bad_count).is_err());
+    }
+
+    #[test]
+    fn test_parse_rejects_overlapping_sections() {
+        // Records overlapping the header.
+        let mut data = GOLDEN.to_vec();
+        set_u32(&mut data, 24, 0);
+        assert_eq!(parse(&data), Err("Records are out of bounds".to_owned()));
+
+        // Misaligned records.
+        let mut data = GOLDEN.to_vec();
+        set_u32(&mut data, 24, HEADER_SIZE as u32 + 4);
+        assert_eq!(parse(&data), Err("Records are out of bounds".to_owned()));
+
+        // String pool overlapping the records.
+        let mut data = GOLDEN.to_vec();
+        set_u32(&mut data, 28, HEADER_SIZE as u32);
+        assert_eq!(parse(&data), Err("String pool is out of bounds".to_owned()));
+    }
+}
@@ -17,9 +17,11 @@
 //! A FFI wrapper for APEX support library
 
 mod apexinfo;
+mod apexinfo_index;
 
 use apexinfo::{AApexInfo, AApexInfoError};
-use std::ffi::c_char;
+use std::borrow::Borrow;
+use std::ffi::{c_char, CStr};
 
 /// NOTE: Keep these constants in sync with apexsupport.h
 const AAPEXINFO_OK: i32 = 0;
@@ -32,32 +34,87 @@ fn as_error_code(err: &AApexInfoError) -> i32 {
         AApexInfoError::PathNotFromApex(_) => AAPEXINFO_NO_APEX,
         AApexInfoError::ExePathUnavailable(_) => AAPEXINFO_ERROR_GET_EXECUTABLE_PATH,
         AApexInfoError::InvalidApex(_) => AAPEXINFO_INALID_APEX,
+        AApexInfoError::ApexNotFound(_) => AAPEXINFO_NO_APEX,
     }
 }
 
-#[no_mangle]
-/// Creates AApexInfo object when called by the executable from an APEX
+/// Hands `result` over to the FFI caller.
 ///
 /// # Safety
 ///
-/// The provided pointer must be valid and have no aliases for the duration of the call.
-pub unsafe extern "C" fn AApexInfo_create(out: *mut *mut AApexInfo) -> i32 {
-    match AApexInfo::create() {
+/// `out` must be valid and have no aliases for the duration of the call.
+unsafe fn into_ffi<E: Borrow<AApexInfoError>>(
+    caller: &str,
+    result: Result<AApexInfo, E>,
+    out: *mut *mut AApexInfo,
+) -> i32 {
+    match result {
         Ok(info) => {
             let ptr = Box::into_raw(Box::new(info));
-            // SAFETY: We have checked that `out` is not null, so the caller guarantees that it is
-            // valid and unaliased.
+            // SAFETY: The caller guarantees that `out` is valid and unaliased.
             unsafe { *out = ptr };
             AAPEXINFO_OK
         }
         Err(err) => {
+            let err = err.borrow();
             // TODO(b/271488212): Use Rust logger.
-            eprintln!("AApexInfo_create(): {err:?}");
-            as_error_code(&err)
+            eprintln!("{caller}(): {err:?}");
+            as_error_code(err)
         }
     }
 }
 
+#[no_mangle]
+/// Creates AApexInfo object when called by the executable from an APEX
+///
+/// # Safety
+///
+/// The provided pointer must be valid and have no aliases for the duration of the call.
+pub unsafe extern "C" fn AApexInfo_create(out: *mut *mut AApexInfo) -> i32 {
+    // SAFETY: The caller guarantees that `out` is valid and unaliased.
+    unsafe { into_ffi("AApexInfo_create", AApexInfo::current().cloned(), out) }
+}
+
+#[no_mangle]
+/// Creates AApexInfo object for the active APEX with the given name
+///
+/// # Safety
+///
+/// `name` must point to a valid NUL-terminated string. `out` must be valid and have no aliases for
+/// the duration of the call.
+pub unsafe extern "C" fn AApexInfo_createWithName(
+    name: *const c_char,
+    out: *mut *mut AApexInfo,
+) -> i32 {
+    // SAFETY: The caller guarantees that `name` is a valid C-string.
+    let name = unsafe { CStr::from_ptr(name) };
+    let result = match name.to_str() {
+        Ok(name) => AApexInfo::with_name(name),
+        Err(_) => Err(AApexInfoError::ApexNotFound(name.to_string_lossy().into_owned())),
+    };
+    // SAFETY: The caller guarantees that `out` is valid and unaliased.
+    unsafe { into_ffi("AApexInfo_createWithName", result, out) }
+}
+
+#[no_mangle]
+/// Creates AApexInfo object for the active APEX which the given path belongs to
+///
+/// # Safety
+///
+/// `path` must point to a valid NUL-terminated string. `out` must be valid and have no aliases for
+/// the duration of the call.
+pub unsafe extern "C" fn AApexInfo_createWithPath(
+    path: *const c_char,
+    out: *mut *mut AApexInfo,
+) -> i32 {
+    use std::os::unix::ffi::OsStrExt;
+    // SAFETY: The caller guarantees that `path` is a valid C-string.
+    let path = std::ffi::OsStr::from_bytes(unsafe { CStr::from_ptr(path) }.to_bytes());
+    let result = AApexInfo::with_path(path);
+    // SAFETY: The caller guarantees that `out` is valid and unaliased.
+    unsafe { into_ffi("AApexInfo_createWithPath", result, out) }
+}
+
 #[no_mangle]
 /// Destroys AApexInfo object created by AApexInfo_create().
 ///
@@ -32,6 +32,9 @@ struct LibApexSupport {
   DLSYM(AApexInfo_destroy)
   DLSYM(AApexInfo_getName)
   DLSYM(AApexInfo_getVersion)
+  // APIs added in AAPEXSUPPORT_API
+  DLSYM(AApexInfo_createWithName)
+  DLSYM(AApexInfo_createWithPath)
 #undef DLSYM
 };
 
@@ -58,6 +61,46 @@ TEST_F(LibApexSupportTest, AApexInfo) {
   AApexInfo_destroy(info);
 }
 
+TEST_F(LibApexSupportTest, AApexInfoIsCached) {
+  AApexInfo *first;
+  ASSERT_EQ(AApexInfo_create(&first), AAPEXINFO_OK);
+  AApexInfo *second;
+  ASSERT_EQ(AApexInfo_create(&second), AAPEXINFO_OK);
+
+  // Each call returns its own object, which can be destroyed independently.
+  ASSERT_NE(first, second);
+  EXPECT_STREQ(AApexInfo_getName(first), AApexInfo_getName(second));
+  EXPECT_EQ(AApexInfo_getVersion(first), AApexInfo_getVersion(second));
+  AApexInfo_destroy(first);
+  EXPECT_STREQ("com.android.libapexsupport.tests", AApexInfo_getName(second));
+  AApexInfo_destroy(second);
+}
+
+TEST_F(LibApexSupportTest, AApexInfoWithName) {
+  if (AApexInfo_createWithName == nullptr) {
+    GTEST_SKIP() << "AApexInfo_createWithName is not available";
+  }
+  AApexInfo *info;
+  ASSERT_EQ(AApexInfo_createWithName("com.android.libapexsupport.tests", &info),
+            AAPEXINFO_OK);
+  EXPECT_STREQ("com.android.libapexsupport.tests", AApexInfo_getName(info));
+  EXPECT_EQ(42, AApexInfo_getVersion(info));
+  AApexInfo_destroy(info);
+}
+
+TEST_F(LibApexSupportTest, AApexInfoWithPath) {
+  if (AApexInfo_createWithPath == nullptr) {
+    GTEST_SKIP() << "AApexInfo_createWithPath is not available";
+  }
+  constexpr const char *kPath =
+      "/apex/com.android.libapexsupport.tests/bin/libapexsupport-tests";
+  AApexInfo *info;
+  ASSERT_EQ(AApexInfo_createWithPath(kPath, &info), AAPEXINFO_OK);
+  EXPECT_STREQ("com.android.libapexsupport.tests", AApexInfo_getName(info));
+  EXPECT_EQ(42, AApexInfo_getVersion(info));
+  AApexInfo_destroy(info);
+}
+
 #else // __ANDROID_APEX__
 
 TEST_F(LibApexSupportTest, AApexInfo) {
@@ -67,6 +110,27 @@ TEST_F(LibApexSupportTest, AApexInfo) {
 
 #endif // __ANDROID_APEX__
 
+TEST_F(LibApexSupportTest, AApexInfoWithNameNotFound) {
+  if (AApexInfo_createWithName == nullptr) {
+    GTEST_SKIP() << "AApexInfo_createWithName is not available";
+  }
+  AApexInfo *info;
+  EXPECT_EQ(AApexInfo_createWithName("com.android.nonexistent", &info),
+            AAPEXINFO_NO_APEX);
+  EXPECT_EQ(AApexInfo_createWithName("", &info), AAPEXINFO_NO_APEX);
+  EXPECT_EQ(AApexInfo_createWithName("../system", &info), AAPEXINFO_NO_APEX);
+}
+
+TEST_F(LibApexSupportTest, AApexInfoWithPathNotFromApex) {
+  if (AApexInfo_createWithPath == nullptr) {
+    GTEST_SKIP() << "AApexInfo_createWithPath is not available";
+  }
+  AApexInfo *info;
+  EXPECT_EQ(AApexInfo_createWithPath("/system/bin/sh", &info),
+            AAPEXINFO_NO_APEX);
+  EXPECT_EQ(AApexInfo_createWithPath("/apex", &info), AAPEXINFO_NO_APEX);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
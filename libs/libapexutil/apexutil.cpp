@@ -19,14 +19,24 @@
 
 #include <dirent.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/result.h>
 #include <apex_manifest.pb.h>
+#include <apexinfo_index.h>
 
+using ::android::apex::ReadApexInfoIndexGeneration;
 using ::android::base::Error;
 using ::android::base::ReadFileToString;
 using ::android::base::Result;
@@ -46,20 +56,69 @@ Result<ApexManifest> ParseApexManifest(const std::string &manifest_path) {
   return manifest;
 }
 
-} // namespace
+constexpr const char *kApexInfoIndexFile = "apex-info-list.bin";
+constexpr size_t kMaxParseWorkers = 4;
 
-namespace android {
-namespace apex {
+// Identifies a state of the apex root. Entries of the apex root are created
+// and removed as APEXes are activated, changing its mtime; apexd additionally
+// bumps the generation of the index whenever the set of active APEXes changes.
+struct Generation {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t index_generation;
 
-std::map<std::string, ApexManifest>
-GetActivePackages(const std::string &apex_root) {
+  bool operator==(const Generation &other) const {
+    return dev == other.dev && ino == other.ino &&
+           mtime.tv_sec == other.mtime.tv_sec &&
+           mtime.tv_nsec == other.mtime.tv_nsec &&
+           index_generation == other.index_generation;
+  }
+};
+
+// Returns nullopt if the state can't be identified, e.g. because the index
+// isn't published (yet). An APEX can be updated in place without touching the
+// apex root, so without the index generation a cached result can't be trusted.
+std::optional<Generation> GetGeneration(const std::string &apex_root) {
+  struct stat st;
+  if (stat(apex_root.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+  auto index_generation =
+      ReadApexInfoIndexGeneration(apex_root + "/" + kApexInfoIndexFile);
+  if (!index_generation.ok() || *index_generation == 0) {
+    return std::nullopt;
+  }
+  return Generation{st.st_dev, st.st_ino, st.st_mtim, *index_generation};
+}
+
+struct Cache {
+  std::mutex mutex;
+  std::string apex_root;
+  std::optional<Generation> generation;
+  std::map<std::string, ApexManifest> apexes;
+
+  bool IsValid(const std::string &root,
+               const std::optional<Generation> &current) const {
+    return generation.has_value() && current == generation &&
+           apex_root == root;
+  }
+};
+
+Cache &GetCache() {
+  // Never destroyed, so that it can be used from other static destructors.
+  static Cache *cache = new Cache;
+  return *cache;
+}
+
+std::vector<std::string> ListActivePackagePaths(const std::string &apex_root) {
   std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(apex_root.c_str()),
                                                 closedir);
   if (!dir) {
     return {};
   }
 
-  std::map<std::string, ApexManifest> apexes;
+  std::vector<std::string> paths;
   dirent *entry;
   while ((entry = readdir(dir.get())) != nullptr) {
     if (entry->d_name[0] == '.')
@@ -70,16 +129,98 @@ GetActivePackages(const std::string &apex_root) {
       continue;
     if (strcmp(entry->d_name, "sharedlibs") == 0)
       continue;
-    std::string apex_path = apex_root + "/" + entry->d_name;
-    auto manifest = ParseApexManifest(apex_path + "/apex_manifest.pb");
-    if (manifest.ok()) {
-      apexes.emplace(std::move(apex_path), std::move(*manifest));
-    } else {
-      LOG(WARNING) << manifest.error();
+    paths.push_back(apex_root + "/" + entry->d_name);
+  }
+  return paths;
+}
+
+std::map<std::string, ApexManifest>
+ParseActivePackages(std::vector<std::string> paths) {
+  if (paths.empty()) {
+    return {};
+  }
+  std::vector<std::optional<ApexManifest>> manifests(paths.size());
+  std::atomic_size_t next = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      auto manifest = ParseApexManifest(paths[i] + "/apex_manifest.pb");
+      if (manifest.ok()) {
+        manifests[i] = std::move(*manifest);
+      } else {
+        LOG(WARNING) << manifest.error();
+      }
+    }
+  };
+
+  // The calling thread is one of the workers. This mirrors RunInParallel() in
+  // apexd_utils.h, which this library can't depend on.
+  size_t num_workers = std::min<size_t>(
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1,
+                         kMaxParseWorkers),
+      paths.size());
+  std::vector<std::future<void>> futures;
+  for (size_t i = 1; i < num_workers; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  worker();
+  for (auto &future : futures) {
+    future.get();
+  }
+
+  std::map<std::string, ApexManifest> apexes;
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (manifests[i].has_value()) {
+      apexes.emplace(std::move(paths[i]), std::move(*manifests[i]));
     }
   }
   return apexes;
 }
 
+} // namespace
+
+namespace android {
+namespace apex {
+
+std::map<std::string, ApexManifest>
+GetActivePackages(const std::string &apex_root) {
+  auto generation = GetGeneration(apex_root);
+  if (!generation.has_value()) {
+    // Neither use nor fill the cache.
+    return ParseActivePackages(ListActivePackagePaths(apex_root));
+  }
+
+  Cache &cache = GetCache();
+  std::lock_guard lock(cache.mutex);
+  if (cache.IsValid(apex_root, generation)) {
+    return cache.apexes;
+  }
+  cache.apexes = ParseActivePackages(ListActivePackagePaths(apex_root));
+  cache.apex_root = apex_root;
+  cache.generation = generation;
+  return cache.apexes;
+}
+
+Result<ApexManifest> GetActivePackage(const std::string &apex_root,
+                                      const std::string &name) {
+  if (name.empty() || name[0] == '.' ||
+      name.find_first_of("/@") != std::string::npos || name == "sharedlibs") {
+    return Error() << "Invalid APEX name: " << name;
+  }
+  const std::string apex_path = apex_root + "/" + name;
+
+  Cache &cache = GetCache();
+  {
+    std::lock_guard lock(cache.mutex);
+    if (cache.IsValid(apex_root, GetGeneration(apex_root))) {
+      auto it = cache.apexes.find(apex_path);
+      if (it == cache.apexes.end()) {
+        return Error() << name << " is not active";
+      }
+      return it->second;
+    }
+  }
+  return ParseApexManifest(apex_path + "/apex_manifest.pb");
+}
+
 } // namespace apex
 } // namespace android
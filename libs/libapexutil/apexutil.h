@@ -18,6 +18,7 @@
 #include <map>
 #include <string>
 
+#include <android-base/result.h>
 #include <apex_manifest.pb.h>
 
 namespace android {
@@ -27,9 +28,18 @@ namespace apex {
 // ApexManifest. This is very similar to ApexService::getActivePackages.
 // For testing purpose, it accepts the apex root path which is defined by
 // kApexRoot constant.
+// Manifests are parsed in parallel, and the result is cached in the process
+// for as long as neither the apex root directory nor the generation of its
+// apex-info-list.bin index changes.
 std::map<std::string, ::apex::proto::ApexManifest>
 GetActivePackages(const std::string &apex_root);
 
+// Returns the manifest of the active APEX package |name|, i.e. the one mounted
+// on <apex_root>/<name>. Unlike GetActivePackages, this only reads one
+// manifest (or none, if GetActivePackages already cached it).
+android::base::Result<::apex::proto::ApexManifest>
+GetActivePackage(const std::string &apex_root, const std::string &name);
+
 constexpr const char *const kApexRoot = "/apex";
 
 } // namespace apex
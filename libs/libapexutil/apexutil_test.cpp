@@ -24,12 +24,15 @@
 
 #include <android-base/file.h>
 #include <apex_manifest.pb.h>
+#include <apexinfo_index.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 using namespace std::literals;
 
+using ::android::apex::GetActivePackage;
 using ::android::apex::GetActivePackages;
+using ::android::apex::SerializeApexInfoIndex;
 using ::android::base::WriteStringToFile;
 using ::apex::proto::ApexManifest;
 using ::testing::Contains;
@@ -99,4 +102,103 @@ TEST(ApexUtil, GetActivePackages) {
 
   ASSERT_THAT(apexes, UnorderedElementsAre(Pair(foo_path, foo_manifest),
                                            Pair(bar_path, bar_manifest)));
-}
\ No newline at end of file
+}
+
+TEST(ApexUtil, GetActivePackage) {
+  TemporaryDir td;
+
+  auto foo_path = td.path + "/com.android.foo"s;
+  auto foo_manifest = CreateApexManifest("com.android.foo", 1);
+  Mkdir(foo_path);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_manifest.SerializeAsString());
+  Mkdir(foo_path + "@1");
+  WriteFile(foo_path + "@1/apex_manifest.pb", foo_manifest.SerializeAsString());
+
+  auto foo = GetActivePackage(td.path, "com.android.foo");
+  ASSERT_TRUE(foo.ok()) << foo.error();
+  ASSERT_EQ(foo_manifest, *foo);
+
+  ASSERT_FALSE(GetActivePackage(td.path, "com.android.bar").ok());
+  ASSERT_FALSE(GetActivePackage(td.path, "com.android.foo@1").ok());
+  ASSERT_FALSE(GetActivePackage(td.path, "../com.android.foo").ok());
+  ASSERT_FALSE(GetActivePackage(td.path, "").ok());
+}
+
+TEST(ApexUtil, GetActivePackagesParsesManyPackages) {
+  TemporaryDir td;
+
+  std::vector<std::pair<std::string, ApexManifest>> expected;
+  for (int i = 0; i < 32; i++) {
+    auto name = "com.android.apex" + std::to_string(i);
+    auto path = td.path + "/"s + name;
+    auto manifest = CreateApexManifest(name, i);
+    Mkdir(path);
+    WriteFile(path + "/apex_manifest.pb", manifest.SerializeAsString());
+    expected.emplace_back(path, manifest);
+  }
+
+  auto apexes = GetActivePackages(td.path);
+  ASSERT_EQ(expected.size(), apexes.size());
+  for (const auto &[path, manifest] : expected) {
+    ASSERT_THAT(apexes, Contains(Pair(path, manifest)));
+  }
+}
+
+TEST(ApexUtil, GetActivePackagesIsCachedUntilGenerationChanges) {
+  TemporaryDir td;
+
+  auto foo_path = td.path + "/com.android.foo"s;
+  auto foo_v1 = CreateApexManifest("com.android.foo", 1);
+  Mkdir(foo_path);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_v1.SerializeAsString());
+  auto index_path = td.path + "/apex-info-list.bin"s;
+  WriteFile(index_path, SerializeApexInfoIndex({}, 1));
+
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v1)));
+
+  // Modifying an APEX in place doesn't change the generation: cached result is
+  // returned, also by the single lookup.
+  auto foo_v2 = CreateApexManifest("com.android.foo", 2);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_v2.SerializeAsString());
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v1)));
+  auto foo = GetActivePackage(td.path, "com.android.foo");
+  ASSERT_TRUE(foo.ok()) << foo.error();
+  ASSERT_EQ(foo_v1, *foo);
+
+  // apexd bumps the generation of the index when active APEXes change.
+  WriteFile(index_path, SerializeApexInfoIndex({}, 2));
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v2)));
+  foo = GetActivePackage(td.path, "com.android.foo");
+  ASSERT_TRUE(foo.ok()) << foo.error();
+  ASSERT_EQ(foo_v2, *foo);
+}
+
+TEST(ApexUtil, GetActivePackagesIsNotCachedWithoutGeneration) {
+  TemporaryDir td;
+
+  auto foo_path = td.path + "/com.android.foo"s;
+  auto foo_v1 = CreateApexManifest("com.android.foo", 1);
+  Mkdir(foo_path);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_v1.SerializeAsString());
+
+  // No index at all.
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v1)));
+  auto foo_v2 = CreateApexManifest("com.android.foo", 2);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_v2.SerializeAsString());
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v2)));
+
+  // An index without a generation.
+  WriteFile(td.path + "/apex-info-list.bin"s, SerializeApexInfoIndex({}, 0));
+  auto foo_v3 = CreateApexManifest("com.android.foo", 3);
+  WriteFile(foo_path + "/apex_manifest.pb", foo_v3.SerializeAsString());
+  ASSERT_THAT(GetActivePackages(td.path),
+              UnorderedElementsAre(Pair(foo_path, foo_v3)));
+  auto foo = GetActivePackage(td.path, "com.android.foo");
+  ASSERT_TRUE(foo.ok()) << foo.error();
+  ASSERT_EQ(foo_v3, *foo);
+}
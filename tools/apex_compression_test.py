@@ -206,18 +206,21 @@ class ApexCompressionTest(unittest.TestCase):
     with open(manifest_path, 'wb') as f:
       f.write(pb.SerializeToString())
 
-  def _compress_apex(self, uncompressed_apex_fp):
+  def _compress_apex(self, uncompressed_apex_fp, chunk_size=0):
     """Returns file path to compressed APEX"""
     fd, compressed_apex_fp = tempfile.mkstemp(
         prefix=self._testMethodName + '_compressed_',
         suffix='.capex')
     os.close(fd)
     self._to_cleanup.append(compressed_apex_fp)
-    self._run_apex_compression_tool([
+    args = [
         'compress',
         '--input', uncompressed_apex_fp,
         '--output', compressed_apex_fp
-    ])
+    ]
+    if chunk_size:
+      args.extend(['--chunk_size', str(chunk_size)])
+    self._run_apex_compression_tool(args)
     return compressed_apex_fp
 
   def _decompress_apex(self, compressed_apex_fp):
@@ -305,6 +308,29 @@ class ApexCompressionTest(unittest.TestCase):
     self.assertIn(uncompressed_apex_fp
                   + ' is not a compressed APEX', str(error.exception))
 
+  def test_chunked_compression(self):
+    uncompressed_apex_fp = os.path.join(get_current_dir(), TEST_APEX + '.apex')
+    compressed_apex_fp = self._compress_apex(uncompressed_apex_fp,
+                                             chunk_size=4096)
+
+    # Verify original_apex is stored in independently compressed chunks
+    with ZipFile(compressed_apex_fp, 'r') as zip_obj:
+      names = zip_obj.namelist()
+      self.assertNotIn('original_apex', names)
+      self.assertIn('original_apex_chunk_0000', names)
+      self.assertEqual(zip_obj.getinfo('original_apex_chunk_0000').file_size,
+                       4096)
+      self.assertEqual(
+          zip_obj.getinfo('original_apex_chunk_0000').compress_type,
+          ZIP_DEFLATED)
+    self.assertEqual(self._get_type(compressed_apex_fp), 'COMPRESSED')
+
+    # Verify chunks decompress back to the uncompressed APEX
+    decompressed_apex_fp = self._decompress_apex(compressed_apex_fp)
+    self.assertEqual(get_sha1sum(uncompressed_apex_fp),
+                     get_sha1sum(decompressed_apex_fp),
+                     'Decompressed APEX is not same as uncompressed APEX')
+
   def test_only_original_apex_is_compressed(self):
     uncompressed_apex_fp = os.path.join(get_current_dir(), TEST_APEX + '.apex')
     compressed_apex_fp = self._compress_apex(uncompressed_apex_fp)
@@ -71,13 +71,16 @@ def RunCompress(args, work_dir):
   """RunCompress takes an uncompressed APEX and compresses into compressed APEX
 
   Compressed apex will contain the following items:
-      - original_apex: The original uncompressed APEX
+      - original_apex: The original uncompressed APEX, or
+        original_apex_chunk_NNNN files holding it in pieces if --chunk_size
+        is given
       - Duplicates of various meta files inside the input APEX, e.g
         AndroidManifest.xml, public_key
 
   Args:
       args.input: file path to uncompressed APEX
       args.output: file path to where compressed APEX will be placed
+      args.chunk_size: size of original_apex chunks, or 0 to store it whole
       work_dir: file path to a temporary folder
   Returns:
       True if compression was executed successfully, otherwise False
@@ -96,8 +99,17 @@ def RunCompress(args, work_dir):
   # copy of the original_apex here.
   original_apex = os.path.join(work_dir, 'original_apex')
   shutil.copy2(args.input, original_apex)
-  cmd.extend(['-C', work_dir])
-  cmd.extend(['-f', original_apex])
+  if args.chunk_size:
+    # Store original_apex as independently compressed chunks, so that apexd
+    # can decompress them in parallel.
+    chunk_dir = os.path.join(work_dir, 'chunks')
+    os.mkdir(chunk_dir)
+    cmd.extend(['-C', chunk_dir])
+    for chunk_path in SplitIntoChunks(original_apex, chunk_dir, args.chunk_size):
+      cmd.extend(['-f', chunk_path])
+  else:
+    cmd.extend(['-C', work_dir])
+    cmd.extend(['-f', original_apex])
 
   # We also need to extract some files from inside of original_apex and zip
   # together with compressed apex
@@ -128,6 +140,23 @@ def RunCompress(args, work_dir):
   return True
 
 
+def SplitIntoChunks(input_path, output_dir, chunk_size):
+  """Splits input_path into original_apex_chunk_NNNN files in output_dir"""
+  chunk_paths = []
+  with open(input_path, 'rb') as f:
+    while True:
+      data = f.read(chunk_size)
+      if not data:
+        break
+      chunk_path = os.path.join(output_dir,
+                                'original_apex_chunk_%04d' % len(chunk_paths))
+      with open(chunk_path, 'wb') as chunk:
+        chunk.write(data)
+      chunk_paths.append(chunk_path)
+  assert len(chunk_paths) <= 10000, 'Too many chunks, increase --chunk_size'
+  return chunk_paths
+
+
 def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path, verbose=False):
   # Retrieve the root digest of the image
   avbtool_cmd = [
@@ -166,6 +195,10 @@ def ParseArgs(argv):
                                     'compressed')
   parser_compress.add_argument('--output', type=str, required=True,
                                help='output path to compressed APEX file')
+  parser_compress.add_argument('--chunk_size', type=int, default=0,
+                               help='if set, original_apex is stored as '
+                                    'independently compressed chunks of this '
+                                    'many bytes')
   apex_compression_tool_path_in_environ = \
     'APEX_COMPRESSION_TOOL_PATH' in os.environ
   parser_compress.add_argument(
@@ -322,7 +322,8 @@ def GetType(apex_path):
   with zipfile.ZipFile(apex_path, 'r') as zip_file:
     names = zip_file.namelist()
     has_payload = 'apex_payload.img' in names
-    has_original_apex = 'original_apex' in names
+    has_original_apex = ('original_apex' in names or
+                         'original_apex_chunk_0000' in names)
     if has_payload and has_original_apex:
       return ApexType.INVALID
     if has_payload:
@@ -365,7 +366,16 @@ def decompress(compressed_apex_fp, decompressed_apex_fp):
     sys.exit(1)
 
   with zipfile.ZipFile(compressed_apex_fp, 'r') as zip_obj:
-    if 'original_apex' not in zip_obj.namelist():
+    names = zip_obj.namelist()
+    if 'original_apex' not in names and 'original_apex_chunk_0000' in names:
+      # original_apex is stored in chunks, concatenate them back in order
+      with open(decompressed_apex_fp, 'wb') as f:
+        index = 0
+        while 'original_apex_chunk_%04d' % index in names:
+          f.write(zip_obj.read('original_apex_chunk_%04d' % index))
+          index += 1
+      return
+    if 'original_apex' not in names:
       print(compressed_apex_fp + ' is not a compressed APEX. Missing '
                                  "'original_apex' file inside it.")
       sys.exit(1)